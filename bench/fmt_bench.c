@@ -0,0 +1,173 @@
+// Copyright 2020 Bonedaddy (Alexandre Trottier)
+//
+// licensed under GNU AFFERO GENERAL PUBLIC LICENSE;
+// you may not use this file except in compliance with the License;
+// You may obtain the license via the LICENSE file in the repository root;
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/*! @file fmt_bench.c
+ * @brief microbenchmarks of the formatting kernels against snprintf
+ * @details every case converts the same inputs with snprintf and with the
+ * matching fmt.h kernel and reports the mean nanoseconds per conversion of each
+ */
+
+#define _GNU_SOURCE
+
+#include "buffer.h"
+#include "fmt.h"
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*! @brief number of distinct inputs cycled through by every case */
+#define BENCH_INPUTS 1024
+
+/*! @brief the conversion being measured */
+typedef enum {
+    BENCH_FMT_U64,     /*! `%lu` vs fmt_u64 */
+    BENCH_FMT_I64,     /*! `%ld` vs fmt_i64 */
+    BENCH_FMT_HEX,     /*! `%lx` vs fmt_hex64 */
+    BENCH_FMT_FIXED,   /*! `%f` vs fmt_fixed */
+    BENCH_FMT_MESSAGE, /*! a typical log message, vsnprintf vs fmt_vformat */
+    BENCH_FMT_COUNT,
+} BENCH_FMT;
+
+static const char *case_names[] = {"u64", "i64", "hex", "fixed", "message"};
+
+/*! @brief a volatile sink so the compiler can not drop the conversions */
+static volatile size_t bench_sink;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static void bench_message(log_buffer *buf, bool kernels, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    buf->len = 0;
+    if (kernels == true) {
+        fmt_vformat(buf, LOG_MESSAGE_MAX_DEFAULT, format, args);
+    } else {
+        log_buffer_vprintf(buf, LOG_MESSAGE_MAX_DEFAULT, format, args);
+    }
+    va_end(args);
+    bench_sink += buf->len;
+}
+
+/*! @brief runs iterations conversions of a case
+ * @return mean nanoseconds per conversion
+ */
+static double bench_run(BENCH_FMT which, bool kernels, size_t iterations,
+                        const uint64_t *ints, const double *doubles) {
+
+    char out[64];
+    log_buffer *buf = thread_log_buffer(LOG_BUFFER_MESSAGE);
+    uint64_t start = now_ns();
+
+    for (size_t i = 0; i < iterations; i++) {
+        uint64_t value = ints[i % BENCH_INPUTS];
+        double real = doubles[i % BENCH_INPUTS];
+        size_t len = 0;
+        switch (which) {
+            case BENCH_FMT_U64:
+                len = kernels ? fmt_u64(out, value)
+                              : (size_t)snprintf(out, sizeof(out), "%" PRIu64, value);
+                break;
+            case BENCH_FMT_I64:
+                len = kernels ? fmt_i64(out, (int64_t)value)
+                              : (size_t)snprintf(out, sizeof(out), "%" PRId64,
+                                                 (int64_t)value);
+                break;
+            case BENCH_FMT_HEX:
+                len = kernels ? fmt_hex64(out, value, false)
+                              : (size_t)snprintf(out, sizeof(out), "%" PRIx64, value);
+                break;
+            case BENCH_FMT_FIXED:
+                len = kernels ? fmt_fixed(out, real, 6)
+                              : (size_t)snprintf(out, sizeof(out), "%f", real);
+                break;
+            default:
+                bench_message(buf, kernels,
+                              "request %lu from %s took %f ms, status %d ptr %p",
+                              (unsigned long)value, "10.0.0.1", real, (int)i,
+                              (void *)buf);
+                break;
+        }
+        bench_sink += len;
+    }
+
+    return (double)(now_ns() - start) / (double)iterations;
+}
+
+static void bench_usage(const char *name) {
+    fprintf(stderr,
+            "usage: %s [-n iterations] [-o output]\n"
+            "  -n  conversions per case (default 1000000)\n"
+            "  -o  file results are written to (default stderr)\n",
+            name);
+}
+
+int main(int argc, char **argv) {
+
+    size_t iterations = 1000000;
+    FILE *out = stderr;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "n:o:h")) != -1) {
+        switch (opt) {
+            case 'n':
+                iterations = strtoul(optarg, NULL, 10);
+                break;
+            case 'o':
+                out = fopen(optarg, "w");
+                if (out == NULL) {
+                    fprintf(stderr, "failed to open %s\n", optarg);
+                    return 1;
+                }
+                break;
+            default:
+                bench_usage(argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (iterations == 0) {
+        bench_usage(argv[0]);
+        return 1;
+    }
+
+    // mix of magnitudes so digit count prediction is exercised
+    uint64_t ints[BENCH_INPUTS];
+    double doubles[BENCH_INPUTS];
+    srand(1);
+    for (int i = 0; i < BENCH_INPUTS; i++) {
+        ints[i] = ((uint64_t)rand() << 31 | (uint64_t)rand()) >> (rand() % 60);
+        doubles[i] = (double)rand() / RAND_MAX * (double)(1 << (rand() % 20));
+    }
+
+    fprintf(out, "case,iterations,snprintf_ns,fmt_ns,speedup\n");
+    for (int which = 0; which < BENCH_FMT_COUNT; which++) {
+        double baseline = bench_run((BENCH_FMT)which, false, iterations, ints, doubles);
+        double kernels = bench_run((BENCH_FMT)which, true, iterations, ints, doubles);
+        fprintf(out, "%s,%zu,%.1f,%.1f,%.2f\n", case_names[which], iterations,
+                baseline, kernels, baseline / kernels);
+    }
+
+    if (out != stderr) {
+        fclose(out);
+    }
+
+    return 0;
+}
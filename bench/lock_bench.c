@@ -0,0 +1,218 @@
+// Copyright 2020 Bonedaddy (Alexandre Trottier)
+//
+// licensed under GNU AFFERO GENERAL PUBLIC LICENSE;
+// you may not use this file except in compliance with the License;
+// You may obtain the license via the LICENSE file in the repository root;
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/*! @file lock_bench.c
+ * @brief throughput of the log_lock strategies across thread counts
+ * @details every strategy is measured with a bare critical section the size of
+ * a console write bookkeeping step, and through a logger writing to /dev/null,
+ * for thread counts doubling from 1 up to the number of online cores
+ */
+
+#define _GNU_SOURCE
+
+#include "lock.h"
+#include "logger.h"
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/*! @brief the critical section being measured */
+typedef enum {
+    BENCH_LOCK_RAW,    /*! a few shared cache lines updated under the lock */
+    BENCH_LOCK_LOGGER, /*! a LOG_INFO call on a logger writing to /dev/null */
+    BENCH_LOCK_COUNT,
+} BENCH_LOCK;
+
+static const char *case_names[] = {"raw", "logger"};
+
+/*! @brief state shared by the threads of a run */
+typedef struct bench_shared {
+    BENCH_LOCK which;
+    size_t iterations; /*! per thread */
+    log_lock lock;
+    thread_logger *thl;
+    uint64_t counters[16]; /*! two cache lines written under the lock */
+    pthread_barrier_t start;
+} bench_shared;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static void *bench_worker_run(void *data) {
+    bench_shared *shared = data;
+
+    pthread_barrier_wait(&shared->start);
+
+    for (size_t i = 0; i < shared->iterations; i++) {
+        if (shared->which == BENCH_LOCK_RAW) {
+            log_lock_acquire(&shared->lock);
+            for (int c = 0; c < 16; c += 4) {
+                shared->counters[c] += i;
+            }
+            log_lock_release(&shared->lock);
+        } else {
+            LOG_INFO(shared->thl, "lock benchmark record with a short payload");
+        }
+    }
+
+    return NULL;
+}
+
+/*! @brief runs one strategy, case and thread count
+ * @return Success: nanoseconds per critical section across all threads
+ * @return Failure: -1
+ */
+static double bench_run(LOG_LOCK strategy, BENCH_LOCK which, long threads,
+                        size_t iterations, int null_fd) {
+
+    bench_shared shared = {.which = which, .iterations = iterations};
+    if (which == BENCH_LOCK_RAW) {
+        log_lock_init(&shared.lock, strategy);
+    } else {
+        thread_logger_config config = {
+            .console_fd = null_fd, .layout = "%L %t %m", .lock = strategy};
+        shared.thl = new_thread_logger_config(&config);
+        if (shared.thl == NULL) {
+            return -1;
+        }
+    }
+
+    pthread_t *tids = calloc((size_t)threads, sizeof(pthread_t));
+    if (tids == NULL) {
+        return -1;
+    }
+    pthread_barrier_init(&shared.start, NULL, (unsigned int)threads + 1);
+    for (long t = 0; t < threads; t++) {
+        pthread_create(&tids[t], NULL, bench_worker_run, &shared);
+    }
+
+    uint64_t start = now_ns();
+    pthread_barrier_wait(&shared.start);
+    for (long t = 0; t < threads; t++) {
+        pthread_join(tids[t], NULL);
+    }
+    uint64_t elapsed = now_ns() - start;
+
+    pthread_barrier_destroy(&shared.start);
+    free(tids);
+    if (which == BENCH_LOCK_RAW) {
+        log_lock_destroy(&shared.lock);
+    } else {
+        clear_thread_logger(shared.thl);
+    }
+
+    return (double)elapsed / (double)(iterations * (size_t)threads);
+}
+
+static void bench_usage(const char *name) {
+    fprintf(stderr,
+            "usage: %s [-n iterations] [-t max_threads] [-l locks] [-o output]\n"
+            "  -n  critical sections per thread per run (default 200000)\n"
+            "  -t  maximum thread count, doubled from 1 (default: online cores)\n"
+            "  -l  comma separated strategies: mutex,adaptive,ticket,mcs,futex "
+            "(default all)\n"
+            "  -o  file results are written to (default stderr)\n",
+            name);
+}
+
+int main(int argc, char **argv) {
+
+    size_t iterations = 200000;
+    long max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    bool enabled[5] = {true, true, true, true, true};
+    FILE *out = stderr;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "n:t:l:o:h")) != -1) {
+        switch (opt) {
+            case 'n':
+                iterations = strtoul(optarg, NULL, 10);
+                break;
+            case 't':
+                max_threads = strtol(optarg, NULL, 10);
+                break;
+            case 'l':
+                memset(enabled, 0, sizeof(enabled));
+                for (char *tok = strtok(optarg, ","); tok != NULL;
+                     tok = strtok(NULL, ",")) {
+                    LOG_LOCK strategy;
+                    if (log_lock_parse(tok, &strategy) != 0) {
+                        fprintf(stderr, "unknown lock %s\n", tok);
+                        return 1;
+                    }
+                    enabled[strategy] = true;
+                }
+                break;
+            case 'o':
+                out = fopen(optarg, "w");
+                if (out == NULL) {
+                    fprintf(stderr, "failed to open %s\n", optarg);
+                    return 1;
+                }
+                break;
+            default:
+                bench_usage(argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (iterations == 0 || max_threads < 1) {
+        bench_usage(argv[0]);
+        return 1;
+    }
+
+    int null_fd = open("/dev/null", O_WRONLY);
+    if (null_fd == -1) {
+        fprintf(stderr, "failed to open /dev/null\n");
+        return 1;
+    }
+
+    fprintf(out, "lock,case,threads,iterations,ns_per_op,ops_per_sec\n");
+    for (int which = 0; which < BENCH_LOCK_COUNT; which++) {
+        for (long threads = 1; threads <= max_threads;) {
+            for (int strategy = 0; strategy < 5; strategy++) {
+                if (enabled[strategy] == false) {
+                    continue;
+                }
+                double ns = bench_run((LOG_LOCK)strategy, (BENCH_LOCK)which, threads,
+                                      iterations, null_fd);
+                if (ns < 0) {
+                    fprintf(stderr, "failed to run %s\n", log_lock_name(strategy));
+                    return 1;
+                }
+                fprintf(out, "%s,%s,%ld,%zu,%.1f,%.0f\n", log_lock_name(strategy),
+                        case_names[which], threads, iterations, ns, 1e9 / ns);
+                fflush(out);
+            }
+            // doubles, clamping the last step to max_threads
+            threads = threads < max_threads && threads * 2 > max_threads
+                          ? max_threads
+                          : threads * 2;
+        }
+    }
+
+    close(null_fd);
+    if (out != stderr) {
+        fclose(out);
+    }
+
+    return 0;
+}
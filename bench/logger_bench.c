@@ -0,0 +1,383 @@
+// Copyright 2020 Bonedaddy (Alexandre Trottier)
+//
+// licensed under GNU AFFERO GENERAL PUBLIC LICENSE;
+// you may not use this file except in compliance with the License;
+// You may obtain the license via the LICENSE file in the repository root;
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/*! @file logger_bench.c
+ * @brief throughput and tail latency benchmarks for the logger
+ * @details runs a matrix of scenarios (thread count, message size, LOG vs LOGF,
+ * enabled vs filtered levels, stdout vs file sinks) and emits one machine readable
+ * result row per scenario containing records/sec along with p50/p99/p99.9 per call
+ * latency in nanoseconds
+ * @note every logger writes to stdout, so run the benchmark with stdout redirected
+ * (`./logger-bench > /dev/null`); results are written to stderr or to the file
+ * given with `-o`
+ */
+
+#define _GNU_SOURCE
+
+#include "logger.h"
+#include <getopt.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/*! @brief the api used to emit records */
+typedef enum {
+    BENCH_API_LOG,  /*! LOG_* style, message logged as is */
+    BENCH_API_LOGF, /*! LOGF_* style, message formatted with vsnprintf */
+} BENCH_API;
+
+/*! @brief the level scenario being measured */
+typedef enum {
+    BENCH_LEVEL_INFO,           /*! enabled info records */
+    BENCH_LEVEL_DEBUG,          /*! enabled debug records */
+    BENCH_LEVEL_DEBUG_FILTERED, /*! debug records on a logger without debug */
+} BENCH_LEVEL;
+
+/*! @brief where records are sent in addition to stdout */
+typedef enum {
+    BENCH_SINK_STDOUT,  /*! thread_logger, stdout only */
+    BENCH_SINK_DEVNULL, /*! file_logger writing to /dev/null */
+    BENCH_SINK_TMPFS,   /*! file_logger writing to /dev/shm */
+    BENCH_SINK_DISK,    /*! file_logger writing to the working directory */
+} BENCH_SINK;
+
+/*! @brief a single benchmark scenario */
+typedef struct bench_case {
+    BENCH_SINK sink;
+    BENCH_API api;
+    BENCH_LEVEL level;
+    int threads;
+    size_t msg_size;
+    size_t records; /*! records emitted per thread */
+} bench_case;
+
+/*! @brief per thread state shared with the worker */
+typedef struct bench_worker {
+    thread_logger *thl;
+    int fd;
+    const bench_case *bcase;
+    const char *message;
+    uint64_t *latencies; /*! one entry per record, nanoseconds */
+    pthread_barrier_t *start;
+} bench_worker;
+
+/*! @brief summary computed from all per call latencies of a scenario */
+typedef struct bench_result {
+    double seconds;
+    double records_per_sec;
+    uint64_t p50;
+    uint64_t p99;
+    uint64_t p999;
+    uint64_t max;
+} bench_result;
+
+static const char *sink_names[] = {"stdout", "devnull", "tmpfs", "disk"};
+static const char *sink_paths[] = {NULL, "/dev/null", "/dev/shm/ulog-bench.log",
+                                   "ulog-bench.log"};
+static const char *api_names[] = {"log", "logf"};
+static const char *level_names[] = {"info", "debug", "debug-filtered"};
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static void *bench_worker_run(void *data) {
+    bench_worker *worker = data;
+    const bench_case *bcase = worker->bcase;
+    LOG_LEVELS level =
+        bcase->level == BENCH_LEVEL_INFO ? LOG_LEVELS_INFO : LOG_LEVELS_DEBUG;
+
+    pthread_barrier_wait(worker->start);
+
+    for (size_t i = 0; i < bcase->records; i++) {
+        uint64_t start = now_ns();
+        if (bcase->api == BENCH_API_LOG) {
+            worker->thl->log(worker->thl, worker->fd, (char *)worker->message,
+                             level, __FILENAME__, __LINE__);
+        } else {
+            worker->thl->logf(worker->thl, worker->fd, level, __FILENAME__,
+                              __LINE__, "payload=%s seq=%zu", worker->message, i);
+        }
+        worker->latencies[i] = now_ns() - start;
+    }
+
+    return NULL;
+}
+
+/*! @brief runs a single scenario and fills in result
+ * @return Success: 0
+ * @return Failure: -1
+ */
+static int bench_run_case(const bench_case *bcase, bench_result *result) {
+
+    bool with_debug = bcase->level != BENCH_LEVEL_DEBUG_FILTERED;
+    thread_logger *thl = NULL;
+    file_logger *fhl = NULL;
+    int fd = 0;
+
+    if (bcase->sink == BENCH_SINK_STDOUT) {
+        thl = new_thread_logger(with_debug);
+    } else {
+        fhl = new_file_logger((char *)sink_paths[bcase->sink], with_debug);
+        if (fhl != NULL) {
+            thl = fhl->thl;
+            fd = fhl->fd;
+        }
+    }
+    if (thl == NULL) {
+        fprintf(stderr, "failed to create logger for sink %s\n",
+                sink_names[bcase->sink]);
+        return -1;
+    }
+
+    char *message = malloc(bcase->msg_size + 1);
+    size_t total = bcase->records * (size_t)bcase->threads;
+    uint64_t *latencies = malloc(sizeof(uint64_t) * total);
+    bench_worker *workers = malloc(sizeof(bench_worker) * (size_t)bcase->threads);
+    pthread_t *threads = malloc(sizeof(pthread_t) * (size_t)bcase->threads);
+    if (message == NULL || latencies == NULL || workers == NULL || threads == NULL) {
+        fprintf(stderr, "failed to allocate benchmark state\n");
+        free(message);
+        free(latencies);
+        free(workers);
+        free(threads);
+        if (fhl != NULL) {
+            clear_file_logger(fhl);
+        } else {
+            clear_thread_logger(thl);
+        }
+        return -1;
+    }
+
+    memset(message, 'x', bcase->msg_size);
+    message[bcase->msg_size] = '\0';
+
+    pthread_barrier_t start;
+    pthread_barrier_init(&start, NULL, (unsigned)bcase->threads + 1);
+
+    for (int i = 0; i < bcase->threads; i++) {
+        workers[i] = (bench_worker){
+            .thl = thl,
+            .fd = fd,
+            .bcase = bcase,
+            .message = message,
+            .latencies = latencies + (size_t)i * bcase->records,
+            .start = &start,
+        };
+        pthread_create(&threads[i], NULL, bench_worker_run, &workers[i]);
+    }
+
+    pthread_barrier_wait(&start);
+    uint64_t begin = now_ns();
+    for (int i = 0; i < bcase->threads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    uint64_t elapsed = now_ns() - begin;
+
+    qsort(latencies, total, sizeof(uint64_t), compare_u64);
+
+    result->seconds = (double)elapsed / 1e9;
+    result->records_per_sec = (double)total / result->seconds;
+    result->p50 = latencies[(total * 50) / 100];
+    result->p99 = latencies[(total * 99) / 100];
+    result->p999 = latencies[(total * 999) / 1000];
+    result->max = latencies[total - 1];
+
+    pthread_barrier_destroy(&start);
+    free(message);
+    free(latencies);
+    free(workers);
+    free(threads);
+
+    if (fhl != NULL) {
+        clear_file_logger(fhl);
+        if (bcase->sink != BENCH_SINK_DEVNULL) {
+            unlink(sink_paths[bcase->sink]);
+        }
+    } else {
+        clear_thread_logger(thl);
+    }
+
+    return 0;
+}
+
+static void bench_print_header(FILE *out, bool json) {
+    if (json == false) {
+        fprintf(out, "sink,api,level,threads,msg_size,records,seconds,"
+                     "records_per_sec,p50_ns,p99_ns,p999_ns,max_ns\n");
+    }
+}
+
+static void bench_print_result(FILE *out, bool json, const bench_case *bcase,
+                               const bench_result *result) {
+
+    size_t total = bcase->records * (size_t)bcase->threads;
+    if (json == true) {
+        fprintf(out,
+                "{\"sink\":\"%s\",\"api\":\"%s\",\"level\":\"%s\",\"threads\":%d,"
+                "\"msg_size\":%zu,\"records\":%zu,\"seconds\":%.6f,"
+                "\"records_per_sec\":%.1f,\"p50_ns\":%llu,\"p99_ns\":%llu,"
+                "\"p999_ns\":%llu,\"max_ns\":%llu}\n",
+                sink_names[bcase->sink], api_names[bcase->api],
+                level_names[bcase->level], bcase->threads, bcase->msg_size, total,
+                result->seconds, result->records_per_sec,
+                (unsigned long long)result->p50, (unsigned long long)result->p99,
+                (unsigned long long)result->p999, (unsigned long long)result->max);
+    } else {
+        fprintf(out, "%s,%s,%s,%d,%zu,%zu,%.6f,%.1f,%llu,%llu,%llu,%llu\n",
+                sink_names[bcase->sink], api_names[bcase->api],
+                level_names[bcase->level], bcase->threads, bcase->msg_size, total,
+                result->seconds, result->records_per_sec,
+                (unsigned long long)result->p50, (unsigned long long)result->p99,
+                (unsigned long long)result->p999, (unsigned long long)result->max);
+    }
+    fflush(out);
+}
+
+/*! @brief doubles the thread count, clamping the last step to max_threads so
+ * that non power of two core counts are measured as well
+ */
+static long bench_next_threads(long threads, long max_threads) {
+    if (threads < max_threads && threads * 2 > max_threads) {
+        return max_threads;
+    }
+    return threads * 2;
+}
+
+static void bench_usage(const char *name) {
+    fprintf(stderr,
+            "usage: %s [-n records] [-t max_threads] [-s sinks] [-f csv|json] "
+            "[-o output]\n"
+            "  -n  records emitted per thread per scenario (default 2000)\n"
+            "  -t  maximum thread count, doubled from 1 (default: online cores)\n"
+            "  -s  comma separated sinks: stdout,devnull,tmpfs,disk (default all)\n"
+            "  -f  result format (default csv)\n"
+            "  -o  file results are written to (default stderr)\n"
+            "run with stdout redirected, eg: %s > /dev/null\n",
+            name, name);
+}
+
+/*! @brief parses a comma separated sink list into enabled
+ * @return Success: 0
+ * @return Failure: -1
+ */
+static int bench_parse_sinks(char *list, bool enabled[4]) {
+    memset(enabled, 0, sizeof(bool) * 4);
+    for (char *tok = strtok(list, ","); tok != NULL; tok = strtok(NULL, ",")) {
+        bool found = false;
+        for (int i = 0; i < 4; i++) {
+            if (strcmp(tok, sink_names[i]) == 0) {
+                enabled[i] = found = true;
+            }
+        }
+        if (found == false) {
+            fprintf(stderr, "unknown sink %s\n", tok);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+
+    size_t records = 2000;
+    long max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    bool sinks[4] = {true, true, true, true};
+    bool json = false;
+    FILE *out = stderr;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "n:t:s:f:o:h")) != -1) {
+        switch (opt) {
+            case 'n':
+                records = strtoul(optarg, NULL, 10);
+                break;
+            case 't':
+                max_threads = strtol(optarg, NULL, 10);
+                break;
+            case 's':
+                if (bench_parse_sinks(optarg, sinks) != 0) {
+                    return 1;
+                }
+                break;
+            case 'f':
+                json = strcmp(optarg, "json") == 0;
+                break;
+            case 'o':
+                out = fopen(optarg, "w");
+                if (out == NULL) {
+                    fprintf(stderr, "failed to open %s\n", optarg);
+                    return 1;
+                }
+                break;
+            default:
+                bench_usage(argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (records == 0 || max_threads < 1) {
+        bench_usage(argv[0]);
+        return 1;
+    }
+
+    size_t msg_sizes[] = {16, 128, 1024};
+    bench_print_header(out, json);
+
+    for (int sink = 0; sink < 4; sink++) {
+        if (sinks[sink] == false) {
+            continue;
+        }
+        for (int api = BENCH_API_LOG; api <= BENCH_API_LOGF; api++) {
+            for (int level = BENCH_LEVEL_INFO; level <= BENCH_LEVEL_DEBUG_FILTERED;
+                 level++) {
+                for (long threads = 1; threads <= max_threads;
+                     threads = bench_next_threads(threads, max_threads)) {
+                    for (size_t i = 0; i < sizeof(msg_sizes) / sizeof(size_t);
+                         i++) {
+                        bench_case bcase = {
+                            .sink = (BENCH_SINK)sink,
+                            .api = (BENCH_API)api,
+                            .level = (BENCH_LEVEL)level,
+                            .threads = (int)threads,
+                            .msg_size = msg_sizes[i],
+                            .records = records,
+                        };
+                        bench_result result;
+                        if (bench_run_case(&bcase, &result) != 0) {
+                            return 1;
+                        }
+                        bench_print_result(out, json, &bcase, &result);
+                    }
+                }
+            }
+        }
+    }
+
+    if (out != stderr) {
+        fclose(out);
+    }
+
+    return 0;
+}
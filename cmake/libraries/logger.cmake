@@ -5,7 +5,21 @@ file(GLOB_RECURSE LOGGER_SOURCES
 
 add_library(liblogger ${LOGGER_SOURCES})
 target_compile_options(liblogger PRIVATE ${flags})
-target_link_libraries(liblogger pthread)
+target_link_libraries(liblogger pthread ${CMAKE_DL_LIBS})
+
+# compressed file sinks fall back to plain text without zlib, see compress.h
+find_package(ZLIB)
+if(ZLIB_FOUND)
+    target_compile_definitions(liblogger PRIVATE LOG_HAVE_ZLIB)
+    target_include_directories(liblogger PRIVATE ${ZLIB_INCLUDE_DIRS})
+    target_link_libraries(liblogger ${ZLIB_LIBRARIES})
+endif()
+
+# shm_open lives in librt before glibc 2.34, see shm.h
+find_library(RT_LIBRARY rt)
+if(RT_LIBRARY)
+    target_link_libraries(liblogger ${RT_LIBRARY})
+endif()
 
 
 add_executable(logger-test-c ./tests/logger_test.c)
@@ -20,4 +34,16 @@ target_compile_options(logger-test-cpp PRIVATE ${cxx-flags})
 
 
 add_test(NAME LoggerTestC COMMAND logger-test-c)
-add_test(NAME LoggerTestCpp COMMAND logger-test-cpp)
\ No newline at end of file
+add_test(NAME LoggerTestCpp COMMAND logger-test-cpp)
+
+add_executable(logger-bench ./bench/logger_bench.c)
+target_link_libraries(logger-bench liblogger)
+target_compile_options(logger-bench PRIVATE ${flags})
+
+add_executable(fmt-bench ./bench/fmt_bench.c)
+target_link_libraries(fmt-bench liblogger)
+target_compile_options(fmt-bench PRIVATE ${flags})
+
+add_executable(lock-bench ./bench/lock_bench.c)
+target_link_libraries(lock-bench liblogger)
+target_compile_options(lock-bench PRIVATE ${flags})
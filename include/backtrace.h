@@ -0,0 +1,106 @@
+// Copyright 2020 Bonedaddy (Alexandre Trottier)
+//
+// licensed under GNU AFFERO GENERAL PUBLIC LICENSE;
+// you may not use this file except in compliance with the License;
+// You may obtain the license via the LICENSE file in the repository root;
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/*! @file backtrace.h
+ * @brief stack traces of error records, symbolized off the hot path
+ * @details the caller only unwinds its stack into a fixed array of return
+ * addresses and appends them to the record as raw `    at 0x<address>` lines.
+ * resolving them to symbols takes locks and walks symbol tables, so it is done
+ * by the writer thread of loggers that have one, and left to offline tools for
+ * the others: their first trace is followed by `    module 0x<base> <path>
+ * <build-id>` lines, enough for addr2line to map the addresses later. call sites
+ * are rate limited, so an error storm does not become an unwinding storm
+ */
+
+#pragma once
+
+#include "buffer.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+/*!
+ * @brief most frames captured per trace
+ */
+#define LOG_BACKTRACE_FRAMES 32
+
+/*!
+ * @brief traces per call site per second when no limit is configured
+ */
+#define LOG_BACKTRACE_SITE_LIMIT 8
+
+/*!
+ * @brief slots call sites are hashed to, sites sharing a slot share its limit
+ */
+#define LOG_BACKTRACE_SITES 1024
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*! @struct opaque per call site limits, see new_log_backtrace_sites
+ */
+typedef struct log_backtrace_sites log_backtrace_sites;
+
+/*! @brief returns new call site limits
+ * @param limit traces admitted per call site per second, 0 for
+ * LOG_BACKTRACE_SITE_LIMIT
+ * @return Success: pointer to the limits
+ * @return Failure: NULL pointer
+ */
+log_backtrace_sites *new_log_backtrace_sites(unsigned int limit);
+
+/*! @brief returns whether a trace may be taken for the call site, lock free
+ * @param site identifies the call site, such as its return address
+ */
+bool log_backtrace_admit(log_backtrace_sites *sites, const void *site);
+
+/*! @brief returns true exactly once, for the first trace that should be followed
+ * by the module lines
+ */
+bool log_backtrace_first(log_backtrace_sites *sites);
+
+/*! @brief frees up resources for the limits
+ */
+void clear_log_backtrace_sites(log_backtrace_sites *sites);
+
+/*! @brief captures the stack of the calling thread
+ * @param frames receives at most count return addresses
+ * @param caller when found in the stack, the frames above it are dropped so the
+ * trace starts at the caller of the logger. may be NULL
+ * @return the number of frames stored
+ */
+size_t log_backtrace_capture(void **frames, size_t count, const void *caller);
+
+/*! @brief appends a `\n    at 0x<address>` line per frame
+ * @return Success: 0
+ * @return Failure: -1
+ */
+int log_backtrace_append(log_buffer *buf, void *const *frames, size_t count);
+
+/*! @brief appends a `\n    module 0x<base> <path> <build-id>` line per loaded
+ * object
+ * @return Success: 0
+ * @return Failure: -1
+ */
+int log_backtrace_append_modules(log_buffer *buf);
+
+/*! @brief appends text with every raw `    at 0x<address>` line resolved to
+ * `    at <symbol>+0x<offset> (<path>)`, or `    at <path>+0x<offset>` when the
+ * address has no symbol
+ * @return Success: 0
+ * @return Failure: -1
+ */
+int log_backtrace_symbolize(log_buffer *buf, const char *text, size_t text_len);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,136 @@
+// Copyright 2020 Bonedaddy (Alexandre Trottier)
+//
+// licensed under GNU AFFERO GENERAL PUBLIC LICENSE;
+// you may not use this file except in compliance with the License;
+// You may obtain the license via the LICENSE file in the repository root;
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/*! @file buffer.h
+ * @brief growable, thread local buffers used to format records
+ * @details every thread owns a small set of reusable buffers which grow
+ * geometrically on demand, so formatting a record of any length never touches the
+ * stack and, once warmed up, does not allocate. buffers that grew past
+ * LOG_BUFFER_RETAIN_SIZE are released after use so one huge record does not pin
+ * memory for the lifetime of the thread
+ */
+
+#pragma once
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/*!
+ * @brief initial capacity of a thread local buffer
+ */
+#define LOG_BUFFER_INITIAL_SIZE 256
+
+/*!
+ * @brief buffers larger than this are freed by log_buffer_release
+ */
+#define LOG_BUFFER_RETAIN_SIZE 65536
+
+/*!
+ * @brief default upper bound of a single message, see thread_logger_config
+ */
+#define LOG_MESSAGE_MAX_DEFAULT (1024 * 1024)
+
+/*!
+ * @brief appended to messages that were cut at the configured maximum size
+ */
+#define LOG_TRUNCATION_MARKER "...[truncated]"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*! @typedef a growable byte buffer
+ */
+typedef struct log_buffer {
+    char *data; /*! @brief the bytes, NULL until the first reserve */
+    size_t len; /*! @brief number of bytes in use */
+    size_t cap; /*! @brief number of bytes allocated */
+    bool fixed; /*! @brief data is borrowed memory of cap bytes, such as a
+                   record_pool slab, which is never grown nor freed */
+} log_buffer;
+
+/*! @brief identifies one of the per thread buffers
+ */
+typedef enum {
+    /*! holds printf style messages and truncated copies of messages */
+    LOG_BUFFER_MESSAGE,
+    /*! holds the fully rendered record */
+    LOG_BUFFER_RECORD,
+    /*! holds messages built by helpers such as log_hexdump before they are
+       passed to logn_func */
+    LOG_BUFFER_PAYLOAD,
+    /*! holds escaped copies of messages, see sanitize.h */
+    LOG_BUFFER_SANITIZED,
+    /*! holds the records of an open log_batch */
+    LOG_BUFFER_BATCH,
+    /*! holds the console_line of every record of an open log_batch */
+    LOG_BUFFER_BATCH_LINES,
+    /*! holds records with their backtrace symbolized, see backtrace.h */
+    LOG_BUFFER_SYMBOLIZED,
+    /*! number of per thread buffers */
+    LOG_BUFFER_COUNT
+} LOG_BUFFER;
+
+/*! @brief returns the calling thread's buffer, emptied
+ * @note the buffer is freed when the thread exits
+ */
+log_buffer *thread_log_buffer(LOG_BUFFER which);
+
+/*! @brief ensures at least additional free bytes after len, growing geometrically
+ * @note fixed buffers never grow, reserving past their capacity fails
+ * @return Success: 0
+ * @return Failure: -1
+ */
+int log_buffer_reserve(log_buffer *buf, size_t additional);
+
+/*! @brief appends data to the buffer
+ * @return Success: 0
+ * @return Failure: -1
+ */
+int log_buffer_append(log_buffer *buf, const char *data, size_t len);
+
+/*! @brief appends a formatted string, null terminated
+ * @details a single vsnprintf into the free space is attempted first, and only if
+ * that was not enough the buffer grows to the measured size for a second pass.
+ * output longer than max_len is cut and ends with LOG_TRUNCATION_MARKER
+ * @param buf the buffer to append to
+ * @param max_len upper bound of the appended length, excluding the terminator
+ * @param format printf style format
+ * @param args arguments for format
+ * @return Success: 0
+ * @return Failure: -1
+ */
+int log_buffer_vprintf(log_buffer *buf, size_t max_len, const char *format,
+                       va_list args);
+
+/*! @brief appends at most max_len bytes of data, null terminated
+ * @details data longer than max_len is cut and ends with LOG_TRUNCATION_MARKER
+ * @return Success: 0
+ * @return Failure: -1
+ */
+int log_buffer_append_capped(log_buffer *buf, const char *data, size_t len,
+                             size_t max_len);
+
+/*! @brief returns the largest length up to cut_len at which data, which is
+ * longer than cut_len, can be cut without splitting a UTF-8 sequence
+ * @details invalid UTF-8 is cut at cut_len
+ */
+size_t log_utf8_cut(const char *data, size_t cut_len);
+
+/*! @brief frees the buffer if it grew past LOG_BUFFER_RETAIN_SIZE
+ */
+void log_buffer_release(log_buffer *buf);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,128 @@
+// Copyright 2020 Bonedaddy (Alexandre Trottier)
+//
+// licensed under GNU AFFERO GENERAL PUBLIC LICENSE;
+// you may not use this file except in compliance with the License;
+// You may obtain the license via the LICENSE file in the repository root;
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/*! @file compress.h
+ * @brief file records compressed on the fly in independent blocks
+ * @details records are collected into blocks of whole records, and a compressor
+ * thread turns every full block into a frame of its own while the callers fill
+ * the next one. a frame is a complete gzip member, so the file reads with zcat,
+ * and its header carries an extra field with the size of the frame and of the
+ * text in it, so readers can hop from frame to frame without inflating them and
+ * decompress frames in parallel. a crash loses at most the blocks not written
+ * yet. without zlib at configure time blocks are written as plain text
+ *
+ * frame header, little endian:
+ *   - gzip header with FEXTRA: `1f 8b 08 04`, mtime 0, xfl 0, os 3, xlen 12
+ *   - subfield `U` `L`, length 8: frame size (header included) and text size
+ */
+
+#pragma once
+
+#include "buffer.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/*!
+ * @brief bytes of text per block when none is configured
+ */
+#define LOG_COMPRESS_BLOCK_SIZE 65536
+
+/*!
+ * @brief blocks in flight: one being filled, the others compressed or queued
+ */
+#define LOG_COMPRESS_BLOCKS 4
+
+/*!
+ * @brief zlib level used when none is configured
+ */
+#define LOG_COMPRESS_LEVEL_DEFAULT 6
+
+/*!
+ * @brief size of the header of every frame
+ */
+#define LOG_COMPRESS_HEADER_SIZE 24
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*! @struct opaque compressed sink, see new_log_compress
+ */
+typedef struct log_compress log_compress;
+
+/*! @brief counters of a compressed sink
+ */
+typedef struct log_compress_stats {
+    bool compressed;    /*! @brief false when built without zlib */
+    uint64_t blocks;    /*! @brief frames written */
+    uint64_t bytes_in;  /*! @brief text bytes written */
+    uint64_t bytes_out; /*! @brief file bytes written */
+    uint64_t errors;    /*! @brief blocks that failed to compress or write */
+} log_compress_stats;
+
+/*! @brief returns a new compressed sink writing to file_descriptor and starts
+ * its compressor thread
+ * @param file_descriptor the file, not closed by clear_log_compress
+ * @param block_size bytes of text per block, 0 for LOG_COMPRESS_BLOCK_SIZE
+ * @param level zlib level from 1 to 9, 0 for LOG_COMPRESS_LEVEL_DEFAULT
+ * @return Success: pointer to the sink
+ * @return Failure: NULL pointer
+ */
+log_compress *new_log_compress(int file_descriptor, size_t block_size, int level);
+
+/*! @brief returns the descriptor the sink writes to
+ */
+int log_compress_fd(const log_compress *compress);
+
+/*! @brief adds text to the current block, handing the block to the compressor
+ * when text does not fit. records are never split across blocks
+ * @param text one or more records, each followed by a newline
+ * @note calls that add text must be serialized by the caller
+ * @return Success: 0
+ * @return Failure: -1
+ */
+int log_compress_write(log_compress *compress, const char *text, size_t text_len);
+
+/*! @brief like log_compress_write for a single record without its newline
+ */
+int log_compress_write_record(log_compress *compress, const char *record,
+                              size_t record_len);
+
+/*! @brief compresses the current block and waits until every block was written
+ * @param sync whether the file is synced to the disk as well
+ * @return Success: 0
+ * @return Failure: -1
+ */
+int log_compress_flush(log_compress *compress, bool sync);
+
+/*! @brief fills stats with the counters of the sink
+ */
+void log_compress_stats_get(log_compress *compress, log_compress_stats *stats);
+
+/*! @brief writes out the current block, stops the compressor and frees the sink
+ */
+void clear_log_compress(log_compress *compress);
+
+/*! @brief decompresses the frame at offset into text
+ * @param next set to the offset of the following frame
+ * @return Success: 0
+ * @return Failure: -1 when there is no valid frame at offset or zlib is missing
+ * @return 1 at the end of the file
+ */
+int log_compress_read_frame(int file_descriptor, off_t offset, log_buffer *text,
+                            off_t *next);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,128 @@
+// Copyright 2020 Bonedaddy (Alexandre Trottier)
+//
+// licensed under GNU AFFERO GENERAL PUBLIC LICENSE;
+// you may not use this file except in compliance with the License;
+// You may obtain the license via the LICENSE file in the repository root;
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/*! @file console.h
+ * @brief console sink writing records straight to stdout/stderr
+ * @details bypasses stdio entirely: records are written to the file descriptor
+ * with write/writev from the sink's own buffer, so there is no FILE lock and the
+ * buffering does not change depending on whether stdout is a TTY or a pipe. ANSI
+ * colors are only emitted when the descriptor is a terminal, unless configured
+ * otherwise
+ */
+
+#pragma once
+
+#include "colors.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+/*!
+ * @brief size of the buffer used by the batch and timed flush policies
+ */
+#define CONSOLE_BUFFER_SIZE 16384
+
+/*!
+ * @brief flush interval used by CONSOLE_FLUSH_TIMED when none is configured
+ */
+#define CONSOLE_FLUSH_INTERVAL_MS 100
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*! @brief when buffered console output is written out
+ */
+typedef enum {
+    /*! every record is written with a single writev call (the default) */
+    CONSOLE_FLUSH_RECORD,
+    /*! records are buffered and written once the buffer is full, on
+       console_sink_flush, or when the sink is cleared */
+    CONSOLE_FLUSH_BATCH,
+    /*! like CONSOLE_FLUSH_BATCH, but a background thread also flushes the buffer
+       every flush interval */
+    CONSOLE_FLUSH_TIMED
+} CONSOLE_FLUSH;
+
+/*! @brief whether ANSI color codes are written
+ */
+typedef enum {
+    /*! color only when the descriptor is a TTY and NO_COLOR is not set */
+    CONSOLE_COLOR_AUTO,
+    /*! always write color codes */
+    CONSOLE_COLOR_ALWAYS,
+    /*! never write color codes */
+    CONSOLE_COLOR_NEVER
+} CONSOLE_COLOR;
+
+/*! @struct opaque console sink, see new_console_sink
+ */
+typedef struct console_sink console_sink;
+
+/*! @brief one of the records passed to console_sink_write_lines
+ */
+typedef struct console_line {
+    size_t len;   /*! @brief length of the record, without its newline */
+    COLORS color; /*! @brief color of the record */
+} console_line;
+
+/*! @brief returns a new console sink
+ * @param file_descriptor descriptor to write to, typically STDOUT_FILENO or
+ * STDERR_FILENO. it is not closed by clear_console_sink
+ * @param flush the flush policy
+ * @param flush_interval_ms interval used by CONSOLE_FLUSH_TIMED, 0 for
+ * CONSOLE_FLUSH_INTERVAL_MS
+ * @param color whether color codes are written
+ * @return Success: pointer to the sink
+ * @return Failure: NULL pointer
+ */
+console_sink *new_console_sink(int file_descriptor, CONSOLE_FLUSH flush,
+                               unsigned int flush_interval_ms, CONSOLE_COLOR color);
+
+/*! @brief writes a record followed by a newline
+ * @param sink the sink to write to
+ * @param color color of the record, ignored when colors are disabled
+ * @param record the record, not required to be null terminated
+ * @param record_len length of record
+ * @return Success: 0
+ * @return Failure: -1
+ */
+int console_sink_write(console_sink *sink, COLORS color, const char *record,
+                       size_t record_len);
+
+/*! @brief writes records that are stored back to back, each followed by a
+ * newline, with as few writes as possible
+ * @param text the records
+ * @param lines length and color of every record
+ * @param count number of records
+ * @return Success: 0
+ * @return Failure: -1
+ */
+int console_sink_write_lines(console_sink *sink, const char *text,
+                             const console_line *lines, size_t count);
+
+/*! @brief writes out anything buffered
+ * @return Success: 0
+ * @return Failure: -1
+ */
+int console_sink_flush(console_sink *sink);
+
+/*! @brief returns whether the sink writes color codes
+ */
+bool console_sink_colored(const console_sink *sink);
+
+/*! @brief flushes and frees up resources for the sink
+ */
+void clear_console_sink(console_sink *sink);
+
+#ifdef __cplusplus
+}
+#endif
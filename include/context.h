@@ -0,0 +1,68 @@
+// Copyright 2020 Bonedaddy (Alexandre Trottier)
+//
+// licensed under GNU AFFERO GENERAL PUBLIC LICENSE;
+// you may not use this file except in compliance with the License;
+// You may obtain the license via the LICENSE file in the repository root;
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/*! @file context.h
+ * @brief thread local context fields attached to every record
+ * @details every thread owns a stack of `key=value` pairs, such as a request or
+ * trace id. the pairs are rendered into a single `key=value key=value` string
+ * when they are pushed, and popping only cuts the string back, so a record pays a
+ * single copy of the finished text whatever the number of pairs. layouts render
+ * it with `%X`, layouts without `%X` append it after the record, and records
+ * render nothing extra while the stack is empty
+ */
+
+#pragma once
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*! @brief pushes key=value onto the calling thread's context
+ * @details control characters and invalid UTF-8 in key and value are escaped as
+ * with LOG_SANITIZE_CONTROL, so a context field can not forge lines
+ * @return Success: 0
+ * @return Failure: -1, the context is left unchanged
+ */
+int log_context_push(const char *key, const char *value);
+
+/*! @brief pushes key=value onto the calling thread's context
+ * @param key the key, key_len bytes
+ * @param value the value, value_len bytes
+ * @return Success: 0
+ * @return Failure: -1, the context is left unchanged
+ */
+int log_context_pushn(const char *key, size_t key_len, const char *value,
+                      size_t value_len);
+
+/*! @brief removes the pair pushed last by the calling thread, if any
+ */
+void log_context_pop(void);
+
+/*! @brief returns the number of pairs in the calling thread's context
+ */
+size_t log_context_depth(void);
+
+/*! @brief pops pairs until depth remain, see log_context_depth
+ */
+void log_context_restore(size_t depth);
+
+/*! @brief returns the rendered context of the calling thread
+ * @param len set to the length of the returned text, 0 when the context is empty
+ * @return the text, null terminated and valid until the next push or pop
+ */
+const char *log_context_get(size_t *len);
+
+#ifdef __cplusplus
+}
+#endif
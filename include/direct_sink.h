@@ -0,0 +1,113 @@
+// Copyright 2020 Bonedaddy (Alexandre Trottier)
+//
+// licensed under GNU AFFERO GENERAL PUBLIC LICENSE;
+// you may not use this file except in compliance with the License;
+// You may obtain the license via the LICENSE file in the repository root;
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/*! @file direct_sink.h
+ * @brief file writes that bypass the page cache
+ * @details the file is opened with O_DIRECT and records are collected in two
+ * buffers aligned to DIRECT_SINK_ALIGNMENT. a full buffer is handed to a writer
+ * thread, which writes it at its aligned offset while the callers fill the
+ * other one, so log files neither evict cached application data nor make the
+ * callers wait on the disk. writing out a partial buffer pads its last block
+ * with zero bytes, and the next buffer starts by rewriting that block. the
+ * padding is cut off when the sink is cleared, and when a file left padded by a
+ * crash is opened again. filesystems without O_DIRECT get the same aligned
+ * writes through the page cache
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*!
+ * @brief alignment of the buffers, file offsets and write sizes
+ */
+#define DIRECT_SINK_ALIGNMENT 4096
+
+/*!
+ * @brief size of each buffer when none is configured
+ */
+#define DIRECT_SINK_BUFFER_SIZE 65536
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*! @struct opaque direct sink, see new_direct_sink
+ */
+typedef struct direct_sink direct_sink;
+
+/*! @brief counters of a direct sink
+ */
+typedef struct direct_sink_stats {
+    bool direct;     /*! @brief false when the filesystem refused O_DIRECT */
+    uint64_t writes; /*! @brief aligned writes issued */
+    uint64_t syncs;  /*! @brief fdatasync calls issued */
+    uint64_t errors; /*! @brief failed writes and syncs */
+} direct_sink_stats;
+
+/*! @brief opens path for a direct sink, creating it when it does not exist
+ * @details falls back to a regular descriptor when the filesystem does not
+ * support O_DIRECT
+ * @return Success: the file descriptor
+ * @return Failure: -1
+ */
+int direct_sink_open(const char *path);
+
+/*! @brief returns a new direct sink appending to file_descriptor and starts its
+ * writer thread
+ * @param file_descriptor a descriptor from direct_sink_open, not closed by
+ * clear_direct_sink
+ * @param buffer_size bytes per buffer, rounded up to DIRECT_SINK_ALIGNMENT, 0
+ * for DIRECT_SINK_BUFFER_SIZE
+ * @return Success: pointer to the sink
+ * @return Failure: NULL pointer
+ */
+direct_sink *new_direct_sink(int file_descriptor, size_t buffer_size);
+
+/*! @brief returns the descriptor the sink writes to
+ */
+int direct_sink_fd(const direct_sink *sink);
+
+/*! @brief adds text to the current buffer, handing full buffers to the writer
+ * @param text one or more records, each followed by a newline
+ * @note calls that add text must be serialized by the caller
+ * @return Success: 0
+ * @return Failure: -1
+ */
+int direct_sink_write(direct_sink *sink, const char *text, size_t text_len);
+
+/*! @brief like direct_sink_write for a single record without its newline
+ */
+int direct_sink_write_record(direct_sink *sink, const char *record, size_t record_len);
+
+/*! @brief writes the current buffer padded to a whole block and waits until
+ * every buffer was written
+ * @param sync whether the file is synced to the disk as well
+ * @return Success: 0
+ * @return Failure: -1
+ */
+int direct_sink_flush(direct_sink *sink, bool sync);
+
+/*! @brief fills stats with the counters of the sink
+ */
+void direct_sink_stats_get(direct_sink *sink, direct_sink_stats *stats);
+
+/*! @brief writes out the current buffer, cuts off the padding, stops the writer
+ * and frees the sink
+ */
+void clear_direct_sink(direct_sink *sink);
+
+#ifdef __cplusplus
+}
+#endif
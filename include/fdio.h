@@ -0,0 +1,44 @@
+// Copyright 2020 Bonedaddy (Alexandre Trottier)
+//
+// licensed under GNU AFFERO GENERAL PUBLIC LICENSE;
+// you may not use this file except in compliance with the License;
+// You may obtain the license via the LICENSE file in the repository root;
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/*! @file fdio.h
+ * @brief helpers for writing to raw file descriptors
+ * @details write and writev may return after writing only part of the data, or
+ * fail with EINTR. these helpers retry until everything was written or a real
+ * error occurs
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <sys/uio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*! @brief writes len bytes of data to file_descriptor
+ * @return Success: 0
+ * @return Failure: -1
+ */
+int fd_write_all(int file_descriptor, const void *data, size_t len);
+
+/*! @brief writes every iovec to file_descriptor
+ * @warning iov is modified to track partial writes
+ * @return Success: 0
+ * @return Failure: -1
+ */
+int fd_writev_all(int file_descriptor, struct iovec *iov, int count);
+
+#ifdef __cplusplus
+}
+#endif
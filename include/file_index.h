@@ -0,0 +1,140 @@
+// Copyright 2020 Bonedaddy (Alexandre Trottier)
+//
+// licensed under GNU AFFERO GENERAL PUBLIC LICENSE;
+// you may not use this file except in compliance with the License;
+// You may obtain the license via the LICENSE file in the repository root;
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/*! @file file_index.h
+ * @brief sidecar index of a log file, for seeking by time and level
+ * @details the file is cut into blocks of roughly FILE_INDEX_BLOCK_SIZE bytes or
+ * FILE_INDEX_INTERVAL seconds of records, and an entry per block is appended to
+ * the index once the block is complete: its byte range in the log file, the
+ * seconds its first and last records were written in, and how many records of
+ * every level it holds. the writer only adds to counters per record and issues
+ * one small write per block. entries are sorted by offset, and by time as long
+ * as the wall clock does not go back, so readers binary search them. records
+ * written after the last entry, such as those of a crashed process, are not
+ * indexed and are found by reading on from the end of the last entry
+ *
+ * index file, native byte order:
+ *   - header: FILE_INDEX_MAGIC, then the size of an entry as uint32_t and 4
+ *     reserved bytes
+ *   - a file_index_entry per block
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+/*!
+ * @brief bytes of records per block when none is configured
+ */
+#define FILE_INDEX_BLOCK_SIZE 1048576
+
+/*!
+ * @brief seconds of records per block when none is configured
+ */
+#define FILE_INDEX_INTERVAL 60
+
+/*!
+ * @brief appended to the log file path to name its index
+ */
+#define FILE_INDEX_SUFFIX ".idx"
+
+/*!
+ * @brief first bytes of an index file
+ */
+#define FILE_INDEX_MAGIC "ulogidx1"
+
+/*!
+ * @brief levels counted per block, indexed by LOG_LEVELS
+ */
+#define FILE_INDEX_LEVELS 4
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*! @brief a block of the log file
+ */
+typedef struct file_index_entry {
+    uint64_t offset;     /*! @brief offset of the first record in the log file */
+    uint64_t length;     /*! @brief bytes of records in the block */
+    int64_t first_time;  /*! @brief second the first record was written in */
+    int64_t last_time;   /*! @brief second the last record was written in */
+    uint32_t counts[FILE_INDEX_LEVELS]; /*! @brief records per level */
+} file_index_entry;
+
+/*! @struct opaque index writer, see new_file_index
+ */
+typedef struct file_index file_index;
+
+/*! @brief returns a new writer appending to the index at index_path, which is
+ * created when it does not exist
+ * @param file_descriptor the log file, offsets start at its current size
+ * @param block_size bytes per block, 0 for FILE_INDEX_BLOCK_SIZE
+ * @param interval seconds per block, 0 for FILE_INDEX_INTERVAL
+ * @return Success: pointer to the writer
+ * @return Failure: NULL pointer
+ */
+file_index *new_file_index(const char *index_path, int file_descriptor,
+                           size_t block_size, unsigned int interval);
+
+/*! @brief returns the log file the writer indexes
+ */
+int file_index_fd(const file_index *index);
+
+/*! @brief accounts for records just written to the log file, appending the entry
+ * of the current block when it is complete
+ * @details the writer is not thread safe, the logger calls it with its lock held
+ * @param len bytes written, newlines included
+ * @param counts number of records of every level in them, indexed by LOG_LEVELS
+ * @return Success: 0
+ * @return Failure: -1 when the entry could not be written
+ */
+int file_index_add(file_index *index, size_t len,
+                   const size_t counts[FILE_INDEX_LEVELS]);
+
+/*! @brief appends the entry of the current block, even when it is not complete
+ * @return Success: 0
+ * @return Failure: -1
+ */
+int file_index_flush(file_index *index);
+
+/*! @brief appends the entry of the current block and frees up resources for the
+ * writer
+ */
+void clear_file_index(file_index *index);
+
+/*! @brief reads every entry of the index at index_path
+ * @param count set to the number of entries
+ * @return Success: array of entries to be freed with free, NULL when empty
+ * @return Failure: NULL pointer and count set to 0
+ */
+file_index_entry *file_index_load(const char *index_path, size_t *count);
+
+/*! @brief returns the first entry that may hold records written at time or
+ * later, count when there is none
+ * @details a binary search, the log file can be read from the offset of the
+ * returned entry on without missing such records
+ */
+size_t file_index_seek_time(const file_index_entry *entries, size_t count,
+                            time_t time);
+
+/*! @brief returns the first entry from start on holding records at least as
+ * severe as level, count when there is none
+ */
+size_t file_index_next_level(const file_index_entry *entries, size_t count,
+                             size_t start, int level);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,124 @@
+// Copyright 2020 Bonedaddy (Alexandre Trottier)
+//
+// licensed under GNU AFFERO GENERAL PUBLIC LICENSE;
+// you may not use this file except in compliance with the License;
+// You may obtain the license via the LICENSE file in the repository root;
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/*! @file file_sink.h
+ * @brief buffered file writes made durable by severe records
+ * @details records are collected in the sink's buffer and written once it is
+ * full, so routine records cost a copy instead of a synchronous write. a record
+ * written through is written together with everything buffered before it in a
+ * single writev, and file_sink_sync then makes it reach the disk with the
+ * records that led up to it. the sink is not thread safe, the logger calls it
+ * with its lock held, except for file_sink_sync which it calls after releasing
+ * the lock
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*!
+ * @brief size of the buffer when none is configured
+ */
+#define FILE_SINK_BUFFER_SIZE 65536
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*! @brief when records written to a file reach the disk
+ */
+typedef enum {
+    /*! the file is opened with O_SYNC and every record is written synchronously
+       (the default) */
+    FILE_SYNC_ALWAYS,
+    /*! records are buffered, and a record at least as severe as the configured
+       level writes the buffer and itself, then calls fdatasync once the logger
+       lock is released */
+    FILE_SYNC_ON_LEVEL,
+    /*! the file is opened with O_DIRECT and records are written in aligned
+       blocks by a thread of their own, see direct_sink.h. a record at least as
+       severe as the configured level writes the partial block and calls
+       fdatasync */
+    FILE_SYNC_DIRECT
+} FILE_SYNC;
+
+/*! @struct opaque file sink, see new_file_sink
+ */
+typedef struct file_sink file_sink;
+
+/*! @brief counters of a file sink
+ */
+typedef struct file_sink_stats {
+    uint64_t writes; /*! @brief writev calls issued */
+    uint64_t syncs;  /*! @brief fdatasync calls issued */
+    uint64_t errors; /*! @brief failed writes and syncs */
+} file_sink_stats;
+
+/*! @brief returns a new file sink
+ * @param buffer_size bytes buffered before they are written, 0 for
+ * FILE_SINK_BUFFER_SIZE
+ * @return Success: pointer to the sink
+ * @return Failure: NULL pointer
+ */
+file_sink *new_file_sink(size_t buffer_size);
+
+/*! @brief buffers text for file_descriptor, writing out the records buffered for
+ * another descriptor first
+ * @param text one or more records, each followed by a newline
+ * @param through whether text and everything buffered before it is written
+ * before returning, to be synced with file_sink_sync
+ * @return Success: 0
+ * @return Failure: -1
+ */
+int file_sink_write(file_sink *sink, int file_descriptor, const char *text,
+                    size_t text_len, bool through);
+
+/*! @brief like file_sink_write for a single record without its newline
+ */
+int file_sink_write_record(file_sink *sink, int file_descriptor, const char *record,
+                           size_t record_len, bool through);
+
+/*! @brief syncs what was written to file_descriptor to the disk
+ * @details unlike the other calls it needs no lock, so a logger syncs after
+ * releasing its own and callers of other levels are not held up by the disk
+ * @return Success: 0
+ * @return Failure: -1
+ */
+int file_sink_sync(file_sink *sink, int file_descriptor);
+
+/*! @brief writes out anything buffered
+ * @param sync whether the file is synced to the disk as well
+ * @return Success: 0
+ * @return Failure: -1
+ */
+int file_sink_flush(file_sink *sink, bool sync);
+
+/*! @brief writes out anything buffered and syncs file_descriptor, which may be
+ * closed afterwards
+ * @return Success: 0
+ * @return Failure: -1
+ */
+int file_sink_close_fd(file_sink *sink, int file_descriptor);
+
+/*! @brief fills stats with the counters of the sink
+ */
+void file_sink_stats_get(const file_sink *sink, file_sink_stats *stats);
+
+/*! @brief writes out anything buffered and frees up resources for the sink
+ */
+void clear_file_sink(file_sink *sink);
+
+#ifdef __cplusplus
+}
+#endif
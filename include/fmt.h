@@ -0,0 +1,107 @@
+// Copyright 2020 Bonedaddy (Alexandre Trottier)
+//
+// licensed under GNU AFFERO GENERAL PUBLIC LICENSE;
+// you may not use this file except in compliance with the License;
+// You may obtain the license via the LICENSE file in the repository root;
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/*! @file fmt.h
+ * @brief specialized formatting kernels used by the printf style hot path
+ * @details integers are converted two digits at a time from a lookup table,
+ * hexadecimal eight digits at a time with SWAR arithmetic on 64 bit words (16
+ * bytes at a time with SSE2 for binary payloads), and `%f` style doubles with
+ * exact 128 bit integer arithmetic rather than going through the locale aware
+ * stdio machinery. fmt_vformat walks a printf format and uses the kernels for
+ * the common conversions, falling back to vsnprintf for the whole message as
+ * soon as it meets anything else (flags, widths, `%e`, `%n`, ...) so the output
+ * always matches glibc
+ */
+
+#pragma once
+
+#include "buffer.h"
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*!
+ * @brief space needed by fmt_u64 and fmt_i64, sign included
+ */
+#define FMT_INT_SIZE 21
+
+/*!
+ * @brief space needed by fmt_hex64
+ */
+#define FMT_HEX_SIZE 16
+
+/*!
+ * @brief largest precision supported by fmt_fixed
+ */
+#define FMT_FIXED_MAX_PRECISION 9
+
+/*!
+ * @brief space needed by fmt_fixed: sign, 20 integer digits, point and fraction
+ */
+#define FMT_FIXED_SIZE (22 + FMT_FIXED_MAX_PRECISION)
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*! @brief writes value in decimal, output needs FMT_INT_SIZE bytes
+ * @return the number of bytes written, the output is not null terminated
+ */
+size_t fmt_u64(char *output, uint64_t value);
+
+/*! @brief writes value in decimal, output needs FMT_INT_SIZE bytes
+ * @return the number of bytes written, the output is not null terminated
+ */
+size_t fmt_i64(char *output, int64_t value);
+
+/*! @brief writes value in hexadecimal without leading zeroes or prefix, output
+ * needs FMT_HEX_SIZE bytes
+ * @return the number of bytes written, the output is not null terminated
+ */
+size_t fmt_hex64(char *output, uint64_t value, bool upper);
+
+/*! @brief writes the bytes of data as 2 * len lowercase hex digits
+ * @details converts 16 bytes per step with SSE2 when available, and 4 bytes per
+ * SWAR step otherwise
+ * @return the number of bytes written, the output is not null terminated
+ */
+size_t fmt_hex_bytes(char *output, const void *data, size_t len);
+
+/*! @brief writes value like printf `%.<precision>f`, output needs FMT_FIXED_SIZE
+ * bytes
+ * @details the result is correctly rounded (ties to even on the exact binary
+ * value, like glibc). values that can not be converted exactly with 128 bit
+ * arithmetic (nan, inf, magnitudes of 2^64 and above, or tiny values with a long
+ * binary fraction) are rejected so the caller can fall back to snprintf
+ * @return Success: the number of bytes written, the output is not null terminated
+ * @return Failure: 0
+ */
+size_t fmt_fixed(char *output, double value, int precision);
+
+/*! @brief appends a printf formatted string, null terminated
+ * @details same contract as log_buffer_vprintf, which it falls back to for
+ * conversions other than `%d %i %u %x %X %c %s %p %f %%` with an optional `l`,
+ * `ll` or `z` length and, for `%f`, a precision of at most
+ * FMT_FIXED_MAX_PRECISION
+ * @param buf the buffer to append to
+ * @param max_len upper bound of the appended length, excluding the terminator
+ * @param format printf style format
+ * @param args arguments for format
+ * @return Success: 0
+ * @return Failure: -1
+ */
+int fmt_vformat(log_buffer *buf, size_t max_len, const char *format, va_list args);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,93 @@
+// Copyright 2020 Bonedaddy (Alexandre Trottier)
+//
+// licensed under GNU AFFERO GENERAL PUBLIC LICENSE;
+// you may not use this file except in compliance with the License;
+// You may obtain the license via the LICENSE file in the repository root;
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/*! @file hexdump.h
+ * @brief logging of binary payloads as offset/hex/ASCII dumps
+ * @details renders the classic `hexdump -C` layout, one line per 16 bytes:
+ *
+ *     00000000  48 65 6c 6c 6f 20 77 6f  72 6c 64 0a 00 01 02 03  |Hello world.....|
+ *
+ * the dump is built in a reusable thread local buffer, so once warmed up logging a
+ * payload does not allocate, and payloads longer than the configured
+ * hexdump_max_bytes are cut with a note of how many bytes were left out
+ */
+
+#pragma once
+
+#include "logger.h"
+#include <stddef.h>
+
+/*!
+ * @brief number of payload bytes rendered per line
+ */
+#define HEXDUMP_BYTES_PER_LINE 16
+
+/*!
+ * @brief upper bound of a line rendered by hexdump_line
+ */
+#define HEXDUMP_LINE_SIZE 88
+
+/*!
+ * @brief default number of payload bytes dumped per record
+ */
+#define HEXDUMP_MAX_BYTES_DEFAULT 4096
+
+/*!
+ * @brief logs a dump of len bytes at data
+ * @param thl an instance of thread_logger
+ * @param level the LOG_LEVELS to log at
+ * @param data the payload, not read when level is disabled
+ * @param len length of the payload
+ * @param label describes the payload, rendered before the dump
+ */
+#define LOG_HEXDUMP(thl, level, data, len, label) \
+    log_hexdump(thl, 0, level, __FILENAME__, __LINE__, label, data, len);
+
+/*!
+  * @brief like LOG_HEXDUMP except for file logging
+*/
+#define fLOG_HEXDUMP(fhl, level, data, len, label) \
+    log_hexdump(fhl->thl, fhl->fd, level, __FILENAME__, __LINE__, label, data, len);
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*! @brief renders one dump line of at most HEXDUMP_BYTES_PER_LINE bytes
+ * @details shorter lines are padded so the ASCII column stays aligned
+ * @param output receives the line, needs HEXDUMP_LINE_SIZE bytes
+ * @param data the bytes of this line
+ * @param len number of bytes, at most HEXDUMP_BYTES_PER_LINE
+ * @param offset offset of data in the payload
+ * @return the number of bytes written, the output is not null terminated
+ */
+size_t hexdump_line(char *output, const void *data, size_t len, size_t offset);
+
+/*! @brief logs a dump of a binary payload
+ * @details the record message is `<label> (<len> bytes)` followed by one dump line
+ * per HEXDUMP_BYTES_PER_LINE bytes. returns before touching data when level is
+ * disabled
+ * @param thl pointer to an instance of thread_logger
+ * @param file_descriptor file descriptor to write log messages to, if 0 then only
+ * stdout is used
+ * @param level the log level to use (effects color used)
+ * @param label describes the payload, may be NULL
+ * @param data the payload
+ * @param len length of the payload
+ */
+void log_hexdump(thread_logger *thl, int file_descriptor, LOG_LEVELS level,
+                 const char *file, int line, const char *label, const void *data,
+                 size_t len);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,111 @@
+// Copyright 2020 Bonedaddy (Alexandre Trottier)
+//
+// licensed under GNU AFFERO GENERAL PUBLIC LICENSE;
+// you may not use this file except in compliance with the License;
+// You may obtain the license via the LICENSE file in the repository root;
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/*! @file histogram.h
+ * @brief lock free, log bucketed latency histogram
+ * @details values are recorded into HDR style buckets: every power of two range is
+ * split into HISTOGRAM_SUB_BUCKETS linear sub buckets, giving a relative error of
+ * roughly 1/HISTOGRAM_SUB_BUCKETS over the whole range. recording is a single
+ * relaxed atomic increment into a per thread shard, so concurrent writers never
+ * share a lock, and shards are merged whenever the histogram is queried
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*!
+ * @brief log2 of the number of linear sub buckets per power of two
+ */
+#define HISTOGRAM_SUB_BUCKET_BITS 4
+
+/*!
+ * @brief number of linear sub buckets per power of two
+ */
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BUCKET_BITS)
+
+/*!
+ * @brief values at or above 2^HISTOGRAM_MAX_BITS are clamped into the last bucket
+ * @note with nanosecond values this is roughly 18 minutes
+ */
+#define HISTOGRAM_MAX_BITS 40
+
+/*!
+ * @brief number of shards writers are spread across
+ */
+#define HISTOGRAM_SHARDS 16
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*! @struct opaque lock free histogram, see new_latency_histogram
+ */
+typedef struct latency_histogram latency_histogram;
+
+/*! @typedef summary of a histogram at the time it was taken
+ */
+typedef struct histogram_snapshot {
+    uint64_t count; /*! @brief number of recorded values */
+    uint64_t min;   /*! @brief lowest recorded value (bucket resolution) */
+    uint64_t max;   /*! @brief highest recorded value (bucket resolution) */
+    uint64_t p50;   /*! @brief 50th percentile */
+    uint64_t p90;   /*! @brief 90th percentile */
+    uint64_t p99;   /*! @brief 99th percentile */
+    uint64_t p999;  /*! @brief 99.9th percentile */
+} histogram_snapshot;
+
+/*! @brief returns a new zeroed histogram
+ * @return Success: pointer to the histogram
+ * @return Failure: NULL pointer
+ */
+latency_histogram *new_latency_histogram(void);
+
+/*! @brief frees up resources for the histogram
+ */
+void clear_latency_histogram(latency_histogram *hist);
+
+/*! @brief records a single value, safe to call concurrently from any thread
+ * @param hist the histogram to record into
+ * @param value the value to record, typically a latency in nanoseconds
+ */
+void histogram_record(latency_histogram *hist, uint64_t value);
+
+/*! @brief returns the number of values recorded so far
+ */
+uint64_t histogram_count(latency_histogram *hist);
+
+/*! @brief returns the value at the given percentile
+ * @param hist the histogram to query
+ * @param percentile the percentile in the range [0, 100], eg 99.9
+ * @return the highest value equivalent to the bucket containing the percentile, or
+ * 0 if nothing was recorded
+ */
+uint64_t histogram_percentile(latency_histogram *hist, double percentile);
+
+/*! @brief merges all shards and fills in snapshot
+ */
+void histogram_snapshot_get(latency_histogram *hist, histogram_snapshot *snapshot);
+
+/*! @brief zeroes all buckets
+ * @note values recorded concurrently with a reset may or may not be kept
+ */
+void histogram_reset(latency_histogram *hist);
+
+/*! @brief returns the current CLOCK_MONOTONIC time in nanoseconds
+ */
+uint64_t histogram_now(void);
+
+#ifdef __cplusplus
+}
+#endif
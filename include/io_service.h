@@ -0,0 +1,93 @@
+// Copyright 2020 Bonedaddy (Alexandre Trottier)
+//
+// licensed under GNU AFFERO GENERAL PUBLIC LICENSE;
+// you may not use this file except in compliance with the License;
+// You may obtain the license via the LICENSE file in the repository root;
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/*! @file io_service.h
+ * @brief a fixed set of I/O threads writing the files of many loggers
+ * @details records are tagged with the descriptor of their file and queued to
+ * the I/O thread owning that descriptor. every thread takes everything queued
+ * in one go, groups the records by descriptor, and writes the groups round robin
+ * with one writev per turn, so a busy file can not starve the others. the number
+ * of threads is fixed when the service is created, however many files are
+ * written through it
+ */
+
+#pragma once
+
+#include "queue.h"
+#include <stddef.h>
+#include <stdint.h>
+
+/*!
+ * @brief records written to one descriptor before the next one gets a turn
+ */
+#define LOG_IO_SERVICE_TURN_RECORDS 32
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*! @struct opaque I/O service, see new_log_io_service
+ */
+typedef struct log_io_service log_io_service;
+
+/*! @brief counters of a service, summed over its threads
+ */
+typedef struct log_io_service_stats {
+    size_t threads;      /*! @brief I/O threads */
+    uint64_t records;    /*! @brief records written */
+    uint64_t writes;     /*! @brief writev calls issued */
+    uint64_t bytes;      /*! @brief bytes written */
+    uint64_t errors;     /*! @brief records that failed to write */
+    uint64_t dropped;    /*! @brief records dropped by the overflow policy */
+} log_io_service_stats;
+
+/*! @brief returns a new service and starts its threads
+ * @param threads number of I/O threads, at least 1
+ * @param queue_size bytes of queue per thread, see new_log_queue
+ * @param overflow policy applied when a queue is full, LOG_OVERFLOW_SPILL is not
+ * supported and LOG_OVERFLOW_DROP_BELOW_LEVEL never drops
+ * @return Success: pointer to the service
+ * @return Failure: NULL pointer
+ */
+log_io_service *new_log_io_service(size_t threads, size_t queue_size,
+                                   LOG_OVERFLOW overflow);
+
+/*! @brief queues record followed by a newline for file_descriptor
+ * @details records too large for a queue are written by the caller once the
+ * records queued before them were written
+ * @return Success: 0
+ * @return Failure: -1 when the record was dropped
+ */
+int log_io_service_write(log_io_service *service, int file_descriptor, int level,
+                         const char *record, size_t record_len);
+
+/*! @brief waits until every record queued for file_descriptor was written, so
+ * it can be closed
+ */
+void log_io_service_flush_fd(log_io_service *service, int file_descriptor);
+
+/*! @brief waits until every queued record was written
+ */
+void log_io_service_flush(log_io_service *service);
+
+/*! @brief fills stats with the counters of the service
+ */
+void log_io_service_stats_get(log_io_service *service, log_io_service_stats *stats);
+
+/*! @brief writes out every queued record, stops the threads and frees the
+ * service, every logger using it must be cleared first
+ */
+void clear_log_io_service(log_io_service *service);
+
+#ifdef __cplusplus
+}
+#endif
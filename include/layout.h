@@ -0,0 +1,106 @@
+// Copyright 2020 Bonedaddy (Alexandre Trottier)
+//
+// licensed under GNU AFFERO GENERAL PUBLIC LICENSE;
+// you may not use this file except in compliance with the License;
+// You may obtain the license via the LICENSE file in the repository root;
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/*! @file layout.h
+ * @brief compiled record layouts
+ * @details a layout pattern such as `"%T %L %t %f:%l %m"` is parsed once into a
+ * flat array of ops, each of which is a specialized appender. literal segments
+ * (and the logger name, which is constant for a logger) are pre-copied into the
+ * layout so rendering a record is a tight loop over the ops without any format
+ * string parsing. the following specifiers are supported:
+ *   - `%T` timestamp of format `Jul 06 10:12:20 PM`
+ *   - `%L` level name (`info`, `warn`, `error`, `debug`)
+ *   - `%f` file that emitted the record
+ *   - `%l` line that emitted the record
+ *   - `%m` the message
+ *   - `%t` kernel thread id of the caller
+ *   - `%p` process id
+ *   - `%n` name of the logger
+ *   - `%X` the thread's context fields, see context.h
+ *   - `%%` a literal percent sign
+ *
+ * any other specifier is kept verbatim. layouts without `%X` render a non empty
+ * context after everything else, separated by a space
+ */
+
+#pragma once
+
+#include "logger.h"
+#include <stddef.h>
+#include <time.h>
+
+/*!
+ * @brief the layout used when none is configured, matches the historical output
+ * `[info - Jul 06 10:12:20 PM - file.c:12] message`
+ */
+#define LOG_LAYOUT_DEFAULT "[%L - %T - %f:%l] %m"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*! @typedef the values a layout renders for a single record
+ */
+typedef struct log_record {
+    LOG_LEVELS level;    /*! @brief level of the record */
+    const char *file;    /*! @brief file that emitted the record */
+    size_t file_len;     /*! @brief strlen of file */
+    int line;            /*! @brief line that emitted the record */
+    const char *message; /*! @brief the message */
+    size_t message_len;  /*! @brief strlen of message */
+    time_t time;         /*! @brief seconds rendered by `%T`, 0 for the current
+                            time */
+    const char *context; /*! @brief rendered context fields, see log_context_get */
+    size_t context_len;  /*! @brief length of context, 0 for none */
+} log_record;
+
+/*! @brief compiles pattern into a layout
+ * @param pattern the layout pattern, see the file documentation for specifiers
+ * @param name the logger name rendered by `%n`, may be NULL
+ * @return Success: pointer to the compiled layout
+ * @return Failure: NULL pointer
+ */
+log_layout *new_log_layout(const char *pattern, const char *name);
+
+/*! @brief frees up resources for the layout
+ */
+void clear_log_layout(log_layout *layout);
+
+/*! @brief returns the pattern layout was compiled from
+ */
+const char *log_layout_pattern(const log_layout *layout);
+
+/*! @brief returns the name layout renders for `%n`, empty when there is none
+ */
+const char *log_layout_name(const log_layout *layout);
+
+/*! @brief returns an upper bound of the bytes layout_render writes for record
+ * @note does not include a null terminator
+ */
+size_t layout_max_size(const log_layout *layout, const log_record *record);
+
+/*! @brief renders record into output
+ * @param layout the compiled layout
+ * @param record the record to render
+ * @param output buffer of at least layout_max_size bytes
+ * @return the number of bytes written, output is not null terminated
+ */
+size_t layout_render(const log_layout *layout, const log_record *record,
+                     char *output);
+
+/*! @brief returns the name of level as rendered by `%L`
+ */
+const char *log_level_name(LOG_LEVELS level);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,162 @@
+// Copyright 2020 Bonedaddy (Alexandre Trottier)
+//
+// licensed under GNU AFFERO GENERAL PUBLIC LICENSE;
+// you may not use this file except in compliance with the License;
+// You may obtain the license via the LICENSE file in the repository root;
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/*! @file lock.h
+ * @brief lock guarding the sinks of a logger, with a strategy chosen at creation
+ * @details log_lock_acquire and log_lock_release are inline functions that
+ * switch on the strategy, so callers take the lock without an indirect call. the
+ * uncontended paths of the mutex, ticket and futex strategies are inline as well
+ * and only contended acquisitions leave the caller. MCS acquisitions and releases
+ * are always out of line, since the per thread queue nodes live in lock.c. the
+ * spinning strategies yield the CPU after a while, so they degrade gracefully
+ * when there are more threads than cores, but are meant for critical sections of
+ * a few hundred nanoseconds on hosts where the lock holder is rarely descheduled.
+ * see lock-bench to compare them on a given host
+ */
+
+#pragma once
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*! @brief how a log_lock waits for its holder
+ */
+typedef enum {
+    /*! a default pthread mutex (the default) */
+    LOG_LOCK_MUTEX,
+    /*! a pthread mutex that spins briefly before sleeping where supported */
+    LOG_LOCK_ADAPTIVE,
+    /*! a FIFO ticket spinlock, fair but every waiter spins on the same line */
+    LOG_LOCK_TICKET,
+    /*! an MCS queue lock, FIFO with every waiter spinning on its own node */
+    LOG_LOCK_MCS,
+    /*! a futex word that spins briefly and then sleeps in the kernel */
+    LOG_LOCK_FUTEX
+} LOG_LOCK;
+
+/*! @struct queue node of an LOG_LOCK_MCS waiter, one per thread and lock held
+ */
+typedef struct log_mcs_node log_mcs_node;
+
+/*! @brief a lock of any strategy, initialize with log_lock_init
+ */
+typedef struct log_lock {
+    LOG_LOCK strategy;
+    union {
+        pthread_mutex_t mutex; /*! @brief LOG_LOCK_MUTEX and LOG_LOCK_ADAPTIVE */
+        struct {
+            uint32_t next;    /*! @brief next ticket handed out */
+            uint32_t serving; /*! @brief ticket holding the lock */
+        } ticket;
+        struct {
+            log_mcs_node *tail;  /*! @brief last waiter, NULL when free */
+            log_mcs_node *owner; /*! @brief node of the holder */
+        } mcs;
+        uint32_t futex; /*! @brief 0 free, 1 held, 2 held with sleepers */
+    };
+} log_lock;
+
+/*! @brief initializes lock with the given strategy
+ * @return Success: 0
+ * @return Failure: -1 when the strategy is unknown
+ */
+int log_lock_init(log_lock *lock, LOG_LOCK strategy);
+
+/*! @brief frees resources of an unlocked lock
+ */
+void log_lock_destroy(log_lock *lock);
+
+/*! @brief contended paths, and the whole MCS paths, called by log_lock_acquire
+ * and log_lock_release */
+void log_lock_ticket_wait(log_lock *lock, uint32_t ticket);
+void log_lock_futex_wait(log_lock *lock);
+void log_lock_futex_wake(log_lock *lock);
+void log_lock_mcs_acquire(log_lock *lock);
+void log_lock_mcs_release(log_lock *lock);
+
+/*! @brief acquires lock
+ * @return 0
+ */
+static inline int log_lock_acquire(log_lock *lock) {
+
+    switch (lock->strategy) {
+        case LOG_LOCK_TICKET: {
+            uint32_t ticket = __atomic_fetch_add(&lock->ticket.next, 1, __ATOMIC_RELAXED);
+            if (__atomic_load_n(&lock->ticket.serving, __ATOMIC_ACQUIRE) != ticket) {
+                log_lock_ticket_wait(lock, ticket);
+            }
+            return 0;
+        }
+        case LOG_LOCK_FUTEX: {
+            uint32_t expected = 0;
+            if (!__atomic_compare_exchange_n(&lock->futex, &expected, 1, false,
+                                             __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+                log_lock_futex_wait(lock);
+            }
+            return 0;
+        }
+        case LOG_LOCK_MCS:
+            log_lock_mcs_acquire(lock);
+            return 0;
+        default:
+            return pthread_mutex_lock(&lock->mutex);
+    }
+}
+
+/*! @brief releases lock, must be called by the thread that acquired it
+ * @return 0
+ */
+static inline int log_lock_release(log_lock *lock) {
+
+    switch (lock->strategy) {
+        case LOG_LOCK_TICKET:
+            // only the holder writes serving
+            __atomic_store_n(&lock->ticket.serving,
+                             __atomic_load_n(&lock->ticket.serving, __ATOMIC_RELAXED) + 1,
+                             __ATOMIC_RELEASE);
+            return 0;
+        case LOG_LOCK_FUTEX:
+            if (__atomic_exchange_n(&lock->futex, 0, __ATOMIC_RELEASE) == 2) {
+                log_lock_futex_wake(lock);
+            }
+            return 0;
+        case LOG_LOCK_MCS:
+            log_lock_mcs_release(lock);
+            return 0;
+        default:
+            return pthread_mutex_unlock(&lock->mutex);
+    }
+}
+
+/*! @brief non inline log_lock_acquire, see thread_logger::lock */
+int log_lock_acquire_fn(log_lock *lock);
+
+/*! @brief non inline log_lock_release, see thread_logger::unlock */
+int log_lock_release_fn(log_lock *lock);
+
+/*! @brief returns the name of strategy, as accepted by log_lock_parse */
+const char *log_lock_name(LOG_LOCK strategy);
+
+/*! @brief returns the strategy called name
+ * @return Success: 0
+ * @return Failure: -1 when name is not a strategy
+ */
+int log_lock_parse(const char *name, LOG_LOCK *strategy);
+
+#ifdef __cplusplus
+}
+#endif
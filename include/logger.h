@@ -20,16 +20,37 @@
  *   - [warn - Jul 06 10:01:07 PM] one	two
  * @note warn, and info appear to not respect format, while debug and error do
  * @todo
- *  - buffer logs and use a dedicated thread for writing (avoid blocking locks)
  *  - handling system signals (exit, kill, etc...)
  */
 
 #pragma once
 
+#include "backtrace.h"
 #include "colors.h"
+#include "compress.h"
+#include "console.h"
+#include "direct_sink.h"
+#include "file_index.h"
+#include "file_sink.h"
+#include "histogram.h"
+#include "io_service.h"
+#include "lock.h"
+#include "percpu.h"
+#include "pool.h"
+#include "queue.h"
+#include "sanitize.h"
+#include "shm.h"
 #include <pthread.h>
 #include <stdbool.h>
 #include <string.h>
+#include <time.h>
+
+/*!
+ * @brief rendered records shorter than this are written without the logger lock
+ * in direct append mode, leaving room below PIPE_BUF (4096 on Linux) for the
+ * newline and console color codes
+ */
+#define LOG_DIRECT_APPEND_MAX (4096 - 32)
 
 /*!
  * @brief strips leading path from __FILE__
@@ -165,6 +186,54 @@
 #define fLOGF_DEBUG(fhl, msg, ...) \
     fhl->thl->logf(fhl->thl, fhl->fd, LOG_LEVELS_DEBUG, __FILENAME__, __LINE__, msg, __VA_ARGS__);
 
+/*!
+  * @brief like LOG_INFO except the record is added to an open log_batch
+*/
+#define BATCH_LOG_INFO(batch, msg) \
+    log_batch_append(batch, LOG_LEVELS_INFO, msg, __FILENAME__, __LINE__);
+
+/*!
+  * @brief like LOG_WARN except the record is added to an open log_batch
+*/
+#define BATCH_LOG_WARN(batch, msg) \
+    log_batch_append(batch, LOG_LEVELS_WARN, msg, __FILENAME__, __LINE__);
+
+/*!
+  * @brief like LOG_ERROR except the record is added to an open log_batch
+*/
+#define BATCH_LOG_ERROR(batch, msg) \
+    log_batch_append(batch, LOG_LEVELS_ERROR, msg, __FILENAME__, __LINE__);
+
+/*!
+  * @brief like LOG_DEBUG except the record is added to an open log_batch
+*/
+#define BATCH_LOG_DEBUG(batch, msg) \
+    log_batch_append(batch, LOG_LEVELS_DEBUG, msg, __FILENAME__, __LINE__);
+
+/*!
+  * @brief like LOGF_INFO except the record is added to an open log_batch
+*/
+#define BATCH_LOGF_INFO(batch, msg, ...) \
+    log_batch_appendf(batch, LOG_LEVELS_INFO, __FILENAME__, __LINE__, msg, __VA_ARGS__);
+
+/*!
+  * @brief like LOGF_WARN except the record is added to an open log_batch
+*/
+#define BATCH_LOGF_WARN(batch, msg, ...) \
+    log_batch_appendf(batch, LOG_LEVELS_WARN, __FILENAME__, __LINE__, msg, __VA_ARGS__);
+
+/*!
+  * @brief like LOGF_ERROR except the record is added to an open log_batch
+*/
+#define BATCH_LOGF_ERROR(batch, msg, ...) \
+    log_batch_appendf(batch, LOG_LEVELS_ERROR, __FILENAME__, __LINE__, msg, __VA_ARGS__);
+
+/*!
+  * @brief like LOGF_DEBUG except the record is added to an open log_batch
+*/
+#define BATCH_LOGF_DEBUG(batch, msg, ...) \
+    log_batch_appendf(batch, LOG_LEVELS_DEBUG, __FILENAME__, __LINE__, msg, __VA_ARGS__);
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -173,6 +242,26 @@ extern "C" {
  */
 struct thread_logger;
 
+/*! @struct compiled record layout, see layout.h
+ */
+typedef struct log_layout log_layout;
+
+/*! @typedef settings a logger renders and writes records with
+ * @brief immutable once published, reconfigure_thread_logger swaps in a new copy
+ * and frees the old one when no log call can still be reading it
+ */
+typedef struct log_settings {
+    log_layout *layout; /*! @brief compiled layout used to render every record */
+    console_sink *console; /*! @brief stdout/stderr sink every record goes to */
+    size_t max_message_size; /*! @brief longer messages are truncated */
+    size_t hexdump_max_bytes; /*! @brief payload bytes dumped by log_hexdump */
+    LOG_SANITIZE sanitize; /*! @brief how message bytes are escaped */
+    int console_fd; /*! @brief descriptor console was created for */
+    CONSOLE_FLUSH console_flush; /*! @brief flush policy console was created with */
+    unsigned int console_flush_ms; /*! @brief interval console was created with */
+    CONSOLE_COLOR console_color; /*! @brief colors console was created with */
+} log_settings;
+
 /*! @typedef specifies log_levels, typically used when determining function
  * invocation by log_fn
  */
@@ -187,11 +276,13 @@ typedef enum {
     LOG_LEVELS_DEBUG
 } LOG_LEVELS;
 
-/*! @typedef signature of pthread_mutex_unlock and pthread_mutex_lock used by the
+/*! @typedef signature of log_lock_acquire_fn and log_lock_release_fn used by the
  * thread_logger
- * @param mx pointer to a pthread_mutex_t type
+ * @note takes a log_lock since lock strategies were added, it took a
+ * pthread_mutex_t before. `thl->lock(&thl->mutex)` compiles either way
+ * @param mx pointer to the lock of a thread_logger
  */
-typedef int (*mutex_fn)(pthread_mutex_t *mx);
+typedef int (*mutex_fn)(log_lock *mx);
 
 #ifdef __cplusplus
 /*! @typedef signature used by the thread_logger for log_fn calls
@@ -248,15 +339,170 @@ typedef void (*log_fnf)(struct thread_logger *thl, int file_descriptor,
  * functions directly
  */
 typedef struct thread_logger {
-    bool debug; /*! @brief indicates whether we will action on debug logs */
-    pthread_mutex_t mutex; /*! @brief used for synchronization across threads */
-    mutex_fn lock;         /*! @brief helper function for pthread_mutex_lock */
-    mutex_fn unlock;       /*! @brief helper function for pthread_mutex_unlock */
+    bool debug; /*! @brief indicates whether we will action on debug logs, kept in
+                   sync with the logger level */
+    log_lock mutex; /*! @brief used for synchronization across threads, see
+                       thread_logger_config::lock. children write under the
+                       mutex of their root instead of their own */
+    mutex_fn lock;   /*! @brief acquires mutex, for callers outside the library
+                        which itself takes it with the inline log_lock_acquire.
+                        for children it acquires the mutex of their root */
+    mutex_fn unlock; /*! @brief releases mutex, see lock */
     log_fn log; /*! @brief function that gets called for all regular logging */
     log_fnf
         logf; /*! @brief function that gets called for all printf style logging */
+    latency_histogram *call_latency; /*! @brief entry to return latency of log_func
+                                        and logf_func, NULL unless enabled and
+                                        for children, see root */
+    latency_histogram *sink_latency; /*! @brief latency of writing a record to
+                                        stdout and the file, NULL unless enabled
+                                        and for children, see root */
+    log_settings *settings; /*! @brief settings read by every log call, replaced
+                               by reconfigure_thread_logger. load it with
+                               rcu_dereference inside an rcu read section */
+    record_pool *pool; /*! @brief slabs records are formatted in, NULL unless a
+                          pool budget is configured */
+    log_queue *queue; /*! @brief records are handed to a writer thread through
+                         it, NULL when the callers write them */
+    log_percpu *percpu; /*! @brief records are handed to a writer thread through
+                           rings of the CPUs, NULL unless configured */
+    log_io_service *io_service; /*! @brief writes the file records when the
+                                   logger has no queue, NULL when the callers
+                                   write them */
+    bool direct_append; /*! @brief see thread_logger_config::direct_append */
+    file_sink *file_buffer; /*! @brief buffers the file records, NULL unless
+                             FILE_SYNC_ON_LEVEL is configured. used with mutex
+                             held, except for file_sink_sync */
+    LOG_LEVELS file_sync_level; /*! @brief see thread_logger_config */
+    log_backtrace_sites *backtraces; /*! @brief call site limits of error
+                                        backtraces, NULL unless enabled */
+    log_compress *compressor; /*! @brief compresses the records of the file of
+                                 new_file_logger_config, NULL unless
+                                 file_compress is set. used with mutex held */
+    direct_sink *direct; /*! @brief writes the file of new_file_logger_config
+                            around the page cache, NULL unless
+                            FILE_SYNC_DIRECT is configured. used with mutex
+                            held */
+    log_shm *shm; /*! @brief ring shared with other processes the file records of
+                     new_file_logger_config go through, NULL unless shm_name
+                     is set */
+    file_index *index; /*! @brief indexes the file of new_file_logger_config, NULL
+                          unless index_file is set. used with mutex held */
+    unsigned int enabled_levels; /*! @brief bit (1 << level) is set for every
+                                    level that is logged, cached from the level of
+                                    the logger or its nearest ancestor */
+    LOG_LEVELS level;     /*! @brief least severe level logged, see
+                             set_thread_logger_level */
+    bool level_set;       /*! @brief false when the level is inherited */
+    char *name;           /*! @brief dotted name of a child logger, NULL for roots */
+    struct thread_logger *root;     /*! @brief owns the sinks, itself for roots */
+    struct thread_logger *parent;   /*! @brief NULL for roots */
+    struct thread_logger *children; /*! @brief first child logger */
+    struct thread_logger *next_sibling; /*! @brief next child of parent */
+    struct file_logger *file; /*! @brief file view of a child, see
+                                 get_child_file_logger */
 } thread_logger;
 
+/*! @typedef options used when creating a thread_logger
+ * @brief zero initialize and set the fields you care about, unset fields use
+ * their defaults
+ */
+typedef struct thread_logger_config {
+    bool debug;       /*! @brief whether debug logs are emitted */
+    const char *name; /*! @brief name of the logger rendered by `%n`, may be NULL */
+    const char *layout; /*! @brief record layout pattern, see layout.h. NULL uses
+                           LOG_LAYOUT_DEFAULT */
+    int console_fd; /*! @brief descriptor of the console sink, 0 for stdout */
+    CONSOLE_FLUSH console_flush; /*! @brief flush policy of the console sink */
+    unsigned int console_flush_ms; /*! @brief interval of CONSOLE_FLUSH_TIMED, 0
+                                      for CONSOLE_FLUSH_INTERVAL_MS */
+    CONSOLE_COLOR console_color; /*! @brief whether the console sink uses colors */
+    size_t max_message_size; /*! @brief messages longer than this are cut and end
+                                with LOG_TRUNCATION_MARKER, 0 for
+                                LOG_MESSAGE_MAX_DEFAULT */
+    size_t hexdump_max_bytes; /*! @brief log_hexdump cuts longer payloads, 0 for
+                                 HEXDUMP_MAX_BYTES_DEFAULT */
+    LOG_SANITIZE sanitize; /*! @brief escaping of untrusted message bytes, see
+                              sanitize.h */
+    size_t pool_budget; /*! @brief bytes preallocated for a record_pool, see
+                           pool.h. 0 formats records in growable thread local
+                           buffers */
+    size_t pool_slab_size; /*! @brief bytes per pool slab, 0 for
+                              RECORD_POOL_SLAB_SIZE_DEFAULT. with a pool messages
+                              are capped at half a slab and at most 8 KiB */
+    int pool_flags; /*! @brief RECORD_POOL_HUGEPAGES and/or RECORD_POOL_MLOCK */
+    RECORD_POOL_EXHAUSTED pool_exhausted; /*! @brief what happens to a record when
+                                             every slab is in use */
+    size_t queue_size; /*! @brief bytes of queue between the callers and a writer
+                          thread, see queue.h. 0 writes records in the caller */
+    LOG_OVERFLOW queue_overflow; /*! @brief what happens to a record that does not
+                                    fit in the queue */
+    LOG_LEVELS queue_drop_level; /*! @brief LOG_OVERFLOW_DROP_BELOW_LEVEL drops
+                                    records less severe than this, never errors */
+    const char *queue_spill_file; /*! @brief file LOG_OVERFLOW_SPILL appends
+                                     records to */
+    size_t percpu_size; /*! @brief bytes of buffer per CPU between the callers
+                           and a writer thread, see percpu.h. queue_overflow
+                           must be LOG_OVERFLOW_BLOCK or LOG_OVERFLOW_DROP_NEWEST.
+                           ignored when a queue is configured */
+    LOG_LOCK lock; /*! @brief strategy of the lock guarding the sinks, see
+                      lock.h */
+    bool direct_append; /*! @brief records shorter than LOG_DIRECT_APPEND_MAX
+                           are written to the file with a single write and
+                           without the logger lock, relying on O_APPEND for
+                           atomicity. ignored when a queue or per CPU
+                           buffers are configured */
+    log_io_service *io_service; /*! @brief service the file records are handed
+                                   to, shared by any number of loggers and not
+                                   owned by them, see io_service.h. the console
+                                   is still written by the caller. ignored when a
+                                   queue or per CPU buffers are configured */
+    FILE_SYNC file_sync; /*! @brief when file records reach the disk, see
+                            file_sink.h. FILE_SYNC_ON_LEVEL and
+                            FILE_SYNC_DIRECT disable direct_append and are
+                            ignored with an io_service, FILE_SYNC_DIRECT also
+                            with file_compress */
+    LOG_LEVELS file_sync_level; /*! @brief least severe level that writes and
+                                   syncs the records buffered before it with
+                                   FILE_SYNC_ON_LEVEL or FILE_SYNC_DIRECT, used
+                                   when file_sync_level_set is true */
+    bool file_sync_level_set; /*! @brief false for a file_sync_level of
+                                 LOG_LEVELS_ERROR */
+    size_t file_buffer_size; /*! @brief bytes of file records buffered with
+                                FILE_SYNC_ON_LEVEL, 0 for FILE_SINK_BUFFER_SIZE,
+                                or per buffer with FILE_SYNC_DIRECT, 0 for
+                                DIRECT_SINK_BUFFER_SIZE */
+    bool error_backtrace; /*! @brief error records carry the stack of their
+                             caller, see backtrace.h */
+    unsigned int backtrace_site_limit; /*! @brief backtraces per call site per
+                                          second, 0 for LOG_BACKTRACE_SITE_LIMIT */
+    bool file_compress; /*! @brief new_file_logger_config compresses its file
+                           in independent blocks on a thread of its own, see
+                           compress.h. disables direct_append and is ignored
+                           with an io_service */
+    size_t compress_block_size; /*! @brief bytes of records per compressed block,
+                                   0 for LOG_COMPRESS_BLOCK_SIZE */
+    int compress_level; /*! @brief zlib level, 0 for LOG_COMPRESS_LEVEL_DEFAULT */
+    bool index_file; /*! @brief new_file_logger_config maintains a sidecar index
+                        of its file named after it with FILE_INDEX_SUFFIX, see
+                        file_index.h. disables direct_append and is ignored
+                        with file_compress or an io_service */
+    size_t index_block_size; /*! @brief bytes of records per index entry, 0 for
+                                FILE_INDEX_BLOCK_SIZE */
+    unsigned int index_interval; /*! @brief seconds of records per index entry,
+                                    0 for FILE_INDEX_INTERVAL */
+    const char *shm_name; /*! @brief new_file_logger_config hands its file
+                             records to the shared memory ring of this name,
+                             written by a single drainer, see shm.h. a full
+                             ring is handled by queue_overflow. disables
+                             direct_append and the other file options, and is
+                             ignored with an io_service */
+    bool shm_drain; /*! @brief this process drains the ring called shm_name
+                       into the file, exactly one process should */
+    size_t shm_size; /*! @brief bytes of the ring when it is created, 0 for
+                        LOG_SHM_SIZE */
+} thread_logger_config;
+
 /*! @typedef a wrapper around thread_logger that enables file logging
  * @brief like thread_logger but also writes to a file
  * @todo
@@ -266,8 +512,28 @@ typedef struct file_logger {
     int fd; /*! @brief the file descriptor used for sending log information to */
     thread_logger *thl; /*! @brief the underlying threadsafe logger used for
                            sycnhronization and the actual logging */
+    bool owns_logger; /*! @brief whether thl is cleared with the file logger */
 } file_logger;
 
+/*! @typedef records collected by log_batch_append and written together by
+ * log_batch_commit
+ * @brief the records share one timestamp, one acquisition of the logger lock and
+ * one write per sink, and stay contiguous in the output. they are collected in
+ * buffers of the calling thread, so a thread has at most one open batch
+ */
+typedef struct log_batch {
+    thread_logger *thl;  /*! @brief logger the records are rendered and written by */
+    int file_descriptor; /*! @brief file the records are written to, 0 for none */
+    time_t time;         /*! @brief seconds rendered by `%T` for every record */
+    log_buffer *text;    /*! @brief the rendered records, each followed by a
+                            newline */
+    log_buffer *lines;   /*! @brief a console_line per record */
+    size_t count;        /*! @brief number of records */
+    LOG_LEVELS level;    /*! @brief most severe level of the records */
+    size_t level_counts[FILE_INDEX_LEVELS]; /*! @brief number of records of every
+                                               level, indexed by LOG_LEVELS */
+} log_batch;
+
 /*! @brief returns a new thread safe logger
  * if with_debug is false, then all debug_log calls will be ignored
  * @param with_debug whether to enable debug logging, if false debug log calls will
@@ -275,6 +541,76 @@ typedef struct file_logger {
  */
 thread_logger *new_thread_logger(bool with_debug);
 
+/*! @brief returns a new thread safe logger configured by config
+ * @param config the logger configuration, only read during the call
+ * @return Success: pointer to the logger
+ * @return Failure: NULL pointer
+ */
+thread_logger *new_thread_logger_config(const thread_logger_config *config);
+
+/*! @brief returns the child logger of parent called name, creating it and any
+ * missing intermediate logger on first use
+ * @details name is a dotted path relative to parent, so `"net.http"` is the child
+ * `"http"` of the child `"net"`. children share every sink, the mutex, queue and
+ * pool of their root, render their full dotted name for `%n` and inherit the level
+ * of their parent until one is set. `child->lock(&child->mutex)` takes the mutex
+ * of the root. they are freed with their root
+ * @return Success: pointer to the child
+ * @return Failure: NULL pointer
+ */
+thread_logger *get_child_logger(thread_logger *parent, const char *name);
+
+/*! @brief like get_child_logger, with records also written to the file of parent
+ * @details the returned file_logger shares the descriptor of parent and is freed
+ * with its root
+ */
+file_logger *get_child_file_logger(file_logger *parent, const char *name);
+
+/*! @brief sets the least severe level logged by thl and every descendant that
+ * inherits its level, severity grows from debug to info, warn and error
+ */
+void set_thread_logger_level(thread_logger *thl, LOG_LEVELS level);
+
+/*! @brief makes a child logger inherit the level of its parent again, ignored for
+ * roots
+ */
+void inherit_thread_logger_level(thread_logger *thl);
+
+/*! @brief replaces the layout, console and message limits of a root logger and
+ * its children while other threads keep logging
+ * @details levels, the record pool and the queue are not touched. new settings
+ * are built for every logger of the tree and published, log calls that already
+ * loaded the old ones finish with them, and the old ones are freed once no call
+ * can still be reading them. must not be called from inside a log call
+ * @param thl a root logger
+ * @param config the fields layout, name, console_*, max_message_size,
+ * hexdump_max_bytes and sanitize are applied, everything else is ignored
+ * @return Success: 0
+ * @return Failure: -1, the old settings stay in place
+ */
+int reconfigure_thread_logger(thread_logger *thl, const thread_logger_config *config);
+
+/*! @brief returns a new file_logger configured by config
+ * @param output_file the file we will dump logs to. created if not exists and is
+ * appended to
+ * @param config the configuration of the underlying thread_logger
+ * @return Success: pointer to the file logger
+ * @return Failure: NULL pointer
+ */
+file_logger *new_file_logger_config(const char *output_file,
+                                    const thread_logger_config *config);
+
+/*! @brief returns a new file_logger writing to output_file through thl
+ * @details many files can share one logger, and with it one lock, console and
+ * I/O service. clearing the file logger closes the file once the records queued
+ * for it were written, and leaves thl alone
+ * @param output_file the file we will dump logs to. created if not exists and is
+ * appended to
+ * @return Success: pointer to the file logger
+ * @return Failure: NULL pointer
+ */
+file_logger *open_file_logger(thread_logger *thl, const char *output_file);
+
 #ifdef __cplusplus
 /*! @brief returns a new file_logger
  * Calls new_thread_logger internally
@@ -291,14 +627,72 @@ file_logger *new_file_logger(const char *output_file, bool with_debug);
 file_logger *new_file_logger(char *output_file, bool with_debug);
 #endif
 
-/*! @brief free resources for the threaded logger
+/*! @brief enables the call and sink latency histograms of the logger
+ * @details once enabled every log_func and logf_func invocation records its entry
+ * to return latency into thl->call_latency, and the time spent writing the record
+ * to stdout and the file descriptor into thl->sink_latency. query them with
+ * histogram_percentile or histogram_snapshot_get. a hierarchy has one pair, on
+ * its root, so called on a child it enables those of the root, which measure
+ * every child as well
+ * @warning must be called before the logger is shared with other threads
+ * @return Success: 0
+ * @return Failure: -1
+ */
+int enable_latency_histograms(thread_logger *thl);
+
+/*! @brief opens a batch of records for thl, written to file_descriptor and the
+ * console when committed
+ * @param file_descriptor file the records are written to, 0 for the console only
+ * @return Success: 0
+ * @return Failure: -1 when the calling thread already has an open batch, or
+ * out of memory
+ */
+int log_batch_begin(log_batch *batch, thread_logger *thl, int file_descriptor);
+
+/*! @brief renders message with the logger layout and adds it to batch, records
+ * below the logger level are skipped
+ * @return Success: 0
+ * @return Failure: -1
+ */
+int log_batch_append(log_batch *batch, LOG_LEVELS level, const char *message,
+                     const char *file, int line);
+
+/*! @brief like log_batch_append with a printf style message
+ */
+int log_batch_appendf(log_batch *batch, LOG_LEVELS level, const char *file, int line,
+                      const char *format, ...);
+
+/*! @brief writes the records of batch and closes it
+ * @details without a queue the file gets all records with one write and the
+ * console with one writev, under a single acquisition of the logger lock. a
+ * queue, per CPU buffers or an I/O service get them as one record of the most
+ * severe level, so they stay contiguous there too
+ * @return Success: 0
+ * @return Failure: -1 when a sink failed
+ */
+int log_batch_commit(log_batch *batch);
+
+/*! @brief writes out any records queued and file or console output buffered by
+ * the logger
+ * @note only needed with a queue, per CPU buffers or an I/O service, or the
+ * FILE_SYNC_ON_LEVEL, FILE_SYNC_DIRECT, CONSOLE_FLUSH_BATCH and
+ * CONSOLE_FLUSH_TIMED policies
+ * @return Success: 0
+ * @return Failure: -1
+ */
+int flush_thread_logger(thread_logger *thl);
+
+/*! @brief free resources for the threaded logger and all of its child loggers
  * @param thl the thread_logger instance to free memory for
+ * @note child loggers are freed with their root, clearing one does nothing
  */
 void clear_thread_logger(thread_logger *thl);
 
 /*! @brief free resources for the file ogger
  * @param fhl the file_logger instance to free memory for. also frees memory for the
- * embedded thread_logger and closes the open file
+ * embedded thread_logger, unless it came from open_file_logger, and closes the
+ * open file
+ * @note child file loggers are freed with their root, clearing one does nothing
  */
 void clear_file_logger(file_logger *fhl);
 
@@ -313,6 +707,37 @@ void clear_file_logger(file_logger *fhl);
 void log_func(thread_logger *thl, int file_descriptor, char *message,
               LOG_LEVELS level, char *file, int line);
 
+/*! @brief like log_func but takes the length of the message
+ * @details used by front ends that format messages themselves, such as ulog.hpp
+ * @param thl pointer to an instance of thread_logger
+ * @param file_descriptor file descriptor to write log messages to, if 0 then only
+ * stdout is used
+ * @param message the message, not required to be null terminated
+ * @param message_len length of message
+ * @param level the log level to use (effects color used)
+ */
+void logn_func(thread_logger *thl, int file_descriptor, const char *message,
+               size_t message_len, LOG_LEVELS level, const char *file, int line);
+
+/*! @brief like logn_func for messages rendered by the library itself, which are
+ * written without sanitizing
+ * @details used by log_hexdump, whose dump lines are separated by newlines. a
+ * caller supplied part of message must be escaped by the caller
+ */
+void logn_func_raw(thread_logger *thl, int file_descriptor, const char *message,
+                   size_t message_len, LOG_LEVELS level, const char *file, int line);
+
+/*! @brief returns whether records of level are emitted by the logger
+ * @details front ends call this before formatting so disabled records cost
+ * nothing but the check
+ */
+bool log_level_enabled(const thread_logger *thl, LOG_LEVELS level);
+
+/*! @brief returns the severity of level, which grows from debug to info, warn
+ * and error
+ */
+int log_level_severity(LOG_LEVELS level);
+
 /*! @brief like log_func but for formatted logs
  * @param thl pointer to an instance of thread_logger
  * @param file_descriptor file descriptor to write log messages to, if 0 then only
@@ -0,0 +1,92 @@
+// Copyright 2020 Bonedaddy (Alexandre Trottier)
+//
+// licensed under GNU AFFERO GENERAL PUBLIC LICENSE;
+// you may not use this file except in compliance with the License;
+// You may obtain the license via the LICENSE file in the repository root;
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/*! @file percpu.h
+ * @brief record buffers sharded by CPU, drained by a writer thread
+ * @details every CPU has a ring of its own. callers reserve space in the ring of
+ * the CPU they run on and copy the record in without a lock. on x86_64 Linux
+ * with glibc the reservation is a restartable sequence, which the kernel aborts
+ * if the caller is preempted or migrated, so it needs no atomic instruction at
+ * all. elsewhere it is a compare and swap on the ring of the CPU reported by
+ * sched_getcpu. a drainer thread merges the rings by timestamp and hands the
+ * records to the writer. memory grows with the number of CPUs, not of threads
+ */
+
+#pragma once
+
+#include "queue.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*!
+ * @brief bytes of ring space used by a record on top of its length, before
+ * rounding to 8 bytes
+ */
+#define LOG_PERCPU_RECORD_OVERHEAD 24
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*! @struct opaque per CPU buffers, see new_log_percpu
+ */
+typedef struct log_percpu log_percpu;
+
+/*! @brief counters of per CPU buffers, summed over the CPUs
+ */
+typedef struct log_percpu_stats {
+    size_t cpus;      /*! @brief rings, one per configured CPU */
+    size_t size;      /*! @brief bytes of each ring */
+    bool rseq;        /*! @brief whether reservations use restartable sequences */
+    uint64_t written; /*! @brief records handed to the writer */
+    uint64_t dropped; /*! @brief records dropped by LOG_OVERFLOW_DROP_NEWEST */
+    uint64_t blocked; /*! @brief pushes that had to wait for room */
+} log_percpu_stats;
+
+/*! @brief returns new per CPU buffers and starts their drainer thread
+ * @param size bytes of ring space per CPU, rounded up to 8 bytes
+ * @param overflow LOG_OVERFLOW_BLOCK or LOG_OVERFLOW_DROP_NEWEST
+ * @param writer called by the drainer for every record, and by callers for
+ * records that can not be buffered, so it must be thread safe
+ * @param ctx passed to writer
+ * @return Success: pointer to the buffers
+ * @return Failure: NULL pointer
+ */
+log_percpu *new_log_percpu(size_t size, LOG_OVERFLOW overflow, log_queue_writer writer,
+                           void *ctx);
+
+/*! @brief copies record into the ring of the current CPU
+ * @details records larger than a ring are written by the caller once every
+ * record pushed before was written
+ * @return Success: 0
+ * @return Failure: -1 when the record was dropped
+ */
+int log_percpu_push(log_percpu *percpu, int file_descriptor, int level,
+                    const char *record, size_t record_len);
+
+/*! @brief waits until every record pushed before the call was written
+ */
+void log_percpu_flush(log_percpu *percpu);
+
+/*! @brief fills stats with the counters of the buffers
+ */
+void log_percpu_stats_get(log_percpu *percpu, log_percpu_stats *stats);
+
+/*! @brief writes out every buffered record, stops the drainer and frees the
+ * buffers, nothing may be pushed during or after the call
+ */
+void clear_log_percpu(log_percpu *percpu);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,142 @@
+// Copyright 2020 Bonedaddy (Alexandre Trottier)
+//
+// licensed under GNU AFFERO GENERAL PUBLIC LICENSE;
+// you may not use this file except in compliance with the License;
+// You may obtain the license via the LICENSE file in the repository root;
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/*! @file pool.h
+ * @brief preallocated pool of fixed size record slabs with a hard memory cap
+ * @details the whole budget is mapped and prefaulted when the pool is created,
+ * optionally backed by huge pages and locked into memory, and carved into slabs
+ * kept on a lock free free list. acquiring and releasing a slab never allocates.
+ * a logger configured with a pool budget renders every record into a slab and
+ * caps messages so the thread local scratch buffers stay below
+ * LOG_BUFFER_RETAIN_SIZE, so once warmed up logging does not call malloc and
+ * records in flight never use more than the budget. when every slab is in use the
+ * pool applies its RECORD_POOL_EXHAUSTED policy
+ */
+
+#pragma once
+
+#include "buffer.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*!
+ * @brief slab size used when none is configured
+ */
+#define RECORD_POOL_SLAB_SIZE_DEFAULT 4096
+
+/*!
+ * @brief back the pool with huge pages, falling back to transparent huge pages
+ * when none are reserved
+ */
+#define RECORD_POOL_HUGEPAGES 0x1
+
+/*!
+ * @brief lock the pool into memory with mlock, creation fails if that is not
+ * permitted
+ */
+#define RECORD_POOL_MLOCK 0x2
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*! @brief what happens when a record needs a slab and none is free
+ */
+typedef enum {
+    /*! the record is dropped and counted in record_pool_stats.dropped */
+    RECORD_POOL_EXHAUSTED_DROP,
+    /*! the caller waits until another thread releases a slab */
+    RECORD_POOL_EXHAUSTED_BLOCK,
+    /*! the record is formatted in the growable thread local buffers instead,
+       counted in record_pool_stats.fallbacks. the memory cap no longer holds */
+    RECORD_POOL_EXHAUSTED_HEAP
+} RECORD_POOL_EXHAUSTED;
+
+/*! @brief outcome of record_pool_acquire
+ */
+typedef enum {
+    /*! a slab was acquired */
+    RECORD_POOL_ACQUIRED,
+    /*! no slab, use the thread local buffers (RECORD_POOL_EXHAUSTED_HEAP) */
+    RECORD_POOL_FALLBACK,
+    /*! no slab, drop the record (RECORD_POOL_EXHAUSTED_DROP) */
+    RECORD_POOL_DROPPED
+} RECORD_POOL_RESULT;
+
+/*! @struct opaque record pool, see new_record_pool
+ */
+typedef struct record_pool record_pool;
+
+/*! @brief occupancy of a pool
+ */
+typedef struct record_pool_stats {
+    size_t slab_size;    /*! @brief bytes per slab */
+    size_t slabs;        /*! @brief number of slabs in the pool */
+    size_t in_use;       /*! @brief slabs currently acquired */
+    size_t high_water;   /*! @brief most slabs ever acquired at once */
+    uint64_t exhausted;  /*! @brief acquires that found the pool empty */
+    uint64_t dropped;    /*! @brief records dropped by RECORD_POOL_EXHAUSTED_DROP,
+                            or because they did not fit a slab */
+    uint64_t fallbacks;  /*! @brief records moved to the heap by
+                            RECORD_POOL_EXHAUSTED_HEAP */
+    uint64_t oversized;  /*! @brief records that did not fit a slab, see
+                            record_pool_outgrown */
+    bool hugepages;      /*! @brief whether explicit huge pages back the pool */
+    bool locked;         /*! @brief whether the pool is locked into memory */
+} record_pool_stats;
+
+/*! @brief returns a new pool of budget / slab_size slabs
+ * @param budget upper bound of the slab memory in bytes
+ * @param slab_size bytes per slab, 0 for RECORD_POOL_SLAB_SIZE_DEFAULT
+ * @param flags RECORD_POOL_HUGEPAGES and/or RECORD_POOL_MLOCK
+ * @param exhausted policy applied when no slab is free
+ * @return Success: pointer to the pool
+ * @return Failure: NULL pointer
+ */
+record_pool *new_record_pool(size_t budget, size_t slab_size, int flags,
+                             RECORD_POOL_EXHAUSTED exhausted);
+
+/*! @brief acquires a slab as an empty fixed size buffer
+ * @details blocks when the pool is empty and the policy is
+ * RECORD_POOL_EXHAUSTED_BLOCK
+ * @param slab receives the slab when RECORD_POOL_ACQUIRED is returned
+ */
+RECORD_POOL_RESULT record_pool_acquire(record_pool *pool, log_buffer *slab);
+
+/*! @brief returns a slab acquired with record_pool_acquire to the pool
+ */
+void record_pool_release(record_pool *pool, log_buffer *slab);
+
+/*! @brief returns a slab too small for the record being rendered to the pool
+ * @details the record moves to the thread local buffers under
+ * RECORD_POOL_EXHAUSTED_HEAP and is dropped otherwise, waiting for another slab
+ * would not help. either way it is counted in record_pool_stats.oversized
+ * @return RECORD_POOL_FALLBACK or RECORD_POOL_DROPPED
+ */
+RECORD_POOL_RESULT record_pool_outgrown(record_pool *pool, log_buffer *slab);
+
+/*! @brief returns whether buf is a slab of the pool
+ */
+bool record_pool_owns(const record_pool *pool, const log_buffer *buf);
+
+/*! @brief fills stats with the current occupancy of the pool
+ */
+void record_pool_stats_get(record_pool *pool, record_pool_stats *stats);
+
+/*! @brief unmaps the pool, every slab must have been released
+ */
+void clear_record_pool(record_pool *pool);
+
+#ifdef __cplusplus
+}
+#endif
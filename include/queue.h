@@ -0,0 +1,142 @@
+// Copyright 2020 Bonedaddy (Alexandre Trottier)
+//
+// licensed under GNU AFFERO GENERAL PUBLIC LICENSE;
+// you may not use this file except in compliance with the License;
+// You may obtain the license via the LICENSE file in the repository root;
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/*! @file queue.h
+ * @brief bounded record queue drained by a writer thread
+ * @details callers copy rendered records into a preallocated ring and return, a
+ * background thread moves everything queued out of the ring in one go and hands
+ * the records to the sinks. a slow sink fills the ring instead of stalling the
+ * callers, and what happens then is decided by the LOG_OVERFLOW policy. drops are
+ * counted, and the writer reports them with a record of its own once the sinks
+ * catch up
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*!
+ * @brief bytes of ring space used by a record on top of its length
+ */
+#define LOG_QUEUE_RECORD_OVERHEAD 16
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*! @brief what happens to a record that does not fit in the queue
+ */
+typedef enum {
+    /*! the caller waits until the writer makes room (the default) */
+    LOG_OVERFLOW_BLOCK,
+    /*! the record is dropped */
+    LOG_OVERFLOW_DROP_NEWEST,
+    /*! the oldest queued records are dropped until the record fits */
+    LOG_OVERFLOW_DROP_OLDEST,
+    /*! the record is dropped if its level is droppable, otherwise the caller
+       waits like LOG_OVERFLOW_BLOCK */
+    LOG_OVERFLOW_DROP_BELOW_LEVEL,
+    /*! the caller appends the record to the spill file instead */
+    LOG_OVERFLOW_SPILL
+} LOG_OVERFLOW;
+
+/*! @typedef writes one record to the sinks, called by the writer thread
+ * @param ctx the context given to new_log_queue
+ * @param file_descriptor the descriptor given to log_queue_push
+ * @param level the level given to log_queue_push
+ * @param record the record, not null terminated
+ * @param record_len length of record
+ */
+typedef void (*log_queue_writer)(void *ctx, int file_descriptor, int level,
+                                 const char *record, size_t record_len);
+
+/*! @typedef called by the writer thread once it handed every record it took out
+ * of the ring in one go to the writer. the queued records passed to the writer
+ * stay valid until it returns, the record reporting drops does not
+ * @param ctx the context given to new_log_queue
+ */
+typedef void (*log_queue_batch_end)(void *ctx);
+
+/*! @struct opaque record queue, see new_log_queue
+ */
+typedef struct log_queue log_queue;
+
+/*! @brief counters of a queue
+ */
+typedef struct log_queue_stats {
+    size_t size;         /*! @brief bytes of ring space */
+    size_t used;         /*! @brief bytes currently queued */
+    size_t high_water;   /*! @brief most bytes ever queued at once */
+    uint64_t pushed;     /*! @brief records queued */
+    uint64_t written;    /*! @brief records handed to the writer */
+    uint64_t dropped;    /*! @brief records dropped, newest or oldest */
+    uint64_t spilled;    /*! @brief records written to the spill file */
+    uint64_t blocked;    /*! @brief pushes that had to wait for room */
+} log_queue_stats;
+
+/*! @brief returns a new queue and starts its writer thread
+ * @param size bytes of ring space, every record takes its length plus
+ * LOG_QUEUE_RECORD_OVERHEAD
+ * @param overflow policy applied when a record does not fit
+ * @param droppable_levels bit (1 << level) is set for every level
+ * LOG_OVERFLOW_DROP_BELOW_LEVEL may drop
+ * @param spill_file file appended to by LOG_OVERFLOW_SPILL, NULL otherwise
+ * @param report_level level of the records reporting drops
+ * @param writer called by the writer thread for every record
+ * @param ctx passed to writer
+ * @return Success: pointer to the queue
+ * @return Failure: NULL pointer
+ */
+log_queue *new_log_queue(size_t size, LOG_OVERFLOW overflow,
+                         unsigned int droppable_levels, const char *spill_file,
+                         int report_level, log_queue_writer writer, void *ctx);
+
+/*! @brief queues a copy of record, or applies the overflow policy when it does
+ * not fit
+ * @details records larger than the whole ring are written by the caller once the
+ * queue drained, unless the policy drops or spills them
+ * @return Success: 0 when the record was queued, spilled or written
+ * @return Failure: -1 when it was dropped
+ */
+int log_queue_push(log_queue *queue, int file_descriptor, int level,
+                   const char *record, size_t record_len);
+
+/*! @brief like log_queue_push for a record starting with prefix_len bytes that
+ * are only meant for the writer, a spill file gets the rest of it
+ */
+int log_queue_push_prefixed(log_queue *queue, int file_descriptor, int level,
+                            const char *record, size_t record_len,
+                            size_t prefix_len);
+
+/*! @brief waits until every queued record was handed to the writer and written
+ */
+void log_queue_flush(log_queue *queue);
+
+/*! @brief sets a function the writer thread calls after every batch of records
+ * @note must be called before the first push
+ */
+void log_queue_on_batch_end(log_queue *queue, log_queue_batch_end batch_end);
+
+/*! @brief fills stats with the counters of the queue
+ */
+void log_queue_stats_get(log_queue *queue, log_queue_stats *stats);
+
+/*! @brief writes out every queued record, stops the writer thread and frees the
+ * queue
+ */
+void clear_log_queue(log_queue *queue);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,55 @@
+// Copyright 2020 Bonedaddy (Alexandre Trottier)
+//
+// licensed under GNU AFFERO GENERAL PUBLIC LICENSE;
+// you may not use this file except in compliance with the License;
+// You may obtain the license via the LICENSE file in the repository root;
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/*! @file rcu.h
+ * @brief epoch based reclamation of data shared with lock free readers
+ * @details readers bracket their use of shared pointers with rcu_read_lock and
+ * rcu_read_unlock, which only announce the current epoch in a thread local slot
+ * and never block. a writer publishes a new version with a release store, calls
+ * synchronize_rcu to wait until every reader that could still see the old version
+ * left its read section, and then frees it. on Linux the reader side fence is
+ * moved to the writer with membarrier, so entering a read section costs two plain
+ * stores
+ */
+
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*!
+ * @brief loads a pointer published for rcu readers
+ */
+#define rcu_dereference(p) __atomic_load_n(&(p), __ATOMIC_ACQUIRE)
+
+/*!
+ * @brief publishes a pointer for rcu readers
+ */
+#define rcu_assign_pointer(p, v) __atomic_store_n(&(p), (v), __ATOMIC_RELEASE)
+
+/*! @brief enters a read section, sections nest
+ */
+void rcu_read_lock(void);
+
+/*! @brief leaves a read section
+ */
+void rcu_read_unlock(void);
+
+/*! @brief waits until every read section that was active when called has ended
+ * @warning must not be called from inside a read section
+ */
+void synchronize_rcu(void);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,94 @@
+// Copyright 2020 Bonedaddy (Alexandre Trottier)
+//
+// licensed under GNU AFFERO GENERAL PUBLIC LICENSE;
+// you may not use this file except in compliance with the License;
+// You may obtain the license via the LICENSE file in the repository root;
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/*! @file reload.h
+ * @brief runtime reconfiguration of a logger from a config file
+ * @details the file holds one `key = value` pair per line, blank lines and lines
+ * starting with `#` are ignored:
+ *
+ * | key | value |
+ * |-----|-------|
+ * | `level` | `debug`, `info`, `warn` or `error`, the level of the root logger |
+ * | `level.<child>` | a level or `inherit`, the level of a named child logger |
+ * | `layout` | record layout pattern, see layout.h |
+ * | `name` | name rendered by `%n` |
+ * | `console` | `stdout` or `stderr` |
+ * | `console_flush` | `record`, `batch` or `timed` |
+ * | `console_color` | `auto`, `always` or `never` |
+ * | `sanitize` | `none`, `control` or `json` |
+ * | `max_message_size` | bytes |
+ * | `hexdump_max_bytes` | bytes |
+ *
+ * keys that are left out keep their current values, so a file only needs what
+ * it changes, and a file with any invalid line is rejected as a whole. settings
+ * are swapped with reconfigure_thread_logger, so threads keep logging while a
+ * reload happens
+ */
+
+#pragma once
+
+#include "logger.h"
+
+/*!
+ * @brief reload when the config file is written or replaced
+ */
+#define CONFIG_WATCH_FILE 0x1
+
+/*!
+ * @brief reload when the process receives SIGHUP
+ */
+#define CONFIG_WATCH_SIGHUP 0x2
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*! @struct opaque config file watcher, see new_config_watcher
+ */
+typedef struct config_watcher config_watcher;
+
+/*! @brief applies a config in the format described in reload.h to a root logger
+ * @param thl a root logger
+ * @param text the config, null terminated
+ * @return Success: 0
+ * @return Failure: -1 when text is invalid or the logger could not be
+ * reconfigured, nothing is changed then. child loggers named by text may have
+ * been created, inheriting their level
+ */
+int apply_logger_config(thread_logger *thl, const char *text);
+
+/*! @brief reads the config file at path and applies it to a root logger
+ * @return Success: 0
+ * @return Failure: -1
+ */
+int load_logger_config(thread_logger *thl, const char *path);
+
+/*! @brief loads the config file at path and starts a thread reloading it
+ * @details the file is watched with inotify through its directory, so editors
+ * that replace the file by renaming a new one over it are picked up. only one
+ * watcher per process may use CONFIG_WATCH_SIGHUP, it installs a SIGHUP handler
+ * that is restored when the watcher is cleared
+ * @param thl a root logger, must outlive the watcher
+ * @param path the config file
+ * @param flags CONFIG_WATCH_FILE and/or CONFIG_WATCH_SIGHUP
+ * @return Success: pointer to the watcher
+ * @return Failure: NULL pointer, when the file cannot be loaded or watched
+ */
+config_watcher *new_config_watcher(thread_logger *thl, const char *path, int flags);
+
+/*! @brief stops the watcher thread and frees the watcher
+ */
+void clear_config_watcher(config_watcher *watcher);
+
+#ifdef __cplusplus
+}
+#endif
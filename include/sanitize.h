@@ -0,0 +1,61 @@
+// Copyright 2020 Bonedaddy (Alexandre Trottier)
+//
+// licensed under GNU AFFERO GENERAL PUBLIC LICENSE;
+// you may not use this file except in compliance with the License;
+// You may obtain the license via the LICENSE file in the repository root;
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/*! @file sanitize.h
+ * @brief optional escaping of untrusted message bytes
+ * @details messages are scanned 32 (AVX2) or 16 (SSE2) bytes at a time for
+ * control characters, DEL, non ASCII bytes and, for JSON, quotes and backslashes.
+ * only the bytes at a hit are inspected one by one: valid UTF-8 sequences are
+ * copied as is and everything else is escaped, so a clean message costs a single
+ * vectorized pass and is not copied at all
+ */
+
+#pragma once
+
+#include "buffer.h"
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*! @brief how message bytes are escaped before a record is rendered
+ */
+typedef enum {
+    /*! messages are written unchanged (the default) */
+    LOG_SANITIZE_NONE,
+    /*! control characters other than tab, DEL and invalid UTF-8 bytes are written
+       as `\n`, `\r` or `\xNN`, so a message can not forge lines or emit terminal
+       escape sequences */
+    LOG_SANITIZE_CONTROL,
+    /*! the message is escaped as the contents of a JSON string: quotes,
+       backslashes and control characters are escaped and invalid UTF-8 bytes
+       become `\ufffd` */
+    LOG_SANITIZE_JSON
+} LOG_SANITIZE;
+
+/*! @brief returns the length of the prefix of data that needs no escaping under
+ * mode, len if the whole message is clean
+ * @note non ASCII bytes end the prefix even when they are valid UTF-8, the caller
+ * decides with sanitize_append
+ */
+size_t sanitize_scan(const char *data, size_t len, LOG_SANITIZE mode);
+
+/*! @brief appends data escaped according to mode, not null terminated
+ * @return Success: 0
+ * @return Failure: -1
+ */
+int sanitize_append(log_buffer *buf, const char *data, size_t len, LOG_SANITIZE mode);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,139 @@
+// Copyright 2020 Bonedaddy (Alexandre Trottier)
+//
+// licensed under GNU AFFERO GENERAL PUBLIC LICENSE;
+// you may not use this file except in compliance with the License;
+// You may obtain the license via the LICENSE file in the repository root;
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/*! @file shm.h
+ * @brief record ring shared by processes and drained by one of them
+ * @details every process maps the same POSIX shared memory object. producers
+ * reserve a slot under a robust process-shared mutex, copy their record into it
+ * without the lock and mark it committed. a single drainer thread, started by
+ * the one process that asks for it, hands every committed record in order to
+ * one writev and syncs the file once per batch, so the file has a single writer
+ * and records of different processes never interleave within a line.
+ *
+ * a producer dying inside the reservation leaves the mutex to the next one,
+ * which repairs it, and a producer dying between reservation and commit leaves
+ * a reserved slot that the drainer skips once the process is gone. ownership is
+ * a lease per handle, a byte of the shared memory object locked with an open
+ * file description lock that the kernel drops when the process exits, so
+ * neither pid reuse nor unreaped workers keep a dead owner alive. pids are never
+ * compared, the processes may live in different pid namespaces as long as they
+ * open the same object, that is share the /dev/shm mount. a forked child takes
+ * new locks for the handles it inherits and never drains the ring of its
+ * parent. committed records outlive their producer, they are written even after
+ * it exited
+ */
+
+#pragma once
+
+#include "queue.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*!
+ * @brief bytes of ring space when none is configured
+ */
+#define LOG_SHM_SIZE 1048576
+
+/*!
+ * @brief bytes of ring space used by a record on top of its length, before
+ * rounding up to a multiple of LOG_SHM_SLOT_ALIGNMENT
+ */
+#define LOG_SHM_RECORD_OVERHEAD 16
+
+/*!
+ * @brief alignment of the slots in the ring
+ */
+#define LOG_SHM_SLOT_ALIGNMENT 16
+
+/*!
+ * @brief handles of one ring that can be open at once, over every process
+ */
+#define LOG_SHM_PRODUCERS 1024
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*! @struct opaque handle of a shared ring, see new_log_shm
+ */
+typedef struct log_shm log_shm;
+
+/*! @brief counters of a shared ring, summed over every process
+ */
+typedef struct log_shm_stats {
+    size_t size;        /*! @brief bytes of ring space */
+    uint64_t pushed;    /*! @brief records committed */
+    uint64_t written;   /*! @brief records written by the drainer */
+    uint64_t dropped;   /*! @brief records that did not fit */
+    uint64_t abandoned; /*! @brief slots skipped because their producer died */
+    uint64_t batches;   /*! @brief writev calls of the drainer */
+} log_shm_stats;
+
+/*! @brief maps the ring called name, creating and initializing it when it does
+ * not exist
+ * @param name POSIX shared memory name, such as `/app-log`
+ * @param size bytes of ring space when the ring is created, 0 for LOG_SHM_SIZE
+ * @param overflow LOG_OVERFLOW_BLOCK waits for room while a drainer is alive,
+ * every other policy drops the record
+ * @param file_descriptor the file the records are for, see log_shm_fd
+ * @param drain whether this process starts the drainer thread writing the
+ * records to file_descriptor. fails when a live process already drains the ring
+ * @return Success: pointer to the handle
+ * @return Failure: NULL pointer, also when LOG_SHM_PRODUCERS handles are open
+ */
+log_shm *new_log_shm(const char *name, size_t size, LOG_OVERFLOW overflow,
+                     int file_descriptor, bool drain);
+
+/*! @brief returns the descriptor given to new_log_shm
+ */
+int log_shm_fd(const log_shm *shm);
+
+/*! @brief reserves a slot of len bytes for a record
+ * @details the slot must be passed to log_shm_commit once filled
+ * @param level level of the record
+ * @return Success: pointer to len bytes of the slot
+ * @return Failure: NULL pointer when the record was dropped, also in a forked
+ * child that found no free lease
+ */
+char *log_shm_reserve(log_shm *shm, int level, size_t len);
+
+/*! @brief marks a slot returned by log_shm_reserve as ready to be written
+ */
+void log_shm_commit(log_shm *shm, char *slot);
+
+/*! @brief copies record, without its newline, into the ring
+ * @return Success: 0
+ * @return Failure: -1 when it was dropped
+ */
+int log_shm_push(log_shm *shm, int level, const char *record, size_t record_len);
+
+/*! @brief waits until every record committed so far was written and synced by
+ * the drainer
+ * @return Success: 0
+ * @return Failure: -1 when the ring has no live drainer
+ */
+int log_shm_flush(log_shm *shm);
+
+/*! @brief fills stats with the counters of the ring
+ */
+void log_shm_stats_get(const log_shm *shm, log_shm_stats *stats);
+
+/*! @brief unmaps the ring. the drainer writes out every committed record first
+ * and removes the name, so the next drainer starts with a fresh ring. a handle
+ * inherited by a forked child is only unmapped
+ */
+void clear_log_shm(log_shm *shm);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,368 @@
+// Copyright 2020 Bonedaddy (Alexandre Trottier)
+//
+// licensed under GNU AFFERO GENERAL PUBLIC LICENSE;
+// you may not use this file except in compliance with the License;
+// You may obtain the license via the LICENSE file in the repository root;
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/*! @file ulog.hpp
+ * @brief header only, type safe C++20 front end for thread_logger
+ * @details `ulog::info(thl, "x={} y={}", x, y)` validates the format string at
+ * compile time: unbalanced braces or a placeholder count that does not match the
+ * number of arguments fail to compile. literal segments are located at compile
+ * time as well, and every argument is appended by an appender specialized for its
+ * type (std::to_chars for integers and floats, sized copies for strings)
+ * straight into the calling thread's LOG_BUFFER_PAYLOAD buffer, so neither
+ * vsnprintf nor an allocation is involved once the buffer is warmed up. the
+ * finished message is handed to logn_func, which renders it with the logger
+ * layout like any other record.
+ *
+ * placeholders:
+ *   - `{}` the argument in its default representation
+ *   - `{:x}` integers and pointers in hexadecimal
+ *   - `{{` and `}}` literal braces
+ *
+ * levels not set in ULOG_ACTIVE_LEVELS (a bitmask indexed by LOG_LEVELS) are
+ * removed at compile time, arguments included
+ */
+
+#pragma once
+
+#include "buffer.h"
+#include "context.h"
+#include "logger.h"
+#include <array>
+#include <charconv>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <source_location>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+
+/*!
+ * @brief bitmask of levels compiled into the C++ front end, bit n enables the
+ * LOG_LEVELS value n. eg `-DULOG_ACTIVE_LEVELS=0x7` compiles out debug logs
+ */
+#ifndef ULOG_ACTIVE_LEVELS
+#define ULOG_ACTIVE_LEVELS 0xF
+#endif
+
+namespace ulog {
+
+/*! @brief returns whether level is compiled in, see ULOG_ACTIVE_LEVELS
+ */
+constexpr bool level_active(LOG_LEVELS level) {
+    return ((ULOG_ACTIVE_LEVELS >> static_cast<int>(level)) & 1) != 0;
+}
+
+namespace detail {
+
+/*! @brief intentionally not constexpr: calling it while parsing a format string
+ * at compile time turns the reason into a compile error
+ */
+void format_string_error(const char *reason);
+
+/*! @brief a literal segment of a format string, followed by a placeholder unless
+ * it is the last segment
+ */
+struct segment {
+    std::size_t begin = 0;
+    std::size_t end = 0;
+    bool escaped = false; /*! @brief contains `{{` or `}}` to unescape */
+    bool hex = false;     /*! @brief the following placeholder is `{:x}` */
+};
+
+consteval const char *basename(const char *path) {
+    const char *name = path;
+    for (const char *c = path; *c != '\0'; c++) {
+        if (*c == '/') {
+            name = c + 1;
+        }
+    }
+    return name;
+}
+
+} // namespace detail
+
+/*! @brief a format string checked against its argument types at compile time
+ * @details also captures the file and line of the call site, so the front end
+ * does not need macros
+ */
+template <typename... Args> struct basic_format_string {
+    std::string_view str;
+    std::array<detail::segment, sizeof...(Args) + 1> segments{};
+    const char *file;
+    int line;
+
+    template <std::size_t N>
+    consteval basic_format_string(
+        const char (&format)[N],
+        std::source_location location = std::source_location::current())
+        : str(format, N - 1), file(detail::basename(location.file_name())),
+          line(static_cast<int>(location.line())) {
+
+        std::size_t count = 0;
+        std::size_t begin = 0;
+        bool escaped = false;
+
+        for (std::size_t i = 0; i < str.size(); i++) {
+            if (str[i] == '}') {
+                if (i + 1 >= str.size() || str[i + 1] != '}') {
+                    detail::format_string_error("unmatched } in format string");
+                }
+                escaped = true;
+                i++;
+                continue;
+            }
+            if (str[i] != '{') {
+                continue;
+            }
+            if (i + 1 < str.size() && str[i + 1] == '{') {
+                escaped = true;
+                i++;
+                continue;
+            }
+
+            bool hex = false;
+            std::size_t close = i + 1;
+            if (str.substr(close, 3) == ":x}") {
+                hex = true;
+                close += 2;
+            }
+            if (close >= str.size() || str[close] != '}') {
+                detail::format_string_error("only {} and {:x} placeholders are "
+                                            "supported");
+            }
+            if (count == sizeof...(Args)) {
+                detail::format_string_error("more placeholders than arguments");
+            }
+
+            segments[count++] = {begin, i, escaped, hex};
+            begin = close + 1;
+            escaped = false;
+            i = close;
+        }
+
+        if (count != sizeof...(Args)) {
+            detail::format_string_error("fewer placeholders than arguments");
+        }
+        segments[count] = {begin, str.size(), escaped, false};
+    }
+};
+
+/*! @brief format string type deduced from the arguments of a log call
+ */
+template <typename... Args>
+using format_string = basic_format_string<std::type_identity_t<Args>...>;
+
+namespace detail {
+
+inline bool append(log_buffer &out, std::string_view text) {
+    return log_buffer_append(&out, text.data(), text.size()) == 0;
+}
+
+inline bool append_literal(log_buffer &out, std::string_view literal,
+                           bool escaped) {
+    if (escaped == false) {
+        return append(out, literal);
+    }
+    if (log_buffer_reserve(&out, literal.size()) != 0) {
+        return false;
+    }
+    for (std::size_t i = 0; i < literal.size(); i++) {
+        out.data[out.len++] = literal[i];
+        if ((literal[i] == '{' || literal[i] == '}') && i + 1 < literal.size() &&
+            literal[i + 1] == literal[i]) {
+            i++;
+        }
+    }
+    return true;
+}
+
+template <typename T> inline bool append_chars(log_buffer &out, T value, int base) {
+    // large enough for any integer in base 2..16 or a shortest round trip double
+    constexpr std::size_t max_chars = 64;
+    if (log_buffer_reserve(&out, max_chars) != 0) {
+        return false;
+    }
+    char *digits = out.data + out.len;
+    std::to_chars_result result;
+    if constexpr (std::is_floating_point_v<T>) {
+        result = std::to_chars(digits, digits + max_chars, value);
+    } else {
+        result = base == 10 ? std::to_chars(digits, digits + max_chars, value)
+                            : std::to_chars(digits, digits + max_chars, value, base);
+    }
+    out.len += static_cast<std::size_t>(result.ptr - digits);
+    return true;
+}
+
+template <typename T>
+inline bool append_value(log_buffer &out, T &&value, bool hex) {
+    using type = std::remove_cvref_t<T>;
+
+    if constexpr (std::is_same_v<type, bool>) {
+        return append(out, value ? "true" : "false");
+    } else if constexpr (std::is_same_v<type, char>) {
+        return append(out, std::string_view(&value, 1));
+    } else if constexpr (std::is_integral_v<type>) {
+        return append_chars(out, value, hex ? 16 : 10);
+    } else if constexpr (std::is_enum_v<type>) {
+        return append_chars(out, static_cast<std::underlying_type_t<type>>(value),
+                            hex ? 16 : 10);
+    } else if constexpr (std::is_floating_point_v<type>) {
+        return append_chars(out, value, 10);
+    } else if constexpr (std::is_array_v<type> &&
+                         std::is_same_v<std::remove_cv_t<std::remove_extent_t<type>>,
+                                        char>) {
+        // bounded by the array size, so literals never need a full strlen
+        return append(out,
+                      std::string_view(value, strnlen(value, std::extent_v<type>)));
+    } else if constexpr (std::is_same_v<type, std::nullptr_t>) {
+        return append(out, "nullptr");
+    } else if constexpr (std::is_same_v<type, const char *> ||
+                         std::is_same_v<type, char *>) {
+        return append(out, value != nullptr ? std::string_view(value) : "(null)");
+    } else if constexpr (std::is_convertible_v<const type &, std::string_view>) {
+        return append(out, std::string_view(value));
+    } else if constexpr (std::is_pointer_v<type>) {
+        return append(out, "0x") &&
+               append_chars(out, reinterpret_cast<std::uintptr_t>(value), 16);
+    } else {
+        static_assert(sizeof(type) == 0, "type is not supported by ulog");
+    }
+}
+
+/*! @brief appends the message to out, false when the buffer could not grow */
+template <std::size_t... I, typename Format, typename... Args>
+inline bool format_to(log_buffer &out, const Format &format,
+                      std::index_sequence<I...>, Args &&...args) {
+    bool done = true;
+    ((done = done &&
+             append_literal(out,
+                            format.str.substr(format.segments[I].begin,
+                                              format.segments[I].end -
+                                                  format.segments[I].begin),
+                            format.segments[I].escaped) &&
+             append_value(out, std::forward<Args>(args), format.segments[I].hex)),
+     ...);
+    const segment &last = format.segments[sizeof...(Args)];
+    std::string_view tail = format.str.substr(last.begin, last.end - last.begin);
+    return done && append_literal(out, tail, last.escaped);
+}
+
+} // namespace detail
+
+/*! @brief formats and emits a record at Level
+ * @param thl the logger
+ * @param file_descriptor file descriptor to also write to, 0 for none
+ * @param format compile time checked format string
+ * @param args values for the placeholders of format
+ */
+template <LOG_LEVELS Level, typename... Args>
+inline void emit(thread_logger *thl, int file_descriptor,
+                 format_string<Args...> format, Args &&...args) {
+    if constexpr (level_active(Level)) {
+        if (log_level_enabled(thl, Level) == false) {
+            return;
+        }
+        // formatted straight into the thread's payload buffer, as log_hexdump
+        // does, so a warmed up thread formats without allocating
+        log_buffer *message = thread_log_buffer(LOG_BUFFER_PAYLOAD);
+        if (detail::format_to(*message, format, std::index_sequence_for<Args...>{},
+                              std::forward<Args>(args)...)) {
+            logn_func(thl, file_descriptor, message->data, message->len, Level,
+                      format.file, format.line);
+        }
+        log_buffer_release(message);
+    }
+}
+
+/*! @brief emits an INFO record, see emit */
+template <typename... Args>
+inline void info(thread_logger *thl, format_string<Args...> format,
+                 Args &&...args) {
+    emit<LOG_LEVELS_INFO, Args...>(thl, 0, format, std::forward<Args>(args)...);
+}
+
+/*! @brief emits a WARN record, see emit */
+template <typename... Args>
+inline void warn(thread_logger *thl, format_string<Args...> format,
+                 Args &&...args) {
+    emit<LOG_LEVELS_WARN, Args...>(thl, 0, format, std::forward<Args>(args)...);
+}
+
+/*! @brief emits an ERROR record, see emit */
+template <typename... Args>
+inline void error(thread_logger *thl, format_string<Args...> format,
+                  Args &&...args) {
+    emit<LOG_LEVELS_ERROR, Args...>(thl, 0, format, std::forward<Args>(args)...);
+}
+
+/*! @brief emits a DEBUG record, see emit */
+template <typename... Args>
+inline void debug(thread_logger *thl, format_string<Args...> format,
+                  Args &&...args) {
+    emit<LOG_LEVELS_DEBUG, Args...>(thl, 0, format, std::forward<Args>(args)...);
+}
+
+/*! @brief like info but also writes to the file of fhl */
+template <typename... Args>
+inline void info(file_logger *fhl, format_string<Args...> format,
+                 Args &&...args) {
+    emit<LOG_LEVELS_INFO, Args...>(fhl->thl, fhl->fd, format,
+                                   std::forward<Args>(args)...);
+}
+
+/*! @brief like warn but also writes to the file of fhl */
+template <typename... Args>
+inline void warn(file_logger *fhl, format_string<Args...> format,
+                 Args &&...args) {
+    emit<LOG_LEVELS_WARN, Args...>(fhl->thl, fhl->fd, format,
+                                   std::forward<Args>(args)...);
+}
+
+/*! @brief like error but also writes to the file of fhl */
+template <typename... Args>
+inline void error(file_logger *fhl, format_string<Args...> format,
+                  Args &&...args) {
+    emit<LOG_LEVELS_ERROR, Args...>(fhl->thl, fhl->fd, format,
+                                    std::forward<Args>(args)...);
+}
+
+/*! @brief like debug but also writes to the file of fhl */
+template <typename... Args>
+inline void debug(file_logger *fhl, format_string<Args...> format,
+                  Args &&...args) {
+    emit<LOG_LEVELS_DEBUG, Args...>(fhl->thl, fhl->fd, format,
+                                    std::forward<Args>(args)...);
+}
+
+/*! @brief pushes a context field for the lifetime of the scope, see context.h
+ * @details `ulog::context_scope request("request", id);` tags every record the
+ * thread emits until request goes out of scope, with LOG_* and LOGF_* as well
+ */
+class context_scope {
+  public:
+    context_scope(std::string_view key, std::string_view value)
+        : depth_(log_context_depth()) {
+        log_context_pushn(key.data(), key.size(), value.data(), value.size());
+    }
+
+    ~context_scope() { log_context_restore(depth_); }
+
+    context_scope(const context_scope &) = delete;
+    context_scope &operator=(const context_scope &) = delete;
+
+  private:
+    std::size_t depth_; /*! @brief pairs in the context before the push */
+};
+
+} // namespace ulog
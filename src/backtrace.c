@@ -0,0 +1,319 @@
+// Copyright 2020 Bonedaddy (Alexandre Trottier)
+//
+// licensed under GNU AFFERO GENERAL PUBLIC LICENSE;
+// you may not use this file except in compliance with the License;
+// You may obtain the license via the LICENSE file in the repository root;
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/*! @file backtrace.c
+ * @brief stack traces of error records, symbolized off the hot path
+ */
+
+#define _GNU_SOURCE
+
+#include "backtrace.h"
+#include "fmt.h"
+#include <dlfcn.h>
+#include <elf.h>
+#include <execinfo.h>
+#include <limits.h>
+#include <link.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/*! @brief bits of a slot holding the traces taken in its current second */
+#define SITE_COUNT_BITS 20
+
+/*! @brief prefix of a raw frame line */
+static const char raw_frame[] = "\n    at 0x";
+
+struct log_backtrace_sites {
+    unsigned int limit;
+    atomic_bool modules_listed;
+    /*! @brief second << SITE_COUNT_BITS | traces taken in that second */
+    _Atomic uint64_t slots[LOG_BACKTRACE_SITES];
+};
+
+/*! @brief returns new call site limits
+ * @param limit traces admitted per call site per second, 0 for
+ * LOG_BACKTRACE_SITE_LIMIT
+ * @return Success: pointer to the limits
+ * @return Failure: NULL pointer
+ */
+log_backtrace_sites *new_log_backtrace_sites(unsigned int limit) {
+
+    log_backtrace_sites *sites = malloc(sizeof(log_backtrace_sites));
+    if (sites == NULL) {
+        printf("failed to malloc log_backtrace_sites\n");
+        return NULL;
+    }
+
+    if (limit == 0) {
+        limit = LOG_BACKTRACE_SITE_LIMIT;
+    }
+    sites->limit = limit < (1u << SITE_COUNT_BITS) ? limit : (1u << SITE_COUNT_BITS) - 1;
+    atomic_init(&sites->modules_listed, false);
+    for (size_t i = 0; i < LOG_BACKTRACE_SITES; i++) {
+        atomic_init(&sites->slots[i], 0);
+    }
+
+    // the first backtrace call loads the unwinder, which must not happen while
+    // logging an error
+    void *warmup[1];
+    backtrace(warmup, 1);
+
+    return sites;
+}
+
+/*! @brief returns whether a trace may be taken for the call site, lock free
+ * @param site identifies the call site, such as its return address
+ */
+bool log_backtrace_admit(log_backtrace_sites *sites, const void *site) {
+
+    uint64_t hash = (uint64_t)(uintptr_t)site * 0x9e3779b97f4a7c15ull;
+    _Atomic uint64_t *slot = &sites->slots[hash >> 32 & (LOG_BACKTRACE_SITES - 1)];
+    uint64_t second = (uint64_t)time(NULL);
+    uint64_t mask = (1ull << SITE_COUNT_BITS) - 1;
+
+    uint64_t current = atomic_load_explicit(slot, memory_order_relaxed);
+    for (;;) {
+        uint64_t next;
+        if (current >> SITE_COUNT_BITS != second) {
+            next = second << SITE_COUNT_BITS | 1;
+        } else if ((current & mask) >= sites->limit) {
+            return false;
+        } else {
+            next = current + 1;
+        }
+        if (atomic_compare_exchange_weak_explicit(slot, &current, next,
+                                                  memory_order_relaxed,
+                                                  memory_order_relaxed)) {
+            return true;
+        }
+    }
+}
+
+/*! @brief returns true exactly once, for the first trace that should be followed
+ * by the module lines
+ */
+bool log_backtrace_first(log_backtrace_sites *sites) {
+    return atomic_exchange_explicit(&sites->modules_listed, true,
+                                    memory_order_relaxed) == false;
+}
+
+/*! @brief frees up resources for the limits
+ */
+void clear_log_backtrace_sites(log_backtrace_sites *sites) {
+    free(sites);
+}
+
+/*! @brief captures the stack of the calling thread
+ * @param frames receives at most count return addresses
+ * @param caller when found in the stack, the frames above it are dropped so the
+ * trace starts at the caller of the logger. may be NULL
+ * @return the number of frames stored
+ */
+size_t log_backtrace_capture(void **frames, size_t count, const void *caller) {
+
+    int captured = backtrace(frames, count < INT_MAX ? (int)count : INT_MAX);
+    if (captured <= 0) {
+        return 0;
+    }
+
+    size_t total = (size_t)captured;
+    for (size_t i = 0; caller != NULL && i < total; i++) {
+        if (frames[i] == caller) {
+            memmove(frames, frames + i, sizeof(void *) * (total - i));
+            return total - i;
+        }
+    }
+
+    return total;
+}
+
+/*! @brief appends a `\n    at 0x<address>` line per frame
+ * @return Success: 0
+ * @return Failure: -1
+ */
+int log_backtrace_append(log_buffer *buf, void *const *frames, size_t count) {
+
+    size_t line_max = sizeof(raw_frame) - 1 + FMT_HEX_SIZE;
+    if (log_buffer_reserve(buf, line_max * count) != 0) {
+        return -1;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        memcpy(buf->data + buf->len, raw_frame, sizeof(raw_frame) - 1);
+        buf->len += sizeof(raw_frame) - 1;
+        buf->len += fmt_hex64(buf->data + buf->len, (uint64_t)(uintptr_t)frames[i],
+                              false);
+    }
+
+    return 0;
+}
+
+/*! @brief appends the build id of an object, nothing when it has none
+ */
+static int append_build_id(log_buffer *buf, const struct dl_phdr_info *info) {
+
+    for (int i = 0; i < info->dlpi_phnum; i++) {
+        const ElfW(Phdr) *phdr = &info->dlpi_phdr[i];
+        if (phdr->p_type != PT_NOTE) {
+            continue;
+        }
+
+        const char *note = (const char *)(info->dlpi_addr + phdr->p_vaddr);
+        const char *end = note + phdr->p_memsz;
+        while (note + sizeof(ElfW(Nhdr)) <= end) {
+            const ElfW(Nhdr) *header = (const ElfW(Nhdr) *)note;
+            const char *name = note + sizeof(ElfW(Nhdr));
+            const char *desc = name + ((header->n_namesz + 3) & ~3u);
+            if (header->n_type == NT_GNU_BUILD_ID && header->n_namesz == 4 &&
+                memcmp(name, "GNU", 4) == 0 && desc + header->n_descsz <= end) {
+                if (log_buffer_append(buf, " ", 1) != 0 ||
+                    log_buffer_reserve(buf, 2 * header->n_descsz) != 0) {
+                    return -1;
+                }
+                buf->len += fmt_hex_bytes(buf->data + buf->len, desc, header->n_descsz);
+                return 0;
+            }
+            note = desc + ((header->n_descsz + 3) & ~3u);
+        }
+    }
+
+    return 0;
+}
+
+/*! @brief dl_iterate_phdr callback appending the module line of an object
+ */
+static int append_module(struct dl_phdr_info *info, size_t size, void *data) {
+
+    (void)size;
+    log_buffer *buf = data;
+
+    const char *path = info->dlpi_name;
+    char exe[PATH_MAX];
+    if (path == NULL || path[0] == '\0') {
+        // the main program is reported without a name
+        ssize_t len = readlink("/proc/self/exe", exe, sizeof(exe) - 1);
+        exe[len > 0 ? len : 0] = '\0';
+        path = exe;
+    }
+
+    char base[FMT_HEX_SIZE];
+    size_t base_len = fmt_hex64(base, (uint64_t)info->dlpi_addr, false);
+
+    if (log_buffer_append(buf, "\n    module 0x", 14) != 0 ||
+        log_buffer_append(buf, base, base_len) != 0 ||
+        log_buffer_append(buf, " ", 1) != 0 ||
+        log_buffer_append(buf, path, strlen(path)) != 0 ||
+        append_build_id(buf, info) != 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/*! @brief appends a `\n    module 0x<base> <path> <build-id>` line per loaded
+ * object
+ * @return Success: 0
+ * @return Failure: -1
+ */
+int log_backtrace_append_modules(log_buffer *buf) {
+    return dl_iterate_phdr(append_module, buf);
+}
+
+/*! @brief appends the resolved form of a frame, or nothing when it is unknown
+ * @return Success: 1 when appended, 0 when unknown
+ * @return Failure: -1
+ */
+static int append_symbol(log_buffer *buf, uintptr_t address) {
+
+    Dl_info info;
+    if (dladdr((void *)address, &info) == 0 || info.dli_fname == NULL) {
+        return 0;
+    }
+
+    char offset[FMT_HEX_SIZE];
+    int response = log_buffer_append(buf, "\n    at ", 8);
+    if (info.dli_sname != NULL) {
+        size_t offset_len = fmt_hex64(offset, address - (uintptr_t)info.dli_saddr, false);
+        response = response != 0 ||
+                   log_buffer_append(buf, info.dli_sname, strlen(info.dli_sname)) != 0 ||
+                   log_buffer_append(buf, "+0x", 3) != 0 ||
+                   log_buffer_append(buf, offset, offset_len) != 0 ||
+                   log_buffer_append(buf, " (", 2) != 0 ||
+                   log_buffer_append(buf, info.dli_fname, strlen(info.dli_fname)) != 0 ||
+                   log_buffer_append(buf, ")", 1) != 0;
+    } else {
+        // the offset into the object is what addr2line expects
+        size_t offset_len = fmt_hex64(offset, address - (uintptr_t)info.dli_fbase, false);
+        response = response != 0 ||
+                   log_buffer_append(buf, info.dli_fname, strlen(info.dli_fname)) != 0 ||
+                   log_buffer_append(buf, "+0x", 3) != 0 ||
+                   log_buffer_append(buf, offset, offset_len) != 0;
+    }
+
+    return response != 0 ? -1 : 1;
+}
+
+/*! @brief returns the value of a hex digit, -1 for anything else
+ */
+static int hex_digit(char c) {
+
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    return -1;
+}
+
+/*! @brief appends text with every raw `    at 0x<address>` line resolved to
+ * `    at <symbol>+0x<offset> (<path>)`, or `    at <path>+0x<offset>` when the
+ * address has no symbol
+ * @return Success: 0
+ * @return Failure: -1
+ */
+int log_backtrace_symbolize(log_buffer *buf, const char *text, size_t text_len) {
+
+    size_t prefix_len = sizeof(raw_frame) - 1;
+    const char *end = text + text_len;
+    const char *copied = text;
+
+    for (const char *line = memmem(text, text_len, raw_frame, prefix_len); line != NULL;
+         line = memmem(line + 1, (size_t)(end - line - 1), raw_frame, prefix_len)) {
+
+        const char *digit = line + prefix_len;
+        uintptr_t address = 0;
+        for (; digit != end && hex_digit(*digit) >= 0; digit++) {
+            address = address << 4 | (uintptr_t)hex_digit(*digit);
+        }
+        if (digit != end && *digit != '\n') {
+            continue;
+        }
+
+        if (log_buffer_append(buf, copied, (size_t)(line - copied)) != 0) {
+            return -1;
+        }
+        int resolved = append_symbol(buf, address);
+        if (resolved < 0) {
+            return -1;
+        }
+        // unknown addresses keep their raw line
+        copied = resolved == 1 ? digit : line;
+    }
+
+    return log_buffer_append(buf, copied, (size_t)(end - copied));
+}
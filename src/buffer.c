@@ -0,0 +1,239 @@
+// Copyright 2020 Bonedaddy (Alexandre Trottier)
+//
+// licensed under GNU AFFERO GENERAL PUBLIC LICENSE;
+// you may not use this file except in compliance with the License;
+// You may obtain the license via the LICENSE file in the repository root;
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/*! @file buffer.c
+ * @brief growable, thread local buffers used to format records
+ */
+
+#include "buffer.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static pthread_key_t buffer_key;
+static pthread_once_t buffer_key_once = PTHREAD_ONCE_INIT;
+
+static _Thread_local log_buffer thread_buffers[LOG_BUFFER_COUNT];
+static _Thread_local bool thread_buffers_registered = false;
+
+/*! @brief pthread key destructor freeing a thread's buffers when it exits */
+static void free_thread_buffers(void *data) {
+
+    log_buffer *buffers = data;
+    for (int i = 0; i < LOG_BUFFER_COUNT; i++) {
+        free(buffers[i].data);
+        buffers[i] = (log_buffer){0};
+    }
+}
+
+static void create_buffer_key(void) {
+    pthread_key_create(&buffer_key, free_thread_buffers);
+}
+
+/*! @brief returns the calling thread's buffer, emptied
+ * @note the buffer is freed when the thread exits
+ */
+log_buffer *thread_log_buffer(LOG_BUFFER which) {
+
+    if (thread_buffers_registered == false) {
+        pthread_once(&buffer_key_once, create_buffer_key);
+        pthread_setspecific(buffer_key, thread_buffers);
+        thread_buffers_registered = true;
+    }
+
+    log_buffer *buf = &thread_buffers[which];
+    buf->len = 0;
+
+    return buf;
+}
+
+/*! @brief ensures at least additional free bytes after len, growing geometrically
+ * @note fixed buffers never grow, reserving past their capacity fails
+ * @return Success: 0
+ * @return Failure: -1
+ */
+int log_buffer_reserve(log_buffer *buf, size_t additional) {
+
+    if (additional > SIZE_MAX - buf->len) {
+        return -1;
+    }
+
+    size_t needed = buf->len + additional;
+    if (needed <= buf->cap) {
+        return 0;
+    }
+    if (buf->fixed == true) {
+        return -1;
+    }
+
+    size_t cap = buf->cap != 0 ? buf->cap : LOG_BUFFER_INITIAL_SIZE;
+    while (cap < needed) {
+        cap = cap > SIZE_MAX / 2 ? needed : cap * 2;
+    }
+
+    char *data = realloc(buf->data, cap);
+    if (data == NULL) {
+        printf("failed to grow log_buffer\n");
+        return -1;
+    }
+
+    buf->data = data;
+    buf->cap = cap;
+
+    return 0;
+}
+
+/*! @brief appends data to the buffer
+ * @return Success: 0
+ * @return Failure: -1
+ */
+int log_buffer_append(log_buffer *buf, const char *data, size_t len) {
+
+    if (len == 0) {
+        return 0;
+    }
+    if (log_buffer_reserve(buf, len) != 0) {
+        return -1;
+    }
+
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+
+    return 0;
+}
+
+/*! @brief returns the largest length up to cut_len at which data, which is
+ * longer than cut_len, can be cut without splitting a UTF-8 sequence
+ * @details invalid UTF-8 is cut at cut_len
+ */
+size_t log_utf8_cut(const char *data, size_t cut_len) {
+
+    // a continuation byte right after the cut belongs to a sequence started at
+    // most 3 bytes before it
+    const unsigned char *bytes = (const unsigned char *)data;
+    for (size_t back = 0; back <= 3 && back <= cut_len; back++) {
+        if ((bytes[cut_len - back] & 0xc0) != 0x80) {
+            return cut_len - back;
+        }
+    }
+
+    return cut_len;
+}
+
+/*! @brief overwrites the tail of a cut string of cut_len bytes at start with the
+ * truncation marker and terminates it
+ * @details the marker is moved back to a character boundary so it does not split
+ * a UTF-8 sequence
+ * @return the length of the marked string
+ */
+static size_t mark_truncated(char *start, size_t cut_len) {
+
+    size_t marker_len = sizeof(LOG_TRUNCATION_MARKER) - 1;
+    if (marker_len > cut_len) {
+        marker_len = cut_len;
+    }
+
+    size_t keep = log_utf8_cut(start, cut_len - marker_len);
+    memcpy(start + keep, LOG_TRUNCATION_MARKER, marker_len);
+    start[keep + marker_len] = '\0';
+
+    return keep + marker_len;
+}
+
+/*! @brief appends a formatted string, null terminated
+ * @details a single vsnprintf into the free space is attempted first, and only if
+ * that was not enough the buffer grows to the measured size for a second pass.
+ * output longer than max_len is cut and ends with LOG_TRUNCATION_MARKER
+ * @param buf the buffer to append to
+ * @param max_len upper bound of the appended length, excluding the terminator
+ * @param format printf style format
+ * @param args arguments for format
+ * @return Success: 0
+ * @return Failure: -1
+ */
+int log_buffer_vprintf(log_buffer *buf, size_t max_len, const char *format,
+                       va_list args) {
+
+    if (log_buffer_reserve(buf, 1) != 0) {
+        return -1;
+    }
+
+    va_list first_pass;
+    va_copy(first_pass, args);
+    size_t available = buf->cap - buf->len;
+    int measured = vsnprintf(buf->data + buf->len, available, format, first_pass);
+    va_end(first_pass);
+    if (measured < 0) {
+        return -1;
+    }
+
+    size_t needed = (size_t)measured;
+    if (needed < available) {
+        // common case, everything fit in a single pass
+        if (needed > max_len) {
+            needed = mark_truncated(buf->data + buf->len, max_len);
+        }
+        buf->len += needed;
+        return 0;
+    }
+
+    size_t keep = needed > max_len ? max_len : needed;
+    if (log_buffer_reserve(buf, keep + 1) != 0) {
+        return -1;
+    }
+
+    vsnprintf(buf->data + buf->len, keep + 1, format, args);
+    if (keep < needed) {
+        keep = mark_truncated(buf->data + buf->len, keep);
+    }
+    buf->len += keep;
+
+    return 0;
+}
+
+/*! @brief appends at most max_len bytes of data, null terminated
+ * @details data longer than max_len is cut and ends with LOG_TRUNCATION_MARKER
+ * @return Success: 0
+ * @return Failure: -1
+ */
+int log_buffer_append_capped(log_buffer *buf, const char *data, size_t len,
+                             size_t max_len) {
+
+    size_t keep = len > max_len ? max_len : len;
+    if (log_buffer_reserve(buf, keep + 1) != 0) {
+        return -1;
+    }
+
+    memcpy(buf->data + buf->len, data, keep);
+    if (keep < len) {
+        keep = mark_truncated(buf->data + buf->len, keep);
+    } else {
+        buf->data[buf->len + keep] = '\0';
+    }
+    buf->len += keep;
+
+    return 0;
+}
+
+/*! @brief frees the buffer if it grew past LOG_BUFFER_RETAIN_SIZE
+ */
+void log_buffer_release(log_buffer *buf) {
+
+    if (buf->fixed == true || buf->cap <= LOG_BUFFER_RETAIN_SIZE) {
+        return;
+    }
+
+    free(buf->data);
+    *buf = (log_buffer){0};
+}
@@ -0,0 +1,415 @@
+// Copyright 2020 Bonedaddy (Alexandre Trottier)
+//
+// licensed under GNU AFFERO GENERAL PUBLIC LICENSE;
+// you may not use this file except in compliance with the License;
+// You may obtain the license via the LICENSE file in the repository root;
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/*! @file compress.c
+ * @brief file records compressed on the fly in independent blocks
+ * @note LOG_HAVE_ZLIB is defined by the build when zlib was found
+ */
+
+#define _GNU_SOURCE
+
+#include "compress.h"
+#include "fdio.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef LOG_HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+/*! @brief bytes of the gzip trailer, crc32 and text size */
+#define COMPRESS_TRAILER_SIZE 8
+
+struct log_compress {
+    int file_descriptor;
+    size_t block_size;
+    log_buffer blocks[LOG_COMPRESS_BLOCKS]; /*! @brief ring of blocks, the one
+                                               being filled is
+                                               blocks[submitted % count] */
+    uint64_t submitted; /*! @brief blocks handed to the compressor, only changed
+                           by the callers */
+    uint64_t written;   /*! @brief blocks the compressor is done with */
+    bool stopping;
+    pthread_mutex_t mutex;
+    pthread_cond_t not_empty; /*! @brief signaled when a block is submitted */
+    pthread_cond_t drained;   /*! @brief broadcast when a block was written */
+    pthread_t thread;
+    log_buffer frame; /*! @brief compressor output, compressor thread only */
+#ifdef LOG_HAVE_ZLIB
+    z_stream stream; /*! @brief raw deflate state, reset for every frame */
+#endif
+    log_compress_stats stats; /*! @brief guarded by mutex */
+};
+
+static void put_le16(unsigned char *output, uint32_t value) {
+    output[0] = (unsigned char)value;
+    output[1] = (unsigned char)(value >> 8);
+}
+
+static void put_le32(unsigned char *output, uint32_t value) {
+    put_le16(output, value);
+    put_le16(output + 2, value >> 16);
+}
+
+static uint32_t get_le32(const unsigned char *input) {
+    return (uint32_t)input[0] | (uint32_t)input[1] << 8 | (uint32_t)input[2] << 16 |
+           (uint32_t)input[3] << 24;
+}
+
+/*! @brief writes the frame header, see the file documentation of compress.h
+ */
+static void put_header(unsigned char *output, uint32_t frame_size, uint32_t text_size) {
+
+    static const unsigned char gzip[] = {0x1f, 0x8b, 8, 4, 0, 0, 0, 0, 0, 3};
+    memcpy(output, gzip, sizeof(gzip));
+    put_le16(output + 10, 12);
+    output[12] = 'U';
+    output[13] = 'L';
+    put_le16(output + 14, 8);
+    put_le32(output + 16, frame_size);
+    put_le32(output + 20, text_size);
+}
+
+/*! @brief compresses block into a frame and writes it
+ * @return Success: bytes written
+ * @return Failure: 0
+ */
+static size_t write_block(log_compress *compress, const log_buffer *block) {
+
+#ifdef LOG_HAVE_ZLIB
+    if (block->len > UINT32_MAX / 2) {
+        return 0;
+    }
+
+    z_stream *stream = &compress->stream;
+    log_buffer *frame = &compress->frame;
+    size_t bound = deflateBound(stream, (uLong)block->len);
+    frame->len = 0;
+    if (log_buffer_reserve(frame, LOG_COMPRESS_HEADER_SIZE + bound +
+                                      COMPRESS_TRAILER_SIZE) != 0 ||
+        deflateReset(stream) != Z_OK) {
+        return 0;
+    }
+
+    unsigned char *output = (unsigned char *)frame->data;
+    stream->next_in = (Bytef *)block->data;
+    stream->avail_in = (uInt)block->len;
+    stream->next_out = output + LOG_COMPRESS_HEADER_SIZE;
+    stream->avail_out = (uInt)bound;
+    if (deflate(stream, Z_FINISH) != Z_STREAM_END) {
+        return 0;
+    }
+
+    size_t frame_size =
+        LOG_COMPRESS_HEADER_SIZE + stream->total_out + COMPRESS_TRAILER_SIZE;
+    put_header(output, (uint32_t)frame_size, (uint32_t)block->len);
+    unsigned char *trailer = output + frame_size - COMPRESS_TRAILER_SIZE;
+    put_le32(trailer, (uint32_t)crc32(crc32(0, NULL, 0), (const Bytef *)block->data,
+                                      (uInt)block->len));
+    put_le32(trailer + 4, (uint32_t)block->len);
+
+    return fd_write_all(compress->file_descriptor, output, frame_size) == 0 ? frame_size
+                                                                            : 0;
+#else
+    return fd_write_all(compress->file_descriptor, block->data, block->len) == 0
+               ? block->len
+               : 0;
+#endif
+}
+
+/*! @brief the compressor thread, writes the submitted blocks in order
+ */
+static void *compress_run(void *data) {
+
+    log_compress *compress = data;
+
+    pthread_mutex_lock(&compress->mutex);
+    while (true) {
+        while (compress->written == compress->submitted && compress->stopping == false) {
+            pthread_cond_wait(&compress->not_empty, &compress->mutex);
+        }
+        if (compress->written == compress->submitted) {
+            break;
+        }
+
+        log_buffer *block = &compress->blocks[compress->written % LOG_COMPRESS_BLOCKS];
+        pthread_mutex_unlock(&compress->mutex);
+
+        size_t bytes = write_block(compress, block);
+        size_t text_len = block->len;
+        block->len = 0;
+        // a block grown by a huge record is not kept around
+        log_buffer_release(block);
+
+        pthread_mutex_lock(&compress->mutex);
+        compress->written++;
+        if (bytes == 0) {
+            compress->stats.errors++;
+        } else {
+            compress->stats.blocks++;
+            compress->stats.bytes_in += text_len;
+            compress->stats.bytes_out += bytes;
+        }
+        pthread_cond_broadcast(&compress->drained);
+    }
+    pthread_mutex_unlock(&compress->mutex);
+
+    return NULL;
+}
+
+/*! @brief returns a new compressed sink writing to file_descriptor and starts
+ * its compressor thread
+ * @param file_descriptor the file, not closed by clear_log_compress
+ * @param block_size bytes of text per block, 0 for LOG_COMPRESS_BLOCK_SIZE
+ * @param level zlib level from 1 to 9, 0 for LOG_COMPRESS_LEVEL_DEFAULT
+ * @return Success: pointer to the sink
+ * @return Failure: NULL pointer
+ */
+log_compress *new_log_compress(int file_descriptor, size_t block_size, int level) {
+
+    log_compress *compress = calloc(1, sizeof(log_compress));
+    if (compress == NULL) {
+        printf("failed to malloc log_compress\n");
+        return NULL;
+    }
+
+    compress->file_descriptor = file_descriptor;
+    compress->block_size = block_size != 0 ? block_size : LOG_COMPRESS_BLOCK_SIZE;
+
+#ifdef LOG_HAVE_ZLIB
+    compress->stats.compressed = true;
+    if (deflateInit2(&compress->stream, level != 0 ? level : LOG_COMPRESS_LEVEL_DEFAULT,
+                     Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        free(compress);
+        printf("failed to initialize zlib\n");
+        return NULL;
+    }
+#else
+    (void)level;
+#endif
+
+    pthread_mutex_init(&compress->mutex, NULL);
+    pthread_cond_init(&compress->not_empty, NULL);
+    pthread_cond_init(&compress->drained, NULL);
+
+    if (pthread_create(&compress->thread, NULL, compress_run, compress) != 0) {
+        pthread_cond_destroy(&compress->drained);
+        pthread_cond_destroy(&compress->not_empty);
+        pthread_mutex_destroy(&compress->mutex);
+#ifdef LOG_HAVE_ZLIB
+        deflateEnd(&compress->stream);
+#endif
+        free(compress);
+        printf("failed to start compressor thread\n");
+        return NULL;
+    }
+
+    return compress;
+}
+
+/*! @brief returns the descriptor the sink writes to
+ */
+int log_compress_fd(const log_compress *compress) {
+    return compress->file_descriptor;
+}
+
+/*! @brief hands the current block to the compressor and waits until the next
+ * block is free
+ */
+static void submit_block(log_compress *compress) {
+
+    pthread_mutex_lock(&compress->mutex);
+    compress->submitted++;
+    pthread_cond_signal(&compress->not_empty);
+    while (compress->submitted - compress->written >= LOG_COMPRESS_BLOCKS) {
+        pthread_cond_wait(&compress->drained, &compress->mutex);
+    }
+    pthread_mutex_unlock(&compress->mutex);
+}
+
+/*! @brief returns the block being filled, submitting it first when len more
+ * bytes do not fit
+ */
+static log_buffer *current_block(log_compress *compress, size_t len) {
+
+    log_buffer *block = &compress->blocks[compress->submitted % LOG_COMPRESS_BLOCKS];
+    if (block->len > 0 && block->len + len > compress->block_size) {
+        submit_block(compress);
+        block = &compress->blocks[compress->submitted % LOG_COMPRESS_BLOCKS];
+    }
+
+    return block;
+}
+
+/*! @brief adds text to the current block, handing the block to the compressor
+ * when text does not fit. records are never split across blocks
+ * @param text one or more records, each followed by a newline
+ * @note calls that add text must be serialized by the caller
+ * @return Success: 0
+ * @return Failure: -1
+ */
+int log_compress_write(log_compress *compress, const char *text, size_t text_len) {
+    return log_buffer_append(current_block(compress, text_len), text, text_len);
+}
+
+/*! @brief like log_compress_write for a single record without its newline
+ */
+int log_compress_write_record(log_compress *compress, const char *record,
+                              size_t record_len) {
+
+    log_buffer *block = current_block(compress, record_len + 1);
+    if (log_buffer_reserve(block, record_len + 1) != 0) {
+        return -1;
+    }
+
+    memcpy(block->data + block->len, record, record_len);
+    block->data[block->len + record_len] = '\n';
+    block->len += record_len + 1;
+
+    return 0;
+}
+
+/*! @brief compresses the current block and waits until every block was written
+ * @param sync whether the file is synced to the disk as well
+ * @return Success: 0
+ * @return Failure: -1
+ */
+int log_compress_flush(log_compress *compress, bool sync) {
+
+    pthread_mutex_lock(&compress->mutex);
+    uint64_t errors = compress->stats.errors;
+    pthread_mutex_unlock(&compress->mutex);
+
+    if (compress->blocks[compress->submitted % LOG_COMPRESS_BLOCKS].len > 0) {
+        submit_block(compress);
+    }
+
+    pthread_mutex_lock(&compress->mutex);
+    while (compress->written != compress->submitted) {
+        pthread_cond_wait(&compress->drained, &compress->mutex);
+    }
+    int response = compress->stats.errors == errors ? 0 : -1;
+    pthread_mutex_unlock(&compress->mutex);
+
+    if (sync == true && fdatasync(compress->file_descriptor) != 0) {
+        response = -1;
+    }
+
+    return response;
+}
+
+/*! @brief fills stats with the counters of the sink
+ */
+void log_compress_stats_get(log_compress *compress, log_compress_stats *stats) {
+
+    pthread_mutex_lock(&compress->mutex);
+    *stats = compress->stats;
+    pthread_mutex_unlock(&compress->mutex);
+}
+
+/*! @brief writes out the current block, stops the compressor and frees the sink
+ */
+void clear_log_compress(log_compress *compress) {
+
+    if (compress == NULL) {
+        return;
+    }
+
+    log_compress_flush(compress, false);
+
+    pthread_mutex_lock(&compress->mutex);
+    compress->stopping = true;
+    pthread_cond_signal(&compress->not_empty);
+    pthread_mutex_unlock(&compress->mutex);
+    pthread_join(compress->thread, NULL);
+
+    pthread_cond_destroy(&compress->drained);
+    pthread_cond_destroy(&compress->not_empty);
+    pthread_mutex_destroy(&compress->mutex);
+#ifdef LOG_HAVE_ZLIB
+    deflateEnd(&compress->stream);
+#endif
+    for (int i = 0; i < LOG_COMPRESS_BLOCKS; i++) {
+        free(compress->blocks[i].data);
+    }
+    free(compress->frame.data);
+    free(compress);
+}
+
+/*! @brief decompresses the frame at offset into text
+ * @param next set to the offset of the following frame
+ * @return Success: 0
+ * @return Failure: -1 when there is no valid frame at offset or zlib is missing
+ * @return 1 at the end of the file
+ */
+int log_compress_read_frame(int file_descriptor, off_t offset, log_buffer *text,
+                            off_t *next) {
+
+    unsigned char header[LOG_COMPRESS_HEADER_SIZE];
+    ssize_t got = pread(file_descriptor, header, sizeof(header), offset);
+    if (got == 0) {
+        return 1;
+    }
+    if (got != (ssize_t)sizeof(header)) {
+        return -1;
+    }
+
+    unsigned char expected[LOG_COMPRESS_HEADER_SIZE];
+    put_header(expected, 0, 0);
+    uint32_t frame_size = get_le32(header + 16);
+    uint32_t text_size = get_le32(header + 20);
+    if (memcmp(header, expected, 16) != 0 ||
+        frame_size < LOG_COMPRESS_HEADER_SIZE + COMPRESS_TRAILER_SIZE) {
+        return -1;
+    }
+
+#ifdef LOG_HAVE_ZLIB
+    size_t body_size = frame_size - LOG_COMPRESS_HEADER_SIZE;
+    unsigned char *body = malloc(body_size);
+    if (body == NULL || log_buffer_reserve(text, text_size) != 0 ||
+        pread(file_descriptor, body, body_size, offset + LOG_COMPRESS_HEADER_SIZE) !=
+            (ssize_t)body_size) {
+        free(body);
+        return -1;
+    }
+
+    z_stream stream = {0};
+    int response = -1;
+    if (inflateInit2(&stream, -15) == Z_OK) {
+        stream.next_in = body;
+        stream.avail_in = (uInt)(body_size - COMPRESS_TRAILER_SIZE);
+        stream.next_out = (Bytef *)text->data + text->len;
+        stream.avail_out = (uInt)text_size;
+        const unsigned char *trailer = body + body_size - COMPRESS_TRAILER_SIZE;
+        if (inflate(&stream, Z_FINISH) == Z_STREAM_END && stream.total_out == text_size &&
+            get_le32(trailer + 4) == text_size &&
+            get_le32(trailer) == (uint32_t)crc32(crc32(0, NULL, 0),
+                                                 (const Bytef *)text->data + text->len,
+                                                 (uInt)text_size)) {
+            text->len += text_size;
+            *next = offset + (off_t)frame_size;
+            response = 0;
+        }
+        inflateEnd(&stream);
+    }
+    free(body);
+
+    return response;
+#else
+    (void)text;
+    (void)text_size;
+    (void)next;
+    return -1;
+#endif
+}
@@ -0,0 +1,294 @@
+// Copyright 2020 Bonedaddy (Alexandre Trottier)
+//
+// licensed under GNU AFFERO GENERAL PUBLIC LICENSE;
+// you may not use this file except in compliance with the License;
+// You may obtain the license via the LICENSE file in the repository root;
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/*! @file console.c
+ * @brief console sink writing records straight to stdout/stderr
+ */
+
+#define _GNU_SOURCE
+
+#include "console.h"
+#include "fdio.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/*! @brief lines of a colored console_sink_write_lines call per writev, three
+ * iovecs each stay well below IOV_MAX */
+#define CONSOLE_LINES_PER_WRITE 128
+
+struct console_sink {
+    int fd;
+    CONSOLE_FLUSH flush;
+    bool colored;
+    unsigned int flush_interval_ms;
+    /*! @brief only used by CONSOLE_FLUSH_TIMED to guard the buffer against the
+     * flusher thread, the logger lock already serializes writers
+     */
+    pthread_mutex_t mutex;
+    pthread_cond_t stop_cond;
+    pthread_t flusher;
+    bool stopping;
+    size_t len;
+    char buffer[CONSOLE_BUFFER_SIZE];
+};
+
+/*! @brief writes out the buffer, caller must hold the sink mutex when timed
+ */
+static int flush_locked(console_sink *sink) {
+
+    if (sink->len == 0) {
+        return 0;
+    }
+
+    size_t len = sink->len;
+    sink->len = 0;
+
+    return fd_write_all(sink->fd, sink->buffer, len);
+}
+
+static void *console_flusher(void *data) {
+
+    console_sink *sink = data;
+
+    pthread_mutex_lock(&sink->mutex);
+    while (sink->stopping == false) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += sink->flush_interval_ms / 1000;
+        deadline.tv_nsec += (long)(sink->flush_interval_ms % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&sink->stop_cond, &sink->mutex, &deadline);
+        flush_locked(sink);
+    }
+    pthread_mutex_unlock(&sink->mutex);
+
+    return NULL;
+}
+
+/*! @brief returns a new console sink
+ * @param file_descriptor descriptor to write to, typically STDOUT_FILENO or
+ * STDERR_FILENO. it is not closed by clear_console_sink
+ * @param flush the flush policy
+ * @param flush_interval_ms interval used by CONSOLE_FLUSH_TIMED, 0 for
+ * CONSOLE_FLUSH_INTERVAL_MS
+ * @param color whether color codes are written
+ * @return Success: pointer to the sink
+ * @return Failure: NULL pointer
+ */
+console_sink *new_console_sink(int file_descriptor, CONSOLE_FLUSH flush,
+                               unsigned int flush_interval_ms, CONSOLE_COLOR color) {
+
+    console_sink *sink = malloc(sizeof(console_sink));
+    if (sink == NULL) {
+        printf("failed to malloc console_sink\n");
+        return NULL;
+    }
+
+    sink->fd = file_descriptor;
+    sink->flush = flush;
+    sink->flush_interval_ms =
+        flush_interval_ms != 0 ? flush_interval_ms : CONSOLE_FLUSH_INTERVAL_MS;
+    sink->stopping = false;
+    sink->len = 0;
+
+    switch (color) {
+        case CONSOLE_COLOR_ALWAYS:
+            sink->colored = true;
+            break;
+        case CONSOLE_COLOR_NEVER:
+            sink->colored = false;
+            break;
+        default:
+            // pipes, files and journald get plain text
+            sink->colored =
+                isatty(file_descriptor) == 1 && getenv("NO_COLOR") == NULL;
+            break;
+    }
+
+    pthread_mutex_init(&sink->mutex, NULL);
+    pthread_cond_init(&sink->stop_cond, NULL);
+
+    if (flush == CONSOLE_FLUSH_TIMED &&
+        pthread_create(&sink->flusher, NULL, console_flusher, sink) != 0) {
+        pthread_cond_destroy(&sink->stop_cond);
+        pthread_mutex_destroy(&sink->mutex);
+        free(sink);
+        printf("failed to start console flusher thread\n");
+        return NULL;
+    }
+
+    return sink;
+}
+
+/*! @brief writes a record followed by a newline
+ * @param sink the sink to write to
+ * @param color color of the record, ignored when colors are disabled
+ * @param record the record, not required to be null terminated
+ * @param record_len length of record
+ * @return Success: 0
+ * @return Failure: -1
+ */
+int console_sink_write(console_sink *sink, COLORS color, const char *record,
+                       size_t record_len) {
+
+    struct iovec iov[3];
+    int count = 0;
+
+    if (sink->colored == true) {
+        char *scheme = get_ansi_color_scheme(color);
+        iov[count++] = (struct iovec){scheme, strlen(scheme)};
+        iov[count++] = (struct iovec){(char *)record, record_len};
+        iov[count++] = (struct iovec){ANSI_COLOR_RESET "\n",
+                                      sizeof(ANSI_COLOR_RESET "\n") - 1};
+    } else {
+        iov[count++] = (struct iovec){(char *)record, record_len};
+        iov[count++] = (struct iovec){"\n", 1};
+    }
+
+    if (sink->flush == CONSOLE_FLUSH_RECORD) {
+        return fd_writev_all(sink->fd, iov, count);
+    }
+
+    size_t total = 0;
+    for (int i = 0; i < count; i++) {
+        total += iov[i].iov_len;
+    }
+
+    if (sink->flush == CONSOLE_FLUSH_TIMED) {
+        pthread_mutex_lock(&sink->mutex);
+    }
+
+    int response = 0;
+    if (sink->len + total > CONSOLE_BUFFER_SIZE) {
+        response = flush_locked(sink);
+    }
+    if (total > CONSOLE_BUFFER_SIZE) {
+        // too large to buffer, the buffer was just flushed so ordering is kept
+        if (fd_writev_all(sink->fd, iov, count) != 0) {
+            response = -1;
+        }
+    } else {
+        for (int i = 0; i < count; i++) {
+            memcpy(sink->buffer + sink->len, iov[i].iov_base, iov[i].iov_len);
+            sink->len += iov[i].iov_len;
+        }
+    }
+
+    if (sink->flush == CONSOLE_FLUSH_TIMED) {
+        pthread_mutex_unlock(&sink->mutex);
+    }
+
+    return response;
+}
+
+/*! @brief writes records that are stored back to back, each followed by a
+ * newline, with as few writes as possible
+ * @param text the records
+ * @param lines length and color of every record
+ * @param count number of records
+ * @return Success: 0
+ * @return Failure: -1
+ */
+int console_sink_write_lines(console_sink *sink, const char *text,
+                             const console_line *lines, size_t count) {
+
+    int response = 0;
+
+    if (sink->flush != CONSOLE_FLUSH_RECORD) {
+        for (size_t i = 0; i < count; i++) {
+            if (console_sink_write(sink, lines[i].color, text, lines[i].len) != 0) {
+                response = -1;
+            }
+            text += lines[i].len + 1;
+        }
+        return response;
+    }
+
+    if (sink->colored == false) {
+        size_t total = 0;
+        for (size_t i = 0; i < count; i++) {
+            total += lines[i].len + 1;
+        }
+        return fd_write_all(sink->fd, text, total);
+    }
+
+    // a color scheme, the record and the reset per line, in runs of at most
+    // CONSOLE_LINES_PER_WRITE lines
+    struct iovec iov[3 * CONSOLE_LINES_PER_WRITE];
+    for (size_t first = 0; first < count; first += CONSOLE_LINES_PER_WRITE) {
+        size_t last = count - first < CONSOLE_LINES_PER_WRITE
+                          ? count
+                          : first + CONSOLE_LINES_PER_WRITE;
+        int iov_count = 0;
+        for (size_t i = first; i < last; i++) {
+            char *scheme = get_ansi_color_scheme(lines[i].color);
+            iov[iov_count++] = (struct iovec){scheme, strlen(scheme)};
+            iov[iov_count++] = (struct iovec){(char *)text, lines[i].len};
+            iov[iov_count++] = (struct iovec){ANSI_COLOR_RESET "\n",
+                                              sizeof(ANSI_COLOR_RESET "\n") - 1};
+            text += lines[i].len + 1;
+        }
+        if (fd_writev_all(sink->fd, iov, iov_count) != 0) {
+            response = -1;
+        }
+    }
+
+    return response;
+}
+
+/*! @brief writes out anything buffered
+ * @return Success: 0
+ * @return Failure: -1
+ */
+int console_sink_flush(console_sink *sink) {
+
+    pthread_mutex_lock(&sink->mutex);
+    int response = flush_locked(sink);
+    pthread_mutex_unlock(&sink->mutex);
+
+    return response;
+}
+
+/*! @brief returns whether the sink writes color codes
+ */
+bool console_sink_colored(const console_sink *sink) {
+    return sink->colored;
+}
+
+/*! @brief flushes and frees up resources for the sink
+ */
+void clear_console_sink(console_sink *sink) {
+
+    if (sink == NULL) {
+        return;
+    }
+
+    if (sink->flush == CONSOLE_FLUSH_TIMED) {
+        pthread_mutex_lock(&sink->mutex);
+        sink->stopping = true;
+        pthread_cond_signal(&sink->stop_cond);
+        pthread_mutex_unlock(&sink->mutex);
+        pthread_join(sink->flusher, NULL);
+    }
+
+    console_sink_flush(sink);
+    pthread_cond_destroy(&sink->stop_cond);
+    pthread_mutex_destroy(&sink->mutex);
+    free(sink);
+}
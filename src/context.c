@@ -0,0 +1,159 @@
+// Copyright 2020 Bonedaddy (Alexandre Trottier)
+//
+// licensed under GNU AFFERO GENERAL PUBLIC LICENSE;
+// you may not use this file except in compliance with the License;
+// You may obtain the license via the LICENSE file in the repository root;
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/*! @file context.c
+ * @brief thread local context fields attached to every record
+ */
+
+#define _GNU_SOURCE
+
+#include "context.h"
+#include "buffer.h"
+#include "sanitize.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*! @brief the context of a thread
+ */
+typedef struct log_context {
+    log_buffer text;  /*! @brief the rendered pairs, null terminated */
+    log_buffer marks; /*! @brief length of text before each pair, as size_t */
+} log_context;
+
+static pthread_key_t context_key;
+static pthread_once_t context_key_once = PTHREAD_ONCE_INIT;
+
+static _Thread_local log_context thread_context;
+static _Thread_local bool thread_context_registered = false;
+
+/*! @brief pthread key destructor freeing a thread's context when it exits */
+static void free_thread_context(void *data) {
+
+    log_context *context = data;
+    free(context->text.data);
+    free(context->marks.data);
+    *context = (log_context){0};
+}
+
+static void create_context_key(void) {
+    pthread_key_create(&context_key, free_thread_context);
+}
+
+/*! @brief appends data escaped as with LOG_SANITIZE_CONTROL
+ * @return Success: 0
+ * @return Failure: -1
+ */
+static int append_escaped(log_buffer *buf, const char *data, size_t len) {
+
+    size_t clean = sanitize_scan(data, len, LOG_SANITIZE_CONTROL);
+    if (log_buffer_append(buf, data, clean) != 0) {
+        return -1;
+    }
+    if (clean == len) {
+        return 0;
+    }
+    return sanitize_append(buf, data + clean, len - clean, LOG_SANITIZE_CONTROL);
+}
+
+/*! @brief pushes key=value onto the calling thread's context
+ * @details control characters and invalid UTF-8 in key and value are escaped as
+ * with LOG_SANITIZE_CONTROL, so a context field can not forge lines
+ * @return Success: 0
+ * @return Failure: -1, the context is left unchanged
+ */
+int log_context_push(const char *key, const char *value) {
+    return log_context_pushn(key, strlen(key), value, strlen(value));
+}
+
+/*! @brief pushes key=value onto the calling thread's context
+ * @param key the key, key_len bytes
+ * @param value the value, value_len bytes
+ * @return Success: 0
+ * @return Failure: -1, the context is left unchanged
+ */
+int log_context_pushn(const char *key, size_t key_len, const char *value,
+                      size_t value_len) {
+
+    if (thread_context_registered == false) {
+        pthread_once(&context_key_once, create_context_key);
+        pthread_setspecific(context_key, &thread_context);
+        thread_context_registered = true;
+    }
+
+    log_buffer *text = &thread_context.text;
+    size_t mark = text->len;
+
+    if (log_buffer_append(&thread_context.marks, (const char *)&mark, sizeof(mark)) !=
+        0) {
+        return -1;
+    }
+
+    int response = mark > 0 ? log_buffer_append(text, " ", 1) : 0;
+    if (response == 0) {
+        response = append_escaped(text, key, key_len) != 0 ||
+                   log_buffer_append(text, "=", 1) != 0 ||
+                   append_escaped(text, value, value_len) != 0 ||
+                   log_buffer_reserve(text, 1) != 0;
+    }
+    if (response != 0) {
+        log_context_restore(log_context_depth() - 1);
+        return -1;
+    }
+
+    text->data[text->len] = '\0';
+    return 0;
+}
+
+/*! @brief removes the pair pushed last by the calling thread, if any
+ */
+void log_context_pop(void) {
+
+    size_t depth = log_context_depth();
+    if (depth > 0) {
+        log_context_restore(depth - 1);
+    }
+}
+
+/*! @brief returns the number of pairs in the calling thread's context
+ */
+size_t log_context_depth(void) {
+    return thread_context.marks.len / sizeof(size_t);
+}
+
+/*! @brief pops pairs until depth remain, see log_context_depth
+ */
+void log_context_restore(size_t depth) {
+
+    if (depth >= log_context_depth()) {
+        return;
+    }
+
+    size_t mark;
+    memcpy(&mark, thread_context.marks.data + depth * sizeof(size_t), sizeof(mark));
+    thread_context.marks.len = depth * sizeof(size_t);
+    thread_context.text.len = mark;
+    if (thread_context.text.data != NULL) {
+        thread_context.text.data[mark] = '\0';
+    }
+}
+
+/*! @brief returns the rendered context of the calling thread
+ * @param len set to the length of the returned text, 0 when the context is empty
+ * @return the text, null terminated and valid until the next push or pop
+ */
+const char *log_context_get(size_t *len) {
+
+    *len = thread_context.text.len;
+    return *len > 0 ? thread_context.text.data : "";
+}
@@ -0,0 +1,387 @@
+// Copyright 2020 Bonedaddy (Alexandre Trottier)
+//
+// licensed under GNU AFFERO GENERAL PUBLIC LICENSE;
+// you may not use this file except in compliance with the License;
+// You may obtain the license via the LICENSE file in the repository root;
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/*! @file direct_sink.c
+ * @brief file writes that bypass the page cache
+ */
+
+#define _GNU_SOURCE
+
+#include "direct_sink.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*! @brief buffers in flight: one being filled, the other written */
+#define DIRECT_BUFFERS 2
+
+/*! @brief an aligned buffer and the file offset it is written at
+ */
+typedef struct direct_buffer {
+    char *data;
+    size_t len;      /*! @brief bytes of records, the rest is padded on write */
+    uint64_t offset; /*! @brief aligned offset of data in the file */
+} direct_buffer;
+
+struct direct_sink {
+    int file_descriptor;
+    size_t buffer_size;
+    direct_buffer buffers[DIRECT_BUFFERS]; /*! @brief the one being filled is
+                                              buffers[submitted % count] */
+    size_t unwritten; /*! @brief bytes of the current buffer never handed to the
+                         writer */
+    uint64_t submitted; /*! @brief buffers handed to the writer, only changed by
+                           the callers */
+    uint64_t written;   /*! @brief buffers the writer is done with */
+    bool stopping;
+    pthread_mutex_t mutex;
+    pthread_cond_t not_empty; /*! @brief signaled when a buffer is submitted */
+    pthread_cond_t drained;   /*! @brief broadcast when a buffer was written */
+    pthread_t thread;
+    direct_sink_stats stats; /*! @brief guarded by mutex */
+};
+
+/*! @brief returns len rounded up to DIRECT_SINK_ALIGNMENT
+ */
+static size_t align_up(size_t len) {
+    return (len + DIRECT_SINK_ALIGNMENT - 1) & ~(size_t)(DIRECT_SINK_ALIGNMENT - 1);
+}
+
+/*! @brief writes len bytes of data at offset, retrying short writes
+ * @return Success: 0
+ * @return Failure: -1
+ */
+static int pwrite_all(int file_descriptor, const char *data, size_t len,
+                      uint64_t offset) {
+
+    while (len > 0) {
+        ssize_t written = pwrite(file_descriptor, data, len, (off_t)offset);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        data += written;
+        len -= (size_t)written;
+        offset += (uint64_t)written;
+    }
+
+    return 0;
+}
+
+/*! @brief the writer thread, writes the submitted buffers in order
+ */
+static void *direct_run(void *data) {
+
+    direct_sink *sink = data;
+
+    pthread_mutex_lock(&sink->mutex);
+    while (true) {
+        while (sink->written == sink->submitted && sink->stopping == false) {
+            pthread_cond_wait(&sink->not_empty, &sink->mutex);
+        }
+        if (sink->written == sink->submitted) {
+            break;
+        }
+
+        const direct_buffer *buffer = &sink->buffers[sink->written % DIRECT_BUFFERS];
+        pthread_mutex_unlock(&sink->mutex);
+
+        int response = pwrite_all(sink->file_descriptor, buffer->data,
+                                  align_up(buffer->len), buffer->offset);
+
+        pthread_mutex_lock(&sink->mutex);
+        sink->written++;
+        sink->stats.writes++;
+        if (response != 0) {
+            sink->stats.errors++;
+        }
+        pthread_cond_broadcast(&sink->drained);
+    }
+    pthread_mutex_unlock(&sink->mutex);
+
+    return NULL;
+}
+
+/*! @brief opens path for a direct sink, creating it when it does not exist
+ * @details falls back to a regular descriptor when the filesystem does not
+ * support O_DIRECT
+ * @return Success: the file descriptor
+ * @return Failure: -1
+ */
+int direct_sink_open(const char *path) {
+
+    // offsets are chosen by the sink, so the file is not opened with O_APPEND
+    int file_descriptor = open(path, O_RDWR | O_CREAT | O_DIRECT, 0640);
+    if (file_descriptor < 0 && errno == EINVAL) {
+        file_descriptor = open(path, O_RDWR | O_CREAT, 0640);
+    }
+
+    return file_descriptor;
+}
+
+/*! @brief cuts off the padding a crash left after the records of the last
+ * block and loads that block into buffer, so writing continues where the
+ * records end
+ * @return Success: 0
+ * @return Failure: -1
+ */
+static int load_tail(int file_descriptor, direct_buffer *buffer) {
+
+    struct stat file_stat;
+    if (fstat(file_descriptor, &file_stat) != 0) {
+        return -1;
+    }
+
+    uint64_t size = (uint64_t)file_stat.st_size;
+    if (size == 0) {
+        return 0;
+    }
+
+    uint64_t offset = (size - 1) & ~(uint64_t)(DIRECT_SINK_ALIGNMENT - 1);
+    ssize_t got = pread(file_descriptor, buffer->data, DIRECT_SINK_ALIGNMENT, (off_t)offset);
+    if (got < 0) {
+        return -1;
+    }
+
+    size_t len = (size_t)got;
+    while (len > 0 && buffer->data[len - 1] == '\0') {
+        len--;
+    }
+    if (offset + len != size && ftruncate(file_descriptor, (off_t)(offset + len)) != 0) {
+        return -1;
+    }
+
+    if (len == DIRECT_SINK_ALIGNMENT) {
+        offset += len;
+        len = 0;
+    }
+    buffer->offset = offset;
+    buffer->len = len;
+
+    return 0;
+}
+
+/*! @brief returns a new direct sink appending to file_descriptor and starts its
+ * writer thread
+ * @param file_descriptor a descriptor from direct_sink_open, not closed by
+ * clear_direct_sink
+ * @param buffer_size bytes per buffer, rounded up to DIRECT_SINK_ALIGNMENT, 0
+ * for DIRECT_SINK_BUFFER_SIZE
+ * @return Success: pointer to the sink
+ * @return Failure: NULL pointer
+ */
+direct_sink *new_direct_sink(int file_descriptor, size_t buffer_size) {
+
+    direct_sink *sink = calloc(1, sizeof(direct_sink));
+    if (sink == NULL) {
+        printf("failed to malloc direct_sink\n");
+        return NULL;
+    }
+
+    sink->file_descriptor = file_descriptor;
+    sink->buffer_size = align_up(buffer_size != 0 ? buffer_size : DIRECT_SINK_BUFFER_SIZE);
+    sink->stats.direct = (fcntl(file_descriptor, F_GETFL) & O_DIRECT) != 0;
+
+    for (int i = 0; i < DIRECT_BUFFERS; i++) {
+        void *data = NULL;
+        if (posix_memalign(&data, DIRECT_SINK_ALIGNMENT, sink->buffer_size) != 0) {
+            for (int j = 0; j < i; j++) {
+                free(sink->buffers[j].data);
+            }
+            free(sink);
+            printf("failed to malloc direct_sink buffers\n");
+            return NULL;
+        }
+        sink->buffers[i].data = data;
+    }
+
+    if (load_tail(file_descriptor, &sink->buffers[0]) != 0) {
+        for (int i = 0; i < DIRECT_BUFFERS; i++) {
+            free(sink->buffers[i].data);
+        }
+        free(sink);
+        printf("failed to read the end of the file\n");
+        return NULL;
+    }
+
+    pthread_mutex_init(&sink->mutex, NULL);
+    pthread_cond_init(&sink->not_empty, NULL);
+    pthread_cond_init(&sink->drained, NULL);
+
+    if (pthread_create(&sink->thread, NULL, direct_run, sink) != 0) {
+        pthread_cond_destroy(&sink->drained);
+        pthread_cond_destroy(&sink->not_empty);
+        pthread_mutex_destroy(&sink->mutex);
+        for (int i = 0; i < DIRECT_BUFFERS; i++) {
+            free(sink->buffers[i].data);
+        }
+        free(sink);
+        printf("failed to start direct sink thread\n");
+        return NULL;
+    }
+
+    return sink;
+}
+
+/*! @brief returns the descriptor the sink writes to
+ */
+int direct_sink_fd(const direct_sink *sink) {
+    return sink->file_descriptor;
+}
+
+/*! @brief pads the current buffer to a whole block, hands it to the writer and
+ * waits until the next buffer is free. a partial last block is carried over to
+ * the next buffer, which rewrites it
+ */
+static void submit_buffer(direct_sink *sink) {
+
+    direct_buffer *current = &sink->buffers[sink->submitted % DIRECT_BUFFERS];
+    memset(current->data + current->len, 0, align_up(current->len) - current->len);
+    size_t tail = current->len % DIRECT_SINK_ALIGNMENT;
+
+    pthread_mutex_lock(&sink->mutex);
+    sink->submitted++;
+    pthread_cond_signal(&sink->not_empty);
+    while (sink->submitted - sink->written >= DIRECT_BUFFERS) {
+        pthread_cond_wait(&sink->drained, &sink->mutex);
+    }
+    pthread_mutex_unlock(&sink->mutex);
+
+    // the writer only reads current, so its tail can be copied meanwhile
+    direct_buffer *next = &sink->buffers[sink->submitted % DIRECT_BUFFERS];
+    next->offset = current->offset + current->len - tail;
+    next->len = tail;
+    memcpy(next->data, current->data + current->len - tail, tail);
+    sink->unwritten = 0;
+}
+
+/*! @brief adds text to the current buffer, handing full buffers to the writer
+ * @param text one or more records, each followed by a newline
+ * @note calls that add text must be serialized by the caller
+ * @return Success: 0
+ * @return Failure: -1
+ */
+int direct_sink_write(direct_sink *sink, const char *text, size_t text_len) {
+
+    while (text_len > 0) {
+        direct_buffer *current = &sink->buffers[sink->submitted % DIRECT_BUFFERS];
+        size_t len = sink->buffer_size - current->len;
+        len = len < text_len ? len : text_len;
+        memcpy(current->data + current->len, text, len);
+        current->len += len;
+        sink->unwritten += len;
+        text += len;
+        text_len -= len;
+        if (current->len == sink->buffer_size) {
+            submit_buffer(sink);
+        }
+    }
+
+    return 0;
+}
+
+/*! @brief like direct_sink_write for a single record without its newline
+ */
+int direct_sink_write_record(direct_sink *sink, const char *record, size_t record_len) {
+
+    if (direct_sink_write(sink, record, record_len) != 0) {
+        return -1;
+    }
+    return direct_sink_write(sink, "\n", 1);
+}
+
+/*! @brief writes the current buffer padded to a whole block and waits until
+ * every buffer was written
+ * @param sync whether the file is synced to the disk as well
+ * @return Success: 0
+ * @return Failure: -1
+ */
+int direct_sink_flush(direct_sink *sink, bool sync) {
+
+    pthread_mutex_lock(&sink->mutex);
+    uint64_t errors = sink->stats.errors;
+    pthread_mutex_unlock(&sink->mutex);
+
+    if (sink->unwritten > 0) {
+        submit_buffer(sink);
+    }
+
+    pthread_mutex_lock(&sink->mutex);
+    while (sink->written != sink->submitted) {
+        pthread_cond_wait(&sink->drained, &sink->mutex);
+    }
+    int response = sink->stats.errors == errors ? 0 : -1;
+    pthread_mutex_unlock(&sink->mutex);
+
+    // O_DIRECT skips the page cache, not the cache of the device or the
+    // metadata, which is what fdatasync is still needed for
+    if (sync == true) {
+        int synced = fdatasync(sink->file_descriptor);
+        pthread_mutex_lock(&sink->mutex);
+        sink->stats.syncs++;
+        if (synced != 0) {
+            sink->stats.errors++;
+            response = -1;
+        }
+        pthread_mutex_unlock(&sink->mutex);
+    }
+
+    return response;
+}
+
+/*! @brief fills stats with the counters of the sink
+ */
+void direct_sink_stats_get(direct_sink *sink, direct_sink_stats *stats) {
+
+    pthread_mutex_lock(&sink->mutex);
+    *stats = sink->stats;
+    pthread_mutex_unlock(&sink->mutex);
+}
+
+/*! @brief writes out the current buffer, cuts off the padding, stops the writer
+ * and frees the sink
+ */
+void clear_direct_sink(direct_sink *sink) {
+
+    if (sink == NULL) {
+        return;
+    }
+
+    direct_sink_flush(sink, false);
+
+    pthread_mutex_lock(&sink->mutex);
+    sink->stopping = true;
+    pthread_cond_signal(&sink->not_empty);
+    pthread_mutex_unlock(&sink->mutex);
+    pthread_join(sink->thread, NULL);
+
+    const direct_buffer *current = &sink->buffers[sink->submitted % DIRECT_BUFFERS];
+    if (ftruncate(sink->file_descriptor, (off_t)(current->offset + current->len)) != 0 ||
+        fdatasync(sink->file_descriptor) != 0) {
+        printf("failed to cut off the padding of the file\n");
+    }
+
+    pthread_cond_destroy(&sink->drained);
+    pthread_cond_destroy(&sink->not_empty);
+    pthread_mutex_destroy(&sink->mutex);
+    for (int i = 0; i < DIRECT_BUFFERS; i++) {
+        free(sink->buffers[i].data);
+    }
+    free(sink);
+}
@@ -0,0 +1,59 @@
+// Copyright 2020 Bonedaddy (Alexandre Trottier)
+//
+// licensed under GNU AFFERO GENERAL PUBLIC LICENSE;
+// you may not use this file except in compliance with the License;
+// You may obtain the license via the LICENSE file in the repository root;
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/*! @file fdio.c
+ * @brief helpers for writing to raw file descriptors
+ */
+
+#include "fdio.h"
+#include <errno.h>
+#include <unistd.h>
+
+/*! @brief writes len bytes of data to file_descriptor
+ * @return Success: 0
+ * @return Failure: -1
+ */
+int fd_write_all(int file_descriptor, const void *data, size_t len) {
+
+    struct iovec iov = {.iov_base = (void *)data, .iov_len = len};
+
+    return fd_writev_all(file_descriptor, &iov, 1);
+}
+
+/*! @brief writes every iovec to file_descriptor
+ * @warning iov is modified to track partial writes
+ * @return Success: 0
+ * @return Failure: -1
+ */
+int fd_writev_all(int file_descriptor, struct iovec *iov, int count) {
+
+    while (count > 0) {
+        ssize_t written = writev(file_descriptor, iov, count);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        while (count > 0 && (size_t)written >= iov->iov_len) {
+            written -= (ssize_t)iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char *)iov->iov_base + written;
+            iov->iov_len -= (size_t)written;
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,288 @@
+// Copyright 2020 Bonedaddy (Alexandre Trottier)
+//
+// licensed under GNU AFFERO GENERAL PUBLIC LICENSE;
+// you may not use this file except in compliance with the License;
+// You may obtain the license via the LICENSE file in the repository root;
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/*! @file file_index.c
+ * @brief sidecar index of a log file, for seeking by time and level
+ */
+
+#define _GNU_SOURCE
+
+#include "file_index.h"
+#include "fdio.h"
+#include "logger.h"
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*! @brief bytes of the header of an index file */
+#define INDEX_HEADER_SIZE 16
+
+struct file_index {
+    int index_fd;        /*! @brief the index file */
+    int file_descriptor; /*! @brief the log file */
+    size_t block_size;
+    unsigned int interval;
+    uint64_t offset;        /*! @brief size of the log file */
+    file_index_entry block; /*! @brief the current block, empty when its length
+                               is 0 */
+};
+
+/*! @brief fills header with the header of an index file
+ */
+static void index_header(unsigned char *header) {
+
+    memset(header, 0, INDEX_HEADER_SIZE);
+    memcpy(header, FILE_INDEX_MAGIC, 8);
+    uint32_t entry_size = sizeof(file_index_entry);
+    memcpy(header + 8, &entry_size, sizeof(entry_size));
+}
+
+/*! @brief returns a new writer appending to the index at index_path, which is
+ * created when it does not exist
+ * @param file_descriptor the log file, offsets start at its current size
+ * @param block_size bytes per block, 0 for FILE_INDEX_BLOCK_SIZE
+ * @param interval seconds per block, 0 for FILE_INDEX_INTERVAL
+ * @return Success: pointer to the writer
+ * @return Failure: NULL pointer
+ */
+file_index *new_file_index(const char *index_path, int file_descriptor,
+                           size_t block_size, unsigned int interval) {
+
+    struct stat log_stat;
+    if (fstat(file_descriptor, &log_stat) != 0) {
+        printf("failed to stat log file\n");
+        return NULL;
+    }
+
+    int index_fd = open(index_path, O_RDWR | O_CREAT | O_APPEND, 0640);
+    if (index_fd < 0) {
+        printf("failed to open index file\n");
+        return NULL;
+    }
+
+    // an index left by an earlier run is appended to when it has our layout
+    unsigned char expected[INDEX_HEADER_SIZE];
+    unsigned char header[INDEX_HEADER_SIZE];
+    index_header(expected);
+    ssize_t read_len = pread(index_fd, header, sizeof(header), 0);
+    if (read_len == 0) {
+        if (fd_write_all(index_fd, expected, sizeof(expected)) != 0) {
+            close(index_fd);
+            printf("failed to write index header\n");
+            return NULL;
+        }
+    } else if (read_len != sizeof(header) || memcmp(header, expected, sizeof(header)) != 0) {
+        close(index_fd);
+        printf("index file has an unknown format\n");
+        return NULL;
+    }
+
+    file_index *index = malloc(sizeof(file_index));
+    if (index == NULL) {
+        close(index_fd);
+        printf("failed to malloc file_index\n");
+        return NULL;
+    }
+
+    *index = (file_index){
+        .index_fd = index_fd,
+        .file_descriptor = file_descriptor,
+        .block_size = block_size != 0 ? block_size : FILE_INDEX_BLOCK_SIZE,
+        .interval = interval != 0 ? interval : FILE_INDEX_INTERVAL,
+        .offset = (uint64_t)log_stat.st_size,
+    };
+
+    return index;
+}
+
+/*! @brief returns the log file the writer indexes
+ */
+int file_index_fd(const file_index *index) {
+    return index->file_descriptor;
+}
+
+/*! @brief accounts for records just written to the log file, appending the entry
+ * of the current block when it is complete
+ * @details the writer is not thread safe, the logger calls it with its lock held
+ * @param len bytes written, newlines included
+ * @param counts number of records of every level in them, indexed by LOG_LEVELS
+ * @return Success: 0
+ * @return Failure: -1 when the entry could not be written
+ */
+int file_index_add(file_index *index, size_t len,
+                   const size_t counts[FILE_INDEX_LEVELS]) {
+
+    int64_t now = (int64_t)time(NULL);
+    file_index_entry *block = &index->block;
+
+    int response = 0;
+    if (block->length > 0 && now - block->first_time >= (int64_t)index->interval) {
+        response = file_index_flush(index);
+    }
+
+    if (block->length == 0) {
+        block->offset = index->offset;
+        block->first_time = now;
+    }
+    block->length += len;
+    block->last_time = now;
+    for (int level = 0; level < FILE_INDEX_LEVELS; level++) {
+        uint32_t *counter = &block->counts[level];
+        *counter = counts[level] < UINT32_MAX - *counter
+                       ? *counter + (uint32_t)counts[level]
+                       : UINT32_MAX;
+    }
+    index->offset += len;
+
+    if (block->length >= index->block_size && file_index_flush(index) != 0) {
+        response = -1;
+    }
+
+    return response;
+}
+
+/*! @brief appends the entry of the current block, even when it is not complete
+ * @return Success: 0
+ * @return Failure: -1
+ */
+int file_index_flush(file_index *index) {
+
+    if (index->block.length == 0) {
+        return 0;
+    }
+
+    int response = fd_write_all(index->index_fd, &index->block, sizeof(index->block));
+    // a lost entry leaves its records to be found by reading on from the one
+    // before, the next block starts where it ended either way
+    index->block = (file_index_entry){0};
+
+    return response;
+}
+
+/*! @brief appends the entry of the current block and frees up resources for the
+ * writer
+ */
+void clear_file_index(file_index *index) {
+
+    if (index == NULL) {
+        return;
+    }
+
+    file_index_flush(index);
+    close(index->index_fd);
+    free(index);
+}
+
+/*! @brief reads every entry of the index at index_path
+ * @param count set to the number of entries
+ * @return Success: array of entries to be freed with free, NULL when empty
+ * @return Failure: NULL pointer and count set to 0
+ */
+file_index_entry *file_index_load(const char *index_path, size_t *count) {
+
+    *count = 0;
+
+    int index_fd = open(index_path, O_RDONLY);
+    if (index_fd < 0) {
+        return NULL;
+    }
+
+    struct stat index_stat;
+    unsigned char expected[INDEX_HEADER_SIZE];
+    unsigned char header[INDEX_HEADER_SIZE];
+    index_header(expected);
+    if (fstat(index_fd, &index_stat) != 0 ||
+        pread(index_fd, header, sizeof(header), 0) != (ssize_t)sizeof(header) ||
+        memcmp(header, expected, sizeof(header)) != 0) {
+        close(index_fd);
+        return NULL;
+    }
+
+    // an entry cut short by a crash is left out
+    size_t total = ((size_t)index_stat.st_size - INDEX_HEADER_SIZE) /
+                   sizeof(file_index_entry);
+    file_index_entry *entries = total > 0 ? malloc(total * sizeof(file_index_entry)) : NULL;
+    if (total == 0 || entries == NULL) {
+        close(index_fd);
+        return NULL;
+    }
+
+    size_t wanted = total * sizeof(file_index_entry);
+    size_t done = 0;
+    while (done < wanted) {
+        ssize_t read_len = pread(index_fd, (char *)entries + done, wanted - done,
+                                 (off_t)(INDEX_HEADER_SIZE + done));
+        if (read_len <= 0) {
+            break;
+        }
+        done += (size_t)read_len;
+    }
+    close(index_fd);
+
+    *count = done / sizeof(file_index_entry);
+    if (*count == 0) {
+        free(entries);
+        return NULL;
+    }
+
+    return entries;
+}
+
+/*! @brief returns the first entry that may hold records written at time or
+ * later, count when there is none
+ * @details a binary search, the log file can be read from the offset of the
+ * returned entry on without missing such records
+ */
+size_t file_index_seek_time(const file_index_entry *entries, size_t count,
+                            time_t time) {
+
+    // records are written no earlier than they are logged, so blocks whose
+    // last record was written before time hold nothing at or after it
+    size_t low = 0;
+    size_t high = count;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        if (entries[middle].last_time < (int64_t)time) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+
+    return low;
+}
+
+/*! @brief returns the first entry from start on holding records at least as
+ * severe as level, count when there is none
+ */
+size_t file_index_next_level(const file_index_entry *entries, size_t count,
+                             size_t start, int level) {
+
+    if (level < 0 || level >= FILE_INDEX_LEVELS) {
+        return count;
+    }
+
+    for (size_t i = start; i < count; i++) {
+        for (int l = 0; l < FILE_INDEX_LEVELS; l++) {
+            if (entries[i].counts[l] != 0 &&
+                log_level_severity(l) >= log_level_severity(level)) {
+                return i;
+            }
+        }
+    }
+
+    return count;
+}
@@ -0,0 +1,213 @@
+// Copyright 2020 Bonedaddy (Alexandre Trottier)
+//
+// licensed under GNU AFFERO GENERAL PUBLIC LICENSE;
+// you may not use this file except in compliance with the License;
+// You may obtain the license via the LICENSE file in the repository root;
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/*! @file file_sink.c
+ * @brief buffered file writes made durable by severe records
+ */
+
+#define _GNU_SOURCE
+
+#include "file_sink.h"
+#include "fdio.h"
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+struct file_sink {
+    char *data;
+    size_t len;
+    size_t cap;
+    int file_descriptor; /*! @brief descriptor of the buffered records, -1 before
+                            the first write */
+    uint64_t writes;
+    atomic_uint_fast64_t syncs;  /*! @brief also counted by file_sink_sync, which
+                                    runs without the lock of the caller */
+    atomic_uint_fast64_t errors; /*! @brief see syncs */
+};
+
+/*! @brief returns a new file sink
+ * @param buffer_size bytes buffered before they are written, 0 for
+ * FILE_SINK_BUFFER_SIZE
+ * @return Success: pointer to the sink
+ * @return Failure: NULL pointer
+ */
+file_sink *new_file_sink(size_t buffer_size) {
+
+    if (buffer_size == 0) {
+        buffer_size = FILE_SINK_BUFFER_SIZE;
+    }
+
+    file_sink *sink = malloc(sizeof(file_sink));
+    char *data = malloc(buffer_size);
+    if (sink == NULL || data == NULL) {
+        free(sink);
+        free(data);
+        printf("failed to malloc file_sink\n");
+        return NULL;
+    }
+
+    *sink = (file_sink){.data = data, .cap = buffer_size, .file_descriptor = -1};
+    atomic_init(&sink->syncs, 0);
+    atomic_init(&sink->errors, 0);
+
+    return sink;
+}
+
+/*! @brief writes the buffer followed by iov in a single writev, then syncs the
+ * file when asked to
+ */
+static int write_through(file_sink *sink, struct iovec *iov, int count, bool sync) {
+
+    struct iovec out[3] = {{sink->data, sink->len}};
+    if (count > 0) {
+        memcpy(out + 1, iov, sizeof(struct iovec) * (size_t)count);
+    }
+
+    int response = 0;
+    if (sink->len > 0 || count > 0) {
+        sink->writes++;
+        if (fd_writev_all(sink->file_descriptor, out, count + 1) != 0) {
+            atomic_fetch_add_explicit(&sink->errors, 1, memory_order_relaxed);
+            response = -1;
+        }
+        sink->len = 0;
+    }
+
+    if (sync == true && file_sink_sync(sink, sink->file_descriptor) != 0) {
+        response = -1;
+    }
+
+    return response;
+}
+
+/*! @brief buffers iov for file_descriptor, see file_sink_write
+ * @param count at most 2
+ */
+static int sink_write(file_sink *sink, int file_descriptor, struct iovec *iov,
+                      int count, bool through) {
+
+    int response = 0;
+    if (sink->len > 0 && sink->file_descriptor != file_descriptor) {
+        response = file_sink_flush(sink, false);
+    }
+    sink->file_descriptor = file_descriptor;
+
+    size_t len = 0;
+    for (int i = 0; i < count; i++) {
+        len += iov[i].iov_len;
+    }
+    if (through == true || len > sink->cap - sink->len) {
+        // whatever did not fit goes out with the buffer in the same call
+        return write_through(sink, iov, count, false) | response;
+    }
+
+    for (int i = 0; i < count; i++) {
+        memcpy(sink->data + sink->len, iov[i].iov_base, iov[i].iov_len);
+        sink->len += iov[i].iov_len;
+    }
+
+    return response;
+}
+
+/*! @brief buffers text for file_descriptor, writing out the records buffered for
+ * another descriptor first
+ * @param text one or more records, each followed by a newline
+ * @param through whether text and everything buffered before it is written
+ * before returning, to be synced with file_sink_sync
+ * @return Success: 0
+ * @return Failure: -1
+ */
+int file_sink_write(file_sink *sink, int file_descriptor, const char *text,
+                    size_t text_len, bool through) {
+
+    struct iovec iov[1] = {{(char *)text, text_len}};
+    return sink_write(sink, file_descriptor, iov, 1, through);
+}
+
+/*! @brief like file_sink_write for a single record without its newline
+ */
+int file_sink_write_record(file_sink *sink, int file_descriptor, const char *record,
+                           size_t record_len, bool through) {
+
+    struct iovec iov[2] = {{(char *)record, record_len}, {"\n", 1}};
+    return sink_write(sink, file_descriptor, iov, 2, through);
+}
+
+/*! @brief syncs what was written to file_descriptor to the disk
+ * @details unlike the other calls it needs no lock, so a logger syncs after
+ * releasing its own and callers of other levels are not held up by the disk
+ * @return Success: 0
+ * @return Failure: -1
+ */
+int file_sink_sync(file_sink *sink, int file_descriptor) {
+
+    atomic_fetch_add_explicit(&sink->syncs, 1, memory_order_relaxed);
+    if (fdatasync(file_descriptor) != 0) {
+        atomic_fetch_add_explicit(&sink->errors, 1, memory_order_relaxed);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*! @brief writes out anything buffered
+ * @param sync whether the file is synced to the disk as well
+ * @return Success: 0
+ * @return Failure: -1
+ */
+int file_sink_flush(file_sink *sink, bool sync) {
+
+    if (sink->file_descriptor == -1 || (sink->len == 0 && sync == false)) {
+        return 0;
+    }
+
+    return write_through(sink, NULL, 0, sync);
+}
+
+/*! @brief writes out anything buffered and syncs file_descriptor, which may be
+ * closed afterwards
+ * @return Success: 0
+ * @return Failure: -1
+ */
+int file_sink_close_fd(file_sink *sink, int file_descriptor) {
+
+    int response = file_sink_flush(sink, false);
+    if (sink->file_descriptor == file_descriptor) {
+        sink->file_descriptor = -1;
+    }
+
+    return file_sink_sync(sink, file_descriptor) | response;
+}
+
+/*! @brief fills stats with the counters of the sink
+ */
+void file_sink_stats_get(const file_sink *sink, file_sink_stats *stats) {
+    stats->writes = sink->writes;
+    stats->syncs = atomic_load_explicit(&sink->syncs, memory_order_relaxed);
+    stats->errors = atomic_load_explicit(&sink->errors, memory_order_relaxed);
+}
+
+/*! @brief writes out anything buffered and frees up resources for the sink
+ */
+void clear_file_sink(file_sink *sink) {
+
+    if (sink == NULL) {
+        return;
+    }
+
+    file_sink_flush(sink, false);
+    free(sink->data);
+    free(sink);
+}
@@ -0,0 +1,496 @@
+// Copyright 2020 Bonedaddy (Alexandre Trottier)
+//
+// licensed under GNU AFFERO GENERAL PUBLIC LICENSE;
+// you may not use this file except in compliance with the License;
+// You may obtain the license via the LICENSE file in the repository root;
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/*! @file fmt.c
+ * @brief specialized formatting kernels used by the printf style hot path
+ */
+
+#define _GNU_SOURCE
+
+#include "fmt.h"
+#include <string.h>
+#include <sys/types.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+__extension__ typedef unsigned __int128 fmt_u128;
+
+static const char digit_pairs[] = "0001020304050607080910111213141516171819"
+                                  "2021222324252627282930313233343536373839"
+                                  "4041424344454647484950515253545556575859"
+                                  "6061626364656667686970717273747576777879"
+                                  "8081828384858687888990919293949596979899";
+
+static const char hex_pairs_lower[] =
+    "000102030405060708090a0b0c0d0e0f101112131415161718191a1b1c1d1e1f"
+    "202122232425262728292a2b2c2d2e2f303132333435363738393a3b3c3d3e3f"
+    "404142434445464748494a4b4c4d4e4f505152535455565758595a5b5c5d5e5f"
+    "606162636465666768696a6b6c6d6e6f707172737475767778797a7b7c7d7e7f"
+    "808182838485868788898a8b8c8d8e8f909192939495969798999a9b9c9d9e9f"
+    "a0a1a2a3a4a5a6a7a8a9aaabacadaeafb0b1b2b3b4b5b6b7b8b9babbbcbdbebf"
+    "c0c1c2c3c4c5c6c7c8c9cacbcccdcecfd0d1d2d3d4d5d6d7d8d9dadbdcdddedf"
+    "e0e1e2e3e4e5e6e7e8e9eaebecedeeeff0f1f2f3f4f5f6f7f8f9fafbfcfdfeff";
+
+/*! @brief writes the 8 nibbles of value as hex digits, most significant first,
+ * with SWAR arithmetic on a 64 bit word instead of a lookup per byte
+ */
+static void hex_swar(char *output, uint32_t value, bool upper) {
+
+    // spread the nibbles into the low half of one byte each, least
+    // significant nibble in the lowest byte
+    uint64_t x = value;
+    x = ((x & 0xffff0000u) << 16) | (x & 0x0000ffffu);
+    x = ((x & 0x0000ff000000ff00ull) << 8) | (x & 0x000000ff000000ffull);
+    x = ((x & 0x00f000f000f000f0ull) << 4) | (x & 0x000f000f000f000full);
+
+    // nibble + '0', plus the gap up to 'a' or 'A' where the nibble is above 9.
+    // no byte exceeds 0x66, so no carry crosses into the next digit
+    uint64_t letters = ((x + 0x0606060606060606ull) >> 4) & 0x0101010101010101ull;
+    x += 0x3030303030303030ull + letters * (uint64_t)(upper ? 'A' - '0' - 10
+                                                            : 'a' - '0' - 10);
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    x = __builtin_bswap64(x);
+#endif
+    memcpy(output, &x, sizeof(x));
+}
+
+static const uint64_t powers_of_10[20] = {1ULL,
+                                          10ULL,
+                                          100ULL,
+                                          1000ULL,
+                                          10000ULL,
+                                          100000ULL,
+                                          1000000ULL,
+                                          10000000ULL,
+                                          100000000ULL,
+                                          1000000000ULL,
+                                          10000000000ULL,
+                                          100000000000ULL,
+                                          1000000000000ULL,
+                                          10000000000000ULL,
+                                          100000000000000ULL,
+                                          1000000000000000ULL,
+                                          10000000000000000ULL,
+                                          100000000000000000ULL,
+                                          1000000000000000000ULL,
+                                          10000000000000000000ULL};
+
+/*! @brief returns the number of decimal digits of value, 1 for 0
+ */
+static size_t count_digits(uint64_t value) {
+
+    value |= 1;
+    // bits * log10(2), off by at most one which the table lookup corrects
+    int bits = 64 - __builtin_clzll(value);
+    int approx = (bits * 1233) >> 12;
+
+    return (size_t)(approx + 1 - (value < powers_of_10[approx]));
+}
+
+/*! @brief writes value into the len bytes ending at end, zero padded
+ */
+static void write_digits(char *end, uint64_t value, size_t len) {
+
+    char *cursor = end;
+    while (value >= 100) {
+        cursor -= 2;
+        memcpy(cursor, digit_pairs + (value % 100) * 2, 2);
+        value /= 100;
+    }
+    if (value >= 10) {
+        cursor -= 2;
+        memcpy(cursor, digit_pairs + value * 2, 2);
+    } else {
+        *--cursor = (char)('0' + value);
+    }
+    while (cursor > end - len) {
+        *--cursor = '0';
+    }
+}
+
+/*! @brief writes value in decimal, output needs FMT_INT_SIZE bytes
+ * @return the number of bytes written, the output is not null terminated
+ */
+size_t fmt_u64(char *output, uint64_t value) {
+
+    size_t len = count_digits(value);
+    write_digits(output + len, value, len);
+
+    return len;
+}
+
+/*! @brief writes value in decimal, output needs FMT_INT_SIZE bytes
+ * @return the number of bytes written, the output is not null terminated
+ */
+size_t fmt_i64(char *output, int64_t value) {
+
+    if (value >= 0) {
+        return fmt_u64(output, (uint64_t)value);
+    }
+
+    output[0] = '-';
+    // negate in unsigned arithmetic so INT64_MIN does not overflow
+    return 1 + fmt_u64(output + 1, 0 - (uint64_t)value);
+}
+
+/*! @brief writes value in hexadecimal without leading zeroes or prefix, output
+ * needs FMT_HEX_SIZE bytes
+ * @return the number of bytes written, the output is not null terminated
+ */
+size_t fmt_hex64(char *output, uint64_t value, bool upper) {
+
+    // one SWAR step per 8 digits, then the significant ones are copied out
+    char digits[FMT_HEX_SIZE];
+    size_t len = (size_t)(64 - __builtin_clzll(value | 1) + 3) / 4;
+    if (len > 8) {
+        hex_swar(digits, (uint32_t)(value >> 32), upper);
+    }
+    hex_swar(digits + 8, (uint32_t)value, upper);
+    memcpy(output, digits + FMT_HEX_SIZE - len, len);
+
+    return len;
+}
+
+/*! @brief writes the bytes of data as 2 * len lowercase hex digits
+ * @details converts 16 bytes per step with SSE2 when available, and 4 bytes per
+ * SWAR step otherwise
+ * @return the number of bytes written, the output is not null terminated
+ */
+size_t fmt_hex_bytes(char *output, const void *data, size_t len) {
+
+    const uint8_t *bytes = data;
+    size_t i = 0;
+
+#ifdef __SSE2__
+    const __m128i nibble_mask = _mm_set1_epi8(0x0f);
+    const __m128i nine = _mm_set1_epi8(9);
+    const __m128i digit_base = _mm_set1_epi8('0');
+    const __m128i letter_gap = _mm_set1_epi8('a' - '0' - 10);
+
+    for (; i + 16 <= len; i += 16) {
+        __m128i value = _mm_loadu_si128((const __m128i *)(bytes + i));
+        __m128i high = _mm_and_si128(_mm_srli_epi16(value, 4), nibble_mask);
+        __m128i low = _mm_and_si128(value, nibble_mask);
+
+        // nibble + '0', plus the gap up to 'a' for nibbles above 9
+        high = _mm_add_epi8(_mm_add_epi8(high, digit_base),
+                            _mm_and_si128(_mm_cmpgt_epi8(high, nine), letter_gap));
+        low = _mm_add_epi8(_mm_add_epi8(low, digit_base),
+                           _mm_and_si128(_mm_cmpgt_epi8(low, nine), letter_gap));
+
+        _mm_storeu_si128((__m128i *)(output + i * 2), _mm_unpacklo_epi8(high, low));
+        _mm_storeu_si128((__m128i *)(output + i * 2 + 16),
+                         _mm_unpackhi_epi8(high, low));
+    }
+#endif
+
+    // 4 bytes per SWAR step, then a table lookup per byte
+    for (; i + 4 <= len; i += 4) {
+        uint32_t word = (uint32_t)bytes[i] << 24 | (uint32_t)bytes[i + 1] << 16 |
+                        (uint32_t)bytes[i + 2] << 8 | bytes[i + 3];
+        hex_swar(output + i * 2, word, false);
+    }
+    for (; i < len; i++) {
+        memcpy(output + i * 2, hex_pairs_lower + bytes[i] * 2, 2);
+    }
+
+    return len * 2;
+}
+
+/*! @brief writes value like printf `%.<precision>f`, output needs FMT_FIXED_SIZE
+ * bytes
+ * @details the result is correctly rounded (ties to even on the exact binary
+ * value, like glibc). values that can not be converted exactly with 128 bit
+ * arithmetic (nan, inf, magnitudes of 2^64 and above, or tiny values with a long
+ * binary fraction) are rejected so the caller can fall back to snprintf
+ * @return Success: the number of bytes written, the output is not null terminated
+ * @return Failure: 0
+ */
+size_t fmt_fixed(char *output, double value, int precision) {
+
+    if (precision < 0 || precision > FMT_FIXED_MAX_PRECISION) {
+        return 0;
+    }
+
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+
+    bool negative = (bits >> 63) != 0;
+    int exponent = (int)((bits >> 52) & 0x7ff);
+    uint64_t mantissa = bits & ((1ULL << 52) - 1);
+
+    if (exponent == 0x7ff) {
+        return 0;
+    }
+    if (exponent != 0) {
+        mantissa |= 1ULL << 52;
+    } else {
+        exponent = 1;
+    }
+
+    // value is mantissa * 2^-shift, split it into integer and binary fraction
+    int shift = 1075 - exponent;
+    uint64_t integer = 0;
+    uint64_t fraction = 0;
+    if (mantissa == 0) {
+        shift = 0;
+    } else if (shift <= 0) {
+        if (shift < -11) {
+            return 0;
+        }
+        integer = mantissa << -shift;
+        shift = 0;
+    } else if (shift < 64) {
+        integer = mantissa >> shift;
+        fraction = mantissa & ((1ULL << shift) - 1);
+    } else {
+        return 0;
+    }
+
+    uint64_t scale = powers_of_10[precision];
+    uint64_t decimals = 0;
+    if (fraction != 0) {
+        // fraction < 2^63 and scale < 2^30, so the product is exact
+        fmt_u128 scaled = (fmt_u128)fraction * scale;
+        fmt_u128 remainder = scaled & (((fmt_u128)1 << shift) - 1);
+        fmt_u128 half = (fmt_u128)1 << (shift - 1);
+        decimals = (uint64_t)(scaled >> shift);
+
+        uint64_t last = precision > 0 ? decimals : integer;
+        if (remainder > half || (remainder == half && (last & 1) != 0)) {
+            decimals++;
+            if (decimals == scale) {
+                decimals = 0;
+                integer++;
+            }
+        }
+    }
+
+    size_t len = 0;
+    if (negative) {
+        output[len++] = '-';
+    }
+    len += fmt_u64(output + len, integer);
+    if (precision > 0) {
+        output[len++] = '.';
+        write_digits(output + len + (size_t)precision, decimals, (size_t)precision);
+        len += (size_t)precision;
+    }
+
+    return len;
+}
+
+/*! @brief length modifiers understood by format_fast
+ */
+typedef enum {
+    FMT_LENGTH_INT,
+    FMT_LENGTH_LONG,
+    FMT_LENGTH_LONG_LONG,
+    FMT_LENGTH_SIZE,
+} FMT_LENGTH;
+
+/*! @brief appends format using the kernels
+ * @return true if every conversion was supported and appended, false if the caller
+ * has to fall back to vsnprintf. args is consumed either way
+ */
+static bool format_fast(log_buffer *buf, const char *format, va_list args) {
+
+    const char *literal = format;
+
+    while (true) {
+        const char *percent = strchr(literal, '%');
+        size_t literal_len =
+            percent != NULL ? (size_t)(percent - literal) : strlen(literal);
+        if (log_buffer_append(buf, literal, literal_len) != 0) {
+            return false;
+        }
+        if (percent == NULL) {
+            return true;
+        }
+
+        const char *spec = percent + 1;
+        if (*spec == '%') {
+            if (log_buffer_append(buf, "%", 1) != 0) {
+                return false;
+            }
+            literal = spec + 1;
+            continue;
+        }
+
+        int precision = -1;
+        if (*spec == '.') {
+            spec++;
+            if (*spec < '0' || *spec > '9') {
+                return false;
+            }
+            precision = 0;
+            while (*spec >= '0' && *spec <= '9') {
+                precision = precision * 10 + (*spec++ - '0');
+                if (precision > FMT_FIXED_MAX_PRECISION) {
+                    return false;
+                }
+            }
+        }
+
+        FMT_LENGTH length = FMT_LENGTH_INT;
+        if (*spec == 'l') {
+            spec++;
+            length = FMT_LENGTH_LONG;
+            if (*spec == 'l') {
+                spec++;
+                length = FMT_LENGTH_LONG_LONG;
+            }
+        } else if (*spec == 'z') {
+            spec++;
+            length = FMT_LENGTH_SIZE;
+        }
+
+        if (precision != -1 && *spec != 'f') {
+            return false;
+        }
+
+        char digits[FMT_FIXED_SIZE];
+        const char *out = digits;
+        size_t out_len = 0;
+
+        switch (*spec) {
+            case 'd':
+            case 'i': {
+                int64_t value;
+                switch (length) {
+                    case FMT_LENGTH_LONG:
+                        value = va_arg(args, long);
+                        break;
+                    case FMT_LENGTH_LONG_LONG:
+                        value = va_arg(args, long long);
+                        break;
+                    case FMT_LENGTH_SIZE:
+                        value = va_arg(args, ssize_t);
+                        break;
+                    default:
+                        value = va_arg(args, int);
+                        break;
+                }
+                out_len = fmt_i64(digits, value);
+                break;
+            }
+            case 'u':
+            case 'x':
+            case 'X': {
+                uint64_t value;
+                switch (length) {
+                    case FMT_LENGTH_LONG:
+                        value = va_arg(args, unsigned long);
+                        break;
+                    case FMT_LENGTH_LONG_LONG:
+                        value = va_arg(args, unsigned long long);
+                        break;
+                    case FMT_LENGTH_SIZE:
+                        value = va_arg(args, size_t);
+                        break;
+                    default:
+                        value = va_arg(args, unsigned int);
+                        break;
+                }
+                out_len = *spec == 'u' ? fmt_u64(digits, value)
+                                       : fmt_hex64(digits, value, *spec == 'X');
+                break;
+            }
+            case 'c':
+                if (length != FMT_LENGTH_INT) {
+                    return false;
+                }
+                digits[0] = (char)va_arg(args, int);
+                out_len = 1;
+                break;
+            case 's':
+                if (length != FMT_LENGTH_INT) {
+                    return false;
+                }
+                out = va_arg(args, const char *);
+                if (out == NULL) {
+                    out = "(null)";
+                }
+                out_len = strlen(out);
+                break;
+            case 'p': {
+                if (length != FMT_LENGTH_INT) {
+                    return false;
+                }
+                void *pointer = va_arg(args, void *);
+                if (pointer == NULL) {
+                    out = "(nil)";
+                    out_len = 5;
+                    break;
+                }
+                digits[0] = '0';
+                digits[1] = 'x';
+                out_len = 2 + fmt_hex64(digits + 2, (uintptr_t)pointer, false);
+                break;
+            }
+            case 'f':
+                // %lf is the same conversion as %f
+                if (length != FMT_LENGTH_INT && length != FMT_LENGTH_LONG) {
+                    return false;
+                }
+                out_len = fmt_fixed(digits, va_arg(args, double),
+                                    precision != -1 ? precision : 6);
+                if (out_len == 0) {
+                    return false;
+                }
+                break;
+            default:
+                return false;
+        }
+
+        if (log_buffer_append(buf, out, out_len) != 0) {
+            return false;
+        }
+        literal = spec + 1;
+    }
+}
+
+/*! @brief appends a printf formatted string, null terminated
+ * @details same contract as log_buffer_vprintf, which it falls back to for
+ * conversions other than `%d %i %u %x %X %c %s %p %f %%` with an optional `l`,
+ * `ll` or `z` length and, for `%f`, a precision of at most
+ * FMT_FIXED_MAX_PRECISION
+ * @param buf the buffer to append to
+ * @param max_len upper bound of the appended length, excluding the terminator
+ * @param format printf style format
+ * @param args arguments for format
+ * @return Success: 0
+ * @return Failure: -1
+ */
+int fmt_vformat(log_buffer *buf, size_t max_len, const char *format, va_list args) {
+
+    size_t start = buf->len;
+
+    va_list fast;
+    va_copy(fast, args);
+    bool formatted = format_fast(buf, format, fast);
+    va_end(fast);
+
+    if (formatted == true && buf->len - start <= max_len &&
+        log_buffer_reserve(buf, 1) == 0) {
+        buf->data[buf->len] = '\0';
+        return 0;
+    }
+
+    // unsupported conversion or too long, let vsnprintf handle it from scratch
+    buf->len = start;
+
+    return log_buffer_vprintf(buf, max_len, format, args);
+}
@@ -0,0 +1,188 @@
+// Copyright 2020 Bonedaddy (Alexandre Trottier)
+//
+// licensed under GNU AFFERO GENERAL PUBLIC LICENSE;
+// you may not use this file except in compliance with the License;
+// You may obtain the license via the LICENSE file in the repository root;
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/*! @file hexdump.c
+ * @brief logging of binary payloads as offset/hex/ASCII dumps
+ */
+
+#include "hexdump.h"
+#include "buffer.h"
+#include "fmt.h"
+#include "rcu.h"
+#include "sanitize.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/*! @brief writes the ASCII column, non printable bytes become '.'
+ */
+static void write_printable(char *output, const uint8_t *bytes, size_t len) {
+
+    size_t i = 0;
+
+#ifdef __SSE2__
+    if (len == HEXDUMP_BYTES_PER_LINE) {
+        __m128i value = _mm_loadu_si128((const __m128i *)bytes);
+        // signed compares, so bytes >= 0x80 are negative and never printable
+        __m128i printable =
+            _mm_and_si128(_mm_cmpgt_epi8(value, _mm_set1_epi8(0x1f)),
+                          _mm_cmplt_epi8(value, _mm_set1_epi8(0x7f)));
+        __m128i dots = _mm_andnot_si128(printable, _mm_set1_epi8('.'));
+        __m128i result = _mm_or_si128(_mm_and_si128(printable, value), dots);
+        _mm_storeu_si128((__m128i *)output, result);
+        return;
+    }
+#endif
+
+    for (; i < len; i++) {
+        output[i] = bytes[i] >= 0x20 && bytes[i] < 0x7f ? (char)bytes[i] : '.';
+    }
+}
+
+/*! @brief renders one dump line of at most HEXDUMP_BYTES_PER_LINE bytes
+ * @details shorter lines are padded so the ASCII column stays aligned
+ * @param output receives the line, needs HEXDUMP_LINE_SIZE bytes
+ * @param data the bytes of this line
+ * @param len number of bytes, at most HEXDUMP_BYTES_PER_LINE
+ * @param offset offset of data in the payload
+ * @return the number of bytes written, the output is not null terminated
+ */
+size_t hexdump_line(char *output, const void *data, size_t len, size_t offset) {
+
+    char hex[HEXDUMP_BYTES_PER_LINE * 2];
+    size_t pos = 0;
+
+    if (len > HEXDUMP_BYTES_PER_LINE) {
+        len = HEXDUMP_BYTES_PER_LINE;
+    }
+
+    // offsets are at least 8 digits wide
+    char digits[FMT_HEX_SIZE];
+    size_t digits_len = fmt_hex64(digits, offset, false);
+    while (pos + digits_len < 8) {
+        output[pos++] = '0';
+    }
+    memcpy(output + pos, digits, digits_len);
+    pos += digits_len;
+    output[pos++] = ' ';
+
+    fmt_hex_bytes(hex, data, len);
+    for (size_t i = 0; i < HEXDUMP_BYTES_PER_LINE; i++) {
+        output[pos++] = ' ';
+        if (i == HEXDUMP_BYTES_PER_LINE / 2) {
+            output[pos++] = ' ';
+        }
+        if (i < len) {
+            memcpy(output + pos, hex + i * 2, 2);
+        } else {
+            memset(output + pos, ' ', 2);
+        }
+        pos += 2;
+    }
+
+    memcpy(output + pos, "  |", 3);
+    pos += 3;
+    write_printable(output + pos, data, len);
+    pos += len;
+    output[pos++] = '|';
+
+    return pos;
+}
+
+/*! @brief logs a dump of a binary payload
+ * @details the record message is `<label> (<len> bytes)` followed by one dump line
+ * per HEXDUMP_BYTES_PER_LINE bytes. returns before touching data when level is
+ * disabled
+ * @param thl pointer to an instance of thread_logger
+ * @param file_descriptor file descriptor to write log messages to, if 0 then only
+ * stdout is used
+ * @param level the log level to use (effects color used)
+ * @param label describes the payload, may be NULL
+ * @param data the payload
+ * @param len length of the payload
+ */
+void log_hexdump(thread_logger *thl, int file_descriptor, LOG_LEVELS level,
+                 const char *file, int line, const char *label, const void *data,
+                 size_t len) {
+
+    if (log_level_enabled(thl, level) == false) {
+        return;
+    }
+
+    if (label == NULL) {
+        label = "hexdump";
+    }
+
+    rcu_read_lock();
+    const log_settings *settings = rcu_dereference(thl->settings);
+    size_t max_bytes = settings->hexdump_max_bytes;
+    LOG_SANITIZE sanitize = settings->sanitize;
+    rcu_read_unlock();
+
+    size_t dumped = len < max_bytes ? len : max_bytes;
+    size_t lines = (dumped + HEXDUMP_BYTES_PER_LINE - 1) / HEXDUMP_BYTES_PER_LINE;
+    size_t label_len = strlen(label);
+
+    // only the label comes from the caller, the dump lines and their newlines
+    // are written as they are. a JSON string can not hold raw newlines though,
+    // so there the whole message is escaped by the logger
+    bool escape_all = sanitize == LOG_SANITIZE_JSON;
+    log_buffer *msg = thread_log_buffer(LOG_BUFFER_PAYLOAD);
+    int response = escape_all == true ||
+                           sanitize_scan(label, label_len, sanitize) == label_len
+                       ? log_buffer_append(msg, label, label_len)
+                       : sanitize_append(msg, label, label_len, sanitize);
+    // two counts with their text, and a newline plus a line per chunk
+    if (response != 0 ||
+        log_buffer_reserve(msg, 2 * FMT_INT_SIZE + 32 +
+                                    lines * (HEXDUMP_LINE_SIZE + 1)) != 0) {
+        log_buffer_release(msg);
+        return;
+    }
+
+    char *cursor = msg->data + msg->len;
+    memcpy(cursor, " (", 2);
+    cursor += 2;
+    cursor += fmt_u64(cursor, len);
+    memcpy(cursor, " bytes)", 7);
+    cursor += 7;
+
+    const uint8_t *bytes = data;
+    for (size_t offset = 0; offset < dumped; offset += HEXDUMP_BYTES_PER_LINE) {
+        size_t chunk = dumped - offset < HEXDUMP_BYTES_PER_LINE
+                           ? dumped - offset
+                           : HEXDUMP_BYTES_PER_LINE;
+        *cursor++ = '\n';
+        cursor += hexdump_line(cursor, bytes + offset, chunk, offset);
+    }
+
+    if (dumped < len) {
+        memcpy(cursor, "\n... ", 5);
+        cursor += 5;
+        cursor += fmt_u64(cursor, len - dumped);
+        memcpy(cursor, " more bytes", 11);
+        cursor += 11;
+    }
+    msg->len = (size_t)(cursor - msg->data);
+
+    if (escape_all == true) {
+        logn_func(thl, file_descriptor, msg->data, msg->len, level, file, line);
+    } else {
+        logn_func_raw(thl, file_descriptor, msg->data, msg->len, level, file, line);
+    }
+
+    log_buffer_release(msg);
+}
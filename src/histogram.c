@@ -0,0 +1,249 @@
+// Copyright 2020 Bonedaddy (Alexandre Trottier)
+//
+// licensed under GNU AFFERO GENERAL PUBLIC LICENSE;
+// you may not use this file except in compliance with the License;
+// You may obtain the license via the LICENSE file in the repository root;
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/*! @file histogram.c
+ * @brief lock free, log bucketed latency histogram
+ */
+
+#define _GNU_SOURCE
+
+#include "histogram.h"
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*! @brief total number of buckets in a shard */
+#define HISTOGRAM_BUCKETS                                                           \
+    ((HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BUCKET_BITS + 1) * HISTOGRAM_SUB_BUCKETS)
+
+/*! @brief a set of buckets written by a subset of threads, cache line aligned so
+ * shards never share a line
+ */
+typedef struct histogram_shard {
+    _Alignas(64) atomic_uint_fast64_t buckets[HISTOGRAM_BUCKETS];
+} histogram_shard;
+
+struct latency_histogram {
+    histogram_shard shards[HISTOGRAM_SHARDS];
+};
+
+/*! @brief hands out shard indices to threads round robin */
+static atomic_uint next_shard;
+
+/*! @brief the shard used by the calling thread, -1 until first use */
+static _Thread_local int thread_shard = -1;
+
+static size_t bucket_index(uint64_t value) {
+
+    if (value < HISTOGRAM_SUB_BUCKETS) {
+        return (size_t)value;
+    }
+    if (value >= (1ull << HISTOGRAM_MAX_BITS)) {
+        value = (1ull << HISTOGRAM_MAX_BITS) - 1;
+    }
+
+    int msb = 63 - __builtin_clzll(value);
+    int shift = msb - HISTOGRAM_SUB_BUCKET_BITS;
+    size_t sub = (size_t)(value >> shift) - HISTOGRAM_SUB_BUCKETS;
+
+    return (size_t)(shift + 1) * HISTOGRAM_SUB_BUCKETS + sub;
+}
+
+static uint64_t bucket_lowest(size_t index) {
+
+    if (index < HISTOGRAM_SUB_BUCKETS) {
+        return index;
+    }
+
+    int shift = (int)(index / HISTOGRAM_SUB_BUCKETS) - 1;
+    uint64_t sub = index % HISTOGRAM_SUB_BUCKETS;
+
+    return (HISTOGRAM_SUB_BUCKETS + sub) << shift;
+}
+
+static uint64_t bucket_highest(size_t index) {
+
+    if (index < HISTOGRAM_SUB_BUCKETS) {
+        return index;
+    }
+
+    int shift = (int)(index / HISTOGRAM_SUB_BUCKETS) - 1;
+
+    return bucket_lowest(index) + (1ull << shift) - 1;
+}
+
+/*! @brief sums every shard into counts
+ * @return the total number of values
+ */
+static uint64_t histogram_merge(latency_histogram *hist,
+                                uint64_t counts[HISTOGRAM_BUCKETS]) {
+
+    uint64_t total = 0;
+    memset(counts, 0, sizeof(uint64_t) * HISTOGRAM_BUCKETS);
+
+    for (int s = 0; s < HISTOGRAM_SHARDS; s++) {
+        for (size_t b = 0; b < HISTOGRAM_BUCKETS; b++) {
+            uint64_t count = atomic_load_explicit(&hist->shards[s].buckets[b],
+                                                  memory_order_relaxed);
+            counts[b] += count;
+            total += count;
+        }
+    }
+
+    return total;
+}
+
+static uint64_t merged_percentile(const uint64_t counts[HISTOGRAM_BUCKETS],
+                                  uint64_t total, double percentile) {
+
+    if (total == 0) {
+        return 0;
+    }
+    if (percentile > 100.0) {
+        percentile = 100.0;
+    }
+
+    uint64_t target = (uint64_t)((percentile / 100.0) * (double)total + 0.5);
+    if (target == 0) {
+        target = 1;
+    }
+
+    uint64_t seen = 0;
+    for (size_t b = 0; b < HISTOGRAM_BUCKETS; b++) {
+        seen += counts[b];
+        if (seen >= target) {
+            return bucket_highest(b);
+        }
+    }
+
+    return bucket_highest(HISTOGRAM_BUCKETS - 1);
+}
+
+/*! @brief returns a new zeroed histogram
+ * @return Success: pointer to the histogram
+ * @return Failure: NULL pointer
+ */
+latency_histogram *new_latency_histogram(void) {
+
+    latency_histogram *hist = aligned_alloc(64, sizeof(latency_histogram));
+    if (hist == NULL) {
+        printf("failed to malloc latency_histogram\n");
+        return NULL;
+    }
+
+    memset(hist, 0, sizeof(latency_histogram));
+
+    return hist;
+}
+
+/*! @brief frees up resources for the histogram
+ */
+void clear_latency_histogram(latency_histogram *hist) {
+    free(hist);
+}
+
+/*! @brief records a single value, safe to call concurrently from any thread
+ * @param hist the histogram to record into
+ * @param value the value to record, typically a latency in nanoseconds
+ */
+void histogram_record(latency_histogram *hist, uint64_t value) {
+
+    if (thread_shard < 0) {
+        thread_shard = (int)(atomic_fetch_add_explicit(&next_shard, 1,
+                                                       memory_order_relaxed) %
+                             HISTOGRAM_SHARDS);
+    }
+
+    histogram_shard *shard = &hist->shards[thread_shard];
+    atomic_fetch_add_explicit(&shard->buckets[bucket_index(value)], 1,
+                              memory_order_relaxed);
+}
+
+/*! @brief returns the number of values recorded so far
+ */
+uint64_t histogram_count(latency_histogram *hist) {
+
+    uint64_t counts[HISTOGRAM_BUCKETS];
+
+    return histogram_merge(hist, counts);
+}
+
+/*! @brief returns the value at the given percentile
+ * @param hist the histogram to query
+ * @param percentile the percentile in the range [0, 100], eg 99.9
+ * @return the highest value equivalent to the bucket containing the percentile, or
+ * 0 if nothing was recorded
+ */
+uint64_t histogram_percentile(latency_histogram *hist, double percentile) {
+
+    uint64_t counts[HISTOGRAM_BUCKETS];
+    uint64_t total = histogram_merge(hist, counts);
+
+    return merged_percentile(counts, total, percentile);
+}
+
+/*! @brief merges all shards and fills in snapshot
+ */
+void histogram_snapshot_get(latency_histogram *hist, histogram_snapshot *snapshot) {
+
+    uint64_t counts[HISTOGRAM_BUCKETS];
+    uint64_t total = histogram_merge(hist, counts);
+
+    memset(snapshot, 0, sizeof(histogram_snapshot));
+    snapshot->count = total;
+    if (total == 0) {
+        return;
+    }
+
+    for (size_t b = 0; b < HISTOGRAM_BUCKETS; b++) {
+        if (counts[b] != 0) {
+            snapshot->min = bucket_lowest(b);
+            break;
+        }
+    }
+    for (size_t b = HISTOGRAM_BUCKETS; b > 0; b--) {
+        if (counts[b - 1] != 0) {
+            snapshot->max = bucket_highest(b - 1);
+            break;
+        }
+    }
+
+    snapshot->p50 = merged_percentile(counts, total, 50.0);
+    snapshot->p90 = merged_percentile(counts, total, 90.0);
+    snapshot->p99 = merged_percentile(counts, total, 99.0);
+    snapshot->p999 = merged_percentile(counts, total, 99.9);
+}
+
+/*! @brief zeroes all buckets
+ * @note values recorded concurrently with a reset may or may not be kept
+ */
+void histogram_reset(latency_histogram *hist) {
+
+    for (int s = 0; s < HISTOGRAM_SHARDS; s++) {
+        for (size_t b = 0; b < HISTOGRAM_BUCKETS; b++) {
+            atomic_store_explicit(&hist->shards[s].buckets[b], 0,
+                                  memory_order_relaxed);
+        }
+    }
+}
+
+/*! @brief returns the current CLOCK_MONOTONIC time in nanoseconds
+ */
+uint64_t histogram_now(void) {
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
@@ -0,0 +1,359 @@
+// Copyright 2020 Bonedaddy (Alexandre Trottier)
+//
+// licensed under GNU AFFERO GENERAL PUBLIC LICENSE;
+// you may not use this file except in compliance with the License;
+// You may obtain the license via the LICENSE file in the repository root;
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/*! @file io_service.c
+ * @brief a fixed set of I/O threads writing the files of many loggers
+ */
+
+#define _GNU_SOURCE
+
+#include "io_service.h"
+#include "fdio.h"
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+/*! @brief records of one descriptor taken out of the queue in the current batch
+ */
+typedef struct io_destination {
+    struct iovec *iov; /*! @brief record and newline pairs, pointing into the
+                          queue's copy of the batch */
+    size_t count;      /*! @brief iovecs queued */
+    size_t cap;
+    size_t next;       /*! @brief iovecs written */
+    bool active;       /*! @brief listed in io_worker::active */
+} io_destination;
+
+/*! @brief an I/O thread, the writer of its own queue
+ */
+typedef struct io_worker {
+    log_queue *queue;
+    size_t threads; /*! @brief of the service, descriptor fd maps to fd % threads */
+    io_destination *destinations; /*! @brief indexed by fd / threads */
+    size_t destination_count;
+    int *active; /*! @brief descriptors with records in the batch, first come first */
+    size_t active_count;
+    size_t active_cap;
+    atomic_uint_fast64_t records;
+    atomic_uint_fast64_t writes;
+    atomic_uint_fast64_t bytes;
+    atomic_uint_fast64_t errors;
+} io_worker;
+
+struct log_io_service {
+    size_t threads;
+    size_t queue_size;
+    io_worker *workers;
+};
+
+static char newline[] = "\n";
+
+/*! @brief writes record and a newline right away and counts it
+ */
+static void write_now(io_worker *worker, int file_descriptor, const char *record,
+                      size_t record_len) {
+
+    struct iovec iov[2] = {{(char *)record, record_len}, {newline, 1}};
+    atomic_fetch_add_explicit(&worker->writes, 1, memory_order_relaxed);
+    if (fd_writev_all(file_descriptor, iov, 2) != 0) {
+        atomic_fetch_add_explicit(&worker->errors, 1, memory_order_relaxed);
+        return;
+    }
+    atomic_fetch_add_explicit(&worker->records, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&worker->bytes, record_len + 1, memory_order_relaxed);
+}
+
+/*! @brief returns the batch state of file_descriptor, NULL when out of memory
+ */
+static io_destination *destination(io_worker *worker, int file_descriptor) {
+
+    size_t slot = (size_t)file_descriptor / worker->threads;
+    if (slot >= worker->destination_count) {
+        size_t count = slot * 2 + 8;
+        io_destination *grown =
+            realloc(worker->destinations, sizeof(io_destination) * count);
+        if (grown == NULL) {
+            return NULL;
+        }
+        memset(grown + worker->destination_count, 0,
+               sizeof(io_destination) * (count - worker->destination_count));
+        worker->destinations = grown;
+        worker->destination_count = count;
+    }
+
+    io_destination *dest = &worker->destinations[slot];
+    if (dest->active == false) {
+        if (worker->active_count == worker->active_cap) {
+            size_t cap = worker->active_cap * 2 + 8;
+            int *grown = realloc(worker->active, sizeof(int) * cap);
+            if (grown == NULL) {
+                return NULL;
+            }
+            worker->active = grown;
+            worker->active_cap = cap;
+        }
+        worker->active[worker->active_count++] = file_descriptor;
+        dest->active = true;
+    }
+
+    return dest;
+}
+
+/*! @brief writes the next turn of at most LOG_IO_SERVICE_TURN_RECORDS grouped
+ * records of file_descriptor with a single writev
+ */
+static void write_turn(io_worker *worker, int file_descriptor,
+                       io_destination *dest) {
+
+    size_t count = dest->count - dest->next;
+    if (count > 2 * LOG_IO_SERVICE_TURN_RECORDS) {
+        count = 2 * LOG_IO_SERVICE_TURN_RECORDS;
+    }
+    size_t bytes = 0;
+    for (size_t j = dest->next; j < dest->next + count; j++) {
+        bytes += dest->iov[j].iov_len;
+    }
+
+    atomic_fetch_add_explicit(&worker->writes, 1, memory_order_relaxed);
+    if (fd_writev_all(file_descriptor, dest->iov + dest->next, (int)count) != 0) {
+        atomic_fetch_add_explicit(&worker->errors, count / 2, memory_order_relaxed);
+    } else {
+        atomic_fetch_add_explicit(&worker->records, count / 2, memory_order_relaxed);
+        atomic_fetch_add_explicit(&worker->bytes, bytes, memory_order_relaxed);
+    }
+
+    dest->next += count;
+}
+
+/*! @brief returns the group of file_descriptor when it has one, without
+ * allocating
+ */
+static io_destination *destination_group(io_worker *worker, int file_descriptor) {
+
+    size_t slot = (size_t)file_descriptor / worker->threads;
+    if (slot >= worker->destination_count ||
+        worker->destinations[slot].active == false) {
+        return NULL;
+    }
+
+    return &worker->destinations[slot];
+}
+
+/*! @brief log_queue_writer of every worker, groups the records by descriptor
+ */
+static void collect_record(void *ctx, int file_descriptor, int level,
+                           const char *record, size_t record_len) {
+
+    (void)level;
+    io_worker *worker = ctx;
+
+    if (file_descriptor <= 0) {
+        // the queue reporting drops, from a buffer that does not outlive the call
+        write_now(worker, STDERR_FILENO, record, record_len);
+        return;
+    }
+
+    io_destination *dest = destination(worker, file_descriptor);
+    if (dest != NULL && dest->count + 2 > dest->cap) {
+        size_t cap = dest->cap * 2 + 2 * LOG_IO_SERVICE_TURN_RECORDS;
+        struct iovec *grown = realloc(dest->iov, sizeof(struct iovec) * cap);
+        if (grown == NULL) {
+            dest = NULL;
+        } else {
+            dest->iov = grown;
+            dest->cap = cap;
+        }
+    }
+    if (dest == NULL) {
+        // out of memory. only a group that could not grow holds records, they
+        // are written before this one to keep the order of the descriptor
+        dest = destination_group(worker, file_descriptor);
+        while (dest != NULL && dest->next < dest->count) {
+            write_turn(worker, file_descriptor, dest);
+        }
+        write_now(worker, file_descriptor, record, record_len);
+        return;
+    }
+
+    dest->iov[dest->count++] = (struct iovec){(char *)record, record_len};
+    dest->iov[dest->count++] = (struct iovec){newline, 1};
+}
+
+/*! @brief log_queue_batch_end of every worker, writes the grouped records one
+ * turn per descriptor at a time
+ */
+static void write_batch(void *ctx) {
+
+    io_worker *worker = ctx;
+
+    // groups written out early by collect_record have nothing left
+    size_t remaining = 0;
+    for (size_t i = 0; i < worker->active_count; i++) {
+        io_destination *dest =
+            &worker->destinations[(size_t)worker->active[i] / worker->threads];
+        remaining += dest->next < dest->count;
+    }
+
+    while (remaining > 0) {
+        for (size_t i = 0; i < worker->active_count; i++) {
+            int file_descriptor = worker->active[i];
+            io_destination *dest =
+                &worker->destinations[(size_t)file_descriptor / worker->threads];
+            if (dest->next == dest->count) {
+                continue;
+            }
+
+            write_turn(worker, file_descriptor, dest);
+            if (dest->next == dest->count) {
+                remaining--;
+            }
+        }
+    }
+
+    for (size_t i = 0; i < worker->active_count; i++) {
+        io_destination *dest =
+            &worker->destinations[(size_t)worker->active[i] / worker->threads];
+        dest->count = 0;
+        dest->next = 0;
+        dest->active = false;
+    }
+    worker->active_count = 0;
+}
+
+/*! @brief returns a new service and starts its threads
+ * @param threads number of I/O threads, at least 1
+ * @param queue_size bytes of queue per thread, see new_log_queue
+ * @param overflow policy applied when a queue is full, LOG_OVERFLOW_SPILL is not
+ * supported and LOG_OVERFLOW_DROP_BELOW_LEVEL never drops
+ * @return Success: pointer to the service
+ * @return Failure: NULL pointer
+ */
+log_io_service *new_log_io_service(size_t threads, size_t queue_size,
+                                   LOG_OVERFLOW overflow) {
+
+    if (threads == 0 || overflow == LOG_OVERFLOW_SPILL) {
+        printf("log io service needs a thread and an overflow policy besides spill\n");
+        return NULL;
+    }
+
+    log_io_service *service = malloc(sizeof(log_io_service));
+    io_worker *workers = calloc(threads, sizeof(io_worker));
+    if (service == NULL || workers == NULL) {
+        free(service);
+        free(workers);
+        printf("failed to malloc log_io_service\n");
+        return NULL;
+    }
+
+    service->threads = threads;
+    service->queue_size = queue_size;
+    service->workers = workers;
+
+    for (size_t i = 0; i < threads; i++) {
+        io_worker *worker = &workers[i];
+        worker->threads = threads;
+        atomic_init(&worker->records, 0);
+        atomic_init(&worker->writes, 0);
+        atomic_init(&worker->bytes, 0);
+        atomic_init(&worker->errors, 0);
+        worker->queue = new_log_queue(queue_size, overflow, 0, NULL, 1, collect_record,
+                                      worker);
+        if (worker->queue == NULL) {
+            service->threads = i;
+            clear_log_io_service(service);
+            return NULL;
+        }
+        log_queue_on_batch_end(worker->queue, write_batch);
+    }
+
+    return service;
+}
+
+/*! @brief queues record followed by a newline for file_descriptor
+ * @return Success: 0
+ * @return Failure: -1 when the record was dropped
+ */
+int log_io_service_write(log_io_service *service, int file_descriptor, int level,
+                         const char *record, size_t record_len) {
+
+    io_worker *worker = &service->workers[(size_t)file_descriptor % service->threads];
+
+    if (record_len + LOG_QUEUE_RECORD_OVERHEAD > service->queue_size) {
+        // the worker is the only writer of its batch state, so the caller writes
+        // records the queue can not hold itself
+        log_queue_flush(worker->queue);
+        write_now(worker, file_descriptor, record, record_len);
+        return 0;
+    }
+
+    return log_queue_push(worker->queue, file_descriptor, level, record, record_len);
+}
+
+/*! @brief waits until every record queued for file_descriptor was written, so
+ * it can be closed
+ */
+void log_io_service_flush_fd(log_io_service *service, int file_descriptor) {
+    log_queue_flush(service->workers[(size_t)file_descriptor % service->threads].queue);
+}
+
+/*! @brief waits until every queued record was written
+ */
+void log_io_service_flush(log_io_service *service) {
+
+    for (size_t i = 0; i < service->threads; i++) {
+        log_queue_flush(service->workers[i].queue);
+    }
+}
+
+/*! @brief fills stats with the counters of the service
+ */
+void log_io_service_stats_get(log_io_service *service, log_io_service_stats *stats) {
+
+    *stats = (log_io_service_stats){.threads = service->threads};
+
+    for (size_t i = 0; i < service->threads; i++) {
+        io_worker *worker = &service->workers[i];
+        log_queue_stats queue_stats;
+        log_queue_stats_get(worker->queue, &queue_stats);
+        stats->dropped += queue_stats.dropped;
+        stats->records += atomic_load_explicit(&worker->records, memory_order_relaxed);
+        stats->writes += atomic_load_explicit(&worker->writes, memory_order_relaxed);
+        stats->bytes += atomic_load_explicit(&worker->bytes, memory_order_relaxed);
+        stats->errors += atomic_load_explicit(&worker->errors, memory_order_relaxed);
+    }
+}
+
+/*! @brief writes out every queued record, stops the threads and frees the
+ * service, every logger using it must be cleared first
+ */
+void clear_log_io_service(log_io_service *service) {
+
+    if (service == NULL) {
+        return;
+    }
+
+    for (size_t i = 0; i < service->threads; i++) {
+        io_worker *worker = &service->workers[i];
+        clear_log_queue(worker->queue);
+        for (size_t j = 0; j < worker->destination_count; j++) {
+            free(worker->destinations[j].iov);
+        }
+        free(worker->destinations);
+        free(worker->active);
+    }
+    free(service->workers);
+    free(service);
+}
@@ -0,0 +1,397 @@
+// Copyright 2020 Bonedaddy (Alexandre Trottier)
+//
+// licensed under GNU AFFERO GENERAL PUBLIC LICENSE;
+// you may not use this file except in compliance with the License;
+// You may obtain the license via the LICENSE file in the repository root;
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/*! @file layout.c
+ * @brief compiled record layouts
+ */
+
+#define _GNU_SOURCE
+
+#include "layout.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+/*! @brief size of the buffer the timestamp is rendered into */
+#define LAYOUT_TIME_MAX 64
+
+/*! @brief maximum rendered size of an int */
+#define LAYOUT_INT_MAX 11
+
+/*! @brief maximum rendered size of a level name */
+#define LAYOUT_LEVEL_MAX 5
+
+typedef struct layout_op layout_op;
+
+/*! @typedef appends the value of an op to output
+ * @return pointer one past the last byte written
+ */
+typedef char *(*layout_appender)(char *output, const layout_op *op,
+                                 const log_record *record);
+
+/*! @brief a single formatting op of a compiled layout */
+struct layout_op {
+    layout_appender append;
+    const char *literal; /*! @brief pre-copied constant, only for literal ops */
+    size_t len;          /*! @brief length of literal */
+};
+
+struct log_layout {
+    layout_op *ops;
+    size_t count;
+    size_t fixed_size;  /*! @brief upper bound of all but file/message/context */
+    size_t file_ops;    /*! @brief number of %f ops */
+    size_t message_ops; /*! @brief number of %m ops */
+    size_t context_ops; /*! @brief number of %X ops, 1 for the implicit one */
+    char *literals;     /*! @brief backing storage for every literal op */
+    char *pattern;      /*! @brief the source pattern, see log_layout_pattern */
+    const char *name;   /*! @brief stored after pattern, see log_layout_name */
+};
+
+static const char *level_names[] = {"info", "warn", "error", "debug"};
+static const size_t level_name_lens[] = {4, 4, 5, 5};
+
+/*! @brief per thread cache of the rendered timestamp, refreshed once a second */
+static _Thread_local time_t cached_second = -1;
+static _Thread_local char cached_time[LAYOUT_TIME_MAX];
+static _Thread_local size_t cached_time_len;
+
+/*! @brief per thread cache of the kernel thread id, 0 until first use */
+static _Thread_local pid_t cached_tid;
+
+static pthread_once_t atfork_once = PTHREAD_ONCE_INIT;
+
+/*! @brief the forking thread keeps its thread locals in the child but gets a new
+ * thread id
+ */
+static void layout_atfork_child(void) {
+    cached_tid = 0;
+}
+
+static void layout_register_atfork(void) {
+    pthread_atfork(NULL, NULL, layout_atfork_child);
+}
+
+/*! @brief writes value in decimal
+ * @return pointer one past the last byte written
+ */
+static char *append_int(char *output, long long value) {
+
+    char digits[20];
+    int count = 0;
+    unsigned long long uvalue =
+        value < 0 ? -(unsigned long long)value : (unsigned long long)value;
+
+    do {
+        digits[count++] = (char)('0' + (uvalue % 10));
+        uvalue /= 10;
+    } while (uvalue != 0);
+
+    if (value < 0) {
+        *output++ = '-';
+    }
+    while (count > 0) {
+        *output++ = digits[--count];
+    }
+
+    return output;
+}
+
+static char *append_literal(char *output, const layout_op *op,
+                            const log_record *record) {
+    (void)record;
+    memcpy(output, op->literal, op->len);
+    return output + op->len;
+}
+
+static char *append_time(char *output, const layout_op *op,
+                         const log_record *record) {
+    (void)op;
+
+    time_t now = record->time != 0 ? record->time : time(NULL);
+    if (now != cached_second) {
+        struct tm local;
+        localtime_r(&now, &local);
+        cached_time_len = strftime(cached_time, sizeof(cached_time), "%b %d %r",
+                                   &local);
+        cached_second = now;
+    }
+
+    memcpy(output, cached_time, cached_time_len);
+    return output + cached_time_len;
+}
+
+static char *append_level(char *output, const layout_op *op,
+                          const log_record *record) {
+    (void)op;
+    memcpy(output, level_names[record->level], level_name_lens[record->level]);
+    return output + level_name_lens[record->level];
+}
+
+static char *append_file(char *output, const layout_op *op,
+                         const log_record *record) {
+    (void)op;
+    memcpy(output, record->file, record->file_len);
+    return output + record->file_len;
+}
+
+static char *append_line(char *output, const layout_op *op,
+                         const log_record *record) {
+    (void)op;
+    return append_int(output, record->line);
+}
+
+static char *append_message(char *output, const layout_op *op,
+                            const log_record *record) {
+    (void)op;
+    memcpy(output, record->message, record->message_len);
+    return output + record->message_len;
+}
+
+static char *append_context(char *output, const layout_op *op,
+                            const log_record *record) {
+    (void)op;
+    memcpy(output, record->context, record->context_len);
+    return output + record->context_len;
+}
+
+/*! @brief appended to layouts without `%X`, renders nothing for an empty context
+ */
+static char *append_context_suffix(char *output, const layout_op *op,
+                                   const log_record *record) {
+    (void)op;
+    if (record->context_len == 0) {
+        return output;
+    }
+    *output = ' ';
+    memcpy(output + 1, record->context, record->context_len);
+    return output + 1 + record->context_len;
+}
+
+static char *append_thread_id(char *output, const layout_op *op,
+                              const log_record *record) {
+    (void)op;
+    (void)record;
+    if (cached_tid == 0) {
+        cached_tid = (pid_t)syscall(SYS_gettid);
+    }
+    return append_int(output, cached_tid);
+}
+
+static char *append_pid(char *output, const layout_op *op,
+                        const log_record *record) {
+    (void)op;
+    (void)record;
+    return append_int(output, getpid());
+}
+
+/*! @brief maps a specifier to its appender and the upper bound of its output
+ * @return the appender, or NULL if spec is not a known specifier
+ */
+static layout_appender lookup_appender(char spec, size_t *max_size) {
+
+    switch (spec) {
+        case 'T':
+            *max_size = LAYOUT_TIME_MAX;
+            return append_time;
+        case 'L':
+            *max_size = LAYOUT_LEVEL_MAX;
+            return append_level;
+        case 'f':
+            *max_size = 0; // scales with the record, see layout_max_size
+            return append_file;
+        case 'l':
+            *max_size = LAYOUT_INT_MAX;
+            return append_line;
+        case 'm':
+            *max_size = 0; // scales with the record, see layout_max_size
+            return append_message;
+        case 'X':
+            *max_size = 0; // scales with the record, see layout_max_size
+            return append_context;
+        case 't':
+        case 'p':
+            *max_size = LAYOUT_INT_MAX;
+            return spec == 't' ? append_thread_id : append_pid;
+        default:
+            return NULL;
+    }
+}
+
+/*! @brief compiles pattern into a layout
+ * @param pattern the layout pattern, see the file documentation for specifiers
+ * @param name the logger name rendered by `%n`, may be NULL
+ * @return Success: pointer to the compiled layout
+ * @return Failure: NULL pointer
+ */
+log_layout *new_log_layout(const char *pattern, const char *name) {
+
+    pthread_once(&atfork_once, layout_register_atfork);
+
+    if (name == NULL) {
+        name = "";
+    }
+
+    size_t pattern_len = strlen(pattern);
+    size_t name_len = strlen(name);
+
+    // every op consumes at least one pattern byte, and each %n expands to at most
+    // name_len literal bytes, so these are upper bounds. one more op is kept for
+    // the implicit context
+    layout_op *ops = malloc(sizeof(layout_op) * (pattern_len + 2));
+    char *literals = malloc(pattern_len * (name_len + 1) + 1);
+    log_layout *layout = malloc(sizeof(log_layout));
+    char *pattern_copy = malloc(pattern_len + name_len + 2);
+    if (ops == NULL || literals == NULL || layout == NULL || pattern_copy == NULL) {
+        free(ops);
+        free(literals);
+        free(layout);
+        free(pattern_copy);
+        printf("failed to malloc log_layout\n");
+        return NULL;
+    }
+    memcpy(pattern_copy, pattern, pattern_len + 1);
+    memcpy(pattern_copy + pattern_len + 1, name, name_len + 1);
+
+    size_t count = 0;
+    size_t fixed_size = 0;
+    size_t file_ops = 0;
+    size_t message_ops = 0;
+    size_t context_ops = 0;
+    char *literal_end = literals;
+    layout_op *current_literal = NULL;
+
+    for (size_t i = 0; i < pattern_len; i++) {
+        const char *chunk = &pattern[i];
+        size_t chunk_len = 1;
+
+        if (pattern[i] == '%' && i + 1 < pattern_len) {
+            char spec = pattern[++i];
+            size_t max_size = 0;
+            layout_appender append = lookup_appender(spec, &max_size);
+            if (append != NULL) {
+                ops[count++] = (layout_op){.append = append};
+                fixed_size += max_size;
+                file_ops += append == append_file;
+                message_ops += append == append_message;
+                context_ops += append == append_context;
+                current_literal = NULL;
+                continue;
+            }
+            if (spec == 'n') {
+                chunk = name;
+                chunk_len = name_len;
+            } else if (spec == '%') {
+                chunk = &pattern[i];
+            } else {
+                // unknown specifier, keep it verbatim
+                chunk = &pattern[i - 1];
+                chunk_len = 2;
+            }
+        }
+
+        // coalesce adjacent constant segments into a single literal op
+        if (current_literal == NULL) {
+            current_literal = &ops[count++];
+            *current_literal = (layout_op){
+                .append = append_literal, .literal = literal_end, .len = 0};
+        }
+        memcpy(literal_end, chunk, chunk_len);
+        literal_end += chunk_len;
+        current_literal->len += chunk_len;
+        fixed_size += chunk_len;
+    }
+
+    if (context_ops == 0) {
+        ops[count++] = (layout_op){.append = append_context_suffix};
+        fixed_size += 1;
+        context_ops = 1;
+    }
+
+    layout->ops = ops;
+    layout->count = count;
+    layout->fixed_size = fixed_size;
+    layout->file_ops = file_ops;
+    layout->message_ops = message_ops;
+    layout->context_ops = context_ops;
+    layout->literals = literals;
+    layout->pattern = pattern_copy;
+    layout->name = pattern_copy + pattern_len + 1;
+
+    return layout;
+}
+
+/*! @brief frees up resources for the layout
+ */
+void clear_log_layout(log_layout *layout) {
+
+    if (layout == NULL) {
+        return;
+    }
+
+    free(layout->ops);
+    free(layout->literals);
+    free(layout->pattern);
+    free(layout);
+}
+
+/*! @brief returns the pattern layout was compiled from
+ */
+const char *log_layout_pattern(const log_layout *layout) {
+    return layout->pattern;
+}
+
+/*! @brief returns the name layout renders for `%n`, empty when there is none
+ */
+const char *log_layout_name(const log_layout *layout) {
+    return layout->name;
+}
+
+/*! @brief returns an upper bound of the bytes layout_render writes for record
+ * @note does not include a null terminator
+ */
+size_t layout_max_size(const log_layout *layout, const log_record *record) {
+
+    return layout->fixed_size + layout->file_ops * record->file_len +
+           layout->message_ops * record->message_len +
+           layout->context_ops * record->context_len;
+}
+
+/*! @brief renders record into output
+ * @param layout the compiled layout
+ * @param record the record to render
+ * @param output buffer of at least layout_max_size bytes
+ * @return the number of bytes written, output is not null terminated
+ */
+size_t layout_render(const log_layout *layout, const log_record *record,
+                     char *output) {
+
+    char *end = output;
+    const layout_op *op = layout->ops;
+    const layout_op *last = layout->ops + layout->count;
+
+    for (; op != last; op++) {
+        end = op->append(end, op, record);
+    }
+
+    return (size_t)(end - output);
+}
+
+/*! @brief returns the name of level as rendered by `%L`
+ */
+const char *log_level_name(LOG_LEVELS level) {
+    return level_names[level];
+}
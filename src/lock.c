@@ -0,0 +1,256 @@
+// Copyright 2020 Bonedaddy (Alexandre Trottier)
+//
+// licensed under GNU AFFERO GENERAL PUBLIC LICENSE;
+// you may not use this file except in compliance with the License;
+// You may obtain the license via the LICENSE file in the repository root;
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/*! @file lock.c
+ * @brief contended paths of the log_lock strategies
+ */
+
+#define _GNU_SOURCE
+
+#include "lock.h"
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+/*! @brief spins before a waiter starts yielding the CPU */
+#define LOCK_SPIN_LIMIT 1024
+
+/*! @brief spins of a futex lock waiter before it sleeps */
+#define LOCK_FUTEX_SPINS 128
+
+/*! @brief MCS locks a thread can hold at once */
+#define LOCK_MCS_NODES 16
+
+struct log_mcs_node {
+    log_mcs_node *next;
+    uint32_t locked;
+} __attribute__((aligned(64)));
+
+/*! @brief MCS queue nodes of the calling thread, bit i of used is set while node
+ * i is queued on or holds a lock
+ */
+static _Thread_local log_mcs_node mcs_nodes[LOCK_MCS_NODES];
+static _Thread_local uint32_t mcs_used = 0;
+
+static const char *strategy_names[] = {"mutex", "adaptive", "ticket", "mcs", "futex"};
+
+static inline void cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+/*! @brief pauses a spinning waiter, yielding once it spun for a while
+ */
+static inline void spin_wait(unsigned int *spins) {
+
+    if (*spins < LOCK_SPIN_LIMIT) {
+        (*spins)++;
+        cpu_relax();
+    } else {
+        sched_yield();
+    }
+}
+
+/*! @brief initializes lock with the given strategy
+ * @return Success: 0
+ * @return Failure: -1 when the strategy is unknown
+ */
+int log_lock_init(log_lock *lock, LOG_LOCK strategy) {
+
+    memset(lock, 0, sizeof(log_lock));
+    lock->strategy = strategy;
+
+    switch (strategy) {
+        case LOG_LOCK_MUTEX:
+            pthread_mutex_init(&lock->mutex, NULL);
+            return 0;
+        case LOG_LOCK_ADAPTIVE: {
+            pthread_mutexattr_t attr;
+            pthread_mutexattr_init(&attr);
+#ifdef __GLIBC__
+            pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_ADAPTIVE_NP);
+#endif
+            pthread_mutex_init(&lock->mutex, &attr);
+            pthread_mutexattr_destroy(&attr);
+            return 0;
+        }
+        case LOG_LOCK_TICKET:
+        case LOG_LOCK_MCS:
+        case LOG_LOCK_FUTEX:
+            return 0;
+        default:
+            printf("unknown lock strategy %d\n", (int)strategy);
+            return -1;
+    }
+}
+
+/*! @brief frees resources of an unlocked lock
+ */
+void log_lock_destroy(log_lock *lock) {
+
+    if (lock->strategy == LOG_LOCK_MUTEX || lock->strategy == LOG_LOCK_ADAPTIVE) {
+        pthread_mutex_destroy(&lock->mutex);
+    }
+}
+
+/*! @brief waits until ticket is served
+ */
+void log_lock_ticket_wait(log_lock *lock, uint32_t ticket) {
+
+    unsigned int spins = 0;
+    while (true) {
+        uint32_t serving = __atomic_load_n(&lock->ticket.serving, __ATOMIC_ACQUIRE);
+        if (serving == ticket) {
+            return;
+        }
+        // back off in proportion to the number of waiters ahead
+        for (uint32_t ahead = ticket - serving; ahead > 1; ahead--) {
+            cpu_relax();
+        }
+        spin_wait(&spins);
+    }
+}
+
+/*! @brief takes a futex lock someone else held when log_lock_acquire tried
+ */
+void log_lock_futex_wait(log_lock *lock) {
+
+    for (int i = 0; i < LOCK_FUTEX_SPINS; i++) {
+        uint32_t expected = 0;
+        if (__atomic_load_n(&lock->futex, __ATOMIC_RELAXED) == 0 &&
+            __atomic_compare_exchange_n(&lock->futex, &expected, 1, false,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            return;
+        }
+        cpu_relax();
+    }
+
+    // marks the lock as having sleepers, so the holder wakes one on release. once
+    // set it stays set until the lock is free, so a woken waiter takes it as 2
+    while (__atomic_exchange_n(&lock->futex, 2, __ATOMIC_ACQUIRE) != 0) {
+#ifdef __linux__
+        syscall(SYS_futex, &lock->futex, FUTEX_WAIT_PRIVATE, 2, NULL, NULL, 0);
+#else
+        sched_yield();
+#endif
+    }
+}
+
+/*! @brief wakes one sleeper of a futex lock
+ */
+void log_lock_futex_wake(log_lock *lock) {
+
+#ifdef __linux__
+    syscall(SYS_futex, &lock->futex, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+#else
+    (void)lock;
+#endif
+}
+
+/*! @brief queues a node of the calling thread on an MCS lock and waits for its turn
+ */
+void log_lock_mcs_acquire(log_lock *lock) {
+
+    if (mcs_used == (1u << LOCK_MCS_NODES) - 1) {
+        // nothing sensible is left to do, locks must not fail
+        printf("more than %d mcs locks held by one thread\n", LOCK_MCS_NODES);
+        abort();
+    }
+    int index = __builtin_ctz(~mcs_used);
+    mcs_used |= 1u << index;
+
+    log_mcs_node *node = &mcs_nodes[index];
+    node->next = NULL;
+    node->locked = 1;
+
+    log_mcs_node *prev = __atomic_exchange_n(&lock->mcs.tail, node, __ATOMIC_ACQ_REL);
+    if (prev != NULL) {
+        __atomic_store_n(&prev->next, node, __ATOMIC_RELEASE);
+        unsigned int spins = 0;
+        while (__atomic_load_n(&node->locked, __ATOMIC_ACQUIRE) != 0) {
+            spin_wait(&spins);
+        }
+    }
+
+    lock->mcs.owner = node;
+}
+
+/*! @brief hands an MCS lock to the next queued node, if any
+ */
+void log_lock_mcs_release(log_lock *lock) {
+
+    log_mcs_node *node = lock->mcs.owner;
+    log_mcs_node *next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE);
+
+    if (next == NULL) {
+        log_mcs_node *expected = node;
+        if (__atomic_compare_exchange_n(&lock->mcs.tail, &expected, NULL, false,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+            mcs_used &= ~(1u << (node - mcs_nodes));
+            return;
+        }
+        // a waiter swapped itself in as tail but did not link itself yet
+        unsigned int spins = 0;
+        while ((next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE)) == NULL) {
+            spin_wait(&spins);
+        }
+    }
+
+    __atomic_store_n(&next->locked, 0, __ATOMIC_RELEASE);
+    mcs_used &= ~(1u << (node - mcs_nodes));
+}
+
+/*! @brief non inline log_lock_acquire, see thread_logger::lock */
+int log_lock_acquire_fn(log_lock *lock) {
+    return log_lock_acquire(lock);
+}
+
+/*! @brief non inline log_lock_release, see thread_logger::unlock */
+int log_lock_release_fn(log_lock *lock) {
+    return log_lock_release(lock);
+}
+
+/*! @brief returns the name of strategy, as accepted by log_lock_parse */
+const char *log_lock_name(LOG_LOCK strategy) {
+
+    if ((unsigned int)strategy >= sizeof(strategy_names) / sizeof(strategy_names[0])) {
+        return "unknown";
+    }
+
+    return strategy_names[strategy];
+}
+
+/*! @brief returns the strategy called name
+ * @return Success: 0
+ * @return Failure: -1 when name is not a strategy
+ */
+int log_lock_parse(const char *name, LOG_LOCK *strategy) {
+
+    for (size_t i = 0; i < sizeof(strategy_names) / sizeof(strategy_names[0]); i++) {
+        if (strcmp(name, strategy_names[i]) == 0) {
+            *strategy = (LOG_LOCK)i;
+            return 0;
+        }
+    }
+
+    return -1;
+}
@@ -20,15 +20,22 @@
  *   - [warn - Jul 06 10:01:07 PM] one	two
  * @note warn, and info appear to not respect format, while debug and error do
  * @todo
- *  - buffer logs and use a dedicated thread for writing (avoid blocking locks)
  *  - handling system signals (exit, kill, etc...)
  */
 
 #include "logger.h"
+#include "buffer.h"
+#include "context.h"
+#include "fdio.h"
+#include "fmt.h"
+#include "hexdump.h"
+#include "layout.h"
+#include "rcu.h"
 #include <fcntl.h>
 #include <pthread.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/stat.h>
@@ -39,6 +46,121 @@
 extern "C" {
 #endif
 
+/*! @brief colors used for stdout output, indexed by LOG_LEVELS */
+static const COLORS level_colors[] = {COLORS_GREEN, COLORS_YELLOW, COLORS_RED,
+                                      COLORS_SOFT_RED};
+
+/*! @brief severity of each level, indexed by LOG_LEVELS */
+static const int level_severity[] = {1, 2, 3, 0};
+
+/*! @brief added to the level of a batch handed to the queue or the per CPU
+ * buffers, its record then starts with the level_counts of the batch so the
+ * writer indexes every record of it, see queue_write
+ */
+#define LOG_BATCH_COUNTED FILE_INDEX_LEVELS
+
+/*! @brief return address of the log call emitting the current error record,
+ * where its backtrace starts
+ */
+static _Thread_local const void *error_caller;
+
+/*! @brief guards the shape and levels of every logger hierarchy, only taken when
+ * children are created and levels change, never to log
+ */
+static pthread_mutex_t hierarchy_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*! @brief returns new settings for thl built from config
+ * @param name the name rendered by `%n`
+ * @param current settings whose console is reused when config asks for the same
+ * one, may be NULL
+ */
+static log_settings *new_log_settings(const thread_logger *thl,
+                                      const thread_logger_config *config,
+                                      const char *name, const log_settings *current) {
+
+    log_settings *settings = malloc(sizeof(log_settings));
+    if (settings == NULL) {
+        printf("failed to malloc log_settings\n");
+        return NULL;
+    }
+
+    settings->console_fd = config->console_fd != 0 ? config->console_fd : STDOUT_FILENO;
+    settings->console_flush = config->console_flush;
+    settings->console_flush_ms = config->console_flush_ms;
+    settings->console_color = config->console_color;
+    settings->max_message_size = config->max_message_size != 0
+                                     ? config->max_message_size
+                                     : LOG_MESSAGE_MAX_DEFAULT;
+    settings->hexdump_max_bytes = config->hexdump_max_bytes != 0
+                                      ? config->hexdump_max_bytes
+                                      : HEXDUMP_MAX_BYTES_DEFAULT;
+    settings->sanitize = config->sanitize;
+
+    if (thl->pool != NULL) {
+        // leave half of a slab for the rest of the record, and keep the thread
+        // local message buffers small enough to be retained between records
+        record_pool_stats stats;
+        record_pool_stats_get(thl->pool, &stats);
+        size_t cap = stats.slab_size / 2 < LOG_BUFFER_RETAIN_SIZE / 8
+                         ? stats.slab_size / 2
+                         : LOG_BUFFER_RETAIN_SIZE / 8;
+        if (settings->max_message_size > cap) {
+            settings->max_message_size = cap;
+        }
+    }
+
+    settings->layout = new_log_layout(
+        config->layout != NULL ? config->layout : LOG_LAYOUT_DEFAULT, name);
+    if (settings->layout == NULL) {
+        // dont printf log here since new_log_layout handles that
+        free(settings);
+        return NULL;
+    }
+
+    if (current != NULL && current->console_fd == settings->console_fd &&
+        current->console_flush == settings->console_flush &&
+        current->console_flush_ms == settings->console_flush_ms &&
+        current->console_color == settings->console_color) {
+        settings->console = current->console;
+        return settings;
+    }
+
+    settings->console =
+        new_console_sink(settings->console_fd, settings->console_flush,
+                         settings->console_flush_ms, settings->console_color);
+    if (settings->console == NULL) {
+        clear_log_layout(settings->layout);
+        free(settings);
+        return NULL;
+    }
+
+    return settings;
+}
+
+/*! @brief returns a copy of settings rendering name for `%n`, sharing the console
+ */
+static log_settings *rename_log_settings(const log_settings *settings,
+                                         const char *name) {
+
+    log_settings *renamed = malloc(sizeof(log_settings));
+    if (renamed == NULL) {
+        printf("failed to malloc log_settings\n");
+        return NULL;
+    }
+
+    *renamed = *settings;
+    renamed->layout = new_log_layout(log_layout_pattern(settings->layout), name);
+    if (renamed->layout == NULL) {
+        free(renamed);
+        return NULL;
+    }
+
+    return renamed;
+}
+
+static void queue_write(void *ctx, int file_descriptor, int level,
+                        const char *record, size_t record_len);
+
 /*! @brief returns a new thread safe logger
  * if with_debug is false, then all debug_log calls will be ignored
  * @param with_debug whether to enable debug logging, if false debug log calls will
@@ -46,22 +168,858 @@ extern "C" {
  */
 thread_logger *new_thread_logger(bool with_debug) {
 
+    thread_logger_config config = {.debug = with_debug};
+
+    return new_thread_logger_config(&config);
+}
+
+/*! @brief returns a new thread safe logger configured by config
+ * @param config the logger configuration, only read during the call
+ * @return Success: pointer to the logger
+ * @return Failure: NULL pointer
+ */
+thread_logger *new_thread_logger_config(const thread_logger_config *config) {
+
     thread_logger *thl = malloc(sizeof(thread_logger));
     if (thl == NULL) {
         printf("failed to malloc thread_logger\n");
         return NULL;
     }
 
-    thl->lock = pthread_mutex_lock;
-    thl->unlock = pthread_mutex_unlock;
+    thl->level = config->debug == true ? LOG_LEVELS_DEBUG : LOG_LEVELS_INFO;
+    thl->level_set = true;
+    thl->enabled_levels = 0;
+    thl->name = NULL;
+    thl->root = thl;
+    thl->parent = NULL;
+    thl->children = NULL;
+    thl->next_sibling = NULL;
+    thl->file = NULL;
+    thl->lock = log_lock_acquire_fn;
+    thl->unlock = log_lock_release_fn;
     thl->log = log_func;
     thl->logf = logf_func;
-    thl->debug = with_debug;
-    pthread_mutex_init(&thl->mutex, NULL);
+    thl->debug = config->debug;
+    thl->call_latency = NULL;
+    thl->sink_latency = NULL;
+    thl->direct_append = config->direct_append;
+    thl->file_buffer = NULL;
+    thl->file_sync_level = config->file_sync_level_set ? config->file_sync_level
+                                                       : LOG_LEVELS_ERROR;
+    thl->backtraces = NULL;
+    thl->compressor = NULL;
+    thl->direct = NULL;
+    thl->shm = NULL;
+    thl->index = NULL;
+    thl->settings = NULL;
+    thl->queue = NULL;
+    thl->percpu = NULL;
+    thl->io_service = config->queue_size == 0 && config->percpu_size == 0
+                          ? config->io_service
+                          : NULL;
+    thl->pool = NULL;
+    if (log_lock_init(&thl->mutex, config->lock) != 0) {
+        free(thl);
+        return NULL;
+    }
+    set_thread_logger_level(thl, thl->level);
+
+    if (config->pool_budget != 0) {
+        thl->pool = new_record_pool(config->pool_budget, config->pool_slab_size,
+                                    config->pool_flags, config->pool_exhausted);
+        if (thl->pool == NULL) {
+            clear_thread_logger(thl);
+            return NULL;
+        }
+    }
+
+    thl->settings = new_log_settings(thl, config, config->name, NULL);
+    if (thl->settings == NULL) {
+        clear_thread_logger(thl);
+        return NULL;
+    }
+
+    if (config->error_backtrace == true) {
+        thl->backtraces = new_log_backtrace_sites(config->backtrace_site_limit);
+        if (thl->backtraces == NULL) {
+            clear_thread_logger(thl);
+            return NULL;
+        }
+    }
+
+    if (config->file_sync == FILE_SYNC_ON_LEVEL && thl->io_service == NULL) {
+        // the buffer is shared by every caller, so writes need the lock
+        thl->direct_append = false;
+        thl->file_buffer = new_file_sink(config->file_buffer_size);
+        if (thl->file_buffer == NULL) {
+            clear_thread_logger(thl);
+            return NULL;
+        }
+    }
+
+    if (config->queue_size != 0) {
+        unsigned int droppable = 0;
+        for (int level = LOG_LEVELS_INFO; level <= LOG_LEVELS_DEBUG; level++) {
+            if (level != LOG_LEVELS_ERROR &&
+                level_severity[level] < level_severity[config->queue_drop_level]) {
+                droppable |= 1u << level | 1u << (LOG_BATCH_COUNTED + level);
+            }
+        }
+        thl->queue = new_log_queue(config->queue_size, config->queue_overflow,
+                                   droppable, config->queue_spill_file,
+                                   LOG_LEVELS_WARN, queue_write, thl);
+        if (thl->queue == NULL) {
+            clear_thread_logger(thl);
+            return NULL;
+        }
+    } else if (config->percpu_size != 0) {
+        thl->percpu =
+            new_log_percpu(config->percpu_size, config->queue_overflow, queue_write, thl);
+        if (thl->percpu == NULL) {
+            clear_thread_logger(thl);
+            return NULL;
+        }
+    }
+
+    return thl;
+}
+
+/*! @brief enables the call and sink latency histograms of the logger
+ * @details once enabled every log_func and logf_func invocation records its entry
+ * to return latency into thl->call_latency, and the time spent writing the record
+ * to stdout and the file descriptor into thl->sink_latency. query them with
+ * histogram_percentile or histogram_snapshot_get. a hierarchy has one pair, on
+ * its root, so called on a child it enables those of the root, which measure
+ * every child as well
+ * @warning must be called before the logger is shared with other threads
+ * @return Success: 0
+ * @return Failure: -1
+ */
+int enable_latency_histograms(thread_logger *thl) {
+
+    thl = thl->root;
+
+    if (thl->call_latency != NULL) {
+        return 0;
+    }
+
+    latency_histogram *call_latency = new_latency_histogram();
+    if (call_latency == NULL) {
+        return -1;
+    }
+
+    latency_histogram *sink_latency = new_latency_histogram();
+    if (sink_latency == NULL) {
+        clear_latency_histogram(call_latency);
+        return -1;
+    }
+
+    thl->call_latency = call_latency;
+    thl->sink_latency = sink_latency;
+
+    return 0;
+}
+
+/*! @brief returns whether records of level sync the file sink of thl
+ */
+static bool file_sync_level(const thread_logger *thl, LOG_LEVELS level) {
+    return level_severity[level] >= level_severity[thl->file_sync_level];
+}
+
+/*! @brief writes text to file_descriptor, through the compressor, direct sink or
+ * file sink of thl when it has them, and accounts for it in the index
+ * @details called with the logger locked
+ * @param record whether text is a single record, still missing its newline
+ * @param counts number of records of every level in text, NULL for a single
+ * record of level
+ * @param sync_after set when the file sink wrote text through, the caller then
+ * calls sync_file once it released the lock
+ * @return Success: 0
+ * @return Failure: -1
+ */
+static int write_file(thread_logger *thl, int file_descriptor, LOG_LEVELS level,
+                      const char *text, size_t text_len, bool record,
+                      const size_t *counts, bool *sync_after) {
+
+    bool sync = (thl->file_buffer != NULL || thl->direct != NULL) &&
+                file_sync_level(thl, level);
+
+    if (thl->compressor != NULL && log_compress_fd(thl->compressor) == file_descriptor) {
+        int response = record == true
+                           ? log_compress_write_record(thl->compressor, text, text_len)
+                           : log_compress_write(thl->compressor, text, text_len);
+        if (response == 0 && sync == true) {
+            response = log_compress_flush(thl->compressor, true);
+        }
+        return response;
+    }
+    if (thl->shm != NULL && log_shm_fd(thl->shm) == file_descriptor) {
+        // the drainer adds the newline back
+        return log_shm_push(thl->shm, level, text,
+                            record == true ? text_len : text_len - 1);
+    }
+
+    int response;
+    if (thl->direct != NULL && direct_sink_fd(thl->direct) == file_descriptor) {
+        response = record == true
+                       ? direct_sink_write_record(thl->direct, text, text_len)
+                       : direct_sink_write(thl->direct, text, text_len);
+        if (response == 0 && sync == true) {
+            response = direct_sink_flush(thl->direct, true);
+        }
+    } else if (thl->file_buffer != NULL) {
+        response = record == true
+                       ? file_sink_write_record(thl->file_buffer, file_descriptor, text,
+                                                text_len, sync)
+                       : file_sink_write(thl->file_buffer, file_descriptor, text,
+                                         text_len, sync);
+        *sync_after = response == 0 && sync == true;
+    } else if (record == true) {
+        struct iovec iov[2] = {{(char *)text, text_len}, {"\n", 1}};
+        response = fd_writev_all(file_descriptor, iov, 2);
+    } else {
+        response = fd_write_all(file_descriptor, text, text_len);
+    }
+
+    if (response == 0 && thl->index != NULL &&
+        file_index_fd(thl->index) == file_descriptor) {
+        size_t single[FILE_INDEX_LEVELS] = {0};
+        if (counts == NULL) {
+            single[level] = 1;
+            counts = single;
+        }
+        file_index_add(thl->index, text_len + (record == true), counts);
+    }
+
+    return response;
+}
+
+/*! @brief syncs file_descriptor after write_file asked for it
+ * @details called without the logger lock, so callers of other levels do not
+ * wait for the disk. a file logger cleared meanwhile was synced when closed
+ */
+static void sync_file(thread_logger *thl, int file_descriptor) {
+    if (file_sink_sync(thl->file_buffer, file_descriptor) != 0) {
+        printf("failed to sync file log message\n");
+    }
+}
+
+/*! @brief writes an already formatted record to the file descriptor and console
+ * @details called with the logger locked, records sink latency when enabled
+ * @param counts see write_file
+ * @return whether the caller calls sync_file once it released the lock
+ */
+static bool write_record(thread_logger *thl, console_sink *console,
+                         int file_descriptor, LOG_LEVELS level, const char *message,
+                         size_t message_len, const size_t *counts) {
+
+    uint64_t start = thl->sink_latency != NULL ? histogram_now() : 0;
+
+    bool sync_after = false;
+    if (file_descriptor != 0 &&
+        write_file(thl, file_descriptor, level, message, message_len, true, counts,
+                   &sync_after) != 0) {
+        printf("failed to write file log message\n");
+    }
+
+    console_sink_write(console, level_colors[level], message, message_len);
+
+    if (thl->sink_latency != NULL) {
+        histogram_record(thl->sink_latency, histogram_now() - start);
+    }
+
+    return sync_after;
+}
+
+/*! @brief writes a record ending in a newline without the logger lock
+ * @details the file gets the record with a single write, which O_APPEND makes
+ * atomic with respect to other appenders for records below PIPE_BUF. the console
+ * is only written without the lock when it does not buffer
+ */
+static void write_record_direct(thread_logger *thl, const log_settings *settings,
+                                int file_descriptor, COLORS color, const char *record,
+                                size_t record_len) {
+
+    uint64_t start = thl->sink_latency != NULL ? histogram_now() : 0;
+
+    if (file_descriptor != 0 && fd_write_all(file_descriptor, record, record_len) != 0) {
+        printf("failed to write file log message\n");
+    }
+
+    if (settings->console_flush == CONSOLE_FLUSH_RECORD) {
+        console_sink_write(settings->console, color, record, record_len - 1);
+    } else {
+        log_lock_acquire(&thl->mutex);
+        console_sink_write(settings->console, color, record, record_len - 1);
+        log_lock_release(&thl->mutex);
+    }
+
+    if (thl->sink_latency != NULL) {
+        histogram_record(thl->sink_latency, histogram_now() - start);
+    }
+}
+
+/*! @brief log_queue_writer of thl->queue and thl->percpu, runs on the writer
+ * thread
+ */
+static void queue_write(void *ctx, int file_descriptor, int level,
+                        const char *record, size_t record_len) {
+
+    thread_logger *thl = ctx;
+
+    size_t counts[FILE_INDEX_LEVELS];
+    const size_t *batch_counts = NULL;
+    if (level >= LOG_BATCH_COUNTED) {
+        memcpy(counts, record, sizeof(counts));
+        record += sizeof(counts);
+        record_len -= sizeof(counts);
+        level -= LOG_BATCH_COUNTED;
+        batch_counts = counts;
+    }
+
+    log_buffer *symbolized = NULL;
+    if (level == LOG_LEVELS_ERROR && thl->backtraces != NULL) {
+        // resolving the frames takes the loader lock, better here than in the caller
+        symbolized = thread_log_buffer(LOG_BUFFER_SYMBOLIZED);
+        if (log_backtrace_symbolize(symbolized, record, record_len) == 0) {
+            record = symbolized->data;
+            record_len = symbolized->len;
+        }
+    }
+
+    rcu_read_lock();
+    const log_settings *settings = rcu_dereference(thl->settings);
+
+    log_lock_acquire(&thl->mutex);
+
+    bool sync_after =
+        write_record(thl, settings->console, file_descriptor, (LOG_LEVELS)level,
+                     record, record_len, batch_counts);
+
+    log_lock_release(&thl->mutex);
+    if (sync_after == true) {
+        sync_file(thl, file_descriptor);
+    }
+
+    rcu_read_unlock();
+    if (symbolized != NULL) {
+        log_buffer_release(symbolized);
+    }
+}
+
+/*! @brief appends the stack of the current error record to rendered, unless its
+ * call site used up its backtraces
+ * @details loggers without a writer thread also list the loaded modules after
+ * their first trace, so the raw addresses can be resolved offline
+ */
+static void append_backtrace(thread_logger *thl, log_buffer *rendered) {
+
+    const void *caller = error_caller;
+    error_caller = NULL;
+    if (thl->backtraces == NULL || caller == NULL ||
+        log_backtrace_admit(thl->backtraces, caller) == false) {
+        return;
+    }
+
+    void *frames[LOG_BACKTRACE_FRAMES];
+    size_t count = log_backtrace_capture(frames, LOG_BACKTRACE_FRAMES, caller);
+    size_t len = rendered->len;
+    if (log_backtrace_append(rendered, frames, count) != 0) {
+        rendered->len = len;
+        return;
+    }
+
+    if (thl->queue == NULL && thl->percpu == NULL &&
+        log_backtrace_first(thl->backtraces) == true) {
+        len = rendered->len;
+        if (log_backtrace_append_modules(rendered) != 0) {
+            rendered->len = len;
+        }
+    }
+}
+
+/*! @brief hands a rendered record to the queue, or writes it to the sinks when
+ * the logger has no queue, without the logger lock in direct append mode. the
+ * file part goes to the I/O service when the logger has one
+ */
+static void submit_record(thread_logger *thl, const log_settings *settings,
+                          int file_descriptor, LOG_LEVELS level, log_buffer *record) {
+
+    // child loggers write through the sinks of their root
+    thl = thl->root;
+
+    if (thl->queue != NULL) {
+        log_queue_push(thl->queue, file_descriptor, level, record->data, record->len);
+        return;
+    }
+    if (thl->percpu != NULL) {
+        log_percpu_push(thl->percpu, file_descriptor, level, record->data, record->len);
+        return;
+    }
+
+    if (thl->io_service != NULL && file_descriptor != 0) {
+        // only the console is left to the caller, a dropped record is counted by
+        // the service
+        log_io_service_write(thl->io_service, file_descriptor, level, record->data,
+                             record->len);
+        file_descriptor = 0;
+    }
+
+    if (thl->direct_append == true && record->len < LOG_DIRECT_APPEND_MAX &&
+        log_buffer_append(record, "\n", 1) == 0) {
+        write_record_direct(thl, settings, file_descriptor, level_colors[level],
+                            record->data, record->len);
+        return;
+    }
+
+    log_lock_acquire(&thl->mutex);
+
+    bool sync_after = write_record(thl, settings->console, file_descriptor, level,
+                                   record->data, record->len, NULL);
+
+    log_lock_release(&thl->mutex);
+    if (sync_after == true) {
+        sync_file(thl, file_descriptor);
+    }
+}
+
+/*! @brief renders the record with the logger layout and writes it to the sinks,
+ * shared by log_func and logf_func so a formatted log is only timed once
+ */
+static void dispatch_log(thread_logger *thl, const log_settings *settings,
+                         int file_descriptor, const char *message, size_t message_len,
+                         LOG_LEVELS level, const char *file, int line,
+                         LOG_SANITIZE sanitize);
+
+/*! @brief returns the buffer a record is rendered in: a slab of thl->pool
+ * stored in slab, the thread local buffer which when there is no pool or it fell
+ * back to the heap, NULL when the record is dropped
+ * @note a caller holds at most one slab, so RECORD_POOL_EXHAUSTED_BLOCK can not
+ * deadlock
+ */
+static log_buffer *acquire_buffer(thread_logger *thl, LOG_BUFFER which,
+                                  log_buffer *slab) {
+
+    if (thl->pool == NULL) {
+        return thread_log_buffer(which);
+    }
+
+    switch (record_pool_acquire(thl->pool, slab)) {
+        case RECORD_POOL_ACQUIRED:
+            return slab;
+        case RECORD_POOL_FALLBACK:
+            return thread_log_buffer(which);
+        default:
+            return NULL;
+    }
+}
+
+/*! @brief swaps slab, which is too small for the record, for the thread local
+ * buffer which, see record_pool_outgrown
+ * @return Success: the thread local buffer
+ * @return Failure: NULL pointer when the record is dropped
+ */
+static log_buffer *outgrow_buffer(thread_logger *thl, LOG_BUFFER which,
+                                  log_buffer *slab) {
+
+    if (record_pool_outgrown(thl->pool, slab) == RECORD_POOL_FALLBACK) {
+        return thread_log_buffer(which);
+    }
+
+    return NULL;
+}
+
+/*! @brief releases a buffer returned by acquire_buffer
+ */
+static void release_buffer(thread_logger *thl, log_buffer *buf) {
+
+    if (buf->fixed == true) {
+        record_pool_release(thl->pool, buf);
+    } else {
+        log_buffer_release(buf);
+    }
+}
+
+/*! @brief truncates messages longer than the max_message_size, then dispatches
+ * them. shared by log_func and logn_func
+ */
+static void dispatch_capped(thread_logger *thl, const log_settings *settings,
+                            int file_descriptor, const char *message,
+                            size_t message_len, LOG_LEVELS level, const char *file,
+                            int line, LOG_SANITIZE sanitize);
+
+/*! @brief returns message, or an escaped copy of it when mode is not
+ * LOG_SANITIZE_NONE and message needs escaping
+ * @details message_len is updated to the returned length. escaped is set to the
+ * buffer holding the copy, or NULL, and must be released by the caller
+ */
+static const char *sanitize_message(LOG_SANITIZE mode, const char *message,
+                                    size_t *message_len, log_buffer **escaped) {
+
+    *escaped = NULL;
+
+    // a single vectorized pass for the common, clean, message
+    size_t clean = sanitize_scan(message, *message_len, mode);
+    if (clean == *message_len) {
+        return message;
+    }
+
+    log_buffer *buf = thread_log_buffer(LOG_BUFFER_SANITIZED);
+    *escaped = buf;
+    if (log_buffer_append(buf, message, clean) != 0 ||
+        sanitize_append(buf, message + clean, *message_len - clean, mode) != 0) {
+        // better to drop the escaping than the record
+        return message;
+    }
+
+    *message_len = buf->len;
+    return buf->data;
+}
+
+/*! @brief returns whether records of level are emitted by the logger
+ * @details front ends call this before formatting so disabled records cost
+ * nothing but the check
+ */
+bool log_level_enabled(const thread_logger *thl, LOG_LEVELS level) {
+    return (__atomic_load_n(&thl->enabled_levels, __ATOMIC_RELAXED) >> level & 1) != 0;
+}
+
+/*! @brief returns the severity of level, which grows from debug to info, warn
+ * and error
+ */
+int log_level_severity(LOG_LEVELS level) {
+    return level_severity[level];
+}
+
+/*! @brief recomputes the cached levels of thl and its descendants, called with
+ * hierarchy_mutex held
+ * @param inherited the level of the parent of thl
+ */
+static void propagate_level(thread_logger *thl, LOG_LEVELS inherited) {
+
+    if (thl->level_set == false) {
+        thl->level = inherited;
+    }
+
+    unsigned int enabled = 0;
+    for (int level = LOG_LEVELS_INFO; level <= LOG_LEVELS_DEBUG; level++) {
+        if (level_severity[level] >= level_severity[thl->level]) {
+            enabled |= 1u << level;
+        }
+    }
+    __atomic_store_n(&thl->enabled_levels, enabled, __ATOMIC_RELAXED);
+    __atomic_store_n(&thl->debug, (enabled >> LOG_LEVELS_DEBUG & 1) != 0,
+                     __ATOMIC_RELAXED);
+
+    for (thread_logger *child = thl->children; child != NULL;
+         child = child->next_sibling) {
+        propagate_level(child, thl->level);
+    }
+}
+
+/*! @brief sets the least severe level logged by thl and every descendant that
+ * inherits its level, severity grows from debug to info, warn and error
+ */
+void set_thread_logger_level(thread_logger *thl, LOG_LEVELS level) {
+
+    pthread_mutex_lock(&hierarchy_mutex);
+    thl->level = level;
+    thl->level_set = true;
+    propagate_level(thl, level);
+    pthread_mutex_unlock(&hierarchy_mutex);
+}
+
+/*! @brief makes a child logger inherit the level of its parent again, ignored for
+ * roots
+ */
+void inherit_thread_logger_level(thread_logger *thl) {
+
+    if (thl->parent == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&hierarchy_mutex);
+    thl->level_set = false;
+    propagate_level(thl, thl->parent->level);
+    pthread_mutex_unlock(&hierarchy_mutex);
+}
+
+/*! @brief returns whether the last dotted segment of name is segment
+ */
+static bool leaf_matches(const char *name, const char *segment, size_t segment_len) {
+
+    const char *dot = strrchr(name, '.');
+    const char *leaf = dot != NULL ? dot + 1 : name;
+
+    return strlen(leaf) == segment_len && memcmp(leaf, segment, segment_len) == 0;
+}
+
+/*! @brief returns the root of the logger whose mutex is mx
+ */
+static thread_logger *mutex_root(log_lock *mx) {
+    return ((thread_logger *)((char *)mx - offsetof(thread_logger, mutex)))->root;
+}
+
+/*! @brief lock of children, `child->lock(&child->mutex)` takes the mutex of the
+ * root, which guards the sinks every child writes through
+ */
+static int child_lock_fn(log_lock *mx) {
+    return log_lock_acquire_fn(&mutex_root(mx)->mutex);
+}
+
+/*! @brief releases the mutex taken by child_lock_fn
+ */
+static int child_unlock_fn(log_lock *mx) {
+    return log_lock_release_fn(&mutex_root(mx)->mutex);
+}
+
+/*! @brief returns the child of parent called segment, creating it when missing.
+ * called with hierarchy_mutex held
+ */
+static thread_logger *child_logger(thread_logger *parent, const char *segment,
+                                   size_t segment_len) {
+
+    for (thread_logger *child = parent->children; child != NULL;
+         child = child->next_sibling) {
+        if (leaf_matches(child->name, segment, segment_len)) {
+            return child;
+        }
+    }
+
+    size_t prefix_len = parent->name != NULL ? strlen(parent->name) + 1 : 0;
+    char *name = malloc(prefix_len + segment_len + 1);
+    thread_logger *child = malloc(sizeof(thread_logger));
+    if (name == NULL || child == NULL) {
+        free(name);
+        free(child);
+        printf("failed to malloc child thread_logger\n");
+        return NULL;
+    }
+    if (prefix_len != 0) {
+        memcpy(name, parent->name, prefix_len - 1);
+        name[prefix_len - 1] = '.';
+    }
+    memcpy(name + prefix_len, segment, segment_len);
+    name[prefix_len + segment_len] = '\0';
+
+    log_settings *settings = rename_log_settings(parent->settings, name);
+    if (settings == NULL) {
+        free(name);
+        free(child);
+        return NULL;
+    }
+
+    // settings and shared sinks are copied from the parent
+    *child = *parent;
+    log_lock_init(&child->mutex, parent->mutex.strategy);
+    child->lock = child_lock_fn;
+    child->unlock = child_unlock_fn;
+    child->call_latency = NULL;
+    child->sink_latency = NULL;
+    child->settings = settings;
+    child->name = name;
+    child->level_set = false;
+    child->parent = parent;
+    child->children = NULL;
+    child->file = NULL;
+    child->next_sibling = parent->children;
+    propagate_level(child, parent->level);
+    parent->children = child;
+
+    return child;
+}
+
+/*! @brief returns the child logger of parent called name, creating it and any
+ * missing intermediate logger on first use
+ * @details name is a dotted path relative to parent, so `"net.http"` is the child
+ * `"http"` of the child `"net"`. children share every sink, the mutex, queue and
+ * pool of their root, render their full dotted name for `%n` and inherit the level
+ * of their parent until one is set. `child->lock(&child->mutex)` takes the mutex
+ * of the root. they are freed with their root
+ * @return Success: pointer to the child
+ * @return Failure: NULL pointer
+ */
+thread_logger *get_child_logger(thread_logger *parent, const char *name) {
+
+    thread_logger *thl = parent;
+
+    pthread_mutex_lock(&hierarchy_mutex);
+    while (thl != NULL && *name != '\0') {
+        const char *dot = strchr(name, '.');
+        size_t segment_len = dot != NULL ? (size_t)(dot - name) : strlen(name);
+        if (segment_len != 0) {
+            thl = child_logger(thl, name, segment_len);
+        }
+        name += segment_len + (dot != NULL);
+    }
+    pthread_mutex_unlock(&hierarchy_mutex);
 
     return thl;
 }
 
+/*! @brief like get_child_logger, with records also written to the file of parent
+ * @details the returned file_logger shares the descriptor of parent and is freed
+ * with its root
+ */
+file_logger *get_child_file_logger(file_logger *parent, const char *name) {
+
+    thread_logger *thl = get_child_logger(parent->thl, name);
+    if (thl == NULL || thl == parent->thl) {
+        return thl == NULL ? NULL : parent;
+    }
+
+    pthread_mutex_lock(&hierarchy_mutex);
+    if (thl->file == NULL) {
+        thl->file = malloc(sizeof(file_logger));
+        if (thl->file != NULL) {
+            thl->file->fd = parent->fd;
+            thl->file->thl = thl;
+            thl->file->owns_logger = false;
+        } else {
+            printf("failed to malloc child file_logger\n");
+        }
+    }
+    pthread_mutex_unlock(&hierarchy_mutex);
+
+    return thl->file;
+}
+
+/*! @brief frees settings and its layout, and its console when owned is true
+ */
+static void clear_log_settings(log_settings *settings, bool owned) {
+
+    clear_log_layout(settings->layout);
+    if (owned == true) {
+        clear_console_sink(settings->console);
+    }
+    free(settings);
+}
+
+/*! @brief frees the descendants of thl
+ */
+static void clear_children(thread_logger *thl) {
+
+    thread_logger *child = thl->children;
+    while (child != NULL) {
+        thread_logger *next = child->next_sibling;
+        clear_children(child);
+        clear_log_settings(child->settings, false);
+        log_lock_destroy(&child->mutex);
+        free(child->name);
+        free(child->file);
+        free(child);
+        child = next;
+    }
+}
+
+/*! @brief returns the number of loggers in the tree below and including thl
+ */
+static size_t count_loggers(const thread_logger *thl) {
+
+    size_t count = 1;
+    for (const thread_logger *child = thl->children; child != NULL;
+         child = child->next_sibling) {
+        count += count_loggers(child);
+    }
+
+    return count;
+}
+
+/*! @brief stores thl and its descendants in loggers, parents before children
+ * @return the number of loggers stored
+ */
+static size_t collect_loggers(thread_logger *thl, thread_logger **loggers) {
+
+    size_t count = 0;
+    loggers[count++] = thl;
+    for (thread_logger *child = thl->children; child != NULL;
+         child = child->next_sibling) {
+        count += collect_loggers(child, loggers + count);
+    }
+
+    return count;
+}
+
+/*! @brief replaces the layout, console and message limits of a root logger and
+ * its children while other threads keep logging
+ * @param thl a root logger
+ * @param config the fields layout, name, console_*, max_message_size,
+ * hexdump_max_bytes and sanitize are applied, everything else is ignored
+ * @return Success: 0
+ * @return Failure: -1, the old settings stay in place
+ */
+int reconfigure_thread_logger(thread_logger *thl, const thread_logger_config *config) {
+
+    if (thl->root != thl) {
+        printf("only root loggers can be reconfigured\n");
+        return -1;
+    }
+
+    pthread_mutex_lock(&hierarchy_mutex);
+
+    size_t count = count_loggers(thl);
+    thread_logger **loggers = malloc(sizeof(thread_logger *) * count);
+    log_settings **previous = malloc(sizeof(log_settings *) * count);
+    if (loggers == NULL || previous == NULL) {
+        pthread_mutex_unlock(&hierarchy_mutex);
+        free(loggers);
+        free(previous);
+        printf("failed to malloc reconfigure state\n");
+        return -1;
+    }
+    collect_loggers(thl, loggers);
+
+    // build everything first so a failure leaves the old settings untouched
+    log_settings *root = new_log_settings(thl, config, config->name, thl->settings);
+    size_t built = 0;
+    if (root != NULL) {
+        previous[built++] = root;
+        for (; built < count; built++) {
+            previous[built] = rename_log_settings(root, loggers[built]->name);
+            if (previous[built] == NULL) {
+                break;
+            }
+        }
+    }
+    if (built != count) {
+        while (built > 1) {
+            clear_log_settings(previous[--built], false);
+        }
+        if (root != NULL) {
+            clear_log_settings(root, root->console != thl->settings->console);
+        }
+        pthread_mutex_unlock(&hierarchy_mutex);
+        free(loggers);
+        free(previous);
+        return -1;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        log_settings *old = loggers[i]->settings;
+        rcu_assign_pointer(loggers[i]->settings, previous[i]);
+        previous[i] = old;
+    }
+
+    // root may already be replaced by a concurrent call once unlocked
+    const console_sink *console = root->console;
+    pthread_mutex_unlock(&hierarchy_mutex);
+
+    // log calls that loaded the old settings before they were replaced are done
+    // with them once this returns
+    synchronize_rcu();
+
+    // children only borrow the console of the root
+    clear_log_settings(previous[0], previous[0]->console != console);
+    for (size_t i = 1; i < count; i++) {
+        clear_log_settings(previous[i], false);
+    }
+
+    free(loggers);
+    free(previous);
+
+    return 0;
+}
+
 /*! @brief returns a new file_logger
  * Calls new_thread_logger internally
  * @param output_file the file we will dump logs to. created if not exists and is
@@ -69,35 +1027,150 @@ thread_logger *new_thread_logger(bool with_debug) {
  */
 file_logger *new_file_logger(char *output_file, bool with_debug) {
 
-    thread_logger *thl = new_thread_logger(with_debug);
+    thread_logger_config config = {.debug = with_debug};
+
+    return new_file_logger_config(output_file, &config);
+}
+
+/*! @brief returns a new file_logger configured by config
+ * @param output_file the file we will dump logs to. created if not exists and is
+ * appended to
+ * @param config the configuration of the underlying thread_logger
+ * @return Success: pointer to the file logger
+ * @return Failure: NULL pointer
+ */
+file_logger *new_file_logger_config(const char *output_file,
+                                    const thread_logger_config *config) {
+
+    thread_logger *thl = new_thread_logger_config(config);
     if (thl == NULL) {
-        // dont printf log here since new_thread_logger handles that
+        // dont printf log here since new_thread_logger_config handles that
         return NULL;
     }
 
     file_logger *fhl = malloc(sizeof(file_logger));
     if (fhl == NULL) {
-        // free thl as it is not null
-        free(thl);
+        clear_thread_logger(thl);
         printf("failed to malloc file_logger\n");
         return NULL;
     }
 
     // append to file, create if not exist, sync write files
     // TODO(bonedaddy): try to use O_DSYNC for data integrity sync
+    // buffered, compressed and direct files are synced by severe records
+    // instead, shared ones by the drainer once per batch
+    bool shared = config->shm_name != NULL && thl->io_service == NULL;
+    bool compressed =
+        config->file_compress == true && shared == false && thl->io_service == NULL;
+    bool direct = config->file_sync == FILE_SYNC_DIRECT && shared == false &&
+                  compressed == false && thl->io_service == NULL;
+    int flags =
+        thl->file_buffer != NULL || compressed == true || shared == true ? 0 : O_SYNC;
     int file_descriptor =
-        open(output_file, O_WRONLY | O_CREAT | O_SYNC | O_APPEND, 0640);
+        direct == true ? direct_sink_open(output_file)
+                       : open(output_file, O_WRONLY | O_CREAT | O_APPEND | flags, 0640);
     if (file_descriptor <= 0) {
-        // free thl as it is not null
-        free(thl);
+        clear_thread_logger(thl);
         // free fhl as it is not null
         free(fhl);
         printf("failed to run posix open function\n");
         return NULL;
     }
 
+    if (compressed == true) {
+        thl->compressor = new_log_compress(file_descriptor, config->compress_block_size,
+                                           config->compress_level);
+        if (thl->compressor == NULL) {
+            close(file_descriptor);
+            clear_thread_logger(thl);
+            free(fhl);
+            return NULL;
+        }
+        // the current block is shared by every caller, so writes need the lock
+        thl->direct_append = false;
+    }
+
+    if (shared == true) {
+        thl->shm = new_log_shm(config->shm_name, config->shm_size, config->queue_overflow,
+                               file_descriptor, config->shm_drain);
+        if (thl->shm == NULL) {
+            close(file_descriptor);
+            clear_thread_logger(thl);
+            free(fhl);
+            return NULL;
+        }
+        // only the drainer writes the file
+        thl->direct_append = false;
+    }
+
+    if (direct == true) {
+        thl->direct = new_direct_sink(file_descriptor, config->file_buffer_size);
+        if (thl->direct == NULL) {
+            close(file_descriptor);
+            clear_thread_logger(thl);
+            free(fhl);
+            return NULL;
+        }
+        // the current buffer is shared by every caller, so writes need the lock
+        thl->direct_append = false;
+    }
+
+    if (config->index_file == true && shared == false && compressed == false &&
+        thl->io_service == NULL) {
+        size_t path_len = strlen(output_file);
+        char *index_path = malloc(path_len + sizeof(FILE_INDEX_SUFFIX));
+        if (index_path != NULL) {
+            memcpy(index_path, output_file, path_len);
+            memcpy(index_path + path_len, FILE_INDEX_SUFFIX, sizeof(FILE_INDEX_SUFFIX));
+            thl->index = new_file_index(index_path, file_descriptor,
+                                        config->index_block_size, config->index_interval);
+            free(index_path);
+        }
+        if (thl->index == NULL) {
+            close(file_descriptor);
+            clear_thread_logger(thl);
+            free(fhl);
+            return NULL;
+        }
+        // offsets are only known to writers holding the lock
+        thl->direct_append = false;
+    }
+
+    fhl->fd = file_descriptor;
+    fhl->thl = thl;
+    fhl->owns_logger = true;
+
+    return fhl;
+}
+
+/*! @brief returns a new file_logger writing to output_file through thl
+ * @details many files can share one logger, and with it one lock, console and
+ * I/O service. clearing the file logger closes the file once the records queued
+ * for it were written, and leaves thl alone
+ * @param output_file the file we will dump logs to. created if not exists and is
+ * appended to
+ * @return Success: pointer to the file logger
+ * @return Failure: NULL pointer
+ */
+file_logger *open_file_logger(thread_logger *thl, const char *output_file) {
+
+    file_logger *fhl = malloc(sizeof(file_logger));
+    if (fhl == NULL) {
+        printf("failed to malloc file_logger\n");
+        return NULL;
+    }
+
+    // O_SYNC is left out, the service batches writes to amortize them instead
+    int file_descriptor = open(output_file, O_WRONLY | O_CREAT | O_APPEND, 0640);
+    if (file_descriptor <= 0) {
+        free(fhl);
+        printf("failed to run posix open function\n");
+        return NULL;
+    }
+
     fhl->fd = file_descriptor;
     fhl->thl = thl;
+    fhl->owns_logger = false;
 
     return fhl;
 }
@@ -111,21 +1184,11 @@ file_logger *new_file_logger(char *output_file, bool with_debug) {
  */
 int write_file_log(int file_descriptor, char *message) {
 
-    char msg[strlen(message) + 2]; // 2 for \n
-    memset(msg, 0, sizeof(msg));
+    struct iovec iov[2] = {{message, strlen(message)}, {"\n", 1}};
 
-    strcat(msg, message);
-    strcat(msg, "\n");
-
-    int response = write(file_descriptor, msg, strlen(msg));
+    int response = fd_writev_all(file_descriptor, iov, 2);
     if (response == -1) {
         printf("failed to write file log message");
-    } else {
-        // this branch will be triggered if write doesnt fail
-        // so overwrite the response to 0 as we want to return 0 to indicate
-        // no error was received, and returning response directly would return the
-        // number of bytes written
-        response = 0;
     }
 
     return response;
@@ -142,19 +1205,37 @@ int write_file_log(int file_descriptor, char *message) {
 void logf_func(thread_logger *thl, int file_descriptor, LOG_LEVELS level, char *file,
                int line, char *message, ...) {
 
-    va_list args;
-    va_start(args, message);
-    char msg[sizeof(args) + (strlen(message) * 2)];
-    memset(msg, 0, sizeof(msg));
-
-    int response = vsnprintf(msg, sizeof(msg), message, args);
-    if (response < 0) {
-        free(msg);
-        printf("failed to vsprintf\n");
-        return;
+    // children are measured by the histograms of their root
+    latency_histogram *call_latency = thl->root->call_latency;
+    uint64_t start = call_latency != NULL ? histogram_now() : 0;
+
+    if (level == LOG_LEVELS_ERROR) {
+        error_caller = __builtin_return_address(0);
+    }
+    if (log_level_enabled(thl, level) == true) {
+        rcu_read_lock();
+        const log_settings *settings = rcu_dereference(thl->settings);
+        log_buffer *msg = thread_log_buffer(LOG_BUFFER_MESSAGE);
+
+        va_list args;
+        va_start(args, message);
+        int response = fmt_vformat(msg, settings->max_message_size, message, args);
+        va_end(args);
+
+        if (response == 0) {
+            dispatch_log(thl, settings, file_descriptor, msg->data, msg->len, level,
+                         file, line, settings->sanitize);
+        } else {
+            printf("failed to vsnprintf\n");
+        }
+
+        log_buffer_release(msg);
+        rcu_read_unlock();
     }
 
-    log_func(thl, file_descriptor, msg, level, file, line);
+    if (call_latency != NULL) {
+        histogram_record(call_latency, histogram_now() - start);
+    }
 }
 
 /*! @brief main function you should call, which will delegate to the appopriate *_log
@@ -168,40 +1249,234 @@ void logf_func(thread_logger *thl, int file_descriptor, LOG_LEVELS level, char *
 void log_func(thread_logger *thl, int file_descriptor, char *message,
               LOG_LEVELS level, char *file, int line) {
 
-    char time_str[76];
-    memset(time_str, 0, sizeof(time_str));
+    // children are measured by the histograms of their root
+    latency_histogram *call_latency = thl->root->call_latency;
+    uint64_t start = call_latency != NULL ? histogram_now() : 0;
+
+    if (level == LOG_LEVELS_ERROR) {
+        error_caller = __builtin_return_address(0);
+    }
+    if (log_level_enabled(thl, level) == true) {
+        rcu_read_lock();
+        const log_settings *settings = rcu_dereference(thl->settings);
+        dispatch_capped(thl, settings, file_descriptor, message, strlen(message),
+                        level, file, line, settings->sanitize);
+        rcu_read_unlock();
+    }
+
+    if (call_latency != NULL) {
+        histogram_record(call_latency, histogram_now() - start);
+    }
+}
+
+/*! @brief like log_func but takes the length of the message
+ * @details used by front ends that format messages themselves, such as ulog.hpp
+ * @param thl pointer to an instance of thread_logger
+ * @param file_descriptor file descriptor to write log messages to, if 0 then only
+ * stdout is used
+ * @param message the message, not required to be null terminated
+ * @param message_len length of message
+ * @param level the log level to use (effects color used)
+ */
+void logn_func(thread_logger *thl, int file_descriptor, const char *message,
+               size_t message_len, LOG_LEVELS level, const char *file, int line) {
+
+    // children are measured by the histograms of their root
+    latency_histogram *call_latency = thl->root->call_latency;
+    uint64_t start = call_latency != NULL ? histogram_now() : 0;
+
+    if (level == LOG_LEVELS_ERROR) {
+        error_caller = __builtin_return_address(0);
+    }
+    if (log_level_enabled(thl, level) == true) {
+        rcu_read_lock();
+        const log_settings *settings = rcu_dereference(thl->settings);
+        dispatch_capped(thl, settings, file_descriptor, message, message_len, level,
+                        file, line, settings->sanitize);
+        rcu_read_unlock();
+    }
+
+    if (call_latency != NULL) {
+        histogram_record(call_latency, histogram_now() - start);
+    }
+}
+
+/*! @brief like logn_func for messages rendered by the library itself, which are
+ * written without sanitizing
+ * @details used by log_hexdump, whose dump lines are separated by newlines. a
+ * caller supplied part of message must be escaped by the caller
+ */
+void logn_func_raw(thread_logger *thl, int file_descriptor, const char *message,
+                   size_t message_len, LOG_LEVELS level, const char *file,
+                   int line) {
+
+    // children are measured by the histograms of their root
+    latency_histogram *call_latency = thl->root->call_latency;
+    uint64_t start = call_latency != NULL ? histogram_now() : 0;
+
+    if (level == LOG_LEVELS_ERROR) {
+        error_caller = __builtin_return_address(0);
+    }
+    if (log_level_enabled(thl, level) == true) {
+        rcu_read_lock();
+        dispatch_capped(thl, rcu_dereference(thl->settings), file_descriptor, message,
+                        message_len, level, file, line, LOG_SANITIZE_NONE);
+        rcu_read_unlock();
+    }
+
+    if (call_latency != NULL) {
+        histogram_record(call_latency, histogram_now() - start);
+    }
+}
+
+static void dispatch_capped(thread_logger *thl, const log_settings *settings,
+                            int file_descriptor, const char *message,
+                            size_t message_len, LOG_LEVELS level, const char *file,
+                            int line, LOG_SANITIZE sanitize) {
 
-    get_time_string(time_str, 76);
+    if (message_len <= settings->max_message_size) {
+        dispatch_log(thl, settings, file_descriptor, message, message_len, level, file,
+                     line, sanitize);
+        return;
+    }
+
+    log_buffer *msg = thread_log_buffer(LOG_BUFFER_MESSAGE);
+    if (log_buffer_append_capped(msg, message, message_len,
+                                 settings->max_message_size) == 0) {
+        dispatch_log(thl, settings, file_descriptor, msg->data, msg->len, level, file,
+                     line, sanitize);
+    }
+    log_buffer_release(msg);
+}
 
-    char location_info[strlen(file) + sizeof(line) + 4];
-    memset(location_info, 0, sizeof(location_info));
+static void dispatch_log(thread_logger *thl, const log_settings *settings,
+                         int file_descriptor, const char *message, size_t message_len,
+                         LOG_LEVELS level, const char *file, int line,
+                         LOG_SANITIZE sanitize) {
+
+    log_buffer *escaped;
+    message = sanitize_message(sanitize, message, &message_len, &escaped);
+
+    log_record record = {
+        .level = level,
+        .file = file,
+        .file_len = strlen(file),
+        .line = line,
+        .message = message,
+        .message_len = message_len,
+    };
+    record.context = log_context_get(&record.context_len);
+
+    log_buffer slab;
+    log_buffer *rendered = acquire_buffer(thl, LOG_BUFFER_RECORD, &slab);
+    size_t needed = layout_max_size(settings->layout, &record);
+    if (rendered != NULL && rendered->fixed == true && needed > rendered->cap) {
+        // long file names or escaping outgrew the slab, cut the message to fit
+        size_t excess = needed - rendered->cap;
+        record.message_len = record.message_len > excess ? record.message_len - excess : 0;
+        needed = layout_max_size(settings->layout, &record);
+        if (needed > rendered->cap) {
+            // the rest of the record alone outgrew it
+            record.message_len = message_len;
+            needed = layout_max_size(settings->layout, &record);
+            rendered = outgrow_buffer(thl, LOG_BUFFER_RECORD, rendered);
+        }
+    }
+    if (rendered == NULL || log_buffer_reserve(rendered, needed) != 0) {
+        if (rendered != NULL) {
+            release_buffer(thl, rendered);
+        }
+        if (escaped != NULL) {
+            log_buffer_release(escaped);
+        }
+        return;
+    }
+    rendered->len = layout_render(settings->layout, &record, rendered->data);
+    if (level == LOG_LEVELS_ERROR) {
+        append_backtrace(thl->root, rendered);
+    }
+
+    submit_record(thl, settings, file_descriptor, level, rendered);
+
+    release_buffer(thl, rendered);
+    if (escaped != NULL) {
+        log_buffer_release(escaped);
+    }
+}
+
+/*! @brief prefixes message with `[<level> - ` and writes it to the sinks
+ * @details implements the *_log functions, which take an already formatted message
+ * and so bypass the logger layout
+ */
+static void level_log(thread_logger *thl, int file_descriptor, LOG_LEVELS level,
+                      char *message) {
 
-    sprintf(location_info, " %s:%i", file, line);
+    if (log_level_enabled(thl, level) == false) {
+        return;
+    }
 
-    char
-        date_msg[strlen(time_str) + strlen(message) + 2 + sizeof(location_info) + 6];
-    memset(date_msg, 0, sizeof(date_msg));
+    rcu_read_lock();
+    const log_settings *settings = rcu_dereference(thl->settings);
+    const char *name = log_level_name(level);
+    log_buffer slab;
+    log_buffer *rendered = acquire_buffer(thl, LOG_BUFFER_RECORD, &slab);
+    if (rendered == NULL) {
+        rcu_read_unlock();
+        return;
+    }
 
-    strcat(date_msg, time_str);
-    strcat(date_msg, " -");
-    strcat(date_msg, location_info);
-    strcat(date_msg, "] ");
-    strcat(date_msg, message);
+    // room for the marker is kept inside the cap, as log_buffer_append_capped
+    // does, and the cut does not split a character
+    size_t message_len = strlen(message);
+    size_t max_len = settings->max_message_size;
+    size_t marker_len = 0;
+    size_t body_len = message_len;
+    if (message_len > max_len) {
+        marker_len = sizeof(LOG_TRUNCATION_MARKER) - 1;
+        marker_len = marker_len < max_len ? marker_len : max_len;
+        body_len = log_utf8_cut(message, max_len - marker_len);
+    }
+    log_buffer *escaped;
+    const char *body =
+        sanitize_message(settings->sanitize, message, &body_len, &escaped);
+    size_t context_len;
+    const char *context = log_context_get(&context_len);
+    size_t needed = strlen(name) + 4 + body_len + marker_len +
+                    (context_len > 0 ? context_len + 1 : 0);
+    if (rendered->fixed == true && needed > rendered->cap) {
+        rendered = outgrow_buffer(thl, LOG_BUFFER_RECORD, rendered);
+        if (rendered == NULL) {
+            if (escaped != NULL) {
+                log_buffer_release(escaped);
+            }
+            rcu_read_unlock();
+            return;
+        }
+    }
 
-    switch (level) {
-        case LOG_LEVELS_INFO:
-            info_log(thl, file_descriptor, date_msg);
-            break;
-        case LOG_LEVELS_WARN:
-            warn_log(thl, file_descriptor, date_msg);
-            break;
-        case LOG_LEVELS_ERROR:
-            error_log(thl, file_descriptor, date_msg);
-            break;
-        case LOG_LEVELS_DEBUG:
-            debug_log(thl, file_descriptor, date_msg);
-            break;
+    // the escaped copy may be longer than the cap, all of it is kept
+    int response = log_buffer_append(rendered, "[", 1) != 0 ||
+                   log_buffer_append(rendered, name, strlen(name)) != 0 ||
+                   log_buffer_append(rendered, " - ", 3) != 0 ||
+                   log_buffer_append(rendered, body, body_len) != 0 ||
+                   log_buffer_append(rendered, LOG_TRUNCATION_MARKER,
+                                     marker_len) != 0;
+    if (escaped != NULL) {
+        log_buffer_release(escaped);
+    }
+    if (response == 0 && context_len > 0) {
+        response = log_buffer_append(rendered, " ", 1) != 0 ||
+                   log_buffer_append(rendered, context, context_len) != 0;
+    }
+    if (response == 0 && level == LOG_LEVELS_ERROR) {
+        append_backtrace(thl->root, rendered);
     }
+    if (response == 0) {
+        submit_record(thl, settings, file_descriptor, level, rendered);
+    }
+
+    release_buffer(thl, rendered);
+    rcu_read_unlock();
 }
 
 /*! @brief logs an info styled message - called by log_fn
@@ -212,128 +1487,411 @@ void log_func(thread_logger *thl, int file_descriptor, char *message,
  */
 void info_log(thread_logger *thl, int file_descriptor, char *message) {
 
-    // 2, 1 for null terminator and 1 for space after ]
-    size_t msg_size = strlen(message) + strlen("[info - ") + 2;
-    char msg[msg_size];
-    memset(msg, 0, sizeof(msg));
-
-    thl->lock(&thl->mutex);
+    level_log(thl, file_descriptor, LOG_LEVELS_INFO, message);
+}
 
-    strcat(msg, "[info - ");
-    strcat(msg, message);
+/*! @brief logs a warned styled message - called by log_fn
+ * @param thl pointer to an instance of thread_logger
+ * @param file_descriptor file descriptor to write log messages to in addition to
+ * stdout logging. if 0 only stdout is used
+ * @param message the actuall message to log
+ */
+void warn_log(thread_logger *thl, int file_descriptor, char *message) {
 
-    if (file_descriptor != 0) {
-        write_file_log(file_descriptor, msg);
-    }
+    level_log(thl, file_descriptor, LOG_LEVELS_WARN, message);
+}
 
-    print_colored(COLORS_GREEN, msg);
+/*! @brief logs an error styled message - called by log_fn
+ * @param thl pointer to an instance of thread_logger
+ * @param file_descriptor file descriptor to write log messages to in addition to
+ * stdout logging. if 0 only stdout is used
+ * @param message the actuall message to log
+ */
+void error_log(thread_logger *thl, int file_descriptor, char *message) {
 
-    thl->unlock(&thl->mutex);
+    error_caller = __builtin_return_address(0);
+    level_log(thl, file_descriptor, LOG_LEVELS_ERROR, message);
 }
 
-/*! @brief logs a warned styled message - called by log_fn
+/*! @brief logs a debug styled message - called by log_fn
  * @param thl pointer to an instance of thread_logger
  * @param file_descriptor file descriptor to write log messages to in addition to
  * stdout logging. if 0 only stdout is used
  * @param message the actuall message to log
  */
-void warn_log(thread_logger *thl, int file_descriptor, char *message) {
+void debug_log(thread_logger *thl, int file_descriptor, char *message) {
 
-    // 2, 1 for null terminator and 1 for space after ]
-    size_t msg_size = strlen(message) + strlen("[warn - ") + 2;
-    char msg[msg_size];
-    memset(msg, 0, sizeof(msg));
+    level_log(thl, file_descriptor, LOG_LEVELS_DEBUG, message);
+}
 
-    thl->lock(&thl->mutex);
+/*! @brief set while the calling thread has an open log_batch */
+static _Thread_local bool batch_open = false;
 
-    strcat(msg, "[warn - ");
-    strcat(msg, message);
+/*! @brief opens a batch of records for thl, written to file_descriptor and the
+ * console when committed
+ * @param file_descriptor file the records are written to, 0 for the console only
+ * @return Success: 0
+ * @return Failure: -1 when the calling thread already has an open batch, or
+ * out of memory
+ */
+int log_batch_begin(log_batch *batch, thread_logger *thl, int file_descriptor) {
 
-    if (file_descriptor != 0) {
-        write_file_log(file_descriptor, msg);
+    if (batch_open == true) {
+        printf("a log batch is already open on this thread\n");
+        return -1;
+    }
+    batch_open = true;
+
+    *batch = (log_batch){
+        .thl = thl,
+        .file_descriptor = file_descriptor,
+        .time = time(NULL),
+        .text = thread_log_buffer(LOG_BUFFER_BATCH),
+        .lines = thread_log_buffer(LOG_BUFFER_BATCH_LINES),
+        .count = 0,
+        .level = LOG_LEVELS_DEBUG,
+    };
+
+    if ((thl->root->queue != NULL || thl->root->percpu != NULL) &&
+        log_buffer_append(batch->text, (const char *)batch->level_counts,
+                          sizeof(batch->level_counts)) != 0) {
+        // room for the counts the writer gets in front of the records
+        log_buffer_release(batch->text);
+        log_buffer_release(batch->lines);
+        batch_open = false;
+        return -1;
     }
 
-    print_colored(COLORS_YELLOW, msg);
+    return 0;
+}
 
-    thl->unlock(&thl->mutex);
+/*! @brief renders a message already cut at max_message_size into batch
+ */
+static int batch_render(log_batch *batch, const log_settings *settings,
+                        LOG_LEVELS level, const char *message, size_t message_len,
+                        const char *file, int line) {
+
+    log_buffer *escaped;
+    message = sanitize_message(settings->sanitize, message, &message_len, &escaped);
+
+    log_record record = {
+        .level = level,
+        .file = file,
+        .file_len = strlen(file),
+        .line = line,
+        .message = message,
+        .message_len = message_len,
+        .time = batch->time,
+    };
+    record.context = log_context_get(&record.context_len);
+
+    log_buffer *text = batch->text;
+    int response = log_buffer_reserve(text, layout_max_size(settings->layout, &record) + 1);
+    if (response == 0) {
+        console_line rendered = {
+            .len = layout_render(settings->layout, &record, text->data + text->len),
+            .color = level_colors[level],
+        };
+        response = log_buffer_append(batch->lines, (const char *)&rendered,
+                                     sizeof(rendered));
+        if (response == 0) {
+            text->data[text->len + rendered.len] = '\n';
+            text->len += rendered.len + 1;
+            batch->count++;
+            batch->level_counts[level]++;
+            if (level_severity[level] > level_severity[batch->level]) {
+                batch->level = level;
+            }
+        }
+    }
+
+    if (escaped != NULL) {
+        log_buffer_release(escaped);
+    }
+
+    return response;
 }
 
-/*! @brief logs an error styled message - called by log_fn
- * @param thl pointer to an instance of thread_logger
- * @param file_descriptor file descriptor to write log messages to in addition to
- * stdout logging. if 0 only stdout is used
- * @param message the actuall message to log
+/*! @brief renders message with the logger layout and adds it to batch, records
+ * below the logger level are skipped
+ * @return Success: 0
+ * @return Failure: -1
  */
-void error_log(thread_logger *thl, int file_descriptor, char *message) {
+int log_batch_append(log_batch *batch, LOG_LEVELS level, const char *message,
+                     const char *file, int line) {
+
+    if (log_level_enabled(batch->thl, level) == false) {
+        return 0;
+    }
+
+    rcu_read_lock();
+    const log_settings *settings = rcu_dereference(batch->thl->settings);
+
+    int response;
+    size_t message_len = strlen(message);
+    if (message_len <= settings->max_message_size) {
+        response = batch_render(batch, settings, level, message, message_len, file, line);
+    } else {
+        log_buffer *msg = thread_log_buffer(LOG_BUFFER_MESSAGE);
+        response = log_buffer_append_capped(msg, message, message_len,
+                                            settings->max_message_size);
+        if (response == 0) {
+            response = batch_render(batch, settings, level, msg->data, msg->len, file,
+                                    line);
+        }
+        log_buffer_release(msg);
+    }
+
+    rcu_read_unlock();
+
+    return response;
+}
+
+/*! @brief like log_batch_append with a printf style message
+ */
+int log_batch_appendf(log_batch *batch, LOG_LEVELS level, const char *file, int line,
+                      const char *format, ...) {
 
-    // 2, 1 for null terminator and 1 for space after ]
-    size_t msg_size = strlen(message) + strlen("[error - ") + 2;
-    char msg[msg_size];
-    memset(msg, 0, sizeof(msg));
+    if (log_level_enabled(batch->thl, level) == false) {
+        return 0;
+    }
 
-    thl->lock(&thl->mutex);
+    rcu_read_lock();
+    const log_settings *settings = rcu_dereference(batch->thl->settings);
+    log_buffer *msg = thread_log_buffer(LOG_BUFFER_MESSAGE);
 
-    strcat(msg, "[error - ");
-    strcat(msg, message);
+    va_list args;
+    va_start(args, format);
+    int response = fmt_vformat(msg, settings->max_message_size, format, args);
+    va_end(args);
 
-    if (file_descriptor != 0) {
-        write_file_log(file_descriptor, msg);
+    if (response == 0) {
+        response = batch_render(batch, settings, level, msg->data, msg->len, file, line);
     }
 
-    print_colored(COLORS_RED, msg);
+    log_buffer_release(msg);
+    rcu_read_unlock();
 
-    thl->unlock(&thl->mutex);
+    return response;
 }
 
-/*! @brief logs a debug styled message - called by log_fn
- * @param thl pointer to an instance of thread_logger
- * @param file_descriptor file descriptor to write log messages to in addition to
- * stdout logging. if 0 only stdout is used
- * @param message the actuall message to log
+/*! @brief writes the records of batch and closes it
+ * @details without a queue the file gets all records with one write and the
+ * console with one writev, under a single acquisition of the logger lock. a
+ * queue, per CPU buffers or an I/O service get them as one record of the most
+ * severe level, so they stay contiguous there too
+ * @return Success: 0
+ * @return Failure: -1 when a sink failed
  */
-void debug_log(thread_logger *thl, int file_descriptor, char *message) {
+int log_batch_commit(log_batch *batch) {
 
-    if (thl->debug == false) {
-        return;
+    batch_open = false;
+
+    int response = 0;
+    if (batch->count == 0) {
+        log_buffer_release(batch->text);
+        log_buffer_release(batch->lines);
+        return response;
     }
 
-    // 2, 1 for null terminator and 1 for space after ]
-    size_t msg_size = strlen(message) + strlen("[debug - ") + 2;
-    char msg[msg_size];
-    memset(msg, 0, sizeof(msg));
+    // child loggers write through the sinks of their root
+    thread_logger *thl = batch->thl->root;
+    log_buffer *text = batch->text;
+    int file_descriptor = batch->file_descriptor;
+
+    rcu_read_lock();
+    const log_settings *settings = rcu_dereference(batch->thl->settings);
+
+    if (thl->queue != NULL || thl->percpu != NULL) {
+        // the writer adds the last newline back and indexes every level
+        memcpy(text->data, batch->level_counts, sizeof(batch->level_counts));
+        int level = LOG_BATCH_COUNTED + (int)batch->level;
+        response = thl->queue != NULL
+                       ? log_queue_push_prefixed(thl->queue, file_descriptor, level,
+                                                 text->data, text->len - 1,
+                                                 sizeof(batch->level_counts))
+                       : log_percpu_push(thl->percpu, file_descriptor, level,
+                                         text->data, text->len - 1);
+    } else {
+        if (thl->io_service != NULL && file_descriptor != 0) {
+            response = log_io_service_write(thl->io_service, file_descriptor,
+                                            batch->level, text->data, text->len - 1);
+            file_descriptor = 0;
+        }
+
+        uint64_t start = thl->sink_latency != NULL ? histogram_now() : 0;
+        log_lock_acquire(&thl->mutex);
+
+        bool sync_after = false;
+        if (file_descriptor != 0 &&
+            write_file(thl, file_descriptor, batch->level, text->data, text->len,
+                       false, batch->level_counts, &sync_after) != 0) {
+            printf("failed to write file log message\n");
+            response = -1;
+        }
+        console_sink_write_lines(settings->console, text->data,
+                                 (const console_line *)batch->lines->data, batch->count);
+
+        log_lock_release(&thl->mutex);
+        if (sync_after == true) {
+            sync_file(thl, file_descriptor);
+        }
+        if (thl->sink_latency != NULL) {
+            histogram_record(thl->sink_latency, histogram_now() - start);
+        }
+    }
 
-    thl->lock(&thl->mutex);
+    rcu_read_unlock();
+    log_buffer_release(batch->text);
+    log_buffer_release(batch->lines);
 
-    strcat(msg, "[debug - ");
-    strcat(msg, message);
+    return response;
+}
 
-    if (file_descriptor != 0) {
-        write_file_log(file_descriptor, msg);
+/*! @brief writes out any records queued and file or console output buffered by
+ * the logger
+ * @note only needed with a queue, per CPU buffers or an I/O service, or the
+ * FILE_SYNC_ON_LEVEL, FILE_SYNC_DIRECT, CONSOLE_FLUSH_BATCH and
+ * CONSOLE_FLUSH_TIMED policies
+ * @return Success: 0
+ * @return Failure: -1
+ */
+int flush_thread_logger(thread_logger *thl) {
+
+    thl = thl->root;
+
+    if (thl->queue != NULL) {
+        log_queue_flush(thl->queue);
+    }
+    if (thl->percpu != NULL) {
+        log_percpu_flush(thl->percpu);
+    }
+    if (thl->io_service != NULL) {
+        log_io_service_flush(thl->io_service);
+    }
+    int response = 0;
+    if (thl->shm != NULL && log_shm_flush(thl->shm) != 0) {
+        response = -1;
     }
 
-    print_colored(COLORS_SOFT_RED, msg);
+    rcu_read_lock();
+    log_lock_acquire(&thl->mutex);
+    if (console_sink_flush(rcu_dereference(thl->settings)->console) != 0) {
+        response = -1;
+    }
+    if (thl->file_buffer != NULL && file_sink_flush(thl->file_buffer, false) != 0) {
+        response = -1;
+    }
+    if (thl->compressor != NULL && log_compress_flush(thl->compressor, false) != 0) {
+        response = -1;
+    }
+    if (thl->direct != NULL && direct_sink_flush(thl->direct, false) != 0) {
+        response = -1;
+    }
+    if (thl->index != NULL && file_index_flush(thl->index) != 0) {
+        response = -1;
+    }
+    log_lock_release(&thl->mutex);
+    rcu_read_unlock();
 
-    thl->unlock(&thl->mutex);
+    return response;
 }
 
-/*! @brief free resources for the threaded logger
+/*! @brief free resources for the threaded logger and all of its child loggers
  * @param thl the thread_logger instance to free memory for
+ * @note child loggers are freed with their root, clearing one does nothing
  */
 void clear_thread_logger(thread_logger *thl) {
 
-    pthread_mutex_lock(&thl->mutex); // lock before destroying
-    pthread_mutex_destroy(&thl->mutex);
+    if (thl->root != thl) {
+        return;
+    }
+
+    // drains the queue while the sinks are still around
+    clear_log_queue(thl->queue);
+    clear_log_percpu(thl->percpu);
+    clear_log_compress(thl->compressor);
+    clear_file_sink(thl->file_buffer);
+    clear_direct_sink(thl->direct);
+    clear_log_shm(thl->shm);
+    clear_file_index(thl->index);
+    clear_log_backtrace_sites(thl->backtraces);
+    clear_children(thl);
+    // waits for a writer that may still hold it
+    log_lock_acquire(&thl->mutex);
+    log_lock_release(&thl->mutex);
+    log_lock_destroy(&thl->mutex);
+    clear_latency_histogram(thl->call_latency);
+    clear_latency_histogram(thl->sink_latency);
+    if (thl->settings != NULL) {
+        clear_log_settings(thl->settings, true);
+    }
+    clear_record_pool(thl->pool);
     free(thl);
 }
 
 /*! @brief free resources for the file ogger
  * @param fhl the file_logger instance to free memory for. also frees memory for the
- * embedded thread_logger and closes the open file
+ * embedded thread_logger, unless it came from open_file_logger, and closes the
+ * open file
+ * @note child file loggers are freed with their root, clearing one does nothing
  */
 void clear_file_logger(file_logger *fhl) {
 
+    if (fhl->thl->file == fhl) {
+        return;
+    }
+
+    // records still queued for the file are written before it is closed
+    thread_logger *root = fhl->thl->root;
+    if (root->queue != NULL) {
+        log_queue_flush(root->queue);
+    }
+    if (root->percpu != NULL) {
+        log_percpu_flush(root->percpu);
+    }
+    if (root->io_service != NULL) {
+        log_io_service_flush_fd(root->io_service, fhl->fd);
+    }
+    if (root->compressor != NULL && log_compress_fd(root->compressor) == fhl->fd) {
+        // the last block is compressed and synced before the file goes away
+        log_lock_acquire(&root->mutex);
+        log_compress_flush(root->compressor, true);
+        clear_log_compress(root->compressor);
+        root->compressor = NULL;
+        log_lock_release(&root->mutex);
+    }
+    if (root->file_buffer != NULL) {
+        // buffered records reach the disk even when no severe record came
+        log_lock_acquire(&root->mutex);
+        file_sink_close_fd(root->file_buffer, fhl->fd);
+        log_lock_release(&root->mutex);
+    }
+    if (root->shm != NULL && log_shm_fd(root->shm) == fhl->fd) {
+        // committed records stay in the ring, the drainer writes them out
+        log_lock_acquire(&root->mutex);
+        clear_log_shm(root->shm);
+        root->shm = NULL;
+        log_lock_release(&root->mutex);
+    }
+    if (root->direct != NULL && direct_sink_fd(root->direct) == fhl->fd) {
+        // the padding of the last block is cut off before the file goes away
+        log_lock_acquire(&root->mutex);
+        clear_direct_sink(root->direct);
+        root->direct = NULL;
+        log_lock_release(&root->mutex);
+    }
+    if (root->index != NULL && file_index_fd(root->index) == fhl->fd) {
+        log_lock_acquire(&root->mutex);
+        clear_file_index(root->index);
+        root->index = NULL;
+        log_lock_release(&root->mutex);
+    }
+
     close(fhl->fd);
-    clear_thread_logger(fhl->thl);
+    if (fhl->owns_logger == true) {
+        clear_thread_logger(fhl->thl);
+    }
     free(fhl);
 }
 
@@ -0,0 +1,554 @@
+// Copyright 2020 Bonedaddy (Alexandre Trottier)
+//
+// licensed under GNU AFFERO GENERAL PUBLIC LICENSE;
+// you may not use this file except in compliance with the License;
+// You may obtain the license via the LICENSE file in the repository root;
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/*! @file percpu.c
+ * @brief record buffers sharded by CPU, drained by a writer thread
+ */
+
+#define _GNU_SOURCE
+
+#include "percpu.h"
+#include "histogram.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/sysinfo.h>
+#include <time.h>
+
+#if defined(__x86_64__) && defined(__GLIBC__) && defined(__has_include)
+#if __has_include(<sys/rseq.h>)
+#include <sys/rseq.h>
+#define PERCPU_RSEQ 1
+#endif
+#endif
+
+/*! @brief state of a record whose header and payload are complete */
+#define PERCPU_READY 1u
+
+/*! @brief longest the drainer sleeps without being woken */
+#define PERCPU_IDLE_MS 100
+
+/*! @brief precedes every record in a ring, at an 8 byte aligned offset so state
+ * never straddles the end of the ring
+ */
+typedef struct percpu_header {
+    uint32_t state; /*! @brief PERCPU_READY once the record is complete, 0 before */
+    uint32_t len;
+    int32_t file_descriptor;
+    int32_t level;
+    uint64_t timestamp; /*! @brief CLOCK_MONOTONIC nanoseconds of the push */
+} percpu_header;
+
+_Static_assert(sizeof(percpu_header) == LOG_PERCPU_RECORD_OVERHEAD,
+               "LOG_PERCPU_RECORD_OVERHEAD must match the record header");
+
+/*! @brief the ring of one CPU, the callers and the drainer write separate lines
+ */
+typedef struct percpu_ring {
+    uint64_t tail; /*! @brief offset past the newest reservation, only grows */
+    uint64_t dropped;
+    uint64_t blocked;
+    uint64_t head __attribute__((aligned(64))); /*! @brief offset of the oldest
+                                                   record, written by the drainer */
+    char *data;
+} __attribute__((aligned(64))) percpu_ring;
+
+struct log_percpu {
+    percpu_ring *rings;
+    size_t cpus;
+    size_t size;
+    bool rseq;
+    LOG_OVERFLOW overflow;
+    log_queue_writer writer;
+    void *ctx;
+    percpu_header *heads; /*! @brief the drainer's copy of the complete record at
+                             the head of every ring, state is 0 when not read yet */
+    char *scratch;        /*! @brief the drainer's copy of records wrapping around */
+    uint64_t written;
+    bool sleeping; /*! @brief set by the drainer before it waits for records */
+    bool stopping;
+    pthread_mutex_t mutex;
+    pthread_cond_t not_empty;
+    pthread_cond_t drained;
+    pthread_t thread;
+};
+
+#ifdef PERCPU_RSEQ
+
+#define PERCPU_STR_(x) #x
+#define PERCPU_STR(x) PERCPU_STR_(x)
+
+/*! @brief returns the rseq area glibc registered for the calling thread
+ */
+static inline struct rseq *rseq_area(void) {
+
+    char *thread_pointer;
+    __asm__("movq %%fs:0, %0" : "=r"(thread_pointer));
+
+    return (struct rseq *)(thread_pointer + __rseq_offset);
+}
+
+/*! @brief stores value to *tail if the caller still runs on cpu and *tail still
+ * holds expect, as a restartable sequence
+ * @return 0 when stored, 1 when tail moved, -1 when the kernel aborted the
+ * sequence because the caller was preempted, migrated or signaled
+ */
+static inline int rseq_commit(struct rseq *area, uint64_t *tail, uint64_t expect,
+                              uint64_t value, uint32_t cpu) {
+
+    __asm__ __volatile__ goto(
+        ".pushsection __rseq_cs, \"aw\"\n\t"
+        ".balign 32\n\t"
+        "3:\n\t"
+        ".long 0x0, 0x0\n\t"
+        ".quad 1f, (2f - 1f), 4f\n\t"
+        ".popsection\n\t"
+        "leaq 3b(%%rip), %%rax\n\t"
+        "movq %%rax, %[rseq_cs]\n\t"
+        "1:\n\t"
+        "cmpl %[cpu], %[cpu_id]\n\t"
+        "jnz 4f\n\t"
+        "cmpq %[tail], %[expect]\n\t"
+        "jnz %l[moved]\n\t"
+        "movq %[value], %[tail]\n\t"
+        "2:\n\t"
+        ".pushsection __rseq_failure, \"ax\"\n\t"
+        ".byte 0x0f, 0xb9, 0x3d\n\t"
+        ".long " PERCPU_STR(RSEQ_SIG) "\n\t"
+        "4:\n\t"
+        "jmp %l[aborted]\n\t"
+        ".popsection\n\t"
+        :
+        : [cpu] "r"(cpu), [cpu_id] "m"(area->cpu_id), [rseq_cs] "m"(area->rseq_cs),
+          [tail] "m"(*tail), [expect] "r"(expect), [value] "r"(value)
+        : "memory", "cc", "rax"
+        : aborted, moved);
+
+    return 0;
+aborted:
+    return -1;
+moved:
+    return 1;
+}
+
+#endif
+
+static void ring_write(log_percpu *percpu, percpu_ring *ring, uint64_t pos,
+                       const void *data, size_t len) {
+
+    size_t offset = (size_t)(pos % percpu->size);
+    size_t first = len < percpu->size - offset ? len : percpu->size - offset;
+    memcpy(ring->data + offset, data, first);
+    memcpy(ring->data, (const char *)data + first, len - first);
+}
+
+static void ring_read(log_percpu *percpu, percpu_ring *ring, uint64_t pos, void *data,
+                      size_t len) {
+
+    size_t offset = (size_t)(pos % percpu->size);
+    size_t first = len < percpu->size - offset ? len : percpu->size - offset;
+    memcpy(data, ring->data + offset, first);
+    memcpy((char *)data + first, ring->data, len - first);
+}
+
+static inline uint32_t *ring_state(log_percpu *percpu, percpu_ring *ring, uint64_t pos) {
+    return (uint32_t *)(ring->data + pos % percpu->size);
+}
+
+static inline size_t record_space(size_t record_len) {
+    return (sizeof(percpu_header) + record_len + 7) & ~(size_t)7;
+}
+
+/*! @brief returns the CPU the caller runs on, negative when unknown
+ */
+static inline int current_cpu(const log_percpu *percpu) {
+
+#ifdef PERCPU_RSEQ
+    if (percpu->rseq == true) {
+        return (int32_t)__atomic_load_n(&rseq_area()->cpu_id, __ATOMIC_RELAXED);
+    }
+#else
+    (void)percpu;
+#endif
+
+    return sched_getcpu();
+}
+
+/*! @brief reserves needed bytes in the ring of the current CPU
+ * @return Success: 0, with *ring and *pos set
+ * @return Failure: 1 when the ring is full with *ring set, -1 when the CPU is
+ * unknown
+ */
+static int reserve(log_percpu *percpu, size_t needed, percpu_ring **ring,
+                   uint64_t *pos) {
+
+    while (true) {
+        int cpu = current_cpu(percpu);
+        if (cpu < 0 || (size_t)cpu >= percpu->cpus) {
+            return -1;
+        }
+        *ring = &percpu->rings[cpu];
+
+        uint64_t tail = __atomic_load_n(&(*ring)->tail, __ATOMIC_RELAXED);
+        uint64_t head = __atomic_load_n(&(*ring)->head, __ATOMIC_ACQUIRE);
+        if (needed > percpu->size - (size_t)(tail - head)) {
+            return 1;
+        }
+
+#ifdef PERCPU_RSEQ
+        if (percpu->rseq == true) {
+            if (rseq_commit(rseq_area(), &(*ring)->tail, tail, tail + needed,
+                            (uint32_t)cpu) == 0) {
+                *pos = tail;
+                return 0;
+            }
+            continue;
+        }
+#endif
+
+        // another thread may run on the same CPU between sched_getcpu and here
+        if (__atomic_compare_exchange_n(&(*ring)->tail, &tail, tail + needed, false,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            *pos = tail;
+            return 0;
+        }
+    }
+}
+
+/*! @brief waits until the drainer made room for needed bytes in ring
+ */
+static void wait_for_room(log_percpu *percpu, percpu_ring *ring, size_t needed) {
+
+    pthread_mutex_lock(&percpu->mutex);
+    while (needed > percpu->size - (size_t)(__atomic_load_n(&ring->tail, __ATOMIC_RELAXED) -
+                                            __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE))) {
+        pthread_cond_signal(&percpu->not_empty);
+        pthread_cond_wait(&percpu->drained, &percpu->mutex);
+    }
+    pthread_mutex_unlock(&percpu->mutex);
+}
+
+/*! @brief wakes the drainer if it went to sleep, after a record was completed
+ */
+static inline void wake_drainer(log_percpu *percpu) {
+
+    // the record was published sequentially consistent, as the drainer sets
+    // sleeping, so either it sees the record or the caller sees it sleeping
+    if (__atomic_load_n(&percpu->sleeping, __ATOMIC_SEQ_CST) == true) {
+        pthread_mutex_lock(&percpu->mutex);
+        pthread_cond_signal(&percpu->not_empty);
+        pthread_mutex_unlock(&percpu->mutex);
+    }
+}
+
+/*! @brief returns the index of the ring whose head record is the oldest complete
+ * one, -1 when there is none or a ring has a record ahead still being written
+ * @details called by the drainer only. a record still being written may have
+ * been pushed before records of the same thread in other rings, so it holds
+ * back the merge until it is complete
+ */
+static long oldest_ring(log_percpu *percpu) {
+
+    long oldest = -1;
+
+    for (size_t c = 0; c < percpu->cpus; c++) {
+        percpu_ring *ring = &percpu->rings[c];
+        percpu_header *head = &percpu->heads[c];
+        if (head->state != PERCPU_READY &&
+            __atomic_load_n(ring_state(percpu, ring, ring->head), __ATOMIC_SEQ_CST) ==
+                PERCPU_READY) {
+            ring_read(percpu, ring, ring->head, head, sizeof(percpu_header));
+        }
+        if (head->state == PERCPU_READY &&
+            (oldest < 0 || head->timestamp < percpu->heads[oldest].timestamp)) {
+            oldest = (long)c;
+        }
+    }
+    if (oldest < 0) {
+        return -1;
+    }
+
+    // read after the loads above, so a reservation made before any record
+    // seen there is visible
+    for (size_t c = 0; c < percpu->cpus; c++) {
+        percpu_ring *ring = &percpu->rings[c];
+        if (percpu->heads[c].state != PERCPU_READY &&
+            __atomic_load_n(&ring->tail, __ATOMIC_RELAXED) != ring->head) {
+            return -1;
+        }
+    }
+
+    return oldest;
+}
+
+/*! @brief hands the head record of ring c to the writer and frees its space
+ */
+static void write_head(log_percpu *percpu, size_t c) {
+
+    percpu_ring *ring = &percpu->rings[c];
+    percpu_header *head = &percpu->heads[c];
+    uint64_t pos = ring->head + sizeof(percpu_header);
+    size_t offset = (size_t)(pos % percpu->size);
+
+    const char *record = ring->data + offset;
+    if (offset + head->len > percpu->size) {
+        ring_read(percpu, ring, pos, percpu->scratch, head->len);
+        record = percpu->scratch;
+    }
+    percpu->writer(percpu->ctx, head->file_descriptor, head->level, record, head->len);
+
+    // stale payload bytes must never read as the state of a later record
+    size_t space = record_space(head->len);
+    offset = (size_t)(ring->head % percpu->size);
+    size_t first = space < percpu->size - offset ? space : percpu->size - offset;
+    memset(ring->data + offset, 0, first);
+    memset(ring->data, 0, space - first);
+
+    head->state = 0;
+    __atomic_store_n(&ring->head, ring->head + space, __ATOMIC_RELEASE);
+}
+
+static void *percpu_drainer(void *data) {
+
+    log_percpu *percpu = data;
+
+    while (true) {
+        uint64_t written = 0;
+        for (long c; (c = oldest_ring(percpu)) >= 0; written++) {
+            write_head(percpu, (size_t)c);
+        }
+
+        pthread_mutex_lock(&percpu->mutex);
+        percpu->written += written;
+        pthread_cond_broadcast(&percpu->drained);
+        if (written == 0) {
+            if (percpu->stopping == true) {
+                pthread_mutex_unlock(&percpu->mutex);
+                break;
+            }
+            __atomic_store_n(&percpu->sleeping, true, __ATOMIC_SEQ_CST);
+            if (oldest_ring(percpu) < 0) {
+                struct timespec deadline;
+                clock_gettime(CLOCK_REALTIME, &deadline);
+                deadline.tv_nsec += PERCPU_IDLE_MS * 1000000L;
+                if (deadline.tv_nsec >= 1000000000) {
+                    deadline.tv_sec++;
+                    deadline.tv_nsec -= 1000000000;
+                }
+                pthread_cond_timedwait(&percpu->not_empty, &percpu->mutex, &deadline);
+            }
+            __atomic_store_n(&percpu->sleeping, false, __ATOMIC_RELAXED);
+        }
+        pthread_mutex_unlock(&percpu->mutex);
+    }
+
+    return NULL;
+}
+
+static void free_percpu(log_percpu *percpu) {
+
+    if (percpu->rings != NULL) {
+        for (size_t c = 0; c < percpu->cpus; c++) {
+            free(percpu->rings[c].data);
+        }
+    }
+    free(percpu->rings);
+    free(percpu->heads);
+    free(percpu->scratch);
+    free(percpu);
+}
+
+/*! @brief returns new per CPU buffers and starts their drainer thread
+ * @param size bytes of ring space per CPU, rounded up to 8 bytes
+ * @param overflow LOG_OVERFLOW_BLOCK or LOG_OVERFLOW_DROP_NEWEST
+ * @param writer called by the drainer for every record, and by callers for
+ * records that can not be buffered, so it must be thread safe
+ * @param ctx passed to writer
+ * @return Success: pointer to the buffers
+ * @return Failure: NULL pointer
+ */
+log_percpu *new_log_percpu(size_t size, LOG_OVERFLOW overflow, log_queue_writer writer,
+                           void *ctx) {
+
+    if (size <= LOG_PERCPU_RECORD_OVERHEAD) {
+        printf("per cpu buffer size must exceed LOG_PERCPU_RECORD_OVERHEAD\n");
+        return NULL;
+    }
+    if (overflow != LOG_OVERFLOW_BLOCK && overflow != LOG_OVERFLOW_DROP_NEWEST) {
+        printf("per cpu buffers only block or drop the newest record\n");
+        return NULL;
+    }
+
+    log_percpu *percpu = calloc(1, sizeof(log_percpu));
+    if (percpu == NULL) {
+        printf("failed to malloc log_percpu\n");
+        return NULL;
+    }
+
+    percpu->cpus = (size_t)get_nprocs_conf();
+    percpu->size = (size + 7) & ~(size_t)7;
+    percpu->overflow = overflow;
+    percpu->writer = writer;
+    percpu->ctx = ctx;
+    percpu->rings = aligned_alloc(64, sizeof(percpu_ring) * percpu->cpus);
+    percpu->heads = calloc(percpu->cpus, sizeof(percpu_header));
+    percpu->scratch = malloc(percpu->size);
+    if (percpu->rings != NULL) {
+        memset(percpu->rings, 0, sizeof(percpu_ring) * percpu->cpus);
+    }
+    bool allocated = percpu->rings != NULL && percpu->heads != NULL &&
+                     percpu->scratch != NULL;
+    for (size_t c = 0; allocated == true && c < percpu->cpus; c++) {
+        percpu->rings[c].data = calloc(1, percpu->size);
+        allocated = percpu->rings[c].data != NULL;
+    }
+    if (allocated == false) {
+        free_percpu(percpu);
+        printf("failed to malloc log_percpu rings\n");
+        return NULL;
+    }
+
+#ifdef PERCPU_RSEQ
+    // glibc registers rseq for every thread or for none, so the creating
+    // thread decides for all of them
+    percpu->rseq = __rseq_size > 0 &&
+                   (int32_t)__atomic_load_n(&rseq_area()->cpu_id, __ATOMIC_RELAXED) >= 0;
+#endif
+
+    pthread_mutex_init(&percpu->mutex, NULL);
+    pthread_cond_init(&percpu->not_empty, NULL);
+    pthread_cond_init(&percpu->drained, NULL);
+
+    if (pthread_create(&percpu->thread, NULL, percpu_drainer, percpu) != 0) {
+        pthread_cond_destroy(&percpu->drained);
+        pthread_cond_destroy(&percpu->not_empty);
+        pthread_mutex_destroy(&percpu->mutex);
+        free_percpu(percpu);
+        printf("failed to start per cpu buffer drainer thread\n");
+        return NULL;
+    }
+
+    return percpu;
+}
+
+/*! @brief copies record into the ring of the current CPU
+ * @details records larger than a ring are written by the caller once every
+ * record pushed before was written
+ * @return Success: 0
+ * @return Failure: -1 when the record was dropped
+ */
+int log_percpu_push(log_percpu *percpu, int file_descriptor, int level,
+                    const char *record, size_t record_len) {
+
+    size_t needed = record_space(record_len);
+    if (needed > percpu->size) {
+        log_percpu_flush(percpu);
+        percpu->writer(percpu->ctx, file_descriptor, level, record, record_len);
+        return 0;
+    }
+
+    percpu_header header = {
+        .len = (uint32_t)record_len,
+        .file_descriptor = file_descriptor,
+        .level = level,
+        .timestamp = histogram_now(),
+    };
+
+    percpu_ring *ring;
+    uint64_t pos;
+    bool counted_block = false;
+    int reserved;
+    while ((reserved = reserve(percpu, needed, &ring, &pos)) != 0) {
+        if (reserved < 0) {
+            // a CPU beyond the configured ones, the record is not lost for it
+            percpu->writer(percpu->ctx, file_descriptor, level, record, record_len);
+            return 0;
+        }
+        if (percpu->overflow == LOG_OVERFLOW_DROP_NEWEST) {
+            __atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+            return -1;
+        }
+        if (counted_block == false) {
+            __atomic_fetch_add(&ring->blocked, 1, __ATOMIC_RELAXED);
+            counted_block = true;
+        }
+        wait_for_room(percpu, ring, needed);
+    }
+
+    // everything but the state, which is published last
+    size_t skip = offsetof(percpu_header, len);
+    ring_write(percpu, ring, pos + skip, (const char *)&header + skip,
+               sizeof(header) - skip);
+    ring_write(percpu, ring, pos + sizeof(header), record, record_len);
+    __atomic_store_n(ring_state(percpu, ring, pos), PERCPU_READY, __ATOMIC_SEQ_CST);
+
+    wake_drainer(percpu);
+
+    return 0;
+}
+
+/*! @brief waits until every record pushed before the call was written
+ */
+void log_percpu_flush(log_percpu *percpu) {
+
+    pthread_mutex_lock(&percpu->mutex);
+    for (size_t c = 0; c < percpu->cpus; c++) {
+        percpu_ring *ring = &percpu->rings[c];
+        uint64_t target = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+        while (__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) < target) {
+            pthread_cond_signal(&percpu->not_empty);
+            pthread_cond_wait(&percpu->drained, &percpu->mutex);
+        }
+    }
+    pthread_mutex_unlock(&percpu->mutex);
+}
+
+/*! @brief fills stats with the counters of the buffers
+ */
+void log_percpu_stats_get(log_percpu *percpu, log_percpu_stats *stats) {
+
+    *stats = (log_percpu_stats){
+        .cpus = percpu->cpus, .size = percpu->size, .rseq = percpu->rseq};
+
+    pthread_mutex_lock(&percpu->mutex);
+    stats->written = percpu->written;
+    pthread_mutex_unlock(&percpu->mutex);
+
+    for (size_t c = 0; c < percpu->cpus; c++) {
+        stats->dropped += __atomic_load_n(&percpu->rings[c].dropped, __ATOMIC_RELAXED);
+        stats->blocked += __atomic_load_n(&percpu->rings[c].blocked, __ATOMIC_RELAXED);
+    }
+}
+
+/*! @brief writes out every buffered record, stops the drainer and frees the
+ * buffers, nothing may be pushed during or after the call
+ */
+void clear_log_percpu(log_percpu *percpu) {
+
+    if (percpu == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&percpu->mutex);
+    percpu->stopping = true;
+    pthread_cond_signal(&percpu->not_empty);
+    pthread_mutex_unlock(&percpu->mutex);
+    pthread_join(percpu->thread, NULL);
+
+    pthread_cond_destroy(&percpu->drained);
+    pthread_cond_destroy(&percpu->not_empty);
+    pthread_mutex_destroy(&percpu->mutex);
+    free_percpu(percpu);
+}
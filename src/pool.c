@@ -0,0 +1,325 @@
+// Copyright 2020 Bonedaddy (Alexandre Trottier)
+//
+// licensed under GNU AFFERO GENERAL PUBLIC LICENSE;
+// you may not use this file except in compliance with the License;
+// You may obtain the license via the LICENSE file in the repository root;
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/*! @file pool.c
+ * @brief preallocated pool of fixed size record slabs with a hard memory cap
+ */
+
+#define _GNU_SOURCE
+
+#include "pool.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/*! @brief size of the huge pages the budget is rounded to */
+#define RECORD_POOL_HUGEPAGE_SIZE (2 * 1024 * 1024)
+
+struct record_pool {
+    char *base;
+    size_t mapped;
+    size_t slab_size;
+    uint32_t slabs;
+    RECORD_POOL_EXHAUSTED exhausted_policy;
+    bool hugepages;
+    bool locked;
+    /*! @brief free list head: generation in the high 32 bits, so a pop racing with
+     * a pop and push of the same slab fails its CAS, and slab index + 1 in the low
+     * 32 bits, 0 when empty
+     */
+    atomic_uint_fast64_t head;
+    atomic_uint_fast32_t *next; /*! @brief free list links, index + 1 or 0 */
+    atomic_size_t in_use;
+    atomic_size_t high_water;
+    atomic_uint_fast64_t exhausted;
+    atomic_uint_fast64_t dropped;
+    atomic_uint_fast64_t fallbacks;
+    atomic_uint_fast64_t oversized;
+    /*! @brief only used by RECORD_POOL_EXHAUSTED_BLOCK */
+    atomic_uint waiters;
+    pthread_mutex_t mutex;
+    pthread_cond_t released;
+};
+
+/*! @brief maps size bytes of prefaulted memory, huge pages when asked for
+ */
+static char *map_slabs(size_t *size, bool want_hugepages, bool *hugepages) {
+
+    *hugepages = false;
+
+    if (want_hugepages == true) {
+        size_t rounded = (*size + RECORD_POOL_HUGEPAGE_SIZE - 1) &
+                         ~(size_t)(RECORD_POOL_HUGEPAGE_SIZE - 1);
+        void *mem = mmap(NULL, rounded, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE,
+                         -1, 0);
+        if (mem != MAP_FAILED) {
+            *size = rounded;
+            *hugepages = true;
+            return mem;
+        }
+    }
+
+    void *mem = mmap(NULL, *size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    if (mem == MAP_FAILED) {
+        return NULL;
+    }
+    if (want_hugepages == true) {
+        // no reserved huge pages, transparent ones are the next best thing
+        madvise(mem, *size, MADV_HUGEPAGE);
+    }
+
+    return mem;
+}
+
+/*! @brief returns a new pool of budget / slab_size slabs
+ * @param budget upper bound of the slab memory in bytes
+ * @param slab_size bytes per slab, 0 for RECORD_POOL_SLAB_SIZE_DEFAULT
+ * @param flags RECORD_POOL_HUGEPAGES and/or RECORD_POOL_MLOCK
+ * @param exhausted policy applied when no slab is free
+ * @return Success: pointer to the pool
+ * @return Failure: NULL pointer
+ */
+record_pool *new_record_pool(size_t budget, size_t slab_size, int flags,
+                             RECORD_POOL_EXHAUSTED exhausted) {
+
+    if (slab_size == 0) {
+        slab_size = RECORD_POOL_SLAB_SIZE_DEFAULT;
+    }
+    if (budget / slab_size == 0 || budget / slab_size > UINT32_MAX - 1) {
+        printf("record pool budget must hold between 1 and 2^32 - 2 slabs\n");
+        return NULL;
+    }
+
+    record_pool *pool = malloc(sizeof(record_pool));
+    if (pool == NULL) {
+        printf("failed to malloc record_pool\n");
+        return NULL;
+    }
+
+    pool->slab_size = slab_size;
+    pool->slabs = (uint32_t)(budget / slab_size);
+    pool->exhausted_policy = exhausted;
+    pool->mapped = (size_t)pool->slabs * slab_size;
+
+    pool->next = malloc(sizeof(atomic_uint_fast32_t) * pool->slabs);
+    if (pool->next == NULL) {
+        free(pool);
+        printf("failed to malloc record_pool free list\n");
+        return NULL;
+    }
+
+    pool->base = map_slabs(&pool->mapped, (flags & RECORD_POOL_HUGEPAGES) != 0,
+                           &pool->hugepages);
+    if (pool->base == NULL) {
+        free(pool->next);
+        free(pool);
+        printf("failed to map record_pool\n");
+        return NULL;
+    }
+
+    pool->locked = false;
+    if ((flags & RECORD_POOL_MLOCK) != 0) {
+        if (mlock(pool->base, pool->mapped) != 0) {
+            munmap(pool->base, pool->mapped);
+            free(pool->next);
+            free(pool);
+            printf("failed to mlock record_pool\n");
+            return NULL;
+        }
+        pool->locked = true;
+    }
+
+    // every slab starts on the free list, lowest address first
+    for (uint32_t i = 0; i < pool->slabs; i++) {
+        atomic_init(&pool->next[i], i + 1 < pool->slabs ? i + 2 : 0);
+    }
+    atomic_init(&pool->head, 1);
+    atomic_init(&pool->in_use, 0);
+    atomic_init(&pool->high_water, 0);
+    atomic_init(&pool->exhausted, 0);
+    atomic_init(&pool->dropped, 0);
+    atomic_init(&pool->fallbacks, 0);
+    atomic_init(&pool->oversized, 0);
+    atomic_init(&pool->waiters, 0);
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->released, NULL);
+
+    return pool;
+}
+
+/*! @brief pops a slab off the free list
+ * @return Success: the slab index
+ * @return Failure: -1 when the pool is empty
+ */
+static int64_t pop_slab(record_pool *pool) {
+
+    uint_fast64_t head = atomic_load(&pool->head);
+    while (true) {
+        uint32_t index = (uint32_t)head;
+        if (index == 0) {
+            return -1;
+        }
+        uint_fast64_t next = atomic_load_explicit(&pool->next[index - 1],
+                                                  memory_order_relaxed);
+        uint_fast64_t generation = (head >> 32) + 1;
+        if (atomic_compare_exchange_weak(&pool->head, &head,
+                                         generation << 32 | next)) {
+            return index - 1;
+        }
+    }
+}
+
+static void push_slab(record_pool *pool, uint32_t index) {
+
+    uint_fast64_t head = atomic_load(&pool->head);
+    while (true) {
+        atomic_store_explicit(&pool->next[index], (uint32_t)head,
+                              memory_order_relaxed);
+        uint_fast64_t generation = (head >> 32) + 1;
+        if (atomic_compare_exchange_weak(&pool->head, &head,
+                                         generation << 32 | (index + 1))) {
+            return;
+        }
+    }
+}
+
+/*! @brief acquires a slab as an empty fixed size buffer
+ * @details blocks when the pool is empty and the policy is
+ * RECORD_POOL_EXHAUSTED_BLOCK
+ * @param slab receives the slab when RECORD_POOL_ACQUIRED is returned
+ */
+RECORD_POOL_RESULT record_pool_acquire(record_pool *pool, log_buffer *slab) {
+
+    int64_t index = pop_slab(pool);
+
+    if (index == -1) {
+        atomic_fetch_add_explicit(&pool->exhausted, 1, memory_order_relaxed);
+        switch (pool->exhausted_policy) {
+            case RECORD_POOL_EXHAUSTED_HEAP:
+                atomic_fetch_add_explicit(&pool->fallbacks, 1, memory_order_relaxed);
+                return RECORD_POOL_FALLBACK;
+            case RECORD_POOL_EXHAUSTED_BLOCK:
+                pthread_mutex_lock(&pool->mutex);
+                atomic_fetch_add(&pool->waiters, 1);
+                while ((index = pop_slab(pool)) == -1) {
+                    pthread_cond_wait(&pool->released, &pool->mutex);
+                }
+                atomic_fetch_sub(&pool->waiters, 1);
+                pthread_mutex_unlock(&pool->mutex);
+                break;
+            default:
+                atomic_fetch_add_explicit(&pool->dropped, 1, memory_order_relaxed);
+                return RECORD_POOL_DROPPED;
+        }
+    }
+
+    size_t in_use = atomic_fetch_add_explicit(&pool->in_use, 1, memory_order_relaxed) + 1;
+    size_t high_water = atomic_load_explicit(&pool->high_water, memory_order_relaxed);
+    while (in_use > high_water &&
+           !atomic_compare_exchange_weak_explicit(&pool->high_water, &high_water,
+                                                  in_use, memory_order_relaxed,
+                                                  memory_order_relaxed)) {
+    }
+
+    *slab = (log_buffer){
+        .data = pool->base + (size_t)index * pool->slab_size,
+        .len = 0,
+        .cap = pool->slab_size,
+        .fixed = true,
+    };
+
+    return RECORD_POOL_ACQUIRED;
+}
+
+/*! @brief returns a slab acquired with record_pool_acquire to the pool
+ */
+void record_pool_release(record_pool *pool, log_buffer *slab) {
+
+    uint32_t index = (uint32_t)((size_t)(slab->data - pool->base) / pool->slab_size);
+    *slab = (log_buffer){0};
+
+    atomic_fetch_sub_explicit(&pool->in_use, 1, memory_order_relaxed);
+    push_slab(pool, index);
+
+    // pairs with the waiter announcing itself before its last pop attempt
+    if (atomic_load(&pool->waiters) != 0) {
+        pthread_mutex_lock(&pool->mutex);
+        pthread_cond_signal(&pool->released);
+        pthread_mutex_unlock(&pool->mutex);
+    }
+}
+
+/*! @brief returns a slab too small for the record being rendered to the pool
+ * @details the record moves to the thread local buffers under
+ * RECORD_POOL_EXHAUSTED_HEAP and is dropped otherwise, waiting for another slab
+ * would not help. either way it is counted in record_pool_stats.oversized
+ * @return RECORD_POOL_FALLBACK or RECORD_POOL_DROPPED
+ */
+RECORD_POOL_RESULT record_pool_outgrown(record_pool *pool, log_buffer *slab) {
+
+    record_pool_release(pool, slab);
+    atomic_fetch_add_explicit(&pool->oversized, 1, memory_order_relaxed);
+
+    if (pool->exhausted_policy == RECORD_POOL_EXHAUSTED_HEAP) {
+        atomic_fetch_add_explicit(&pool->fallbacks, 1, memory_order_relaxed);
+        return RECORD_POOL_FALLBACK;
+    }
+    atomic_fetch_add_explicit(&pool->dropped, 1, memory_order_relaxed);
+    return RECORD_POOL_DROPPED;
+}
+
+/*! @brief returns whether buf is a slab of the pool
+ */
+bool record_pool_owns(const record_pool *pool, const log_buffer *buf) {
+    return buf->data >= pool->base && buf->data < pool->base + pool->mapped;
+}
+
+/*! @brief fills stats with the current occupancy of the pool
+ */
+void record_pool_stats_get(record_pool *pool, record_pool_stats *stats) {
+
+    *stats = (record_pool_stats){
+        .slab_size = pool->slab_size,
+        .slabs = pool->slabs,
+        .in_use = atomic_load_explicit(&pool->in_use, memory_order_relaxed),
+        .high_water = atomic_load_explicit(&pool->high_water, memory_order_relaxed),
+        .exhausted = atomic_load_explicit(&pool->exhausted, memory_order_relaxed),
+        .dropped = atomic_load_explicit(&pool->dropped, memory_order_relaxed),
+        .fallbacks = atomic_load_explicit(&pool->fallbacks, memory_order_relaxed),
+        .oversized = atomic_load_explicit(&pool->oversized, memory_order_relaxed),
+        .hugepages = pool->hugepages,
+        .locked = pool->locked,
+    };
+}
+
+/*! @brief unmaps the pool, every slab must have been released
+ */
+void clear_record_pool(record_pool *pool) {
+
+    if (pool == NULL) {
+        return;
+    }
+
+    if (pool->locked == true) {
+        munlock(pool->base, pool->mapped);
+    }
+    munmap(pool->base, pool->mapped);
+    pthread_cond_destroy(&pool->released);
+    pthread_mutex_destroy(&pool->mutex);
+    free(pool->next);
+    free(pool);
+}
@@ -0,0 +1,393 @@
+// Copyright 2020 Bonedaddy (Alexandre Trottier)
+//
+// licensed under GNU AFFERO GENERAL PUBLIC LICENSE;
+// you may not use this file except in compliance with the License;
+// You may obtain the license via the LICENSE file in the repository root;
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/*! @file queue.c
+ * @brief bounded record queue drained by a writer thread
+ */
+
+#define _GNU_SOURCE
+
+#include "queue.h"
+#include "fdio.h"
+#include "fmt.h"
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*! @brief precedes every record in the ring */
+typedef struct queue_header {
+    uint32_t len;
+    int32_t file_descriptor;
+    int32_t level;
+    uint32_t reserved;
+} queue_header;
+
+_Static_assert(sizeof(queue_header) == LOG_QUEUE_RECORD_OVERHEAD,
+               "LOG_QUEUE_RECORD_OVERHEAD must match the record header");
+
+struct log_queue {
+    char *ring;
+    char *scratch; /*! @brief the writer's copy of the drained records */
+    size_t size;
+    uint64_t head; /*! @brief offset of the oldest record, only grows */
+    uint64_t tail; /*! @brief offset past the newest record, only grows */
+    LOG_OVERFLOW overflow;
+    unsigned int droppable_levels;
+    int spill_fd;
+    int report_level;
+    log_queue_writer writer;
+    log_queue_batch_end batch_end; /*! @brief NULL unless set */
+    void *ctx;
+    bool writing;
+    bool stopping;
+    uint64_t reported; /*! @brief drops covered by a report already */
+    log_queue_stats stats;
+    pthread_mutex_t mutex;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    pthread_cond_t drained;
+    pthread_t thread;
+};
+
+static void ring_write(log_queue *queue, uint64_t pos, const void *data, size_t len) {
+
+    size_t offset = (size_t)(pos % queue->size);
+    size_t first = len < queue->size - offset ? len : queue->size - offset;
+    memcpy(queue->ring + offset, data, first);
+    memcpy(queue->ring, (const char *)data + first, len - first);
+}
+
+static void ring_read(log_queue *queue, uint64_t pos, void *data, size_t len) {
+
+    size_t offset = (size_t)(pos % queue->size);
+    size_t first = len < queue->size - offset ? len : queue->size - offset;
+    memcpy(data, queue->ring + offset, first);
+    memcpy((char *)data + first, queue->ring, len - first);
+}
+
+/*! @brief drops the oldest queued record, called locked
+ */
+static void drop_oldest(log_queue *queue) {
+
+    queue_header header;
+    ring_read(queue, queue->head, &header, sizeof(header));
+    queue->head += sizeof(header) + header.len;
+    queue->stats.dropped++;
+}
+
+/*! @brief appends record to the spill file, called unlocked
+ */
+static int spill(log_queue *queue, const char *record, size_t record_len) {
+
+    struct iovec iov[2] = {{(char *)record, record_len}, {"\n", 1}};
+    if (fd_writev_all(queue->spill_fd, iov, 2) != 0) {
+        printf("failed to write spill file\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+/*! @brief hands a report of the drops since the last one to the writer
+ */
+static void report_drops(log_queue *queue, uint64_t dropped) {
+
+    static const char prefix[] = "log queue overflowed, dropped ";
+    static const char suffix[] = " records";
+    char message[sizeof(prefix) + FMT_INT_SIZE + sizeof(suffix)];
+
+    size_t len = sizeof(prefix) - 1;
+    memcpy(message, prefix, len);
+    len += fmt_u64(message + len, dropped);
+    memcpy(message + len, suffix, sizeof(suffix) - 1);
+    len += sizeof(suffix) - 1;
+
+    queue->writer(queue->ctx, 0, queue->report_level, message, len);
+}
+
+static void *queue_writer(void *data) {
+
+    log_queue *queue = data;
+
+    pthread_mutex_lock(&queue->mutex);
+    while (true) {
+        while (queue->head == queue->tail && queue->stopping == false) {
+            pthread_cond_wait(&queue->not_empty, &queue->mutex);
+        }
+        if (queue->head == queue->tail) {
+            break;
+        }
+
+        // take everything queued so far in one go
+        size_t len = (size_t)(queue->tail - queue->head);
+        ring_read(queue, queue->head, queue->scratch, len);
+        queue->head = queue->tail;
+        queue->writing = true;
+        uint64_t dropped = queue->stats.dropped - queue->reported;
+        queue->reported = queue->stats.dropped;
+        pthread_cond_broadcast(&queue->not_full);
+        pthread_mutex_unlock(&queue->mutex);
+
+        uint64_t written = 0;
+        for (size_t pos = 0; pos < len; written++) {
+            queue_header header;
+            memcpy(&header, queue->scratch + pos, sizeof(header));
+            pos += sizeof(header);
+            queue->writer(queue->ctx, header.file_descriptor, header.level,
+                          queue->scratch + pos, header.len);
+            pos += header.len;
+        }
+        if (dropped != 0) {
+            report_drops(queue, dropped);
+        }
+        if (queue->batch_end != NULL) {
+            queue->batch_end(queue->ctx);
+        }
+
+        pthread_mutex_lock(&queue->mutex);
+        queue->stats.written += written;
+        queue->writing = false;
+        if (queue->head == queue->tail) {
+            pthread_cond_broadcast(&queue->drained);
+        }
+    }
+    pthread_mutex_unlock(&queue->mutex);
+
+    return NULL;
+}
+
+/*! @brief returns a new queue and starts its writer thread
+ * @param size bytes of ring space, every record takes its length plus
+ * LOG_QUEUE_RECORD_OVERHEAD
+ * @param overflow policy applied when a record does not fit
+ * @param droppable_levels bit (1 << level) is set for every level
+ * LOG_OVERFLOW_DROP_BELOW_LEVEL may drop
+ * @param spill_file file appended to by LOG_OVERFLOW_SPILL, NULL otherwise
+ * @param report_level level of the records reporting drops
+ * @param writer called by the writer thread for every record
+ * @param ctx passed to writer
+ * @return Success: pointer to the queue
+ * @return Failure: NULL pointer
+ */
+log_queue *new_log_queue(size_t size, LOG_OVERFLOW overflow,
+                         unsigned int droppable_levels, const char *spill_file,
+                         int report_level, log_queue_writer writer, void *ctx) {
+
+    if (size <= LOG_QUEUE_RECORD_OVERHEAD) {
+        printf("log queue size must exceed LOG_QUEUE_RECORD_OVERHEAD\n");
+        return NULL;
+    }
+    if (overflow == LOG_OVERFLOW_SPILL && spill_file == NULL) {
+        printf("LOG_OVERFLOW_SPILL needs a spill file\n");
+        return NULL;
+    }
+
+    log_queue *queue = calloc(1, sizeof(log_queue));
+    if (queue == NULL) {
+        printf("failed to malloc log_queue\n");
+        return NULL;
+    }
+
+    queue->ring = malloc(size);
+    queue->scratch = malloc(size);
+    if (queue->ring == NULL || queue->scratch == NULL) {
+        free(queue->ring);
+        free(queue->scratch);
+        free(queue);
+        printf("failed to malloc log_queue ring\n");
+        return NULL;
+    }
+
+    queue->spill_fd = -1;
+    if (overflow == LOG_OVERFLOW_SPILL) {
+        queue->spill_fd =
+            open(spill_file, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0640);
+        if (queue->spill_fd < 0) {
+            free(queue->ring);
+            free(queue->scratch);
+            free(queue);
+            printf("failed to open spill file\n");
+            return NULL;
+        }
+    }
+
+    queue->size = size;
+    queue->overflow = overflow;
+    queue->droppable_levels = droppable_levels;
+    queue->report_level = report_level;
+    queue->writer = writer;
+    queue->batch_end = NULL;
+    queue->ctx = ctx;
+    queue->stats.size = size;
+
+    pthread_mutex_init(&queue->mutex, NULL);
+    pthread_cond_init(&queue->not_empty, NULL);
+    pthread_cond_init(&queue->not_full, NULL);
+    pthread_cond_init(&queue->drained, NULL);
+
+    if (pthread_create(&queue->thread, NULL, queue_writer, queue) != 0) {
+        pthread_cond_destroy(&queue->drained);
+        pthread_cond_destroy(&queue->not_full);
+        pthread_cond_destroy(&queue->not_empty);
+        pthread_mutex_destroy(&queue->mutex);
+        if (queue->spill_fd >= 0) {
+            close(queue->spill_fd);
+        }
+        free(queue->ring);
+        free(queue->scratch);
+        free(queue);
+        printf("failed to start log queue writer thread\n");
+        return NULL;
+    }
+
+    return queue;
+}
+
+/*! @brief queues a copy of record, or applies the overflow policy when it does
+ * not fit
+ * @details records larger than the whole ring are written by the caller once the
+ * queue drained, unless the policy drops or spills them
+ * @return Success: 0 when the record was queued, spilled or written
+ * @return Failure: -1 when it was dropped
+ */
+int log_queue_push(log_queue *queue, int file_descriptor, int level,
+                   const char *record, size_t record_len) {
+    return log_queue_push_prefixed(queue, file_descriptor, level, record, record_len,
+                                   0);
+}
+
+/*! @brief like log_queue_push for a record starting with prefix_len bytes that
+ * are only meant for the writer, a spill file gets the rest of it
+ */
+int log_queue_push_prefixed(log_queue *queue, int file_descriptor, int level,
+                            const char *record, size_t record_len,
+                            size_t prefix_len) {
+
+    size_t needed = sizeof(queue_header) + record_len;
+    bool droppable = (queue->droppable_levels >> level & 1) != 0;
+    bool counted_block = false;
+
+    pthread_mutex_lock(&queue->mutex);
+
+    while (needed > queue->size - (size_t)(queue->tail - queue->head)) {
+        if (queue->overflow == LOG_OVERFLOW_DROP_NEWEST ||
+            (queue->overflow == LOG_OVERFLOW_DROP_BELOW_LEVEL && droppable) ||
+            (queue->overflow == LOG_OVERFLOW_DROP_OLDEST && needed > queue->size)) {
+            queue->stats.dropped++;
+            pthread_mutex_unlock(&queue->mutex);
+            return -1;
+        }
+        if (queue->overflow == LOG_OVERFLOW_DROP_OLDEST) {
+            drop_oldest(queue);
+            continue;
+        }
+        if (queue->overflow == LOG_OVERFLOW_SPILL) {
+            queue->stats.spilled++;
+            pthread_mutex_unlock(&queue->mutex);
+            return spill(queue, record + prefix_len, record_len - prefix_len);
+        }
+        if (needed > queue->size) {
+            // can never be queued, keep the order by writing it once drained
+            while (queue->head != queue->tail || queue->writing == true) {
+                pthread_cond_wait(&queue->drained, &queue->mutex);
+            }
+            queue->stats.pushed++;
+            queue->stats.written++;
+            pthread_mutex_unlock(&queue->mutex);
+            queue->writer(queue->ctx, file_descriptor, level, record, record_len);
+            return 0;
+        }
+        if (counted_block == false) {
+            queue->stats.blocked++;
+            counted_block = true;
+        }
+        pthread_cond_wait(&queue->not_full, &queue->mutex);
+    }
+
+    queue_header header = {
+        .len = (uint32_t)record_len,
+        .file_descriptor = file_descriptor,
+        .level = level,
+    };
+    ring_write(queue, queue->tail, &header, sizeof(header));
+    ring_write(queue, queue->tail + sizeof(header), record, record_len);
+    queue->tail += needed;
+
+    size_t used = (size_t)(queue->tail - queue->head);
+    if (used > queue->stats.high_water) {
+        queue->stats.high_water = used;
+    }
+    queue->stats.pushed++;
+
+    pthread_cond_signal(&queue->not_empty);
+    pthread_mutex_unlock(&queue->mutex);
+
+    return 0;
+}
+
+/*! @brief waits until every queued record was handed to the writer and written
+ */
+void log_queue_flush(log_queue *queue) {
+
+    pthread_mutex_lock(&queue->mutex);
+    while (queue->head != queue->tail || queue->writing == true) {
+        pthread_cond_wait(&queue->drained, &queue->mutex);
+    }
+    pthread_mutex_unlock(&queue->mutex);
+}
+
+/*! @brief sets a function the writer thread calls after every batch of records
+ * @note must be called before the first push
+ */
+void log_queue_on_batch_end(log_queue *queue, log_queue_batch_end batch_end) {
+    queue->batch_end = batch_end;
+}
+
+/*! @brief fills stats with the counters of the queue
+ */
+void log_queue_stats_get(log_queue *queue, log_queue_stats *stats) {
+
+    pthread_mutex_lock(&queue->mutex);
+    *stats = queue->stats;
+    stats->used = (size_t)(queue->tail - queue->head);
+    pthread_mutex_unlock(&queue->mutex);
+}
+
+/*! @brief writes out every queued record, stops the writer thread and frees the
+ * queue
+ */
+void clear_log_queue(log_queue *queue) {
+
+    if (queue == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&queue->mutex);
+    queue->stopping = true;
+    pthread_cond_signal(&queue->not_empty);
+    pthread_mutex_unlock(&queue->mutex);
+    pthread_join(queue->thread, NULL);
+
+    pthread_cond_destroy(&queue->drained);
+    pthread_cond_destroy(&queue->not_full);
+    pthread_cond_destroy(&queue->not_empty);
+    pthread_mutex_destroy(&queue->mutex);
+    if (queue->spill_fd >= 0) {
+        close(queue->spill_fd);
+    }
+    free(queue->ring);
+    free(queue->scratch);
+    free(queue);
+}
@@ -0,0 +1,166 @@
+// Copyright 2020 Bonedaddy (Alexandre Trottier)
+//
+// licensed under GNU AFFERO GENERAL PUBLIC LICENSE;
+// you may not use this file except in compliance with the License;
+// You may obtain the license via the LICENSE file in the repository root;
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/*! @file rcu.c
+ * @brief epoch based reclamation of data shared with lock free readers
+ */
+
+#define _GNU_SOURCE
+
+#include "rcu.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/membarrier.h>
+#include <sys/syscall.h>
+#endif
+
+/*! @brief per thread announcement of the epoch a reader entered in */
+typedef struct rcu_reader {
+    atomic_uint_fast64_t epoch; /*! @brief 0 while outside a read section */
+    unsigned int nesting;
+    atomic_bool in_use;   /*! @brief false once the owning thread exited */
+    struct rcu_reader *next;
+} rcu_reader;
+
+static atomic_uint_fast64_t global_epoch = 1;
+static _Atomic(rcu_reader *) readers = NULL;
+static _Thread_local rcu_reader *self = NULL;
+
+static pthread_key_t reader_key;
+static pthread_once_t reader_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t synchronize_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*! @brief whether the writer side membarrier replaces the reader side fence */
+static bool use_membarrier = false;
+
+/*! @brief pthread key destructor handing the slot of an exiting thread back */
+static void release_reader(void *data) {
+
+    rcu_reader *reader = data;
+    atomic_store(&reader->epoch, 0);
+    reader->nesting = 0;
+    atomic_store(&reader->in_use, false);
+}
+
+static void init_readers(void) {
+
+    pthread_key_create(&reader_key, release_reader);
+
+#if defined(__linux__) && defined(MEMBARRIER_CMD_PRIVATE_EXPEDITED)
+    use_membarrier =
+        syscall(SYS_membarrier, MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED, 0, 0) == 0;
+#endif
+}
+
+/*! @brief claims a slot for the calling thread, reusing those of exited threads
+ */
+static rcu_reader *register_reader(void) {
+
+    pthread_once(&reader_once, init_readers);
+
+    rcu_reader *reader = atomic_load(&readers);
+    for (; reader != NULL; reader = reader->next) {
+        bool expected = false;
+        if (atomic_compare_exchange_strong(&reader->in_use, &expected, true)) {
+            break;
+        }
+    }
+
+    if (reader == NULL) {
+        reader = calloc(1, sizeof(rcu_reader));
+        if (reader == NULL) {
+            // nothing sensible is left to do, readers must not fail
+            printf("failed to malloc rcu_reader\n");
+            abort();
+        }
+        atomic_init(&reader->in_use, true);
+        reader->next = atomic_load(&readers);
+        while (!atomic_compare_exchange_weak(&readers, &reader->next, reader)) {
+        }
+    }
+
+    pthread_setspecific(reader_key, reader);
+    self = reader;
+
+    return reader;
+}
+
+/*! @brief enters a read section, sections nest
+ */
+void rcu_read_lock(void) {
+
+    rcu_reader *reader = self != NULL ? self : register_reader();
+
+    if (reader->nesting++ != 0) {
+        return;
+    }
+
+    atomic_store_explicit(&reader->epoch,
+                          atomic_load_explicit(&global_epoch, memory_order_relaxed),
+                          memory_order_relaxed);
+    // the announcement must be visible before the protected pointer is loaded
+    if (use_membarrier == true) {
+        atomic_signal_fence(memory_order_seq_cst);
+    } else {
+        atomic_thread_fence(memory_order_seq_cst);
+    }
+}
+
+/*! @brief leaves a read section
+ */
+void rcu_read_unlock(void) {
+
+    if (--self->nesting == 0) {
+        atomic_store_explicit(&self->epoch, 0, memory_order_release);
+    }
+}
+
+/*! @brief waits until every read section that was active when called has ended
+ * @warning must not be called from inside a read section
+ */
+void synchronize_rcu(void) {
+
+    pthread_once(&reader_once, init_readers);
+    pthread_mutex_lock(&synchronize_mutex);
+
+    uint_fast64_t epoch = atomic_fetch_add(&global_epoch, 1) + 1;
+
+#if defined(__linux__) && defined(MEMBARRIER_CMD_PRIVATE_EXPEDITED)
+    if (use_membarrier == true) {
+        // runs a full barrier on every thread of the process, pairing with the
+        // compiler only fence of rcu_read_lock
+        syscall(SYS_membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED, 0, 0);
+    }
+#endif
+    atomic_thread_fence(memory_order_seq_cst);
+
+    for (rcu_reader *reader = atomic_load(&readers); reader != NULL;
+         reader = reader->next) {
+        while (true) {
+            uint_fast64_t entered = atomic_load(&reader->epoch);
+            if (entered == 0 || entered >= epoch) {
+                break;
+            }
+            sched_yield();
+        }
+    }
+
+    pthread_mutex_unlock(&synchronize_mutex);
+}
@@ -0,0 +1,586 @@
+// Copyright 2020 Bonedaddy (Alexandre Trottier)
+//
+// licensed under GNU AFFERO GENERAL PUBLIC LICENSE;
+// you may not use this file except in compliance with the License;
+// You may obtain the license via the LICENSE file in the repository root;
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/*! @file reload.c
+ * @brief runtime reconfiguration of a logger from a config file
+ */
+
+#define _GNU_SOURCE
+
+#include "reload.h"
+#include "layout.h"
+#include "rcu.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+/*! @brief a level found in a config, applied after the settings */
+typedef struct level_change {
+    const char *child; /*! @brief NULL for the root logger */
+    LOG_LEVELS level;
+    bool inherit;
+    thread_logger *target; /*! @brief the logger child resolves to */
+} level_change;
+
+struct config_watcher {
+    thread_logger *thl;
+    char *path;
+    const char *base; /*! @brief file name of path, what inotify reports */
+    int inotify_fd;   /*! @brief -1 without CONFIG_WATCH_FILE */
+    int stop_pipe[2];
+    bool sighup;
+    struct sigaction previous_sighup;
+    pthread_t thread;
+};
+
+/*! @brief written to by the SIGHUP handler, read by the watcher owning it */
+static int sighup_pipe[2] = {-1, -1};
+static config_watcher *sighup_watcher = NULL;
+static pthread_mutex_t sighup_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*! @brief strips leading and trailing whitespace in place
+ */
+static char *trim(char *str) {
+
+    while (*str == ' ' || *str == '\t') {
+        str++;
+    }
+
+    char *end = str + strlen(str);
+    while (end > str && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\r')) {
+        end--;
+    }
+    *end = '\0';
+
+    return str;
+}
+
+/*! @brief returns the index of value in names, -1 when it is not one of them
+ */
+static int parse_name(const char *value, const char *const *names, int count) {
+
+    for (int i = 0; i < count; i++) {
+        if (strcasecmp(value, names[i]) == 0) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+static bool parse_size(const char *value, size_t *size) {
+
+    char *end;
+    errno = 0;
+    unsigned long long parsed = strtoull(value, &end, 10);
+    if (errno != 0 || end == value || *end != '\0' || *value == '-') {
+        return false;
+    }
+    *size = (size_t)parsed;
+
+    return true;
+}
+
+static bool parse_level(const char *value, level_change *change) {
+
+    // indexed by LOG_LEVELS
+    static const char *const levels[] = {"info", "warn", "error", "debug"};
+
+    if (change->child != NULL && strcasecmp(value, "inherit") == 0) {
+        change->inherit = true;
+        return true;
+    }
+
+    int level = parse_name(value, levels, 4);
+    if (level == -1) {
+        return false;
+    }
+    change->level = (LOG_LEVELS)level;
+    change->inherit = false;
+
+    return true;
+}
+
+/*! @brief parses one `key = value` line into config or a level change
+ * @return Success: true
+ * @return Failure: false when the key or value is invalid
+ */
+static bool parse_line(char *key, char *value, thread_logger_config *config,
+                       level_change *changes, size_t *change_count) {
+
+    static const char *const consoles[] = {"", "stdout", "stderr"};
+    static const char *const flushes[] = {"record", "batch", "timed"};
+    static const char *const colors[] = {"auto", "always", "never"};
+    static const char *const sanitizers[] = {"none", "control", "json"};
+
+    int parsed;
+
+    if (strcmp(key, "level") == 0 || strncmp(key, "level.", 6) == 0) {
+        level_change *change = &changes[*change_count];
+        change->child = key[5] == '.' ? key + 6 : NULL;
+        if (change->child != NULL && *change->child == '\0') {
+            return false;
+        }
+        if (parse_level(value, change) == false) {
+            return false;
+        }
+        (*change_count)++;
+    } else if (strcmp(key, "layout") == 0) {
+        config->layout = value;
+    } else if (strcmp(key, "name") == 0) {
+        config->name = value;
+    } else if (strcmp(key, "console") == 0) {
+        // index 1 and 2 are the descriptors of stdout and stderr
+        if ((parsed = parse_name(value, consoles, 3)) < 1) {
+            return false;
+        }
+        config->console_fd = parsed;
+    } else if (strcmp(key, "console_flush") == 0) {
+        if ((parsed = parse_name(value, flushes, 3)) == -1) {
+            return false;
+        }
+        config->console_flush = (CONSOLE_FLUSH)parsed;
+    } else if (strcmp(key, "console_color") == 0) {
+        if ((parsed = parse_name(value, colors, 3)) == -1) {
+            return false;
+        }
+        config->console_color = (CONSOLE_COLOR)parsed;
+    } else if (strcmp(key, "sanitize") == 0) {
+        if ((parsed = parse_name(value, sanitizers, 3)) == -1) {
+            return false;
+        }
+        config->sanitize = (LOG_SANITIZE)parsed;
+    } else if (strcmp(key, "max_message_size") == 0) {
+        return parse_size(value, &config->max_message_size);
+    } else if (strcmp(key, "hexdump_max_bytes") == 0) {
+        return parse_size(value, &config->hexdump_max_bytes);
+    } else {
+        return false;
+    }
+
+    return true;
+}
+
+/*! @brief applies a config in the format described in reload.h to a root logger
+ * @param thl a root logger
+ * @param text the config, null terminated
+ * @return Success: 0
+ * @return Failure: -1 when text is invalid or the logger could not be
+ * reconfigured, nothing is changed then
+ */
+int apply_logger_config(thread_logger *thl, const char *text) {
+
+    // keys that are left out keep their current values
+    rcu_read_lock();
+    const log_settings *current = rcu_dereference(thl->settings);
+    thread_logger_config config = {
+        .console_fd = current->console_fd,
+        .console_flush = current->console_flush,
+        .console_flush_ms = current->console_flush_ms,
+        .console_color = current->console_color,
+        .max_message_size = current->max_message_size,
+        .hexdump_max_bytes = current->hexdump_max_bytes,
+        .sanitize = current->sanitize,
+    };
+    char *pattern = strdup(log_layout_pattern(current->layout));
+    char *name = strdup(log_layout_name(current->layout));
+    rcu_read_unlock();
+    config.layout = pattern;
+    config.name = name;
+
+    // values are parsed in place, so the config points into the copy
+    char *copy = strdup(text);
+    size_t lines = 1;
+    for (const char *c = text; *c != '\0'; c++) {
+        lines += *c == '\n';
+    }
+    level_change *changes = malloc(sizeof(level_change) * lines);
+    if (pattern == NULL || name == NULL || copy == NULL || changes == NULL) {
+        free(pattern);
+        free(name);
+        free(copy);
+        free(changes);
+        printf("failed to malloc logger config\n");
+        return -1;
+    }
+
+    size_t change_count = 0;
+    size_t line_number = 0;
+    int response = 0;
+
+    char *next = copy;
+    while (next != NULL && response == 0) {
+        char *line = next;
+        next = strchr(line, '\n');
+        if (next != NULL) {
+            *next++ = '\0';
+        }
+        line_number++;
+
+        line = trim(line);
+        if (*line == '\0' || *line == '#') {
+            continue;
+        }
+
+        char *equals = strchr(line, '=');
+        if (equals == NULL) {
+            printf("logger config line %zu is not a key = value pair\n", line_number);
+            response = -1;
+            break;
+        }
+        *equals = '\0';
+        char *key = trim(line);
+        char *value = trim(equals + 1);
+        if (parse_line(key, value, &config, changes, &change_count) == false) {
+            printf("logger config line %zu has an invalid %s\n", line_number, key);
+            response = -1;
+        }
+    }
+
+    // every level change is resolved before anything is applied, a child
+    // created on the way inherits its level so it changes nothing by itself
+    for (size_t i = 0; response == 0 && i < change_count; i++) {
+        changes[i].target = changes[i].child != NULL
+                                ? get_child_logger(thl, changes[i].child)
+                                : thl;
+        if (changes[i].target == NULL) {
+            response = -1;
+        }
+    }
+
+    if (response == 0) {
+        response = reconfigure_thread_logger(thl, &config);
+    }
+
+    // with the settings published, applying the levels can not fail
+    for (size_t i = 0; response == 0 && i < change_count; i++) {
+        if (changes[i].inherit == true) {
+            inherit_thread_logger_level(changes[i].target);
+        } else {
+            set_thread_logger_level(changes[i].target, changes[i].level);
+        }
+    }
+
+    free(pattern);
+    free(name);
+    free(changes);
+    free(copy);
+
+    return response;
+}
+
+/*! @brief reads the config file at path and applies it to a root logger
+ * @return Success: 0
+ * @return Failure: -1
+ */
+int load_logger_config(thread_logger *thl, const char *path) {
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        printf("failed to open logger config %s\n", path);
+        return -1;
+    }
+
+    size_t len = 0;
+    size_t cap = 4096;
+    char *text = malloc(cap);
+    while (text != NULL) {
+        if (len + 1 == cap) {
+            char *grown = realloc(text, cap * 2);
+            if (grown == NULL) {
+                free(text);
+                text = NULL;
+                break;
+            }
+            text = grown;
+            cap *= 2;
+        }
+        ssize_t n = read(fd, text + len, cap - len - 1);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n == -1) {
+            free(text);
+            text = NULL;
+            break;
+        }
+        if (n == 0) {
+            break;
+        }
+        len += (size_t)n;
+    }
+    close(fd);
+
+    if (text == NULL) {
+        printf("failed to read logger config %s\n", path);
+        return -1;
+    }
+    text[len] = '\0';
+
+    int response = apply_logger_config(thl, text);
+    free(text);
+
+    return response;
+}
+
+static void on_sighup(int signal_number) {
+
+    (void)signal_number;
+    int saved = errno;
+    ssize_t written = write(sighup_pipe[1], "", 1);
+    (void)written;
+    errno = saved;
+}
+
+/*! @brief reads everything pending from fd
+ */
+static void drain(int fd) {
+
+    char buf[64];
+    while (read(fd, buf, sizeof(buf)) > 0) {
+    }
+}
+
+/*! @brief returns whether the inotify events pending on the watcher concern its
+ * config file
+ */
+static bool file_changed(config_watcher *watcher) {
+
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    bool changed = false;
+
+    ssize_t n;
+    while ((n = read(watcher->inotify_fd, buf, sizeof(buf))) > 0) {
+        for (char *cursor = buf; cursor < buf + n;) {
+            struct inotify_event *event = (struct inotify_event *)cursor;
+            if (event->len != 0 && strcmp(event->name, watcher->base) == 0) {
+                changed = true;
+            }
+            cursor += sizeof(struct inotify_event) + event->len;
+        }
+    }
+
+    return changed;
+}
+
+/*! @brief watcher thread, reloads once per batch of changes
+ */
+static void *watch_config(void *data) {
+
+    config_watcher *watcher = data;
+
+    struct pollfd fds[3] = {{.fd = watcher->stop_pipe[0], .events = POLLIN}};
+    nfds_t count = 1;
+    if (watcher->inotify_fd != -1) {
+        fds[count++] = (struct pollfd){.fd = watcher->inotify_fd, .events = POLLIN};
+    }
+    if (watcher->sighup == true) {
+        fds[count++] = (struct pollfd){.fd = sighup_pipe[0], .events = POLLIN};
+    }
+
+    while (true) {
+        if (poll(fds, count, -1) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            printf("failed to poll logger config watcher\n");
+            break;
+        }
+        if (fds[0].revents != 0) {
+            break;
+        }
+
+        bool reload = false;
+        for (nfds_t i = 1; i < count; i++) {
+            if (fds[i].revents == 0) {
+                continue;
+            }
+            if (fds[i].fd == watcher->inotify_fd) {
+                reload |= file_changed(watcher);
+            } else {
+                drain(fds[i].fd);
+                reload = true;
+            }
+        }
+
+        if (reload == true) {
+            load_logger_config(watcher->thl, watcher->path);
+        }
+    }
+
+    return NULL;
+}
+
+/*! @brief starts watching the directory of the config file with inotify
+ */
+static int watch_file(config_watcher *watcher) {
+
+    watcher->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (watcher->inotify_fd == -1) {
+        return -1;
+    }
+
+    char *slash = strrchr(watcher->path, '/');
+    char *dir = slash == NULL
+                    ? strdup(".")
+                    : strndup(watcher->path, slash == watcher->path
+                                                 ? 1
+                                                 : (size_t)(slash - watcher->path));
+    if (dir == NULL) {
+        return -1;
+    }
+    watcher->base = slash == NULL ? watcher->path : slash + 1;
+
+    // written in place or replaced by a rename, creation alone has no content yet
+    int wd = inotify_add_watch(watcher->inotify_fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO);
+    free(dir);
+
+    return wd == -1 ? -1 : 0;
+}
+
+/*! @brief makes watcher the one receiving SIGHUP
+ */
+static int watch_sighup(config_watcher *watcher) {
+
+    pthread_mutex_lock(&sighup_mutex);
+
+    if (sighup_watcher != NULL) {
+        pthread_mutex_unlock(&sighup_mutex);
+        printf("another config watcher already handles SIGHUP\n");
+        return -1;
+    }
+    if (sighup_pipe[0] == -1 && pipe2(sighup_pipe, O_NONBLOCK | O_CLOEXEC) != 0) {
+        pthread_mutex_unlock(&sighup_mutex);
+        return -1;
+    }
+    drain(sighup_pipe[0]);
+
+    struct sigaction action = {.sa_handler = on_sighup, .sa_flags = SA_RESTART};
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGHUP, &action, &watcher->previous_sighup) != 0) {
+        pthread_mutex_unlock(&sighup_mutex);
+        return -1;
+    }
+    watcher->sighup = true;
+    sighup_watcher = watcher;
+
+    pthread_mutex_unlock(&sighup_mutex);
+
+    return 0;
+}
+
+static void unwatch_sighup(config_watcher *watcher) {
+
+    pthread_mutex_lock(&sighup_mutex);
+    sigaction(SIGHUP, &watcher->previous_sighup, NULL);
+    watcher->sighup = false;
+    sighup_watcher = NULL;
+    pthread_mutex_unlock(&sighup_mutex);
+}
+
+/*! @brief frees what new_config_watcher set up before the thread was started
+ */
+static void free_config_watcher(config_watcher *watcher) {
+
+    if (watcher->sighup == true) {
+        unwatch_sighup(watcher);
+    }
+    if (watcher->inotify_fd != -1) {
+        close(watcher->inotify_fd);
+    }
+    if (watcher->stop_pipe[0] != -1) {
+        close(watcher->stop_pipe[0]);
+        close(watcher->stop_pipe[1]);
+    }
+    free(watcher->path);
+    free(watcher);
+}
+
+/*! @brief loads the config file at path and starts a thread reloading it
+ * @param thl a root logger, must outlive the watcher
+ * @param path the config file
+ * @param flags CONFIG_WATCH_FILE and/or CONFIG_WATCH_SIGHUP
+ * @return Success: pointer to the watcher
+ * @return Failure: NULL pointer, when the file cannot be loaded or watched
+ */
+config_watcher *new_config_watcher(thread_logger *thl, const char *path, int flags) {
+
+    config_watcher *watcher = malloc(sizeof(config_watcher));
+    if (watcher == NULL) {
+        printf("failed to malloc config_watcher\n");
+        return NULL;
+    }
+
+    watcher->thl = thl;
+    watcher->path = strdup(path);
+    watcher->base = NULL;
+    watcher->inotify_fd = -1;
+    watcher->stop_pipe[0] = -1;
+    watcher->stop_pipe[1] = -1;
+    watcher->sighup = false;
+    if (watcher->path == NULL) {
+        free_config_watcher(watcher);
+        printf("failed to malloc config_watcher\n");
+        return NULL;
+    }
+
+    if (pipe2(watcher->stop_pipe, O_CLOEXEC) != 0) {
+        watcher->stop_pipe[0] = -1;
+        free_config_watcher(watcher);
+        printf("failed to create config_watcher pipe\n");
+        return NULL;
+    }
+
+    // watch before loading so a change made in between is not missed
+    if ((flags & CONFIG_WATCH_FILE) != 0 && watch_file(watcher) != 0) {
+        free_config_watcher(watcher);
+        printf("failed to watch logger config %s\n", path);
+        return NULL;
+    }
+    if ((flags & CONFIG_WATCH_SIGHUP) != 0 && watch_sighup(watcher) != 0) {
+        free_config_watcher(watcher);
+        return NULL;
+    }
+
+    if (load_logger_config(thl, path) != 0 ||
+        pthread_create(&watcher->thread, NULL, watch_config, watcher) != 0) {
+        free_config_watcher(watcher);
+        return NULL;
+    }
+
+    return watcher;
+}
+
+/*! @brief stops the watcher thread and frees the watcher
+ */
+void clear_config_watcher(config_watcher *watcher) {
+
+    if (watcher == NULL) {
+        return;
+    }
+
+    close(watcher->stop_pipe[1]);
+    watcher->stop_pipe[1] = -1;
+    pthread_join(watcher->thread, NULL);
+    close(watcher->stop_pipe[0]);
+    watcher->stop_pipe[0] = -1;
+
+    free_config_watcher(watcher);
+}
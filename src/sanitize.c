@@ -0,0 +1,279 @@
+// Copyright 2020 Bonedaddy (Alexandre Trottier)
+//
+// licensed under GNU AFFERO GENERAL PUBLIC LICENSE;
+// you may not use this file except in compliance with the License;
+// You may obtain the license via the LICENSE file in the repository root;
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/*! @file sanitize.c
+ * @brief optional escaping of untrusted message bytes
+ */
+
+#include "sanitize.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SANITIZE_X86 1
+#endif
+
+static const char hex_digits[] = "0123456789abcdef";
+
+/*! @brief returns whether byte ends the clean prefix under mode
+ */
+static bool needs_escape(uint8_t byte, LOG_SANITIZE mode) {
+    return byte < 0x20 || byte >= 0x7f ||
+           (mode == LOG_SANITIZE_JSON && (byte == '"' || byte == '\\'));
+}
+
+static size_t scan_scalar(const char *data, size_t len, LOG_SANITIZE mode) {
+
+    for (size_t i = 0; i < len; i++) {
+        if (needs_escape((uint8_t)data[i], mode)) {
+            return i;
+        }
+    }
+
+    return len;
+}
+
+#ifdef SANITIZE_X86
+static size_t scan_sse2(const char *data, size_t len, LOG_SANITIZE mode) {
+
+    // signed compares: bytes >= 0x80 are negative so they are below 0x20 as well
+    const __m128i space = _mm_set1_epi8(0x20);
+    const __m128i del = _mm_set1_epi8(0x7f);
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const bool json = mode == LOG_SANITIZE_JSON;
+
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i value = _mm_loadu_si128((const __m128i *)(data + i));
+        __m128i hits =
+            _mm_or_si128(_mm_cmplt_epi8(value, space), _mm_cmpeq_epi8(value, del));
+        if (json) {
+            hits = _mm_or_si128(hits, _mm_or_si128(_mm_cmpeq_epi8(value, quote),
+                                                   _mm_cmpeq_epi8(value, backslash)));
+        }
+        int mask = _mm_movemask_epi8(hits);
+        if (mask != 0) {
+            return i + (size_t)__builtin_ctz((unsigned int)mask);
+        }
+    }
+
+    return i + scan_scalar(data + i, len - i, mode);
+}
+
+__attribute__((target("avx2"))) static size_t scan_avx2(const char *data, size_t len,
+                                                       LOG_SANITIZE mode) {
+
+    const __m256i space = _mm256_set1_epi8(0x20);
+    const __m256i del = _mm256_set1_epi8(0x7f);
+    const __m256i quote = _mm256_set1_epi8('"');
+    const __m256i backslash = _mm256_set1_epi8('\\');
+    const bool json = mode == LOG_SANITIZE_JSON;
+
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        __m256i value = _mm256_loadu_si256((const __m256i *)(data + i));
+        // there is no cmplt for 8 bit lanes, 0x20 > value is the same test
+        __m256i hits = _mm256_or_si256(_mm256_cmpgt_epi8(space, value),
+                                       _mm256_cmpeq_epi8(value, del));
+        if (json) {
+            hits = _mm256_or_si256(hits,
+                                   _mm256_or_si256(_mm256_cmpeq_epi8(value, quote),
+                                                   _mm256_cmpeq_epi8(value, backslash)));
+        }
+        unsigned int mask = (unsigned int)_mm256_movemask_epi8(hits);
+        if (mask != 0) {
+            return i + (size_t)__builtin_ctz(mask);
+        }
+    }
+
+    // the tail runs legacy SSE code, avoid the AVX to SSE transition penalty
+    _mm256_zeroupper();
+
+    return i + scan_sse2(data + i, len - i, mode);
+}
+#endif
+
+typedef size_t (*scan_fn)(const char *data, size_t len, LOG_SANITIZE mode);
+
+static scan_fn scan_impl = scan_scalar;
+static pthread_once_t scan_impl_once = PTHREAD_ONCE_INIT;
+
+/*! @brief picks the widest scan kernel supported by the cpu
+ */
+static void select_scan_impl(void) {
+#ifdef SANITIZE_X86
+    __builtin_cpu_init();
+    scan_impl = __builtin_cpu_supports("avx2") ? scan_avx2 : scan_sse2;
+#endif
+}
+
+/*! @brief returns the length of the prefix of data that needs no escaping under
+ * mode, len if the whole message is clean
+ * @note non ASCII bytes end the prefix even when they are valid UTF-8, the caller
+ * decides with sanitize_append
+ */
+size_t sanitize_scan(const char *data, size_t len, LOG_SANITIZE mode) {
+
+    if (mode == LOG_SANITIZE_NONE) {
+        return len;
+    }
+
+    pthread_once(&scan_impl_once, select_scan_impl);
+
+    return scan_impl(data, len, mode);
+}
+
+/*! @brief returns the length of the valid UTF-8 sequence at bytes, 0 if invalid
+ * @details rejects overlong encodings, surrogates and code points past U+10FFFF
+ */
+static size_t utf8_sequence(const uint8_t *bytes, size_t len) {
+
+    uint8_t lead = bytes[0];
+    uint8_t low = 0x80;
+    uint8_t high = 0xbf;
+    size_t size;
+
+    if (lead >= 0xc2 && lead <= 0xdf) {
+        size = 2;
+    } else if (lead == 0xe0) {
+        size = 3;
+        low = 0xa0;
+    } else if (lead == 0xed) {
+        size = 3;
+        high = 0x9f;
+    } else if (lead >= 0xe1 && lead <= 0xef) {
+        size = 3;
+    } else if (lead == 0xf0) {
+        size = 4;
+        low = 0x90;
+    } else if (lead == 0xf4) {
+        size = 4;
+        high = 0x8f;
+    } else if (lead >= 0xf1 && lead <= 0xf3) {
+        size = 4;
+    } else {
+        return 0;
+    }
+
+    if (len < size || bytes[1] < low || bytes[1] > high) {
+        return 0;
+    }
+    for (size_t i = 2; i < size; i++) {
+        if ((bytes[i] & 0xc0) != 0x80) {
+            return 0;
+        }
+    }
+
+    return size;
+}
+
+/*! @brief writes the escape of a single byte that needs one, returns its length
+ */
+static size_t escape_byte(char *output, uint8_t byte, LOG_SANITIZE mode) {
+
+    switch (byte) {
+        case '\n':
+            memcpy(output, "\\n", 2);
+            return 2;
+        case '\r':
+            memcpy(output, "\\r", 2);
+            return 2;
+        default:
+            break;
+    }
+
+    if (mode == LOG_SANITIZE_JSON) {
+        switch (byte) {
+            case '"':
+                memcpy(output, "\\\"", 2);
+                return 2;
+            case '\\':
+                memcpy(output, "\\\\", 2);
+                return 2;
+            case '\t':
+                memcpy(output, "\\t", 2);
+                return 2;
+            case '\b':
+                memcpy(output, "\\b", 2);
+                return 2;
+            case '\f':
+                memcpy(output, "\\f", 2);
+                return 2;
+            case 0x7f:
+                // valid inside a JSON string
+                output[0] = (char)byte;
+                return 1;
+            default:
+                break;
+        }
+        if (byte >= 0x80) {
+            memcpy(output, "\\ufffd", 6);
+            return 6;
+        }
+        memcpy(output, "\\u00", 4);
+        output[4] = hex_digits[byte >> 4];
+        output[5] = hex_digits[byte & 0xf];
+        return 6;
+    }
+
+    if (byte == '\t') {
+        output[0] = '\t';
+        return 1;
+    }
+    output[0] = '\\';
+    output[1] = 'x';
+    output[2] = hex_digits[byte >> 4];
+    output[3] = hex_digits[byte & 0xf];
+    return 4;
+}
+
+/*! @brief appends data escaped according to mode, not null terminated
+ * @return Success: 0
+ * @return Failure: -1
+ */
+int sanitize_append(log_buffer *buf, const char *data, size_t len, LOG_SANITIZE mode) {
+
+    size_t pos = 0;
+
+    while (pos < len) {
+        size_t clean = sanitize_scan(data + pos, len - pos, mode);
+        if (log_buffer_append(buf, data + pos, clean) != 0) {
+            return -1;
+        }
+        pos += clean;
+        if (pos == len) {
+            break;
+        }
+
+        const uint8_t *hit = (const uint8_t *)data + pos;
+        size_t sequence = *hit >= 0x80 ? utf8_sequence(hit, len - pos) : 0;
+        if (sequence != 0) {
+            if (log_buffer_append(buf, data + pos, sequence) != 0) {
+                return -1;
+            }
+            pos += sequence;
+            continue;
+        }
+
+        char escaped[8];
+        if (log_buffer_append(buf, escaped, escape_byte(escaped, *hit, mode)) != 0) {
+            return -1;
+        }
+        pos++;
+    }
+
+    return 0;
+}
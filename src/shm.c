@@ -0,0 +1,660 @@
+// Copyright 2020 Bonedaddy (Alexandre Trottier)
+//
+// licensed under GNU AFFERO GENERAL PUBLIC LICENSE;
+// you may not use this file except in compliance with the License;
+// You may obtain the license via the LICENSE file in the repository root;
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/*! @file shm.c
+ * @brief record ring shared by processes and drained by one of them
+ * @details the futex words are waited on with a timeout, so a waiter notices
+ * when the process on the other side died without waking it. the drainer and
+ * every handle hold a byte of the shared memory object with an open file
+ * description lock, which the kernel drops with the last descriptor of the
+ * handle, so a dead owner is told apart without looking at pids
+ */
+
+#define _GNU_SOURCE
+
+#include "shm.h"
+#include "fdio.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+/*! @brief first bytes of an initialized ring */
+#define SHM_MAGIC "ulogshm2"
+
+/*! @brief milliseconds a waiter sleeps before it checks the other side */
+#define SHM_WAIT_MS 50
+
+/*! @brief waits of SHM_WAIT_MS for another process to initialize the ring */
+#define SHM_INIT_WAITS 100
+
+/*! @brief records written by one writev of the drainer */
+#define SHM_BATCH 512
+
+/*! @brief byte of the shared memory object locked by the drainer */
+#define SHM_LOCK_DRAINER 0
+
+/*! @brief byte locked by the handle holding lease 0, the others follow it */
+#define SHM_LOCK_LEASES 1
+
+/*! @brief states of a slot */
+enum { SLOT_RESERVED = 1, SLOT_COMMITTED = 2, SLOT_PADDING = 3 };
+
+/*! @brief states of the ring, in shm_header::ready */
+enum { RING_EMPTY = 0, RING_INITIALIZING = 1, RING_READY = 2 };
+
+/*! @brief header of a slot, followed by the record
+ */
+typedef struct shm_slot {
+    uint32_t state;
+    uint32_t len;        /*! @brief bytes of the record, or of the whole padding
+                            slot */
+    uint16_t lease;      /*! @brief lease of the handle that reserved the slot */
+    int16_t level;
+    uint32_t generation; /*! @brief of the lease when the slot was reserved */
+} shm_slot;
+
+/*! @brief start of the shared memory object, followed by the ring
+ */
+typedef struct shm_header {
+    char magic[8];
+    uint32_t ready;             /*! @brief futex word, see RING_READY */
+    uint32_t data_seq;          /*! @brief futex word bumped by every commit */
+    uint32_t space_seq;         /*! @brief futex word bumped when tail moves */
+    uint32_t drainer_waiting;   /*! @brief whether commits need to wake the drainer */
+    uint32_t producers_waiting; /*! @brief processes waiting for tail to move */
+    uint64_t size;              /*! @brief bytes of ring space */
+    pthread_mutex_t mutex;      /*! @brief robust and process shared, guards
+                                   reservations */
+    uint32_t generations[LOG_SHM_PRODUCERS]; /*! @brief bumped by every handle
+                                                taking the lease, so the slots
+                                                of its previous holder are told
+                                                apart */
+    _Alignas(64) uint64_t head; /*! @brief bytes ever reserved */
+    _Alignas(64) uint64_t tail; /*! @brief bytes ever released by the drainer */
+    _Alignas(64) uint64_t pushed;
+    uint64_t written;
+    uint64_t dropped;
+    uint64_t abandoned;
+    uint64_t batches;
+} shm_header;
+
+/*! @brief offset of the ring in the shared memory object */
+#define SHM_DATA_OFFSET ((sizeof(shm_header) + 63) & ~(size_t)63)
+
+struct log_shm {
+    shm_header *header;
+    char *data;
+    size_t map_size;
+    int file_descriptor;
+    LOG_OVERFLOW overflow;
+    bool drain;
+    bool stopping; /*! @brief tells the drainer thread to exit once idle */
+    pthread_t thread;
+    char *name;
+    int lock_fd;         /*! @brief the shared memory object, holding the locks
+                            of the handle. -1 in a forked child that could not
+                            open it again */
+    int lease;           /*! @brief locked byte of the handle past
+                            SHM_LOCK_LEASES, -1 without one */
+    uint32_t generation; /*! @brief of the lease when it was taken */
+    log_shm *next;       /*! @brief in handles */
+};
+
+/*! @brief every handle of the process, so a forked child takes over its own */
+static log_shm *handles;
+static pthread_mutex_t handles_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t atfork_once = PTHREAD_ONCE_INIT;
+
+/*! @brief sets or clears the lock of fd on byte offset of the shared memory
+ * object
+ * @param type F_WRLCK or F_UNLCK
+ * @return Success: 0
+ * @return Failure: -1 when another open file description holds it
+ */
+static int lock_byte(int fd, off_t offset, short type) {
+
+    struct flock lock = {
+        .l_type = type, .l_whence = SEEK_SET, .l_start = offset, .l_len = 1};
+    return fcntl(fd, F_OFD_SETLK, &lock);
+}
+
+/*! @brief returns whether an open file description other than the one of fd
+ * holds a lock on byte offset
+ */
+static bool byte_locked(int fd, off_t offset) {
+
+    struct flock lock = {
+        .l_type = F_WRLCK, .l_whence = SEEK_SET, .l_start = offset, .l_len = 1};
+    return fd >= 0 && fcntl(fd, F_OFD_GETLK, &lock) == 0 && lock.l_type != F_UNLCK;
+}
+
+/*! @brief takes the first free lease of the ring for shm
+ * @return Success: 0
+ * @return Failure: -1 when LOG_SHM_PRODUCERS handles hold one
+ */
+static int take_lease(log_shm *shm) {
+
+    shm->lease = -1;
+    for (int lease = 0; lease < LOG_SHM_PRODUCERS; lease++) {
+        if (lock_byte(shm->lock_fd, SHM_LOCK_LEASES + lease, F_WRLCK) == 0) {
+            shm->generation = __atomic_add_fetch(&shm->header->generations[lease], 1,
+                                                 __ATOMIC_ACQ_REL);
+            shm->lease = lease;
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+/*! @brief returns whether the handle that reserved slot still exists
+ * @details a lease taken again since has a new generation. the lock of shm
+ * itself does not conflict with its own description, so it is compared instead
+ */
+static bool slot_owner_alive(const log_shm *shm, const shm_slot *slot) {
+
+    uint32_t generation =
+        __atomic_load_n(&shm->header->generations[slot->lease], __ATOMIC_ACQUIRE);
+    if (generation != slot->generation) {
+        return false;
+    }
+
+    return slot->lease == shm->lease ||
+           byte_locked(shm->lock_fd, SHM_LOCK_LEASES + slot->lease);
+}
+
+/*! @brief returns whether a handle in any process drains the ring
+ */
+static bool drainer_alive(const log_shm *shm) {
+    return shm->drain == true || byte_locked(shm->lock_fd, SHM_LOCK_DRAINER);
+}
+
+static void fork_prepare(void) {
+    pthread_mutex_lock(&handles_mutex);
+}
+
+static void fork_parent(void) {
+    pthread_mutex_unlock(&handles_mutex);
+}
+
+/*! @brief gives every handle of a forked child locks of its own
+ * @details the child shares the open file descriptions of the parent, and with
+ * them its locks, so they are closed after opening the object again. the
+ * drainer thread is not forked, the child neither stops it nor removes the ring
+ */
+static void fork_child(void) {
+
+    for (log_shm *shm = handles; shm != NULL; shm = shm->next) {
+        shm->drain = false;
+        if (shm->lock_fd < 0) {
+            continue;
+        }
+
+        char path[32];
+        snprintf(path, sizeof(path), "/proc/self/fd/%d", shm->lock_fd);
+        int lock_fd = open(path, O_RDWR | O_CLOEXEC);
+        close(shm->lock_fd);
+        shm->lock_fd = lock_fd;
+        shm->lease = -1;
+        if (lock_fd >= 0) {
+            take_lease(shm);
+        }
+    }
+
+    pthread_mutex_unlock(&handles_mutex);
+}
+
+static void register_fork_handlers(void) {
+    pthread_atfork(fork_prepare, fork_parent, fork_child);
+}
+
+static size_t slot_size(size_t len) {
+    return (sizeof(shm_slot) + len + LOG_SHM_SLOT_ALIGNMENT - 1) &
+           ~(size_t)(LOG_SHM_SLOT_ALIGNMENT - 1);
+}
+
+/*! @brief sleeps until word no longer holds expected, it is woken or
+ * SHM_WAIT_MS passed
+ */
+static void futex_wait(uint32_t *word, uint32_t expected) {
+
+    struct timespec timeout = {0, SHM_WAIT_MS * 1000000L};
+    syscall(SYS_futex, word, FUTEX_WAIT, expected, &timeout, NULL, 0);
+}
+
+/*! @brief wakes every process sleeping on word
+ */
+static void futex_wake(uint32_t *word) {
+    syscall(SYS_futex, word, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+/*! @brief bumps word and wakes its sleepers when there may be any
+ */
+static void futex_bump(uint32_t *word, const uint32_t *waiting) {
+
+    __atomic_add_fetch(word, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(waiting, __ATOMIC_SEQ_CST) != 0) {
+        futex_wake(word);
+    }
+}
+
+/*! @brief takes the reservation mutex, repairing it when its owner died
+ */
+static void lock_ring(shm_header *header) {
+
+    if (pthread_mutex_lock(&header->mutex) == EOWNERDEAD) {
+        // head is only moved once the slot header is complete, so the ring is
+        // consistent whenever the owner died
+        pthread_mutex_consistent(&header->mutex);
+    }
+}
+
+/*! @brief initializes a ring nobody initialized yet
+ */
+static int init_ring(shm_header *header, size_t size) {
+
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    int response = pthread_mutex_init(&header->mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+    if (response != 0) {
+        return -1;
+    }
+
+    memcpy(header->magic, SHM_MAGIC, sizeof(header->magic));
+    header->size = size;
+    __atomic_store_n(&header->ready, RING_READY, __ATOMIC_RELEASE);
+    futex_wake(&header->ready);
+
+    return 0;
+}
+
+/*! @brief waits until the ring is initialized, initializing it when nobody
+ * else does
+ * @return Success: 0
+ * @return Failure: -1
+ */
+static int ready_ring(shm_header *header, size_t size) {
+
+    uint32_t state = RING_EMPTY;
+    if (__atomic_compare_exchange_n(&header->ready, &state, RING_INITIALIZING, false,
+                                    __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+        return init_ring(header, size);
+    }
+
+    for (int i = 0; state != RING_READY && i < SHM_INIT_WAITS; i++) {
+        futex_wait(&header->ready, state);
+        state = __atomic_load_n(&header->ready, __ATOMIC_ACQUIRE);
+    }
+    if (state != RING_READY ||
+        memcmp(header->magic, SHM_MAGIC, sizeof(header->magic)) != 0 ||
+        header->size != size) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/*! @brief the drainer thread, writes the committed records in ring order
+ */
+static void *drain_run(void *data) {
+
+    log_shm *shm = data;
+    shm_header *header = shm->header;
+    struct iovec iov[2 * SHM_BATCH];
+
+    while (true) {
+        // loaded before the scan, so a commit during it is not slept through
+        uint32_t seq = __atomic_load_n(&header->data_seq, __ATOMIC_SEQ_CST);
+        uint64_t tail = header->tail;
+        uint64_t head = __atomic_load_n(&header->head, __ATOMIC_ACQUIRE);
+
+        uint64_t position = tail;
+        int count = 0;
+        while (position < head && count < SHM_BATCH) {
+            shm_slot *slot = (shm_slot *)(shm->data + position % header->size);
+            uint32_t state = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE);
+            if (state == SLOT_PADDING) {
+                position += slot->len;
+                continue;
+            }
+            if (state == SLOT_COMMITTED) {
+                iov[2 * count] = (struct iovec){slot + 1, slot->len};
+                iov[2 * count + 1] = (struct iovec){"\n", 1};
+                count++;
+            } else if (slot_owner_alive(shm, slot) == true) {
+                // still being filled
+                break;
+            } else {
+                __atomic_add_fetch(&header->abandoned, 1, __ATOMIC_RELAXED);
+            }
+            position += slot_size(slot->len);
+        }
+
+        if (count > 0) {
+            // one write and one sync per batch, for every process at once
+            if (fd_writev_all(shm->file_descriptor, iov, 2 * count) != 0 ||
+                fdatasync(shm->file_descriptor) != 0) {
+                printf("failed to write shared log records\n");
+            }
+            __atomic_add_fetch(&header->written, (uint64_t)count, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&header->batches, 1, __ATOMIC_RELAXED);
+        }
+
+        if (position != tail) {
+            __atomic_store_n(&header->tail, position, __ATOMIC_SEQ_CST);
+            futex_bump(&header->space_seq, &header->producers_waiting);
+            continue;
+        }
+
+        if (__atomic_load_n(&shm->stopping, __ATOMIC_ACQUIRE) == true) {
+            break;
+        }
+        __atomic_store_n(&header->drainer_waiting, 1, __ATOMIC_SEQ_CST);
+        futex_wait(&header->data_seq, seq);
+        __atomic_store_n(&header->drainer_waiting, 0, __ATOMIC_RELAXED);
+    }
+
+    return NULL;
+}
+
+/*! @brief maps the ring called name, creating and initializing it when it does
+ * not exist
+ * @param name POSIX shared memory name, such as `/app-log`
+ * @param size bytes of ring space when the ring is created, 0 for LOG_SHM_SIZE
+ * @param overflow LOG_OVERFLOW_BLOCK waits for room while a drainer is alive,
+ * every other policy drops the record
+ * @param file_descriptor the file the records are for, see log_shm_fd
+ * @param drain whether this process starts the drainer thread writing the
+ * records to file_descriptor. fails when a live process already drains the ring
+ * @return Success: pointer to the handle
+ * @return Failure: NULL pointer, also when LOG_SHM_PRODUCERS handles are open
+ */
+log_shm *new_log_shm(const char *name, size_t size, LOG_OVERFLOW overflow,
+                     int file_descriptor, bool drain) {
+
+    pthread_once(&atfork_once, register_fork_handlers);
+
+    size = size != 0 ? size : LOG_SHM_SIZE;
+    size = (size + LOG_SHM_SLOT_ALIGNMENT - 1) & ~(size_t)(LOG_SHM_SLOT_ALIGNMENT - 1);
+    log_shm *shm = calloc(1, sizeof(log_shm));
+    char *name_copy = strdup(name);
+    if (shm == NULL || name_copy == NULL) {
+        free(shm);
+        free(name_copy);
+        printf("failed to malloc log_shm\n");
+        return NULL;
+    }
+
+    int shm_fd = shm_open(name, O_RDWR | O_CREAT, 0600);
+    struct stat shm_stat;
+    if (shm_fd < 0 || fstat(shm_fd, &shm_stat) != 0 ||
+        (shm_stat.st_size == 0 &&
+         ftruncate(shm_fd, (off_t)(SHM_DATA_OFFSET + size)) != 0)) {
+        if (shm_fd >= 0) {
+            close(shm_fd);
+        }
+        free(shm);
+        free(name_copy);
+        printf("failed to create shared memory\n");
+        return NULL;
+    }
+
+    // a ring created by another process keeps its size
+    if (shm_stat.st_size != 0) {
+        size = (size_t)shm_stat.st_size > SHM_DATA_OFFSET
+                   ? (size_t)shm_stat.st_size - SHM_DATA_OFFSET
+                   : 0;
+    }
+    void *map = size > 0 ? mmap(NULL, SHM_DATA_OFFSET + size, PROT_READ | PROT_WRITE,
+                                MAP_SHARED, shm_fd, 0)
+                         : MAP_FAILED;
+    if (map == MAP_FAILED) {
+        close(shm_fd);
+        free(shm);
+        free(name_copy);
+        printf("failed to map shared memory\n");
+        return NULL;
+    }
+
+    *shm = (log_shm){
+        .header = map,
+        .data = (char *)map + SHM_DATA_OFFSET,
+        .map_size = SHM_DATA_OFFSET + size,
+        .file_descriptor = file_descriptor,
+        .overflow = overflow,
+        .drain = drain,
+        .name = name_copy,
+        .lock_fd = shm_fd,
+        .lease = -1,
+    };
+
+    if (ready_ring(shm->header, size) != 0) {
+        printf("shared memory is not a log ring\n");
+        shm->drain = false;
+        clear_log_shm(shm);
+        return NULL;
+    }
+    if (take_lease(shm) != 0) {
+        printf("shared log ring has no free lease\n");
+        shm->drain = false;
+        clear_log_shm(shm);
+        return NULL;
+    }
+
+    if (drain == true) {
+        if (lock_byte(shm->lock_fd, SHM_LOCK_DRAINER, F_WRLCK) != 0) {
+            printf("shared log ring already has a drainer\n");
+            shm->drain = false;
+            clear_log_shm(shm);
+            return NULL;
+        }
+        if (pthread_create(&shm->thread, NULL, drain_run, shm) != 0) {
+            printf("failed to start shared log drainer\n");
+            lock_byte(shm->lock_fd, SHM_LOCK_DRAINER, F_UNLCK);
+            shm->drain = false;
+            clear_log_shm(shm);
+            return NULL;
+        }
+    }
+
+    pthread_mutex_lock(&handles_mutex);
+    shm->next = handles;
+    handles = shm;
+    pthread_mutex_unlock(&handles_mutex);
+
+    return shm;
+}
+
+/*! @brief returns the descriptor given to new_log_shm
+ */
+int log_shm_fd(const log_shm *shm) {
+    return shm->file_descriptor;
+}
+
+/*! @brief reserves a slot of len bytes for a record
+ * @details the slot must be passed to log_shm_commit once filled
+ * @param level level of the record
+ * @return Success: pointer to len bytes of the slot
+ * @return Failure: NULL pointer when the record was dropped, also in a forked
+ * child that found no free lease
+ */
+char *log_shm_reserve(log_shm *shm, int level, size_t len) {
+
+    shm_header *header = shm->header;
+    size_t size = header->size;
+    size_t needed = slot_size(len);
+    if (shm->lease < 0 || len > UINT32_MAX || needed > size) {
+        __atomic_add_fetch(&header->dropped, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+
+    while (true) {
+        lock_ring(header);
+        uint64_t head = __atomic_load_n(&header->head, __ATOMIC_RELAXED);
+        uint64_t tail = __atomic_load_n(&header->tail, __ATOMIC_SEQ_CST);
+        size_t offset = head % size;
+        size_t padding = offset + needed > size ? size - offset : 0;
+
+        if (head + padding + needed - tail <= size) {
+            // records never wrap, the end of the ring is skipped instead
+            if (padding > 0) {
+                shm_slot *pad = (shm_slot *)(shm->data + offset);
+                pad->len = (uint32_t)padding;
+                __atomic_store_n(&pad->state, SLOT_PADDING, __ATOMIC_RELAXED);
+            }
+            shm_slot *slot = (shm_slot *)(shm->data + (head + padding) % size);
+            slot->len = (uint32_t)len;
+            slot->lease = (uint16_t)shm->lease;
+            slot->level = (int16_t)level;
+            slot->generation = shm->generation;
+            __atomic_store_n(&slot->state, SLOT_RESERVED, __ATOMIC_RELAXED);
+            __atomic_store_n(&header->head, head + padding + needed, __ATOMIC_RELEASE);
+            pthread_mutex_unlock(&header->mutex);
+            return (char *)(slot + 1);
+        }
+        pthread_mutex_unlock(&header->mutex);
+
+        if (shm->overflow != LOG_OVERFLOW_BLOCK || drainer_alive(shm) == false) {
+            __atomic_add_fetch(&header->dropped, 1, __ATOMIC_RELAXED);
+            return NULL;
+        }
+
+        // the drainer wakes the waiters after moving tail, checked again here
+        // in case it moved before the waiter was counted
+        __atomic_add_fetch(&header->producers_waiting, 1, __ATOMIC_SEQ_CST);
+        uint32_t seq = __atomic_load_n(&header->space_seq, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&header->tail, __ATOMIC_SEQ_CST) == tail) {
+            futex_wait(&header->space_seq, seq);
+        }
+        __atomic_sub_fetch(&header->producers_waiting, 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+/*! @brief marks a slot returned by log_shm_reserve as ready to be written
+ */
+void log_shm_commit(log_shm *shm, char *slot) {
+
+    shm_header *header = shm->header;
+    __atomic_store_n(&((shm_slot *)slot - 1)->state, SLOT_COMMITTED, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&header->pushed, 1, __ATOMIC_RELAXED);
+    futex_bump(&header->data_seq, &header->drainer_waiting);
+}
+
+/*! @brief copies record, without its newline, into the ring
+ * @return Success: 0
+ * @return Failure: -1 when it was dropped
+ */
+int log_shm_push(log_shm *shm, int level, const char *record, size_t record_len) {
+
+    char *slot = log_shm_reserve(shm, level, record_len);
+    if (slot == NULL) {
+        return -1;
+    }
+
+    memcpy(slot, record, record_len);
+    log_shm_commit(shm, slot);
+
+    return 0;
+}
+
+/*! @brief waits until every record committed so far was written and synced by
+ * the drainer
+ * @return Success: 0
+ * @return Failure: -1 when the ring has no live drainer
+ */
+int log_shm_flush(log_shm *shm) {
+
+    shm_header *header = shm->header;
+    uint64_t target = __atomic_load_n(&header->head, __ATOMIC_ACQUIRE);
+
+    while (true) {
+        __atomic_add_fetch(&header->producers_waiting, 1, __ATOMIC_SEQ_CST);
+        uint32_t seq = __atomic_load_n(&header->space_seq, __ATOMIC_SEQ_CST);
+        bool drained = __atomic_load_n(&header->tail, __ATOMIC_SEQ_CST) >= target;
+        if (drained == false) {
+            futex_wait(&header->space_seq, seq);
+        }
+        __atomic_sub_fetch(&header->producers_waiting, 1, __ATOMIC_SEQ_CST);
+
+        if (drained == true) {
+            return 0;
+        }
+        if (drainer_alive(shm) == false) {
+            return -1;
+        }
+    }
+}
+
+/*! @brief fills stats with the counters of the ring
+ */
+void log_shm_stats_get(const log_shm *shm, log_shm_stats *stats) {
+
+    shm_header *header = shm->header;
+    *stats = (log_shm_stats){
+        .size = header->size,
+        .pushed = __atomic_load_n(&header->pushed, __ATOMIC_RELAXED),
+        .written = __atomic_load_n(&header->written, __ATOMIC_RELAXED),
+        .dropped = __atomic_load_n(&header->dropped, __ATOMIC_RELAXED),
+        .abandoned = __atomic_load_n(&header->abandoned, __ATOMIC_RELAXED),
+        .batches = __atomic_load_n(&header->batches, __ATOMIC_RELAXED),
+    };
+}
+
+/*! @brief unmaps the ring. the drainer writes out every committed record first
+ * and removes the name, so the next drainer starts with a fresh ring. a handle
+ * inherited by a forked child is only unmapped
+ */
+void clear_log_shm(log_shm *shm) {
+
+    if (shm == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&handles_mutex);
+    for (log_shm **link = &handles; *link != NULL; link = &(*link)->next) {
+        if (*link == shm) {
+            *link = shm->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&handles_mutex);
+
+    if (shm->drain == true) {
+        __atomic_store_n(&shm->stopping, true, __ATOMIC_RELEASE);
+        __atomic_add_fetch(&shm->header->data_seq, 1, __ATOMIC_SEQ_CST);
+        futex_wake(&shm->header->data_seq);
+        pthread_join(shm->thread, NULL);
+        shm_unlink(shm->name);
+    }
+
+    // closing the object drops the lease and the drainer lock
+    if (shm->lock_fd >= 0) {
+        close(shm->lock_fd);
+    }
+    munmap(shm->header, shm->map_size);
+    free(shm->name);
+    free(shm);
+}
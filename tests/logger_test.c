@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <time.h>
@@ -8,10 +9,32 @@
 #include <assert.h>
 #include <pthread.h>
 #include "logger.h"
+#include "buffer.h"
+#include "fmt.h"
+#include "hexdump.h"
+#include "sanitize.h"
+#include "pool.h"
+#include "queue.h"
+#include "rcu.h"
+#include "reload.h"
+#include "layout.h"
+#include "lock.h"
+#include "percpu.h"
+#include "context.h"
+#include "file_sink.h"
+#include "backtrace.h"
+#include "compress.h"
+#include "shm.h"
 #include "colors.h"
 #include <unistd.h>
 #include <fcntl.h>
+#include <inttypes.h>
+#include <math.h>
 #include <sys/stat.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
 
 void *test_thread_log(void *data) {
     thread_logger *thl = (thread_logger *)data;
@@ -233,13 +256,2075 @@ void test_write_colored(void **state) {
     close(fd);
 }
 
+void test_latency_histogram(void **state) {
+    latency_histogram *hist = new_latency_histogram();
+    assert_non_null(hist);
+    assert_int_equal(histogram_percentile(hist, 99), 0);
+
+    for (uint64_t i = 1; i <= 10000; i++) {
+        histogram_record(hist, i * 1000);
+    }
+    assert_int_equal(histogram_count(hist), 10000);
+
+    // buckets have a relative error of 1/HISTOGRAM_SUB_BUCKETS
+    histogram_snapshot snapshot;
+    histogram_snapshot_get(hist, &snapshot);
+    assert_int_equal(snapshot.count, 10000);
+    assert_true(snapshot.min <= 1000);
+    assert_in_range(snapshot.max, 10000000, 10000000 + 10000000 / 16);
+    assert_in_range(snapshot.p50, 5000000, 5000000 + 5000000 / 16);
+    assert_in_range(snapshot.p99, 9900000, 9900000 + 9900000 / 16);
+    assert_true(snapshot.p999 >= snapshot.p99);
+
+    histogram_reset(hist);
+    assert_int_equal(histogram_count(hist), 0);
+    clear_latency_histogram(hist);
+
+    thread_logger *thl = new_thread_logger(false);
+    assert_non_null(thl);
+    assert_int_equal(enable_latency_histograms(thl), 0);
+    pthread_t threads[4];
+    for (int i = 0; i < 4; i++) {
+        pthread_create(&threads[i], NULL, test_thread_log, thl);
+    }
+    for (int i = 0; i < 4; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    // every call is timed, including the filtered debug ones
+    assert_int_equal(histogram_count(thl->call_latency), 32);
+    // only the 24 non debug records reached the sinks
+    assert_int_equal(histogram_count(thl->sink_latency), 24);
+    assert_true(histogram_percentile(thl->call_latency, 100) >=
+                histogram_percentile(thl->sink_latency, 50));
+    clear_thread_logger(thl);
+}
+
+void test_log_layout(void **state) {
+    log_record record = {
+        .level = LOG_LEVELS_WARN,
+        .file = "main.c",
+        .file_len = 6,
+        .line = 42,
+        .message = "hello world",
+        .message_len = 11,
+    };
+
+    log_layout *layout = new_log_layout("%L %f:%l %n 100%% %q %m", "net.http");
+    assert_non_null(layout);
+    char output[layout_max_size(layout, &record) + 1];
+    output[layout_render(layout, &record, output)] = '\0';
+    assert_string_equal(output, "warn main.c:42 net.http 100% %q hello world");
+    clear_log_layout(layout);
+
+    layout = new_log_layout("%p/%t %m%m", NULL);
+    assert_non_null(layout);
+    char ids[layout_max_size(layout, &record) + 1];
+    ids[layout_render(layout, &record, ids)] = '\0';
+    char want[64];
+    snprintf(want, sizeof(want), "%d/", getpid());
+    assert_true(strncmp(ids, want, strlen(want)) == 0);
+    assert_non_null(strstr(ids, " hello worldhello world"));
+    clear_log_layout(layout);
+
+    // the default layout keeps the historical record format
+    layout = new_log_layout(LOG_LAYOUT_DEFAULT, NULL);
+    assert_non_null(layout);
+    char line[layout_max_size(layout, &record) + 1];
+    line[layout_render(layout, &record, line)] = '\0';
+    assert_true(strncmp(line, "[warn - ", 8) == 0);
+    assert_non_null(strstr(line, " - main.c:42] hello world"));
+    clear_log_layout(layout);
+
+    thread_logger_config config = {
+        .debug = true,
+        .name = "layout-test",
+        .layout = "%n | %L | %m",
+    };
+    thread_logger *thl = new_thread_logger_config(&config);
+    assert_non_null(thl);
+    LOG_INFO(thl, "rendered with a custom layout");
+    LOGF_DEBUG(thl, "%s with a custom layout", "formatted");
+    clear_thread_logger(thl);
+}
+
+void test_console_sink(void **state) {
+    int fds[2];
+    char output[256];
+    assert_int_equal(pipe(fds), 0);
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+
+    // a pipe is not a tty so colors are skipped
+    console_sink *sink = new_console_sink(fds[1], CONSOLE_FLUSH_RECORD, 0,
+                                          CONSOLE_COLOR_AUTO);
+    assert_non_null(sink);
+    assert_false(console_sink_colored(sink));
+    assert_int_equal(console_sink_write(sink, COLORS_RED, "hello world", 5), 0);
+    assert_int_equal(read(fds[0], output, sizeof(output)), 6);
+    assert_memory_equal(output, "hello\n", 6);
+    clear_console_sink(sink);
+
+    sink = new_console_sink(fds[1], CONSOLE_FLUSH_BATCH, 0, CONSOLE_COLOR_ALWAYS);
+    assert_non_null(sink);
+    assert_int_equal(console_sink_write(sink, COLORS_GREEN, "one", 3), 0);
+    assert_int_equal(console_sink_write(sink, COLORS_GREEN, "two", 3), 0);
+    assert_int_equal(read(fds[0], output, sizeof(output)), -1);
+    assert_int_equal(console_sink_flush(sink), 0);
+    char want[64];
+    int want_len = snprintf(want, sizeof(want), "%sone%s\n%stwo%s\n",
+                            ANSI_COLOR_GREEN, ANSI_COLOR_RESET, ANSI_COLOR_GREEN,
+                            ANSI_COLOR_RESET);
+    assert_int_equal(read(fds[0], output, sizeof(output)), want_len);
+    assert_memory_equal(output, want, (size_t)want_len);
+    clear_console_sink(sink);
+
+    sink = new_console_sink(fds[1], CONSOLE_FLUSH_TIMED, 5, CONSOLE_COLOR_NEVER);
+    assert_non_null(sink);
+    assert_int_equal(console_sink_write(sink, COLORS_GREEN, "timed", 5), 0);
+    usleep(100 * 1000);
+    assert_int_equal(read(fds[0], output, sizeof(output)), 6);
+    assert_memory_equal(output, "timed\n", 6);
+    clear_console_sink(sink);
+
+    thread_logger_config config = {
+        .console_fd = fds[1],
+        .console_flush = CONSOLE_FLUSH_BATCH,
+        .layout = "%L %m",
+    };
+    thread_logger *thl = new_thread_logger_config(&config);
+    assert_non_null(thl);
+    LOG_WARN(thl, "buffered");
+    assert_int_equal(read(fds[0], output, sizeof(output)), -1);
+    assert_int_equal(flush_thread_logger(thl), 0);
+    assert_int_equal(read(fds[0], output, sizeof(output)), 14);
+    assert_memory_equal(output, "warn buffered\n", 14);
+    clear_thread_logger(thl);
+
+    close(fds[0]);
+    close(fds[1]);
+}
+
+static int test_buffer_printf(log_buffer *buf, size_t max_len, const char *format,
+                              ...) {
+    va_list args;
+    va_start(args, format);
+    int response = log_buffer_vprintf(buf, max_len, format, args);
+    va_end(args);
+    return response;
+}
+
+static int test_fmt_vformat(log_buffer *buf, size_t max_len, const char *format,
+                            ...) {
+    va_list args;
+    va_start(args, format);
+    int response = fmt_vformat(buf, max_len, format, args);
+    va_end(args);
+    return response;
+}
+
+static void test_large_records_log(thread_logger *thl, char *message) {
+    LOGF_INFO(thl, "%s", message);
+    LOG_INFO(thl, message);
+}
+
+void test_large_records(void **state) {
+    log_buffer *buf = thread_log_buffer(LOG_BUFFER_MESSAGE);
+    assert_int_equal(log_buffer_append(buf, "prefix ", 7), 0);
+    assert_int_equal(test_buffer_printf(buf, 64, "%d-%s", 7, "x"), 0);
+    assert_string_equal(buf->data, "prefix 7-x");
+    // forces the measured second pass
+    char wide[LOG_BUFFER_INITIAL_SIZE * 4];
+    memset(wide, 'w', sizeof(wide) - 1);
+    wide[sizeof(wide) - 1] = '\0';
+    assert_int_equal(test_buffer_printf(buf, sizeof(wide), "%s", wide), 0);
+    assert_int_equal(buf->len, 10 + sizeof(wide) - 1);
+    assert_true(buf->cap >= buf->len + 1);
+    buf = thread_log_buffer(LOG_BUFFER_MESSAGE);
+    assert_int_equal(test_buffer_printf(buf, 20, "%s", wide), 0);
+    assert_int_equal(buf->len, 20);
+    assert_string_equal(buf->data, "wwwwww" LOG_TRUNCATION_MARKER);
+    log_buffer_release(buf);
+
+    size_t big_len = 3 * 1024 * 1024;
+    char *big = malloc(big_len + 1);
+    assert_non_null(big);
+    memset(big, 'j', big_len);
+    big[big_len] = '\0';
+
+    int fd = open("large_records_test.log", O_RDWR | O_CREAT | O_TRUNC | O_APPEND,
+                  0640);
+    assert_true(fd > 0);
+    thread_logger_config config = {.console_fd = fd, .layout = "%m"};
+    thread_logger *thl = new_thread_logger_config(&config);
+    assert_non_null(thl);
+
+    // below the default cap nothing is cut, even though the message is far larger
+    // than any stack buffer the logger used to format into
+    big[512 * 1024] = '\0';
+    test_large_records_log(thl, big);
+    big[512 * 1024] = 'j';
+    assert_int_equal(lseek(fd, 0, SEEK_END), 2 * (512 * 1024 + 1));
+
+    // above the default cap messages end with the truncation marker
+    assert_int_equal(ftruncate(fd, 0), 0);
+    test_large_records_log(thl, big);
+    off_t size = lseek(fd, 0, SEEK_END);
+    assert_int_equal(size, 2 * (LOG_MESSAGE_MAX_DEFAULT + 1));
+    char tail[sizeof(LOG_TRUNCATION_MARKER)];
+    assert_int_equal(pread(fd, tail, sizeof(tail), size - (off_t)sizeof(tail)),
+                     sizeof(tail));
+    assert_memory_equal(tail, LOG_TRUNCATION_MARKER "\n", sizeof(tail));
+    clear_thread_logger(thl);
+
+    config.max_message_size = 32;
+    thl = new_thread_logger_config(&config);
+    assert_non_null(thl);
+    assert_int_equal(ftruncate(fd, 0), 0);
+    test_large_records_log(thl, big);
+    LOGF_INFO(thl, "%s", "short");
+    char output[128];
+    assert_int_equal(pread(fd, output, sizeof(output), 0), 2 * 33 + 6);
+    assert_memory_equal(output, "jjjjjjjjjjjjjjjjjj" LOG_TRUNCATION_MARKER "\n", 33);
+    assert_memory_equal(output + 33, output, 33);
+    assert_memory_equal(output + 66, "short\n", 6);
+    clear_thread_logger(thl);
+
+    close(fd);
+    unlink("large_records_test.log");
+    free(big);
+}
+
+// formats with fmt_vformat and snprintf and compares the results
+static void test_fmt_compare(const char *format, ...) {
+    char want[512];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(want, sizeof(want), format, args);
+    va_end(args);
+
+    log_buffer *buf = thread_log_buffer(LOG_BUFFER_MESSAGE);
+    va_start(args, format);
+    assert_int_equal(fmt_vformat(buf, LOG_MESSAGE_MAX_DEFAULT, format, args), 0);
+    va_end(args);
+    assert_string_equal(buf->data, want);
+}
+
+void test_fmt_kernels(void **state) {
+    char got[FMT_FIXED_SIZE + 1];
+    char want[64];
+
+    int64_t ints[] = {0, 1, -1, 9, 10, 99, 100, 12345, -98765, INT32_MAX, INT32_MIN,
+                      INT64_MAX, INT64_MIN, 1000000000000000000LL,
+                      0x0123456789ABCDEFLL, -0x0123456789ABCDF0LL};
+    for (size_t i = 0; i < sizeof(ints) / sizeof(ints[0]); i++) {
+        got[fmt_i64(got, ints[i])] = '\0';
+        snprintf(want, sizeof(want), "%" PRId64, ints[i]);
+        assert_string_equal(got, want);
+        got[fmt_u64(got, (uint64_t)ints[i])] = '\0';
+        snprintf(want, sizeof(want), "%" PRIu64, (uint64_t)ints[i]);
+        assert_string_equal(got, want);
+        got[fmt_hex64(got, (uint64_t)ints[i], false)] = '\0';
+        snprintf(want, sizeof(want), "%" PRIx64, (uint64_t)ints[i]);
+        assert_string_equal(got, want);
+        got[fmt_hex64(got, (uint64_t)ints[i], true)] = '\0';
+        snprintf(want, sizeof(want), "%" PRIX64, (uint64_t)ints[i]);
+        assert_string_equal(got, want);
+    }
+
+    // every length through the SSE2 blocks, the SWAR words and the byte tail
+    unsigned char bytes[40];
+    char hex[2 * sizeof(bytes) + 1];
+    for (size_t i = 0; i < sizeof(bytes); i++) {
+        bytes[i] = (unsigned char)(i * 37 + 5);
+    }
+    for (size_t len = 0; len <= sizeof(bytes); len++) {
+        hex[fmt_hex_bytes(hex, bytes, len)] = '\0';
+        for (size_t i = 0; i < len; i++) {
+            snprintf(want, sizeof(want), "%02x", bytes[i]);
+            assert_memory_equal(hex + 2 * i, want, 2);
+        }
+        assert_int_equal(strlen(hex), 2 * len);
+    }
+
+    // ties round to even on the exact binary value, like glibc
+    double doubles[] = {0.0, -0.0, 0.5, 1.5, 2.5, 0.125, 0.25, 1.0 / 3.0, -2.675,
+                        123456.789, 999999.9999999, 1e15, 1.8e19, 0.001953125};
+    for (size_t i = 0; i < sizeof(doubles) / sizeof(doubles[0]); i++) {
+        for (int precision = 0; precision <= FMT_FIXED_MAX_PRECISION; precision++) {
+            size_t len = fmt_fixed(got, doubles[i], precision);
+            assert_true(len > 0);
+            got[len] = '\0';
+            snprintf(want, sizeof(want), "%.*f", precision, doubles[i]);
+            assert_string_equal(got, want);
+        }
+    }
+    double scales[] = {1e-3, 1e-2, 1e-1, 1, 1e1, 1e2, 1e3, 1e4, 1e6, 1e9, 1e12};
+    srand(42);
+    for (int i = 0; i < 20000; i++) {
+        double value = (double)rand() / RAND_MAX * scales[rand() % 11];
+        size_t len = fmt_fixed(got, value, 6);
+        if (len == 0) {
+            continue;
+        }
+        got[len] = '\0';
+        snprintf(want, sizeof(want), "%f", value);
+        assert_string_equal(got, want);
+    }
+    assert_int_equal(fmt_fixed(got, 1e300, 6), 0);
+    assert_int_equal(fmt_fixed(got, NAN, 6), 0);
+
+    test_fmt_compare("plain");
+    test_fmt_compare("%d %i %u %x %X %c %s %%", -5, 7, 4000000000u, 0xbeefu, 0xbeefu,
+                     'q', "str");
+    test_fmt_compare("%ld %lu %lld %llu %zu %lx", -1L, 2UL, -3LL, 4ULL, (size_t)5,
+                     0xabcUL);
+    test_fmt_compare("%f %.2f %.0f %lf", 3.14159, 2.675, 0.5, -1.25);
+    test_fmt_compare("%p %p %s", (void *)0x1234, NULL, (char *)NULL);
+    // falls back to vsnprintf
+    test_fmt_compare("%5d|%-4s|%e|%g|%.3s|%08.3f", 42, "ab", 1.5, 0.1, "abcdef",
+                     3.14159);
+    test_fmt_compare("%f %s", 1e300, "after");
+
+    // truncation follows log_buffer_vprintf
+    log_buffer *buf = thread_log_buffer(LOG_BUFFER_MESSAGE);
+    char long_arg[64];
+    memset(long_arg, 'z', sizeof(long_arg) - 1);
+    long_arg[sizeof(long_arg) - 1] = '\0';
+    assert_int_equal(test_fmt_vformat(buf, 20, "%s%d", long_arg, 1), 0);
+    assert_int_equal(buf->len, 20);
+    assert_string_equal(buf->data, "zzzzzz" LOG_TRUNCATION_MARKER);
+}
+
+void test_hexdump(void **state) {
+    uint8_t payload[40];
+    for (size_t i = 0; i < sizeof(payload); i++) {
+        payload[i] = (uint8_t)(i * 7 + 0x30);
+    }
+    memcpy(payload, "Hello world\n\x00\x01\xff\x7f", 16);
+
+    char line[HEXDUMP_LINE_SIZE + 1];
+    line[hexdump_line(line, payload, 16, 0)] = '\0';
+    assert_string_equal(line, "00000000  48 65 6c 6c 6f 20 77 6f  72 6c 64 0a 00 01 "
+                              "ff 7f  |Hello world.....|");
+    line[hexdump_line(line, payload + 16, 3, 0x10)] = '\0';
+    assert_string_equal(line, "00000010  a0 a7 ae                                  "
+                              "        |...|");
+
+    int fds[2];
+    assert_int_equal(pipe(fds), 0);
+    thread_logger_config config = {
+        .console_fd = fds[1], .layout = "%m", .hexdump_max_bytes = 20};
+    thread_logger *thl = new_thread_logger_config(&config);
+    assert_non_null(thl);
+
+    LOG_HEXDUMP(thl, LOG_LEVELS_INFO, payload, 4, "packet");
+    // truncated at hexdump_max_bytes
+    LOG_HEXDUMP(thl, LOG_LEVELS_WARN, payload, sizeof(payload), NULL);
+    // debug is disabled, so the payload must not be read
+    LOG_HEXDUMP(thl, LOG_LEVELS_DEBUG, (const void *)1, 1024, "never");
+
+    char output[1024] = {0};
+    assert_true(read(fds[0], output, sizeof(output) - 1) > 0);
+    assert_string_equal(
+        output,
+        "packet (4 bytes)\n"
+        "00000000  48 65 6c 6c                                    "
+        "   |Hell|\n"
+        "hexdump (40 bytes)\n"
+        "00000000  48 65 6c 6c 6f 20 77 6f  72 6c 64 0a 00 01 ff 7f  "
+        "|Hello world.....|\n"
+        "00000010  a0 a7 ae b5                                    "
+        "   |....|\n"
+        "... 20 more bytes\n");
+
+    clear_thread_logger(thl);
+    close(fds[0]);
+    close(fds[1]);
+}
+
+// escapes data with sanitize_append and compares the result
+static void test_sanitize_compare(LOG_SANITIZE mode, const char *data,
+                                  const char *want) {
+    log_buffer *buf = thread_log_buffer(LOG_BUFFER_SANITIZED);
+    assert_int_equal(sanitize_append(buf, data, strlen(data), mode), 0);
+    assert_int_equal(log_buffer_append(buf, "", 1), 0);
+    assert_string_equal(buf->data, want);
+}
+
+void test_sanitize(void **state) {
+    // hits at every position of a message longer than both vector widths
+    char clean[100];
+    memset(clean, 'a', sizeof(clean));
+    assert_int_equal(sanitize_scan(clean, sizeof(clean), LOG_SANITIZE_NONE),
+                     sizeof(clean));
+    assert_int_equal(sanitize_scan(clean, sizeof(clean), LOG_SANITIZE_JSON),
+                     sizeof(clean));
+    const char hits[] = {'\n', 0x1b, 0x7f, (char)0x80, (char)0xff, '"', '\\'};
+    for (size_t pos = 0; pos < sizeof(clean); pos++) {
+        for (size_t i = 0; i < sizeof(hits); i++) {
+            char saved = clean[pos];
+            clean[pos] = hits[i];
+            bool json_only = hits[i] == '"' || hits[i] == '\\';
+            assert_int_equal(sanitize_scan(clean, sizeof(clean), LOG_SANITIZE_JSON),
+                             pos);
+            assert_int_equal(sanitize_scan(clean, sizeof(clean), LOG_SANITIZE_CONTROL),
+                             json_only ? sizeof(clean) : pos);
+            clean[pos] = saved;
+        }
+    }
+
+    test_sanitize_compare(LOG_SANITIZE_CONTROL, "plain\ttext", "plain\ttext");
+    test_sanitize_compare(LOG_SANITIZE_CONTROL, "forged\n[info - x] line\r",
+                          "forged\\n[info - x] line\\r");
+    test_sanitize_compare(LOG_SANITIZE_CONTROL, "\x1b[31mred\x7f \"q\" \\",
+                          "\\x1b[31mred\\x7f \"q\" \\");
+    // valid UTF-8 passes, invalid, overlong and surrogate bytes are escaped
+    test_sanitize_compare(LOG_SANITIZE_CONTROL, "caf\xc3\xa9 \xe2\x82\xac \xf0\x9f\x98\x80",
+                          "caf\xc3\xa9 \xe2\x82\xac \xf0\x9f\x98\x80");
+    test_sanitize_compare(LOG_SANITIZE_CONTROL, "bad \xc3 \xc0\xaf \xed\xa0\x80",
+                          "bad \\xc3 \\xc0\\xaf \\xed\\xa0\\x80");
+    test_sanitize_compare(LOG_SANITIZE_JSON, "{\"k\": \"a\\b\"}\n\t\x01\xff",
+                          "{\\\"k\\\": \\\"a\\\\b\\\"}\\n\\t\\u0001\\ufffd");
+
+    int fds[2];
+    assert_int_equal(pipe(fds), 0);
+    thread_logger_config config = {
+        .console_fd = fds[1], .layout = "%m", .sanitize = LOG_SANITIZE_CONTROL};
+    thread_logger *thl = new_thread_logger_config(&config);
+    assert_non_null(thl);
+    LOG_INFO(thl, "user=admin\n[info - fake] \x1b[2J");
+    LOGF_INFO(thl, "user=%s", "x\ry");
+    LOG_INFO(thl, "clean");
+    info_log(thl, 0, "a\nb");
+    char output[256] = {0};
+    assert_true(read(fds[0], output, sizeof(output) - 1) > 0);
+    assert_string_equal(output, "user=admin\\n[info - fake] \\x1b[2J\n"
+                                "user=x\\ry\n"
+                                "clean\n"
+                                "[info - a\\nb\n");
+    clear_thread_logger(thl);
+
+    // the marker fits in the cap and a cut never splits a character
+    config.max_message_size = 20;
+    thl = new_thread_logger_config(&config);
+    assert_non_null(thl);
+    info_log(thl, 0, "01234\n6789abcdefghijkl");
+    info_log(thl, 0, "aaaaa\xc3\xa9zzzzzzzzzzzzzz");
+    LOG_INFO(thl, "aaaaa\xc3\xa9zzzzzzzzzzzzzz");
+    memset(output, 0, sizeof(output));
+    assert_true(read(fds[0], output, sizeof(output) - 1) > 0);
+    assert_string_equal(output, "[info - 01234\\n...[truncated]\n"
+                                "[info - aaaaa...[truncated]\n"
+                                "aaaaa...[truncated]\n");
+    clear_thread_logger(thl);
+
+    // only the label of a hexdump is escaped, not the newlines between lines
+    config.max_message_size = 0;
+    thl = new_thread_logger_config(&config);
+    assert_non_null(thl);
+    LOG_HEXDUMP(thl, LOG_LEVELS_INFO, "\x1b", 1, "pkt\n");
+    memset(output, 0, sizeof(output));
+    assert_true(read(fds[0], output, sizeof(output) - 1) > 0);
+    assert_string_equal(output, "pkt\\n (1 bytes)\n"
+                                "00000000  1b                                      "
+                                "          |.|\n");
+    clear_thread_logger(thl);
+    close(fds[0]);
+    close(fds[1]);
+}
+
+typedef struct test_pool_release_args {
+    record_pool *pool;
+    log_buffer *slab;
+} test_pool_release_args;
+
+static void *test_pool_release(void *data) {
+    test_pool_release_args *args = data;
+    usleep(10000);
+    record_pool_release(args->pool, args->slab);
+    return NULL;
+}
+
+void test_record_pool(void **state) {
+    assert_null(new_record_pool(100, 4096, 0, RECORD_POOL_EXHAUSTED_DROP));
+
+    record_pool *pool = new_record_pool(3 * 256 + 100, 256, 0,
+                                        RECORD_POOL_EXHAUSTED_DROP);
+    assert_non_null(pool);
+    log_buffer slabs[4];
+    for (int i = 0; i < 3; i++) {
+        assert_int_equal(record_pool_acquire(pool, &slabs[i]), RECORD_POOL_ACQUIRED);
+        assert_true(slabs[i].fixed);
+        assert_int_equal(slabs[i].cap, 256);
+        assert_true(record_pool_owns(pool, &slabs[i]));
+    }
+    assert_int_equal(record_pool_acquire(pool, &slabs[3]), RECORD_POOL_DROPPED);
+
+    // slabs never grow past their size
+    assert_int_equal(log_buffer_append(&slabs[0], "abc", 3), 0);
+    assert_int_equal(log_buffer_reserve(&slabs[0], 253), 0);
+    assert_int_equal(log_buffer_reserve(&slabs[0], 254), -1);
+
+    record_pool_stats stats;
+    record_pool_stats_get(pool, &stats);
+    assert_int_equal(stats.slabs, 3);
+    assert_int_equal(stats.in_use, 3);
+    assert_int_equal(stats.high_water, 3);
+    assert_int_equal(stats.exhausted, 1);
+    assert_int_equal(stats.dropped, 1);
+
+    for (int i = 0; i < 3; i++) {
+        record_pool_release(pool, &slabs[i]);
+    }
+    record_pool_stats_get(pool, &stats);
+    assert_int_equal(stats.in_use, 0);
+    assert_int_equal(stats.high_water, 3);
+    clear_record_pool(pool);
+
+    // a blocked acquire wakes up once another thread releases a slab
+    pool = new_record_pool(256, 256, 0, RECORD_POOL_EXHAUSTED_BLOCK);
+    assert_non_null(pool);
+    assert_int_equal(record_pool_acquire(pool, &slabs[0]), RECORD_POOL_ACQUIRED);
+    test_pool_release_args args = {.pool = pool, .slab = &slabs[0]};
+    pthread_t thread;
+    assert_int_equal(pthread_create(&thread, NULL, test_pool_release, &args), 0);
+    assert_int_equal(record_pool_acquire(pool, &slabs[1]), RECORD_POOL_ACQUIRED);
+    pthread_join(thread, NULL);
+    record_pool_release(pool, &slabs[1]);
+    record_pool_stats_get(pool, &stats);
+    assert_int_equal(stats.exhausted, 1);
+    assert_int_equal(stats.dropped, 0);
+    clear_record_pool(pool);
+
+    pool = new_record_pool(256, 256, 0, RECORD_POOL_EXHAUSTED_HEAP);
+    assert_non_null(pool);
+    assert_int_equal(record_pool_acquire(pool, &slabs[0]), RECORD_POOL_ACQUIRED);
+    assert_int_equal(record_pool_acquire(pool, &slabs[1]), RECORD_POOL_FALLBACK);
+    record_pool_stats_get(pool, &stats);
+    assert_int_equal(stats.fallbacks, 1);
+    record_pool_release(pool, &slabs[0]);
+    clear_record_pool(pool);
+
+    // records are rendered in slabs and messages capped at half a slab
+    int fds[2];
+    assert_int_equal(pipe(fds), 0);
+    thread_logger_config config = {.console_fd = fds[1],
+                                   .layout = "%L %m",
+                                   .pool_budget = 2 * 64,
+                                   .pool_slab_size = 64,
+                                   .pool_flags = RECORD_POOL_HUGEPAGES};
+    thread_logger *thl = new_thread_logger_config(&config);
+    assert_non_null(thl);
+    assert_int_equal(thl->settings->max_message_size, 32);
+    LOG_INFO(thl, "pooled");
+    LOGF_WARN(thl, "%d slabs", 2);
+    LOG_INFO(thl, "0123456789012345678901234567890123456789");
+    info_log(thl, 0, "direct");
+    char output[256] = {0};
+    assert_true(read(fds[0], output, sizeof(output) - 1) > 0);
+    assert_string_equal(output, "info pooled\n"
+                                "warn 2 slabs\n"
+                                "info 012345678901234567...[truncated]\n"
+                                "[info - direct\n");
+    record_pool_stats_get(thl->pool, &stats);
+    assert_int_equal(stats.in_use, 0);
+    assert_int_equal(stats.high_water, 1);
+    assert_int_equal(stats.oversized, 0);
+    clear_thread_logger(thl);
+
+    // a record whose file name alone outgrows the slab is counted, and moves to
+    // the heap when the policy allows it
+    const char *file = "a_source_file_with_a_name_longer_than_a_whole_pool_slab.c";
+    config.layout = "%L %f %m";
+    for (int heap = 0; heap < 2; heap++) {
+        config.pool_exhausted = heap ? RECORD_POOL_EXHAUSTED_HEAP
+                                     : RECORD_POOL_EXHAUSTED_DROP;
+        thl = new_thread_logger_config(&config);
+        assert_non_null(thl);
+        logn_func(thl, 0, "long", 4, LOG_LEVELS_INFO, file, 1);
+        LOG_INFO(thl, "short");
+        record_pool_stats_get(thl->pool, &stats);
+        assert_int_equal(stats.oversized, 1);
+        assert_int_equal(stats.dropped, heap ? 0 : 1);
+        assert_int_equal(stats.fallbacks, heap ? 1 : 0);
+        assert_int_equal(stats.in_use, 0);
+        clear_thread_logger(thl);
+    }
+    memset(output, 0, sizeof(output));
+    assert_true(read(fds[0], output, sizeof(output) - 1) > 0);
+    assert_string_equal(output, "info logger_test.c short\n"
+                                "info a_source_file_with_a_name_longer_than_a_whole_pool_"
+                                "slab.c long\n"
+                                "info logger_test.c short\n");
+    close(fds[0]);
+    close(fds[1]);
+}
+
+typedef struct test_queue_sink {
+    int open;
+    int entered;
+    char output[512];
+    size_t len;
+} test_queue_sink;
+
+static void test_queue_write(void *ctx, int file_descriptor, int level,
+                             const char *record, size_t record_len) {
+    (void)file_descriptor;
+    test_queue_sink *sink = ctx;
+    __atomic_add_fetch(&sink->entered, 1, __ATOMIC_SEQ_CST);
+    // the test keeps the gate closed to simulate a stalled disk
+    while (__atomic_load_n(&sink->open, __ATOMIC_SEQ_CST) == 0) {
+        usleep(1000);
+    }
+    sink->len += (size_t)snprintf(sink->output + sink->len, sizeof(sink->output) - sink->len,
+                                  "%d:%.*s;", level, (int)record_len, record);
+}
+
+/*! @brief stalls the writer on "a", then pushes records b to f into a queue with
+ * room for three of them
+ */
+static log_queue *test_queue_stall(test_queue_sink *sink, LOG_OVERFLOW overflow,
+                                   const char *spill_file) {
+    memset(sink, 0, sizeof(*sink));
+    log_queue *queue = new_log_queue(3 * (LOG_QUEUE_RECORD_OVERHEAD + 1), overflow,
+                                     1u << LOG_LEVELS_DEBUG, spill_file,
+                                     LOG_LEVELS_WARN, test_queue_write, sink);
+    assert_non_null(queue);
+    assert_int_equal(log_queue_push(queue, 0, LOG_LEVELS_INFO, "a", 1), 0);
+    while (__atomic_load_n(&sink->entered, __ATOMIC_SEQ_CST) == 0) {
+        usleep(1000);
+    }
+    const char *records[] = {"b", "c", "d", "e", "f"};
+    for (int i = 0; i < 5; i++) {
+        log_queue_push(queue, 0, i < 3 ? LOG_LEVELS_DEBUG : LOG_LEVELS_ERROR,
+                       records[i], 1);
+    }
+    return queue;
+}
+
+static void test_queue_finish(test_queue_sink *sink, log_queue *queue,
+                              const char *want) {
+    __atomic_store_n(&sink->open, 1, __ATOMIC_SEQ_CST);
+    log_queue_flush(queue);
+    assert_string_equal(sink->output, want);
+    clear_log_queue(queue);
+}
+
+static void *test_queue_unblock(void *data) {
+    usleep(20000);
+    __atomic_store_n(&((test_queue_sink *)data)->open, 1, __ATOMIC_SEQ_CST);
+    return NULL;
+}
+
+void test_log_queue(void **state) {
+    test_queue_sink sink;
+    log_queue_stats stats;
+
+    log_queue *queue = test_queue_stall(&sink, LOG_OVERFLOW_DROP_NEWEST, NULL);
+    log_queue_stats_get(queue, &stats);
+    assert_int_equal(stats.pushed, 4);
+    assert_int_equal(stats.dropped, 2);
+    assert_int_equal(stats.used, 3 * (LOG_QUEUE_RECORD_OVERHEAD + 1));
+    assert_int_equal(stats.high_water, stats.used);
+    test_queue_finish(&sink, queue,
+                      "0:a;3:b;3:c;3:d;1:log queue overflowed, dropped 2 records;");
+
+    queue = test_queue_stall(&sink, LOG_OVERFLOW_DROP_OLDEST, NULL);
+    test_queue_finish(&sink, queue,
+                      "0:a;3:d;2:e;2:f;1:log queue overflowed, dropped 2 records;");
+
+    queue = test_queue_stall(&sink, LOG_OVERFLOW_SPILL, "queue_spill.log");
+    test_queue_finish(&sink, queue, "0:a;3:b;3:c;3:d;");
+    int fd = open("queue_spill.log", O_RDONLY);
+    assert_true(fd >= 0);
+    char spilled[16] = {0};
+    assert_int_equal(read(fd, spilled, sizeof(spilled)), 4);
+    assert_string_equal(spilled, "e\nf\n");
+    close(fd);
+    unlink("queue_spill.log");
+
+    // debug records are dropped, errors wait for the stalled writer
+    memset(&sink, 0, sizeof(sink));
+    queue = new_log_queue(2 * (LOG_QUEUE_RECORD_OVERHEAD + 1),
+                          LOG_OVERFLOW_DROP_BELOW_LEVEL, 1u << LOG_LEVELS_DEBUG, NULL,
+                          LOG_LEVELS_WARN, test_queue_write, &sink);
+    assert_non_null(queue);
+    assert_int_equal(log_queue_push(queue, 0, LOG_LEVELS_INFO, "a", 1), 0);
+    while (__atomic_load_n(&sink.entered, __ATOMIC_SEQ_CST) == 0) {
+        usleep(1000);
+    }
+    assert_int_equal(log_queue_push(queue, 0, LOG_LEVELS_INFO, "b", 1), 0);
+    assert_int_equal(log_queue_push(queue, 0, LOG_LEVELS_INFO, "c", 1), 0);
+    assert_int_equal(log_queue_push(queue, 0, LOG_LEVELS_DEBUG, "d", 1), -1);
+    pthread_t thread;
+    assert_int_equal(pthread_create(&thread, NULL, test_queue_unblock, &sink), 0);
+    assert_int_equal(log_queue_push(queue, 0, LOG_LEVELS_ERROR, "e", 1), 0);
+    pthread_join(thread, NULL);
+    log_queue_flush(queue);
+    log_queue_stats_get(queue, &stats);
+    assert_int_equal(stats.blocked, 1);
+    assert_int_equal(stats.dropped, 1);
+    assert_int_equal(stats.written, 4);
+    clear_log_queue(queue);
+
+    // records still queued are written before the file is closed
+    unlink("queue_file.log");
+    thread_logger_config file_config = {
+        .console_fd = -1, .layout = "%m", .queue_size = 4096};
+    file_logger *fhl = new_file_logger_config("queue_file.log", &file_config);
+    assert_non_null(fhl);
+    for (int i = 0; i < 100; i++) {
+        fLOG_INFO(fhl, "queued record");
+    }
+    clear_file_logger(fhl);
+    struct stat file_stat;
+    assert_int_equal(stat("queue_file.log", &file_stat), 0);
+    assert_int_equal(file_stat.st_size, 100 * strlen("queued record\n"));
+    unlink("queue_file.log");
+
+    // records go through the writer thread, larger ones than the queue as well
+    int fds[2];
+    assert_int_equal(pipe(fds), 0);
+    thread_logger_config config = {
+        .console_fd = fds[1], .layout = "%L %m", .queue_size = 64};
+    thread_logger *thl = new_thread_logger_config(&config);
+    assert_non_null(thl);
+    LOG_INFO(thl, "queued");
+    LOGF_WARN(thl, "%s", "0123456789012345678901234567890123456789012345678901234567890123");
+    info_log(thl, 0, "direct");
+    assert_int_equal(flush_thread_logger(thl), 0);
+    char output[256] = {0};
+    assert_true(read(fds[0], output, sizeof(output) - 1) > 0);
+    assert_string_equal(output, "info queued\n"
+                                "warn 0123456789012345678901234567890123456789012345678901234567890123\n"
+                                "[info - direct\n");
+    clear_thread_logger(thl);
+    close(fds[0]);
+    close(fds[1]);
+}
+
+void test_child_loggers(void **state) {
+    int fds[2];
+    assert_int_equal(pipe(fds), 0);
+    thread_logger_config config = {
+        .console_fd = fds[1], .name = "app", .layout = "%n %L %m"};
+    thread_logger *root = new_thread_logger_config(&config);
+    assert_non_null(root);
+
+    thread_logger *http = get_child_logger(root, "net.http");
+    thread_logger *net = get_child_logger(root, "net");
+    thread_logger *db = get_child_logger(root, "db");
+    assert_non_null(http);
+    assert_ptr_equal(http->parent, net);
+    assert_ptr_equal(get_child_logger(net, "http"), http);
+    assert_ptr_equal(get_child_logger(root, ""), root);
+    assert_string_equal(http->name, "net.http");
+
+    set_thread_logger_level(net, LOG_LEVELS_ERROR);
+    LOG_INFO(http, "filtered");
+    LOG_ERROR(http, "kept");
+    LOG_INFO(db, "inherited");
+    LOG_DEBUG(db, "filtered");
+    set_thread_logger_level(root, LOG_LEVELS_DEBUG);
+    LOG_DEBUG(db, "now on");
+    LOG_DEBUG(http, "still filtered");
+    inherit_thread_logger_level(net);
+    assert_true(log_level_enabled(http, LOG_LEVELS_DEBUG));
+    assert_true(http->debug);
+    LOG_DEBUG(http, "inherited");
+    warn_log(http, 0, "direct");
+    LOG_INFO(root, "root");
+
+    char output[256] = {0};
+    assert_true(read(fds[0], output, sizeof(output) - 1) > 0);
+    assert_string_equal(output, "net.http error kept\n"
+                                "db info inherited\n"
+                                "db debug now on\n"
+                                "net.http debug inherited\n"
+                                "[warn - direct\n"
+                                "app info root\n");
+    // children are freed with their root
+    clear_thread_logger(http);
+    clear_thread_logger(root);
+    close(fds[0]);
+    close(fds[1]);
+
+    // a child enables the histograms of its root, which measure it too
+    config = (thread_logger_config){.console_fd = -1, .layout = "%m"};
+    root = new_thread_logger_config(&config);
+    assert_non_null(root);
+    http = get_child_logger(root, "net.http");
+    assert_int_equal(enable_latency_histograms(http), 0);
+    assert_null(http->call_latency);
+    assert_non_null(root->call_latency);
+    LOG_INFO(http, "measured");
+    assert_int_equal(histogram_count(root->call_latency), 1);
+    assert_int_equal(histogram_count(root->sink_latency), 1);
+    clear_thread_logger(root);
+
+    // histograms enabled on the root after its children were created
+    root = new_thread_logger_config(&config);
+    assert_non_null(root);
+    db = get_child_logger(root, "db");
+    assert_int_equal(enable_latency_histograms(root), 0);
+    LOG_INFO(db, "measured");
+    assert_int_equal(histogram_count(root->call_latency), 1);
+    assert_int_equal(histogram_count(root->sink_latency), 1);
+    clear_thread_logger(root);
+
+    // child file loggers share the descriptor of their parent
+    config = (thread_logger_config){.console_fd = -1, .layout = "%n %m"};
+    file_logger *fhl = new_file_logger_config("child_file.log", &config);
+    assert_non_null(fhl);
+    file_logger *child = get_child_file_logger(fhl, "db");
+    assert_non_null(child);
+    assert_int_equal(child->fd, fhl->fd);
+    assert_ptr_equal(get_child_file_logger(fhl, "db"), child);
+    fLOG_INFO(child, "query");
+    clear_file_logger(child);
+    clear_file_logger(fhl);
+    int fd = open("child_file.log", O_RDONLY);
+    assert_true(fd >= 0);
+    char contents[64] = {0};
+    assert_true(read(fd, contents, sizeof(contents) - 1) > 0);
+    assert_string_equal(contents, "db query\n");
+    close(fd);
+    unlink("child_file.log");
+}
+
+static void *test_reload_log(void *data) {
+    thread_logger *thl = data;
+    for (int i = 0; i < 2000; i++) {
+        LOG_INFO(thl, "reloading");
+        LOG_WARN(get_child_logger(thl, "worker"), "reloading");
+    }
+    return NULL;
+}
+
+/*! @brief waits up to 5 seconds for the layout of thl to become pattern */
+static bool test_wait_layout(thread_logger *thl, const char *pattern) {
+    for (int i = 0; i < 500; i++) {
+        rcu_read_lock();
+        bool matched = strcmp(log_layout_pattern(rcu_dereference(thl->settings)->layout),
+                              pattern) == 0;
+        rcu_read_unlock();
+        if (matched) {
+            return true;
+        }
+        usleep(10000);
+    }
+    return false;
+}
+
+static void test_write_config(const char *path, const char *text) {
+    // replaced by a rename like most editors do
+    int fd = open("reload.conf.tmp", O_WRONLY | O_CREAT | O_TRUNC, 0640);
+    assert_true(fd >= 0);
+    assert_int_equal(write(fd, text, strlen(text)), (ssize_t)strlen(text));
+    close(fd);
+    assert_int_equal(rename("reload.conf.tmp", path), 0);
+}
+
+void test_config_reload(void **state) {
+    int fds[2];
+    assert_int_equal(pipe(fds), 0);
+    thread_logger_config config = {
+        .console_fd = fds[1], .name = "app", .layout = "%n %L %m"};
+    thread_logger *thl = new_thread_logger_config(&config);
+    assert_non_null(thl);
+    thread_logger *net = get_child_logger(thl, "net");
+    assert_non_null(net);
+
+    assert_int_equal(apply_logger_config(thl, "# comment\n\n"
+                                              "layout = %n %L: %m\n"
+                                              "level = debug\r\n"
+                                              "level.net = error\n"
+                                              "hexdump_max_bytes = 8\n"),
+                     0);
+    LOG_DEBUG(thl, "debug on");
+    LOG_WARN(net, "filtered");
+    LOG_ERROR(net, "kept");
+    assert_int_equal(thl->settings->hexdump_max_bytes, 8);
+    // invalid configs change nothing
+    assert_int_equal(apply_logger_config(thl, "level = loud\nlayout = %m\n"), -1);
+    assert_int_equal(apply_logger_config(thl, "colour = never\n"), -1);
+    assert_int_equal(apply_logger_config(thl, "max_message_size = -1\n"), -1);
+    assert_int_equal(apply_logger_config(thl, "level.net = inherit\nname = svc\n"), 0);
+    LOG_INFO(net, "inherited");
+
+    char output[256] = {0};
+    assert_true(read(fds[0], output, sizeof(output) - 1) > 0);
+    assert_string_equal(output, "app debug: debug on\n"
+                                "net error: kept\n"
+                                "net info: inherited\n");
+    clear_thread_logger(thl);
+    close(fds[0]);
+    close(fds[1]);
+
+    // settings are swapped while other threads keep logging
+    int null_fd = open("/dev/null", O_WRONLY);
+    assert_true(null_fd >= 0);
+    config = (thread_logger_config){.console_fd = null_fd, .layout = "%L %m"};
+    thl = new_thread_logger_config(&config);
+    assert_non_null(thl);
+    pthread_t threads[4];
+    for (int i = 0; i < 4; i++) {
+        assert_int_equal(pthread_create(&threads[i], NULL, test_reload_log, thl), 0);
+    }
+    for (int i = 0; i < 200; i++) {
+        config.layout = i % 2 == 0 ? "%T %t %L %m" : "%L %m";
+        config.max_message_size = (size_t)(16 + i);
+        config.console_flush = i % 3 == 0 ? CONSOLE_FLUSH_BATCH : CONSOLE_FLUSH_RECORD;
+        assert_int_equal(reconfigure_thread_logger(thl, &config), 0);
+    }
+    for (int i = 0; i < 4; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    assert_int_equal(reconfigure_thread_logger(get_child_logger(thl, "worker"), &config),
+                     -1);
+
+    // the watcher applies the file when created and again on every change
+    test_write_config("reload.conf", "layout = first %m\n");
+    config_watcher *watcher =
+        new_config_watcher(thl, "reload.conf", CONFIG_WATCH_FILE | CONFIG_WATCH_SIGHUP);
+    assert_non_null(watcher);
+    assert_true(test_wait_layout(thl, "first %m"));
+    assert_null(new_config_watcher(thl, "reload.conf", CONFIG_WATCH_SIGHUP));
+    test_write_config("reload.conf", "layout = second %m\n");
+    assert_true(test_wait_layout(thl, "second %m"));
+    clear_config_watcher(watcher);
+
+    watcher = new_config_watcher(thl, "reload.conf", CONFIG_WATCH_SIGHUP);
+    assert_non_null(watcher);
+    int fd = open("reload.conf", O_WRONLY | O_TRUNC);
+    assert_true(fd >= 0);
+    assert_int_equal(write(fd, "layout = third %m\n", 18), 18);
+    close(fd);
+    assert_int_equal(kill(getpid(), SIGHUP), 0);
+    assert_true(test_wait_layout(thl, "third %m"));
+    clear_config_watcher(watcher);
+
+    assert_null(new_config_watcher(thl, "missing.conf", CONFIG_WATCH_FILE));
+    clear_thread_logger(thl);
+    close(null_fd);
+    unlink("reload.conf");
+}
+
+typedef struct test_lock_state {
+    log_lock lock;
+    uint64_t counter;
+} test_lock_state;
+
+static void *test_lock_run(void *data) {
+    test_lock_state *state = data;
+    for (int i = 0; i < 2000; i++) {
+        log_lock_acquire(&state->lock);
+        state->counter++;
+        log_lock_release(&state->lock);
+    }
+    return NULL;
+}
+
+static void *test_child_lock_run(void *data) {
+    thread_logger *thl = data;
+    LOG_INFO(thl, "waited");
+    return NULL;
+}
+
+void test_lock_strategies(void **state) {
+    for (int strategy = LOG_LOCK_MUTEX; strategy <= LOG_LOCK_FUTEX; strategy++) {
+        LOG_LOCK parsed;
+        assert_int_equal(log_lock_parse(log_lock_name((LOG_LOCK)strategy), &parsed), 0);
+        assert_int_equal(parsed, strategy);
+
+        test_lock_state shared = {.counter = 0};
+        assert_int_equal(log_lock_init(&shared.lock, (LOG_LOCK)strategy), 0);
+        pthread_t threads[4];
+        for (int i = 0; i < 4; i++) {
+            assert_int_equal(pthread_create(&threads[i], NULL, test_lock_run, &shared), 0);
+        }
+        for (int i = 0; i < 4; i++) {
+            pthread_join(threads[i], NULL);
+        }
+        assert_int_equal(shared.counter, 8000);
+
+        // nested locks of the same strategy, released out of order
+        log_lock other;
+        assert_int_equal(log_lock_init(&other, (LOG_LOCK)strategy), 0);
+        assert_int_equal(log_lock_acquire(&shared.lock), 0);
+        assert_int_equal(log_lock_acquire(&other), 0);
+        assert_int_equal(log_lock_release(&shared.lock), 0);
+        assert_int_equal(log_lock_release(&other), 0);
+        log_lock_destroy(&other);
+        log_lock_destroy(&shared.lock);
+
+        int fds[2];
+        assert_int_equal(pipe(fds), 0);
+        thread_logger_config config = {
+            .console_fd = fds[1], .layout = "%m", .lock = (LOG_LOCK)strategy};
+        thread_logger *thl = new_thread_logger_config(&config);
+        assert_non_null(thl);
+        assert_int_equal(thl->lock(&thl->mutex), 0);
+        assert_int_equal(thl->unlock(&thl->mutex), 0);
+        LOG_INFO(get_child_logger(thl, "child"), "locked");
+        char output[16] = {0};
+        assert_true(read(fds[0], output, sizeof(output) - 1) > 0);
+        assert_string_equal(output, "locked\n");
+
+        // the lock of a child is the mutex of its root, holding it stalls writes
+        thread_logger *child = get_child_logger(thl, "child");
+        assert_int_equal(child->lock(&child->mutex), 0);
+        pthread_t writer;
+        assert_int_equal(pthread_create(&writer, NULL, test_child_lock_run, thl), 0);
+        usleep(20000);
+        assert_int_equal(fcntl(fds[0], F_SETFL, O_NONBLOCK), 0);
+        assert_int_equal(read(fds[0], output, sizeof(output) - 1), -1);
+        assert_int_equal(fcntl(fds[0], F_SETFL, 0), 0);
+        assert_int_equal(child->unlock(&child->mutex), 0);
+        pthread_join(writer, NULL);
+        memset(output, 0, sizeof(output));
+        assert_true(read(fds[0], output, sizeof(output) - 1) > 0);
+        assert_string_equal(output, "waited\n");
+        clear_thread_logger(thl);
+        close(fds[0]);
+        close(fds[1]);
+    }
+    assert_int_equal(log_lock_parse("spin", &(LOG_LOCK){0}), -1);
+}
+
+#define TEST_APPEND_THREADS 8
+#define TEST_APPEND_RECORDS 250
+
+/*! @brief length of the message thread t logs as record seq, some of them too
+ * long for the lock free path */
+static size_t test_append_len(int t, int seq) {
+    return 16 + (size_t)(t * 977 + seq * 389) % 5000;
+}
+
+static void *test_append_run(void *data) {
+    file_logger *fhl = ((void **)data)[0];
+    int t = (int)(intptr_t)((void **)data)[1];
+    char *message = malloc(5100);
+    for (int seq = 0; seq < TEST_APPEND_RECORDS; seq++) {
+        size_t len = test_append_len(t, seq);
+        int prefix = sprintf(message, "%d:%d:", t, seq);
+        memset(message + prefix, 'a' + t, len - (size_t)prefix);
+        message[len] = '\0';
+        fLOG_INFO(fhl, message);
+    }
+    free(message);
+    return NULL;
+}
+
+void test_direct_append(void **state) {
+    unlink("direct_append.log");
+    thread_logger_config config = {
+        .console_fd = -1, .layout = "%m", .direct_append = true};
+    file_logger *fhl = new_file_logger_config("direct_append.log", &config);
+    assert_non_null(fhl);
+
+    pthread_t threads[TEST_APPEND_THREADS];
+    void *args[TEST_APPEND_THREADS][2];
+    for (int t = 0; t < TEST_APPEND_THREADS; t++) {
+        args[t][0] = fhl;
+        args[t][1] = (void *)(intptr_t)t;
+        assert_int_equal(pthread_create(&threads[t], NULL, test_append_run, args[t]), 0);
+    }
+    for (int t = 0; t < TEST_APPEND_THREADS; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    clear_file_logger(fhl);
+
+    // every line must be exactly one record, whole and uninterrupted
+    FILE *file = fopen("direct_append.log", "r");
+    assert_non_null(file);
+    bool seen[TEST_APPEND_THREADS][TEST_APPEND_RECORDS] = {{false}};
+    size_t lines = 0;
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t read_len;
+    while ((read_len = getline(&line, &cap, file)) != -1) {
+        int t, seq, prefix;
+        assert_int_equal(sscanf(line, "%d:%d:%n", &t, &seq, &prefix), 2);
+        assert_true(t >= 0 && t < TEST_APPEND_THREADS);
+        assert_true(seq >= 0 && seq < TEST_APPEND_RECORDS);
+        assert_false(seen[t][seq]);
+        seen[t][seq] = true;
+        assert_int_equal(read_len, test_append_len(t, seq) + 1);
+        for (ssize_t i = prefix; i < read_len - 1; i++) {
+            assert_int_equal(line[i], 'a' + t);
+        }
+        lines++;
+    }
+    assert_int_equal(lines, TEST_APPEND_THREADS * TEST_APPEND_RECORDS);
+    free(line);
+    fclose(file);
+    unlink("direct_append.log");
+}
+
+#define TEST_IO_FILES 48
+#define TEST_IO_THREADS 4
+#define TEST_IO_RECORDS 480
+
+static void *test_io_run(void *data) {
+    file_logger **files = ((void **)data)[0];
+    int t = (int)(intptr_t)((void **)data)[1];
+    char message[5100];
+    for (int seq = 0; seq < TEST_IO_RECORDS; seq++) {
+        // every 97th record is too large for the service queue
+        size_t len = seq % 97 == 0 ? 5000 : 32;
+        int prefix = sprintf(message, "%d:%d:", t, seq);
+        memset(message + prefix, 'a' + t, len - (size_t)prefix);
+        message[len] = '\0';
+        fLOG_INFO(files[seq % TEST_IO_FILES], message);
+    }
+    return NULL;
+}
+
+void test_io_service(void **state) {
+    assert_null(new_log_io_service(0, 4096, LOG_OVERFLOW_BLOCK));
+    assert_null(new_log_io_service(2, 4096, LOG_OVERFLOW_SPILL));
+
+    log_io_service *service = new_log_io_service(2, 4096, LOG_OVERFLOW_BLOCK);
+    assert_non_null(service);
+    thread_logger_config config = {
+        .console_fd = -1, .layout = "%m", .io_service = service};
+    thread_logger *thl = new_thread_logger_config(&config);
+    assert_non_null(thl);
+
+    file_logger *files[TEST_IO_FILES];
+    char path[64];
+    for (int f = 0; f < TEST_IO_FILES; f++) {
+        sprintf(path, "io_service_%d.log", f);
+        unlink(path);
+        files[f] = open_file_logger(thl, path);
+        assert_non_null(files[f]);
+    }
+
+    pthread_t threads[TEST_IO_THREADS];
+    void *args[TEST_IO_THREADS][2];
+    for (int t = 0; t < TEST_IO_THREADS; t++) {
+        args[t][0] = files;
+        args[t][1] = (void *)(intptr_t)t;
+        assert_int_equal(pthread_create(&threads[t], NULL, test_io_run, args[t]), 0);
+    }
+    for (int t = 0; t < TEST_IO_THREADS; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    assert_int_equal(flush_thread_logger(thl), 0);
+
+    log_io_service_stats stats;
+    log_io_service_stats_get(service, &stats);
+    assert_int_equal(stats.threads, 2);
+    assert_int_equal(stats.records, TEST_IO_THREADS * TEST_IO_RECORDS);
+    assert_int_equal(stats.errors, 0);
+    assert_int_equal(stats.dropped, 0);
+    assert_true(stats.writes <= stats.records);
+
+    for (int f = 0; f < TEST_IO_FILES; f++) {
+        clear_file_logger(files[f]);
+    }
+    clear_thread_logger(thl);
+    clear_log_io_service(service);
+
+    // every file holds the records of every thread in the order they were logged
+    for (int f = 0; f < TEST_IO_FILES; f++) {
+        sprintf(path, "io_service_%d.log", f);
+        FILE *file = fopen(path, "r");
+        assert_non_null(file);
+        int next[TEST_IO_THREADS];
+        for (int t = 0; t < TEST_IO_THREADS; t++) {
+            next[t] = f;
+        }
+        char *line = NULL;
+        size_t cap = 0;
+        ssize_t read_len;
+        while ((read_len = getline(&line, &cap, file)) != -1) {
+            int t, seq;
+            assert_int_equal(sscanf(line, "%d:%d:", &t, &seq), 2);
+            assert_true(t >= 0 && t < TEST_IO_THREADS);
+            assert_int_equal(seq, next[t]);
+            assert_int_equal(read_len, (seq % 97 == 0 ? 5000 : 32) + 1);
+            next[t] += TEST_IO_FILES;
+        }
+        for (int t = 0; t < TEST_IO_THREADS; t++) {
+            assert_true(next[t] >= TEST_IO_RECORDS);
+        }
+        free(line);
+        fclose(file);
+        unlink(path);
+    }
+}
+
+#define TEST_PERCPU_THREADS 4
+#define TEST_PERCPU_RECORDS 2000
+
+static void *test_percpu_run(void *data) {
+    file_logger *fhl = ((void **)data)[0];
+    int t = (int)(intptr_t)((void **)data)[1];
+    char message[5100];
+    for (int seq = 0; seq < TEST_PERCPU_RECORDS; seq++) {
+        // every 499th record is too large for a ring
+        size_t len = seq % 499 == 0 ? 5000 : 40;
+        int prefix = sprintf(message, "%d:%d:", t, seq);
+        memset(message + prefix, 'a' + t, len - (size_t)prefix);
+        message[len] = '\0';
+        fLOG_INFO(fhl, message);
+        if (seq % 256 == 0) {
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+void test_percpu_buffers(void **state) {
+    assert_null(new_log_percpu(16, LOG_OVERFLOW_BLOCK, NULL, NULL));
+    assert_null(new_log_percpu(4096, LOG_OVERFLOW_DROP_OLDEST, NULL, NULL));
+
+    unlink("percpu.log");
+    thread_logger_config config = {
+        .console_fd = -1, .layout = "%m", .percpu_size = 4096};
+    file_logger *fhl = new_file_logger_config("percpu.log", &config);
+    assert_non_null(fhl);
+    assert_non_null(fhl->thl->percpu);
+
+    pthread_t threads[TEST_PERCPU_THREADS];
+    void *args[TEST_PERCPU_THREADS][2];
+    for (int t = 0; t < TEST_PERCPU_THREADS; t++) {
+        args[t][0] = fhl;
+        args[t][1] = (void *)(intptr_t)t;
+        assert_int_equal(pthread_create(&threads[t], NULL, test_percpu_run, args[t]), 0);
+    }
+    for (int t = 0; t < TEST_PERCPU_THREADS; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    assert_int_equal(flush_thread_logger(fhl->thl), 0);
+
+    log_percpu_stats stats;
+    log_percpu_stats_get(fhl->thl->percpu, &stats);
+    assert_true(stats.cpus >= 1);
+    assert_int_equal(stats.size, 4096);
+    assert_int_equal(stats.dropped, 0);
+    // the oversized records were written by their callers
+    assert_int_equal(stats.written, TEST_PERCPU_THREADS * (TEST_PERCPU_RECORDS - 5));
+    clear_file_logger(fhl);
+
+    // the records of every thread keep their order across CPUs
+    FILE *file = fopen("percpu.log", "r");
+    assert_non_null(file);
+    int next[TEST_PERCPU_THREADS] = {0};
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t read_len;
+    while ((read_len = getline(&line, &cap, file)) != -1) {
+        int t, seq;
+        assert_int_equal(sscanf(line, "%d:%d:", &t, &seq), 2);
+        assert_true(t >= 0 && t < TEST_PERCPU_THREADS);
+        assert_int_equal(seq, next[t]);
+        assert_int_equal(read_len, (seq % 499 == 0 ? 5000 : 40) + 1);
+        next[t]++;
+    }
+    for (int t = 0; t < TEST_PERCPU_THREADS; t++) {
+        assert_int_equal(next[t], TEST_PERCPU_RECORDS);
+    }
+    free(line);
+    fclose(file);
+    unlink("percpu.log");
+}
+
+#define TEST_BATCH_THREADS 3
+#define TEST_BATCH_COUNT 40
+#define TEST_BATCH_LINES 25
+
+static void *test_batch_run(void *data) {
+    file_logger *fhl = ((void **)data)[0];
+    int t = (int)(intptr_t)((void **)data)[1];
+    for (int b = 0; b < TEST_BATCH_COUNT; b++) {
+        log_batch batch;
+        assert_int_equal(log_batch_begin(&batch, fhl->thl, fhl->fd), 0);
+        for (int i = 0; i < TEST_BATCH_LINES; i++) {
+            BATCH_LOGF_INFO(&batch, "%d:%d:%d", t, b, i);
+            // interleaved single records of the same thread go out on their own
+            if (i == TEST_BATCH_LINES / 2) {
+                fLOG_WARN(fhl, "single");
+            }
+        }
+        BATCH_LOG_DEBUG(&batch, "skipped below the logger level");
+        assert_int_equal(batch.count, TEST_BATCH_LINES);
+        assert_int_equal(log_batch_commit(&batch), 0);
+    }
+    return NULL;
+}
+
+void test_log_batch(void **state) {
+    unlink("log_batch.log");
+    thread_logger_config config = {.console_fd = -1, .layout = "%L %m"};
+    file_logger *fhl = new_file_logger_config("log_batch.log", &config);
+    assert_non_null(fhl);
+
+    log_batch batch;
+    assert_int_equal(log_batch_begin(&batch, fhl->thl, fhl->fd), 0);
+    log_batch nested;
+    assert_int_equal(log_batch_begin(&nested, fhl->thl, fhl->fd), -1);
+    assert_int_equal(log_batch_commit(&batch), 0);
+
+    pthread_t threads[TEST_BATCH_THREADS];
+    void *args[TEST_BATCH_THREADS][2];
+    for (int t = 0; t < TEST_BATCH_THREADS; t++) {
+        args[t][0] = fhl;
+        args[t][1] = (void *)(intptr_t)t;
+        assert_int_equal(pthread_create(&threads[t], NULL, test_batch_run, args[t]), 0);
+    }
+    for (int t = 0; t < TEST_BATCH_THREADS; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    clear_file_logger(fhl);
+
+    // the lines of every batch are contiguous and in order
+    FILE *file = fopen("log_batch.log", "r");
+    assert_non_null(file);
+    int batches = 0, singles = 0, expected = 0, batch_t = -1, batch_b = -1;
+    char line[128];
+    while (fgets(line, sizeof(line), file) != NULL) {
+        if (strcmp(line, "warn single\n") == 0) {
+            assert_int_equal(expected, 0);
+            singles++;
+            continue;
+        }
+        int t, b, i;
+        assert_int_equal(sscanf(line, "info %d:%d:%d", &t, &b, &i), 3);
+        assert_int_equal(i, expected);
+        if (i == 0) {
+            batch_t = t;
+            batch_b = b;
+        }
+        assert_int_equal(t, batch_t);
+        assert_int_equal(b, batch_b);
+        expected = (expected + 1) % TEST_BATCH_LINES;
+        batches += expected == 0;
+    }
+    assert_int_equal(expected, 0);
+    assert_int_equal(batches, TEST_BATCH_THREADS * TEST_BATCH_COUNT);
+    assert_int_equal(singles, TEST_BATCH_THREADS * TEST_BATCH_COUNT);
+    fclose(file);
+    unlink("log_batch.log");
+
+    // through a queue a batch is a single record
+    thread_logger_config queued = {
+        .console_fd = -1, .layout = "%m", .queue_size = 4096};
+    fhl = new_file_logger_config("log_batch.log", &queued);
+    assert_non_null(fhl);
+    assert_int_equal(log_batch_begin(&batch, fhl->thl, fhl->fd), 0);
+    BATCH_LOG_INFO(&batch, "one");
+    BATCH_LOG_ERROR(&batch, "two");
+    assert_int_equal(batch.level, LOG_LEVELS_ERROR);
+    assert_int_equal(log_batch_commit(&batch), 0);
+    clear_file_logger(fhl);
+    file = fopen("log_batch.log", "r");
+    assert_non_null(file);
+    char contents[32] = {0};
+    assert_int_equal(fread(contents, 1, sizeof(contents) - 1, file), 8);
+    assert_string_equal(contents, "one\ntwo\n");
+    fclose(file);
+    unlink("log_batch.log");
+}
+
+static void *test_context_run(void *data) {
+    // a new thread starts with an empty context
+    size_t len;
+    log_context_get(&len);
+    file_logger *fhl = data;
+    fLOG_INFO(fhl, "other thread");
+    return (void *)len;
+}
+
+void test_log_context(void **state) {
+    unlink("log_context.log");
+    thread_logger_config config = {.console_fd = -1, .layout = "%L %m"};
+    file_logger *fhl = new_file_logger_config("log_context.log", &config);
+    assert_non_null(fhl);
+
+    size_t len;
+    assert_string_equal(log_context_get(&len), "");
+    assert_int_equal(len, 0);
+    fLOG_INFO(fhl, "empty");
+
+    assert_int_equal(log_context_push("request", "abc"), 0);
+    assert_int_equal(log_context_push("tenant", "4\n2"), 0);
+    assert_int_equal(log_context_depth(), 2);
+    assert_string_equal(log_context_get(&len), "request=abc tenant=4\\n2");
+    fLOG_INFO(fhl, "macro");
+    fLOGF_WARN(fhl, "formatted %d", 7);
+    info_log(fhl->thl, fhl->fd, "direct");
+
+    pthread_t thread;
+    void *other_len;
+    assert_int_equal(pthread_create(&thread, NULL, test_context_run, fhl), 0);
+    pthread_join(thread, &other_len);
+    assert_int_equal((size_t)other_len, 0);
+
+    log_context_pop();
+    fLOG_INFO(fhl, "popped");
+    assert_int_equal(log_context_push("trace", "t1"), 0);
+    assert_int_equal(log_context_push("span", "s1"), 0);
+    log_context_restore(1);
+    assert_string_equal(log_context_get(&len), "request=abc");
+    log_context_restore(0);
+    log_context_pop();
+    fLOG_INFO(fhl, "cleared");
+    clear_file_logger(fhl);
+
+    FILE *file = fopen("log_context.log", "r");
+    assert_non_null(file);
+    char contents[512] = {0};
+    assert_true(fread(contents, 1, sizeof(contents) - 1, file) > 0);
+    assert_string_equal(contents, "info empty\n"
+                                  "info macro request=abc tenant=4\\n2\n"
+                                  "warn formatted 7 request=abc tenant=4\\n2\n"
+                                  "[info - direct request=abc tenant=4\\n2\n"
+                                  "info other thread\n"
+                                  "info popped request=abc\n"
+                                  "info cleared\n");
+    fclose(file);
+    unlink("log_context.log");
+
+    // %X places the context, through a queue as well
+    thread_logger_config queued = {
+        .console_fd = -1, .layout = "[%X] %m", .queue_size = 4096};
+    fhl = new_file_logger_config("log_context.log", &queued);
+    assert_non_null(fhl);
+    fLOG_INFO(fhl, "none");
+    assert_int_equal(log_context_push("request", "xyz"), 0);
+    fLOG_INFO(fhl, "queued");
+    log_context_pop();
+    clear_file_logger(fhl);
+    file = fopen("log_context.log", "r");
+    assert_non_null(file);
+    memset(contents, 0, sizeof(contents));
+    assert_true(fread(contents, 1, sizeof(contents) - 1, file) > 0);
+    assert_string_equal(contents, "[] none\n[request=xyz] queued\n");
+    fclose(file);
+    unlink("log_context.log");
+}
+
+static off_t test_file_size(const char *path) {
+    struct stat st;
+    assert_int_equal(stat(path, &st), 0);
+    return st.st_size;
+}
+
+void test_file_sink(void **state) {
+    unlink("file_sink.log");
+    unlink("file_sink2.log");
+    int fd = open("file_sink.log", O_WRONLY | O_CREAT | O_APPEND, 0640);
+    int other = open("file_sink2.log", O_WRONLY | O_CREAT | O_APPEND, 0640);
+    assert_true(fd > 0 && other > 0);
+
+    file_sink *sink = new_file_sink(64);
+    assert_non_null(sink);
+    file_sink_stats stats;
+
+    // buffered until a syncing record
+    assert_int_equal(file_sink_write_record(sink, fd, "one", 3, false), 0);
+    assert_int_equal(file_sink_write(sink, fd, "two\n", 4, false), 0);
+    assert_int_equal(test_file_size("file_sink.log"), 0);
+    assert_int_equal(file_sink_write_record(sink, fd, "three", 5, true), 0);
+    assert_int_equal(test_file_size("file_sink.log"), 14);
+    file_sink_stats_get(sink, &stats);
+    assert_int_equal(stats.writes, 1);
+    assert_int_equal(stats.syncs, 0);
+    assert_int_equal(file_sink_sync(sink, fd), 0);
+    file_sink_stats_get(sink, &stats);
+    assert_int_equal(stats.syncs, 1);
+
+    // a full buffer goes out with the record that did not fit
+    char large[80];
+    memset(large, 'x', sizeof(large));
+    assert_int_equal(file_sink_write_record(sink, fd, "four", 4, false), 0);
+    assert_int_equal(file_sink_write_record(sink, fd, large, sizeof(large), false), 0);
+    assert_int_equal(test_file_size("file_sink.log"), 14 + 5 + 81);
+
+    // another descriptor writes out the records buffered before it
+    assert_int_equal(file_sink_write_record(sink, fd, "five", 4, false), 0);
+    assert_int_equal(file_sink_write_record(sink, other, "six", 3, false), 0);
+    assert_int_equal(test_file_size("file_sink.log"), 14 + 5 + 81 + 5);
+    assert_int_equal(test_file_size("file_sink2.log"), 0);
+    assert_int_equal(file_sink_flush(sink, false), 0);
+    assert_int_equal(test_file_size("file_sink2.log"), 4);
+    file_sink_stats_get(sink, &stats);
+    assert_int_equal(stats.writes, 4);
+    assert_int_equal(stats.syncs, 1);
+    assert_int_equal(stats.errors, 0);
+    clear_file_sink(sink);
+    close(fd);
+    close(other);
+    unlink("file_sink2.log");
+    unlink("file_sink.log");
+
+    // through a logger, errors write the records that led up to them, the
+    // unset level meaning LOG_LEVELS_ERROR
+    thread_logger_config config = {
+        .console_fd = -1, .layout = "%L %m", .file_sync = FILE_SYNC_ON_LEVEL};
+    file_logger *fhl = new_file_logger_config("file_sink.log", &config);
+    assert_non_null(fhl);
+    assert_int_equal(fcntl(fhl->fd, F_GETFL) & O_SYNC, 0);
+    fLOG_INFO(fhl, "started");
+    fLOGF_WARN(fhl, "retrying %d", 1);
+    assert_int_equal(test_file_size("file_sink.log"), 0);
+    fLOG_ERROR(fhl, "failed");
+    assert_int_equal(test_file_size("file_sink.log"), 42);
+
+    log_batch batch;
+    assert_int_equal(log_batch_begin(&batch, fhl->thl, fhl->fd), 0);
+    BATCH_LOG_INFO(&batch, "batched");
+    assert_int_equal(log_batch_commit(&batch), 0);
+    assert_int_equal(test_file_size("file_sink.log"), 42);
+    assert_int_equal(flush_thread_logger(fhl->thl), 0);
+    assert_int_equal(test_file_size("file_sink.log"), 55);
+    fLOG_INFO(fhl, "stopped");
+    clear_file_logger(fhl);
+
+    FILE *file = fopen("file_sink.log", "r");
+    assert_non_null(file);
+    char contents[128] = {0};
+    assert_true(fread(contents, 1, sizeof(contents) - 1, file) > 0);
+    assert_string_equal(contents, "info started\nwarn retrying 1\nerror failed\n"
+                                  "info batched\ninfo stopped\n");
+    fclose(file);
+    unlink("file_sink.log");
+
+    // an explicitly set LOG_LEVELS_INFO writes every record
+    config.file_sync_level = LOG_LEVELS_INFO;
+    config.file_sync_level_set = true;
+    fhl = new_file_logger_config("file_sink.log", &config);
+    assert_non_null(fhl);
+    fLOG_INFO(fhl, "started");
+    assert_int_equal(test_file_size("file_sink.log"), 13);
+    clear_file_logger(fhl);
+    unlink("file_sink.log");
+}
+
+/*! @brief counts the lines of path starting with prefix */
+static int test_count_lines(const char *path, const char *prefix) {
+    FILE *file = fopen(path, "r");
+    assert_non_null(file);
+    int count = 0;
+    char line[4096];
+    while (fgets(line, sizeof(line), file) != NULL) {
+        count += strncmp(line, prefix, strlen(prefix)) == 0;
+    }
+    fclose(file);
+    return count;
+}
+
+static __attribute__((noinline)) void test_backtrace_storm(file_logger *fhl) {
+    for (int i = 0; i < 20; i++) {
+        fLOG_ERROR(fhl, "storm");
+    }
+}
+
+void test_error_backtrace(void **state) {
+    unlink("error_backtrace.log");
+    thread_logger_config config = {.console_fd = -1,
+                                   .layout = "%L %m",
+                                   .error_backtrace = true,
+                                   .backtrace_site_limit = 3};
+    file_logger *fhl = new_file_logger_config("error_backtrace.log", &config);
+    assert_non_null(fhl);
+    fLOG_INFO(fhl, "no trace");
+    // the storm starts a second of its own, so it meets the limit only once
+    time_t start = time(NULL);
+    while (time(NULL) == start) {
+        usleep(1000);
+    }
+    test_backtrace_storm(fhl);
+    error_log(fhl->thl, fhl->fd, "direct");
+    clear_file_logger(fhl);
+
+    // one call site is limited, the modules follow the first trace only
+    assert_int_equal(test_count_lines("error_backtrace.log", "error storm"), 20);
+    assert_int_equal(test_count_lines("error_backtrace.log", "[error - "), 1);
+    FILE *file = fopen("error_backtrace.log", "r");
+    assert_non_null(file);
+    int traced = 0, modules = 0;
+    bool in_trace = false, previous_module = false;
+    char line[4096];
+    while (fgets(line, sizeof(line), file) != NULL) {
+        bool frame = strncmp(line, "    at 0x", 9) == 0;
+        bool module = strncmp(line, "    module 0x", 13) == 0;
+        traced += frame && in_trace == false;
+        modules += module && previous_module == false;
+        in_trace = frame || module;
+        previous_module = module;
+    }
+    fclose(file);
+    // 3 of the storm and the direct one
+    assert_int_equal(traced, 4);
+    assert_int_equal(modules, 1);
+    unlink("error_backtrace.log");
+
+    // the writer thread resolves the frames
+    thread_logger_config queued = {.console_fd = -1,
+                                   .layout = "%L %m",
+                                   .queue_size = 1 << 16,
+                                   .error_backtrace = true};
+    fhl = new_file_logger_config("error_backtrace.log", &queued);
+    assert_non_null(fhl);
+    fLOG_ERROR(fhl, "queued");
+    clear_file_logger(fhl);
+    assert_int_equal(test_count_lines("error_backtrace.log", "error queued"), 1);
+    assert_true(test_count_lines("error_backtrace.log", "    at ") > 0);
+    assert_int_equal(test_count_lines("error_backtrace.log", "    at 0x"), 0);
+    assert_int_equal(test_count_lines("error_backtrace.log", "    module "), 0);
+    unlink("error_backtrace.log");
+
+    // symbolizing leaves everything else alone
+    log_buffer out = {0};
+    const char *text = "error x\n    at 0xnothex\n    at 0x1";
+    assert_int_equal(log_backtrace_symbolize(&out, text, strlen(text)), 0);
+    assert_int_equal(out.len, strlen(text));
+    assert_memory_equal(out.data, text, out.len);
+    free(out.data);
+}
+
+/*! @brief reads every frame of path into text, or the plain text of a sink
+ * built without zlib
+ * @return the number of frames
+ */
+static int test_read_frames(const char *path, bool compressed, log_buffer *text) {
+    int fd = open(path, O_RDONLY);
+    assert_true(fd > 0);
+    int frames = 0;
+    if (compressed == false) {
+        struct stat st;
+        assert_int_equal(fstat(fd, &st), 0);
+        assert_int_equal(log_buffer_reserve(text, (size_t)st.st_size), 0);
+        assert_int_equal(read(fd, text->data, (size_t)st.st_size), st.st_size);
+        text->len = (size_t)st.st_size;
+    } else {
+        off_t offset = 0;
+        int response;
+        while ((response = log_compress_read_frame(fd, offset, text, &offset)) == 0) {
+            frames++;
+        }
+        assert_int_equal(response, 1);
+    }
+    close(fd);
+    return frames;
+}
+
+void test_compressed_file(void **state) {
+    unlink("compressed.log");
+    int fd = open("compressed.log", O_WRONLY | O_CREAT | O_APPEND, 0640);
+    assert_true(fd > 0);
+    log_compress *compress = new_log_compress(fd, 256, 0);
+    assert_non_null(compress);
+    assert_int_equal(log_compress_fd(compress), fd);
+
+    log_buffer want = {0};
+    char record[64];
+    for (int i = 0; i < 100; i++) {
+        int len = snprintf(record, sizeof(record), "compressed record %d", i);
+        assert_int_equal(log_compress_write_record(compress, record, (size_t)len), 0);
+        assert_int_equal(log_buffer_append(&want, record, (size_t)len), 0);
+        assert_int_equal(log_buffer_append(&want, "\n", 1), 0);
+    }
+    // larger than a block, gets a block of its own
+    char large[1000];
+    memset(large, 'x', sizeof(large) - 1);
+    large[sizeof(large) - 1] = '\n';
+    assert_int_equal(log_compress_write(compress, large, sizeof(large)), 0);
+    assert_int_equal(log_buffer_append(&want, large, sizeof(large)), 0);
+    assert_int_equal(log_compress_flush(compress, true), 0);
+
+    log_compress_stats stats;
+    log_compress_stats_get(compress, &stats);
+    assert_int_equal(stats.bytes_in, want.len);
+    assert_int_equal(stats.errors, 0);
+    assert_true(stats.blocks > 2);
+    clear_log_compress(compress);
+    close(fd);
+
+    log_buffer text = {0};
+    int frames = test_read_frames("compressed.log", stats.compressed, &text);
+    if (stats.compressed == true) {
+        assert_int_equal(frames, stats.blocks);
+        assert_true(stats.bytes_out < stats.bytes_in);
+    }
+    assert_int_equal(text.len, want.len);
+    assert_memory_equal(text.data, want.data, want.len);
+    unlink("compressed.log");
+
+    // through a file logger, records are never split across frames
+    thread_logger_config config = {.console_fd = -1,
+                                   .layout = "%m",
+                                   .file_compress = true,
+                                   .compress_block_size = 512};
+    file_logger *fhl = new_file_logger_config("compressed.log", &config);
+    assert_non_null(fhl);
+    for (int i = 0; i < 200; i++) {
+        fLOGF_INFO(fhl, "logged record %d", i);
+    }
+    clear_file_logger(fhl);
+
+    text.len = 0;
+    frames = test_read_frames("compressed.log", stats.compressed, &text);
+    int expected = 0;
+    for (char *line = text.data; line < text.data + text.len; expected++) {
+        char *end = memchr(line, '\n', (size_t)(text.data + text.len - line));
+        assert_non_null(end);
+        snprintf(record, sizeof(record), "logged record %d", expected);
+        assert_int_equal(end - line, strlen(record));
+        assert_memory_equal(line, record, strlen(record));
+        line = end + 1;
+    }
+    assert_int_equal(expected, 200);
+    free(text.data);
+    free(want.data);
+    unlink("compressed.log");
+}
+
+void test_file_index(void **state) {
+    unlink("file_index.log");
+    unlink("file_index.log.idx");
+    int fd = open("file_index.log", O_WRONLY | O_CREAT | O_APPEND, 0640);
+    assert_true(fd > 0);
+    file_index *index = new_file_index("file_index.log.idx", fd, 100, 3600);
+    assert_non_null(index);
+    assert_int_equal(file_index_fd(index), fd);
+
+    // a block ends once it reaches the block size or is flushed
+    char record[60];
+    memset(record, 'x', sizeof(record));
+    for (int i = 0; i < 2; i++) {
+        assert_int_equal(write(fd, record, sizeof(record)), sizeof(record));
+        size_t info[FILE_INDEX_LEVELS] = {[LOG_LEVELS_INFO] = 1};
+        assert_int_equal(file_index_add(index, sizeof(record), info), 0);
+    }
+    assert_int_equal(write(fd, record, 50), 50);
+    size_t error[FILE_INDEX_LEVELS] = {[LOG_LEVELS_ERROR] = 1};
+    assert_int_equal(file_index_add(index, 50, error), 0);
+    assert_int_equal(file_index_flush(index), 0);
+    assert_int_equal(write(fd, record, 10), 10);
+    size_t warn[FILE_INDEX_LEVELS] = {[LOG_LEVELS_WARN] = 1};
+    assert_int_equal(file_index_add(index, 10, warn), 0);
+    clear_file_index(index);
+
+    // appending to the file continues the index
+    index = new_file_index("file_index.log.idx", fd, 100, 3600);
+    assert_non_null(index);
+    size_t mixed[FILE_INDEX_LEVELS] = {[LOG_LEVELS_DEBUG] = 5,
+                                       [LOG_LEVELS_WARN] = 2};
+    assert_int_equal(file_index_add(index, 5, mixed), 0);
+    clear_file_index(index);
+    close(fd);
+
+    size_t count;
+    file_index_entry *entries = file_index_load("file_index.log.idx", &count);
+    assert_non_null(entries);
+    assert_int_equal(count, 4);
+    assert_int_equal(entries[0].offset, 0);
+    assert_int_equal(entries[0].length, 120);
+    assert_int_equal(entries[0].counts[LOG_LEVELS_INFO], 2);
+    assert_int_equal(entries[1].offset, 120);
+    assert_int_equal(entries[1].counts[LOG_LEVELS_ERROR], 1);
+    assert_int_equal(entries[2].offset, 170);
+    assert_int_equal(entries[3].offset, 180);
+    assert_int_equal(entries[3].counts[LOG_LEVELS_DEBUG], 5);
+    assert_int_equal(entries[3].counts[LOG_LEVELS_WARN], 2);
+    assert_true(entries[0].first_time <= entries[3].last_time);
+
+    assert_int_equal(file_index_next_level(entries, count, 0, LOG_LEVELS_ERROR), 1);
+    assert_int_equal(file_index_next_level(entries, count, 2, LOG_LEVELS_ERROR), 4);
+    assert_int_equal(file_index_next_level(entries, count, 2, LOG_LEVELS_WARN), 2);
+    assert_int_equal(file_index_next_level(entries, count, 0, LOG_LEVELS_DEBUG), 0);
+    assert_int_equal(file_index_seek_time(entries, count, entries[0].first_time - 10), 0);
+    assert_int_equal(file_index_seek_time(entries, count, entries[3].last_time + 1), 4);
+    free(entries);
+
+    file_index_entry timed[3] = {{.last_time = 10}, {.last_time = 20}, {.last_time = 30}};
+    assert_int_equal(file_index_seek_time(timed, 3, 5), 0);
+    assert_int_equal(file_index_seek_time(timed, 3, 15), 1);
+    assert_int_equal(file_index_seek_time(timed, 3, 20), 1);
+    assert_int_equal(file_index_seek_time(timed, 3, 31), 3);
+    assert_int_equal(file_index_seek_time(timed, 0, 31), 0);
+    unlink("file_index.log");
+    unlink("file_index.log.idx");
+
+    // through a file logger, the blocks cover the whole file and batches are
+    // counted by the level of each record, queued or not
+    for (int queued = 1; queued >= 0; queued--) {
+        thread_logger_config config = {.console_fd = -1,
+                                       .layout = "%L %m",
+                                       .index_file = true,
+                                       .index_block_size = 64,
+                                       .queue_size = queued == 1 ? 4096 : 0};
+        file_logger *fhl = new_file_logger_config("file_index.log", &config);
+        assert_non_null(fhl);
+        for (int i = 0; i < 10; i++) {
+            fLOGF_INFO(fhl, "before %d", i);
+        }
+        fLOG_ERROR(fhl, "failed");
+        log_batch batch;
+        assert_int_equal(log_batch_begin(&batch, fhl->thl, fhl->fd), 0);
+        for (int i = 0; i < 10; i++) {
+            BATCH_LOGF_INFO(&batch, "after %d", i);
+        }
+        BATCH_LOG_WARN(&batch, "warned");
+        assert_int_equal(log_batch_commit(&batch), 0);
+        clear_file_logger(fhl);
+
+        entries = file_index_load("file_index.log.idx", &count);
+        assert_non_null(entries);
+        uint64_t offset = 0;
+        uint32_t levels[FILE_INDEX_LEVELS] = {0};
+        for (size_t i = 0; i < count; i++) {
+            assert_int_equal(entries[i].offset, offset);
+            offset += entries[i].length;
+            for (int l = 0; l < FILE_INDEX_LEVELS; l++) {
+                levels[l] += entries[i].counts[l];
+            }
+        }
+        assert_int_equal(offset, test_file_size("file_index.log"));
+        assert_int_equal(levels[LOG_LEVELS_INFO], 20);
+        assert_int_equal(levels[LOG_LEVELS_WARN], 1);
+        assert_int_equal(levels[LOG_LEVELS_ERROR], 1);
+        assert_int_equal(levels[LOG_LEVELS_DEBUG], 0);
+        if (queued == 1) {
+            free(entries);
+            unlink("file_index.log");
+            unlink("file_index.log.idx");
+        }
+    }
+
+    size_t failed = file_index_next_level(entries, count, 0, LOG_LEVELS_ERROR);
+    assert_true(failed < count);
+    char block[256] = {0};
+    assert_true(entries[failed].length < sizeof(block));
+    fd = open("file_index.log", O_RDONLY);
+    assert_int_equal(pread(fd, block, entries[failed].length, (off_t)entries[failed].offset),
+                     entries[failed].length);
+    close(fd);
+    assert_non_null(strstr(block, "error failed\n"));
+    free(entries);
+    unlink("file_index.log");
+    unlink("file_index.log.idx");
+}
+
+void test_direct_sink(void **state) {
+    unlink("direct_sink.log");
+    int fd = direct_sink_open("direct_sink.log");
+    assert_true(fd > 0);
+    direct_sink *sink = new_direct_sink(fd, 100);
+    assert_non_null(sink);
+    assert_int_equal(direct_sink_fd(sink), fd);
+
+    // a partial buffer is written padded to a whole block
+    assert_int_equal(direct_sink_write_record(sink, "one", 3), 0);
+    assert_int_equal(test_file_size("direct_sink.log"), 0);
+    assert_int_equal(direct_sink_flush(sink, false), 0);
+    assert_int_equal(test_file_size("direct_sink.log"), DIRECT_SINK_ALIGNMENT);
+
+    // the next buffer rewrites the partial block
+    char large[5001];
+    memset(large, 'x', sizeof(large) - 1);
+    large[sizeof(large) - 1] = '\n';
+    assert_int_equal(direct_sink_write(sink, large, sizeof(large)), 0);
+    assert_int_equal(direct_sink_flush(sink, true), 0);
+    assert_int_equal(test_file_size("direct_sink.log"), 2 * DIRECT_SINK_ALIGNMENT);
+    direct_sink_stats stats;
+    direct_sink_stats_get(sink, &stats);
+    assert_int_equal(stats.writes, 3);
+    assert_int_equal(stats.syncs, 1);
+    assert_int_equal(stats.errors, 0);
+
+    // clearing cuts the padding off
+    clear_direct_sink(sink);
+    assert_int_equal(test_file_size("direct_sink.log"), 4 + sizeof(large));
+
+    // so does opening a file left padded
+    char zeros[1000] = {0};
+    int plain = open("direct_sink.log", O_WRONLY | O_APPEND);
+    assert_int_equal(write(plain, zeros, sizeof(zeros)), sizeof(zeros));
+    close(plain);
+    sink = new_direct_sink(fd, 0);
+    assert_non_null(sink);
+    assert_int_equal(test_file_size("direct_sink.log"), 4 + sizeof(large));
+    assert_int_equal(direct_sink_write_record(sink, "two", 3), 0);
+    clear_direct_sink(sink);
+    close(fd);
+
+    FILE *file = fopen("direct_sink.log", "r");
+    assert_non_null(file);
+    char contents[8192] = {0};
+    assert_int_equal(fread(contents, 1, sizeof(contents), file), 8 + sizeof(large));
+    fclose(file);
+    assert_memory_equal(contents, "one\n", 4);
+    assert_memory_equal(contents + 4, large, sizeof(large));
+    assert_memory_equal(contents + 4 + sizeof(large), "two\n", 4);
+    unlink("direct_sink.log");
+
+    // through a logger, errors write the partial block and sync it
+    thread_logger_config config = {.console_fd = -1,
+                                   .layout = "%L %m",
+                                   .file_sync = FILE_SYNC_DIRECT,
+                                   .file_sync_level = LOG_LEVELS_ERROR,
+                                   .file_sync_level_set = true};
+    file_logger *fhl = new_file_logger_config("direct_sink.log", &config);
+    assert_non_null(fhl);
+    fLOG_INFO(fhl, "started");
+    assert_int_equal(test_file_size("direct_sink.log"), 0);
+    fLOG_ERROR(fhl, "failed");
+    assert_int_equal(test_file_size("direct_sink.log"), DIRECT_SINK_ALIGNMENT);
+    fLOG_INFO(fhl, "stopped");
+    clear_file_logger(fhl);
+
+    file = fopen("direct_sink.log", "r");
+    assert_non_null(file);
+    memset(contents, 0, sizeof(contents));
+    assert_true(fread(contents, 1, sizeof(contents) - 1, file) > 0);
+    assert_string_equal(contents, "info started\nerror failed\ninfo stopped\n");
+    fclose(file);
+    unlink("direct_sink.log");
+}
+
+void test_shm_ring(void **state) {
+    unlink("shm_ring.log");
+    shm_unlink("/ulog-test");
+    thread_logger_config config = {.console_fd = -1,
+                                   .layout = "%m",
+                                   .shm_name = "/ulog-test",
+                                   .shm_drain = true};
+    file_logger *fhl = new_file_logger_config("shm_ring.log", &config);
+    assert_non_null(fhl);
+    assert_non_null(fhl->thl->shm);
+
+    // a second drainer is refused while this one is alive
+    assert_null(new_log_shm("/ulog-test", 0, LOG_OVERFLOW_BLOCK, -1, true));
+
+    pid_t children[4];
+    for (int i = 0; i < 3; i++) {
+        children[i] = fork();
+        assert_true(children[i] >= 0);
+        if (children[i] == 0) {
+            thread_logger_config producer = {.console_fd = -1,
+                                             .layout = "%m",
+                                             .shm_name = "/ulog-test"};
+            file_logger *child = new_file_logger_config("shm_ring.log", &producer);
+            if (child == NULL) {
+                _exit(1);
+            }
+            for (int j = 0; j < 100; j++) {
+                fLOGF_INFO(child, "child %d record %03d", i, j);
+            }
+            clear_file_logger(child);
+            _exit(0);
+        }
+    }
+
+    // a producer dying between reservation and commit does not stall the ring
+    children[3] = fork();
+    assert_true(children[3] >= 0);
+    if (children[3] == 0) {
+        log_shm *shm = new_log_shm("/ulog-test", 0, LOG_OVERFLOW_BLOCK, -1, false);
+        if (shm == NULL || log_shm_reserve(shm, LOG_LEVELS_INFO, 32) == NULL) {
+            _exit(1);
+        }
+        _exit(0);
+    }
+
+    for (int i = 0; i < 4; i++) {
+        int status = 0;
+        assert_int_equal(waitpid(children[i], &status, 0), children[i]);
+        assert_true(WIFEXITED(status));
+        assert_int_equal(WEXITSTATUS(status), 0);
+    }
+
+    // a forked child neither drains nor removes the ring of its parent
+    pid_t forked = fork();
+    assert_true(forked >= 0);
+    if (forked == 0) {
+        if (new_log_shm("/ulog-test", 0, LOG_OVERFLOW_BLOCK, -1, true) != NULL) {
+            _exit(1);
+        }
+        clear_file_logger(fhl);
+        _exit(0);
+    }
+    int status = 0;
+    assert_int_equal(waitpid(forked, &status, 0), forked);
+    assert_true(WIFEXITED(status));
+    assert_int_equal(WEXITSTATUS(status), 0);
+    int shm_fd = shm_open("/ulog-test", O_RDWR, 0);
+    assert_true(shm_fd >= 0);
+    close(shm_fd);
+
+    fLOG_INFO(fhl, "parent done");
+    assert_int_equal(flush_thread_logger(fhl->thl), 0);
+    log_shm_stats stats;
+    log_shm_stats_get(fhl->thl->shm, &stats);
+    assert_int_equal(stats.size, LOG_SHM_SIZE);
+    assert_int_equal(stats.pushed, 301);
+    assert_int_equal(stats.written, 301);
+    assert_int_equal(stats.dropped, 0);
+    assert_int_equal(stats.abandoned, 1);
+    assert_true(stats.batches > 0);
+    clear_file_logger(fhl);
+
+    // every record is on a line of its own, in order per process
+    FILE *file = fopen("shm_ring.log", "r");
+    assert_non_null(file);
+    int next[3] = {0, 0, 0};
+    int lines = 0;
+    char line[128];
+    while (fgets(line, sizeof(line), file) != NULL) {
+        lines++;
+        int child = 0;
+        int record = 0;
+        if (sscanf(line, "child %d record %d", &child, &record) == 2) {
+            assert_true(child >= 0 && child < 3);
+            assert_int_equal(record, next[child]);
+            next[child]++;
+        } else {
+            assert_string_equal(line, "parent done\n");
+        }
+    }
+    fclose(file);
+    assert_int_equal(lines, 301);
+    for (int i = 0; i < 3; i++) {
+        assert_int_equal(next[i], 100);
+    }
+    unlink("shm_ring.log");
+}
+
 int main(void) {
     const struct CMUnitTest tests[] = {
         cmocka_unit_test(test_thread_logger),
         cmocka_unit_test(test_file_logger),
         cmocka_unit_test(test_demo_log_thread),
         cmocka_unit_test(test_demo_log_file),
-        cmocka_unit_test(test_write_colored)
+        cmocka_unit_test(test_write_colored),
+        cmocka_unit_test(test_latency_histogram),
+        cmocka_unit_test(test_log_layout),
+        cmocka_unit_test(test_console_sink),
+        cmocka_unit_test(test_large_records),
+        cmocka_unit_test(test_fmt_kernels),
+        cmocka_unit_test(test_hexdump),
+        cmocka_unit_test(test_sanitize),
+        cmocka_unit_test(test_record_pool),
+        cmocka_unit_test(test_log_queue),
+        cmocka_unit_test(test_child_loggers),
+        cmocka_unit_test(test_config_reload),
+        cmocka_unit_test(test_lock_strategies),
+        cmocka_unit_test(test_direct_append),
+        cmocka_unit_test(test_io_service),
+        cmocka_unit_test(test_percpu_buffers),
+        cmocka_unit_test(test_log_batch),
+        cmocka_unit_test(test_log_context),
+        cmocka_unit_test(test_file_sink),
+        cmocka_unit_test(test_error_backtrace),
+        cmocka_unit_test(test_compressed_file),
+        cmocka_unit_test(test_file_index),
+        cmocka_unit_test(test_direct_sink),
+        cmocka_unit_test(test_shm_ring)
     };
     return cmocka_run_group_tests(tests, NULL, NULL);
 }
\ No newline at end of file
@@ -1,6 +1,10 @@
 #include <string.h>
 #include <stdio.h>
+#include <string>
+#include <string_view>
+#include <unistd.h>
 #include "logger.h"
+#include "ulog.hpp"
 
 typedef struct args {
     COLORS test_color;
@@ -23,6 +27,54 @@ void validate_test_args(test testdata) {
     printf("test %s failed\n", testdata.name);
 }
 
+// renders records through the C++ front end into a pipe and compares them
+int test_ulog_frontend() {
+    int pipe_fds[2];
+    if (pipe(pipe_fds) != 0) {
+        printf("test ulog failed: pipe\n");
+        return 1;
+    }
+
+    thread_logger_config config = {};
+    config.layout = "%L %m";
+    config.console_fd = pipe_fds[1];
+    config.console_color = CONSOLE_COLOR_NEVER;
+    thread_logger *thl = new_thread_logger_config(&config);
+
+    std::string name = "ulog";
+    char buffer[32] = "bounded";
+    ulog::info(thl, "x={} y={} z={}", 42, -7, 2.5);
+    ulog::warn(thl, "{} {} {} {}", name, std::string_view("view"), buffer, 'c');
+    ulog::error(thl, "{:x} {{literal}} {} {}", 255u, true, nullptr);
+    ulog::debug(thl, "debug is disabled {}", 1);
+    ulog::info(thl, "no arguments");
+    {
+        ulog::context_scope request("request", "abc");
+        ulog::context_scope tenant("tenant", std::to_string(42));
+        LOG_INFO(thl, "scoped");
+    }
+    ulog::info(thl, "unscoped");
+    clear_thread_logger(thl);
+    close(pipe_fds[1]);
+
+    char output[512] = {0};
+    ssize_t len = read(pipe_fds[0], output, sizeof(output) - 1);
+    close(pipe_fds[0]);
+
+    const char *want = "info x=42 y=-7 z=2.5\n"
+                       "warn ulog view bounded c\n"
+                       "error ff {literal} true nullptr\n"
+                       "info no arguments\n"
+                       "info scoped request=abc tenant=42\n"
+                       "info unscoped\n";
+    if (len < 0 || strcmp(output, want) != 0) {
+        printf("test ulog failed, got:\n%s", output);
+        return 1;
+    }
+    printf("test ulog passed\n");
+    return 0;
+}
+
 int main(void) {
     // thread logger tests
     thread_logger *thl = new_thread_logger(true);
@@ -111,4 +163,6 @@ int main(void) {
     for (int i = 0; i < 7; i++) {
         validate_test_args(tests[i]);
     }
+
+    return test_ulog_frontend();
 }
\ No newline at end of file